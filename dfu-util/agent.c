@@ -0,0 +1,871 @@
+/*
+ *  Remote flashing agent, serves DFU devices over TCP
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "agent.h"
+#include "libdfu.h"
+#include "dfu_sim.h"
+
+struct agentConnection
+{
+    int socket;
+    const char* secret;
+    bool simulate;
+    /* Simulated device loses a status reply and stalls a block */
+    bool faults;
+    bool opened;
+    /* Interface requests are served by, the session's or the simulator's */
+    struct dfu_if* dif;
+    IOUSBDFUDescriptor descriptor;
+    struct dfu_session session;
+    struct dfu_sim sim;
+    struct dfu_if simInterface;
+    uint8_t* simMemory;
+    int lastReported;
+};
+
+static void putShort(uint8_t* buffer, unsigned short value)
+{
+    buffer[0] = value >> 8;
+    buffer[1] = value & 0xff;
+}
+
+static void putLong(uint8_t* buffer, uint32_t value)
+{
+    buffer[0] = value >> 24;
+    buffer[1] = (value >> 16) & 0xff;
+    buffer[2] = (value >> 8) & 0xff;
+    buffer[3] = value & 0xff;
+}
+
+static unsigned short getShort(const uint8_t* buffer)
+{
+    return (buffer[0] << 8) | buffer[1];
+}
+
+static uint32_t getLong(const uint8_t* buffer)
+{
+    return ((uint32_t)buffer[0] << 24) | (buffer[1] << 16) | (buffer[2] << 8) | buffer[3];
+}
+
+static bool readFully(int socket, void* buffer, size_t length)
+{
+    uint8_t* position = buffer;
+    
+    while (length > 0)
+    {
+        ssize_t count = read(socket, position, length);
+        
+        if (count < 0 && errno == EINTR)
+            continue;
+        
+        if (count <= 0)
+            return false;
+        
+        position += count;
+        length -= count;
+    }
+    
+    return true;
+}
+
+static bool writeFully(int socket, const void* buffer, size_t length)
+{
+    const uint8_t* position = buffer;
+    
+    while (length > 0)
+    {
+        ssize_t count = write(socket, position, length);
+        
+        if (count < 0 && errno == EINTR)
+            continue;
+        
+        if (count <= 0)
+            return false;
+        
+        position += count;
+        length -= count;
+    }
+    
+    return true;
+}
+
+static bool sendFrame(int socket, enum agentFrame type, const void* payload, uint32_t length)
+{
+    uint8_t header[AGENT_HEADER_SIZE] = { type, 0, 0, 0 };
+    
+    putLong(header + 4, length);
+    
+    return writeFully(socket, header, sizeof(header)) && writeFully(socket, payload, length);
+}
+
+/* Largest payload a frame of the type may carry, 0 for unknown types */
+static uint32_t frameLimit(int type)
+{
+    switch (type)
+    {
+        case AGENT_OPEN:
+            return 4;
+        case AGENT_CONTROL:
+            return 8 + 0xffff;
+        case AGENT_RESET:
+            return 0;
+        case AGENT_IMAGE:
+            return AGENT_MAX_IMAGE;
+        case AGENT_AUTH:
+            return DFU_SHA256_LENGTH;
+        case AGENT_CONTROL_REPLY:
+            return 4 + 0xffff;
+        case AGENT_RESULT:
+            return AGENT_RESULT_SIZE;
+        case AGENT_PROGRESS:
+            return 8;
+        case AGENT_CHALLENGE:
+            return AGENT_NONCE_SIZE;
+        default:
+            return 0;
+    }
+}
+
+/*
+ *  Receive one frame
+ *
+ *  socket    - connection
+ *  type      - receives the frame type
+ *  payload   - receives a malloc()ed payload, NULL when empty
+ *  length    - receives the payload length
+ *
+ *  returns false when the connection is closed or the frame is invalid
+ */
+static bool receiveFrame(int socket, int* type, uint8_t** payload, uint32_t* length)
+{
+    uint8_t header[AGENT_HEADER_SIZE];
+    
+    *payload = NULL;
+    
+    if (!readFully(socket, header, sizeof(header)))
+        return false;
+    
+    *type = header[0];
+    *length = getLong(header + 4);
+    
+    // Checked before allocating, a peer must not make us reserve more than
+    // the frame type can need
+    if (*length > frameLimit(*type))
+    {
+        fprintf(stderr, "[!] Frame type 0x%02x of %u bytes exceeds limit.\n", *type, *length);
+        return false;
+    }
+    
+    if (*length == 0)
+        return true;
+    
+    *payload = malloc(*length);
+    
+    if (*payload == NULL || !readFully(socket, *payload, *length))
+    {
+        free(*payload);
+        *payload = NULL;
+        return false;
+    }
+    
+    return true;
+}
+
+static void authDigest(const uint8_t* nonce, const char* secret, uint8_t* digest)
+{
+    struct dfu_sha256 sha;
+    
+    dfu_sha256_init(&sha);
+    dfu_sha256_update(&sha, nonce, AGENT_NONCE_SIZE);
+    dfu_sha256_update(&sha, secret, strlen(secret));
+    dfu_sha256_final(&sha, digest);
+}
+
+/*
+ *  Challenge a new controller to prove it knows the shared secret
+ *
+ *  connection - connection before any other frame
+ *
+ *  returns true if the controller answered with the right digest
+ */
+static bool authenticate(struct agentConnection* connection)
+{
+    uint8_t nonce[AGENT_NONCE_SIZE];
+    uint8_t expected[DFU_SHA256_LENGTH];
+    uint8_t* payload;
+    uint32_t length;
+    int type;
+    
+    arc4random_buf(nonce, sizeof(nonce));
+    authDigest(nonce, connection->secret, expected);
+    
+    if (!sendFrame(connection->socket, AGENT_CHALLENGE, nonce, sizeof(nonce)) ||
+        !receiveFrame(connection->socket, &type, &payload, &length))
+        return false;
+    
+    bool valid = type == AGENT_AUTH && length == DFU_SHA256_LENGTH;
+    uint8_t difference = 0;
+    
+    // Compare every byte, the time taken must not tell how many matched
+    for (int i = 0; valid && i < DFU_SHA256_LENGTH; i++)
+        difference |= payload[i] ^ expected[i];
+    
+    free(payload);
+    
+    return valid && difference == 0;
+}
+
+static bool sendResult(struct agentConnection* connection, IOReturn result, const struct dfu_status* status, int bytes)
+{
+    uint8_t payload[AGENT_RESULT_SIZE];
+    
+    memset(payload, 0, sizeof(payload));
+    putLong(payload, result);
+    
+    if (status != NULL)
+    {
+        payload[4] = status->bStatus;
+        payload[5] = status->bState;
+    }
+    
+    payload[6] = connection->descriptor.bmAttributes;
+    putShort(payload + 8, connection->descriptor.wTransferSize);
+    putShort(payload + 10, connection->descriptor.wDetachTimeout);
+    putLong(payload + 12, bytes);
+    
+    return sendFrame(connection->socket, AGENT_RESULT, payload, sizeof(payload));
+}
+
+static void closeDevice(struct agentConnection* connection)
+{
+    if (connection->opened && !connection->simulate)
+        dfu_session_close(&connection->session);
+    
+    connection->opened = false;
+    connection->dif = NULL;
+}
+
+static IOReturn openSimulator(struct agentConnection* connection)
+{
+    struct dfu_status status;
+    
+    if (connection->simMemory == NULL)
+        connection->simMemory = malloc(AGENT_SIM_MEMORY);
+    
+    if (connection->simMemory == NULL)
+        return kIOReturnNoMemory;
+    
+    // Start in run-time mode so the detach path is exercised too
+    dfu_sim_init(&connection->sim, connection->simMemory, AGENT_SIM_MEMORY, STATE_APP_IDLE);
+    dfu_sim_attach(&connection->sim, &connection->simInterface);
+    
+    // Both have to be recovered from without writing a block twice
+    if (connection->faults)
+    {
+        connection->sim.drop_status = AGENT_SIM_DROP_STATUS;
+        connection->sim.stall_download = AGENT_SIM_STALL_DOWNLOAD;
+    }
+    
+    connection->descriptor.bmAttributes = connection->sim.attributes;
+    connection->descriptor.wDetachTimeout = connection->sim.detach_timeout;
+    connection->descriptor.wTransferSize = connection->sim.transfer_size;
+    connection->dif = &connection->simInterface;
+    
+    IOReturn result = dfu_get_status(connection->dif, &status);
+    
+    if (result != kIOReturnSuccess)
+        return result;
+    
+    return dfu_state_recover(connection->dif, connection->sim.attributes, connection->sim.detach_timeout, &status);
+}
+
+static IOReturn openDevice(struct agentConnection* connection, unsigned short idVendor, unsigned short idProduct)
+{
+    closeDevice(connection);
+    
+    printf("[i] Agent opening %sdevice [%04x:%04x].\n", connection->simulate ? "simulated " : "", idVendor, idProduct);
+    
+    if (connection->simulate)
+    {
+        IOReturn result = openSimulator(connection);
+        
+        connection->opened = result == kIOReturnSuccess;
+        
+        return result;
+    }
+    
+    dfu_session_init(&connection->session, idVendor, idProduct);
+    
+    IOReturn result = dfu_session_prepare(&connection->session);
+    
+    // Keep the interface claimed for AGENT_CONTROL requests
+    if (result == kIOReturnSuccess)
+        result = dfu_session_open_interface(&connection->session, 0);
+    
+    if (result != kIOReturnSuccess)
+    {
+        dfu_session_close(&connection->session);
+        return result;
+    }
+    
+    connection->descriptor = connection->session.descriptor;
+    connection->dif = &connection->session.dif;
+    connection->opened = true;
+    
+    return kIOReturnSuccess;
+}
+
+static void sendProgress(const struct dfu_transfer* transfer, int block_size, void* context)
+{
+    struct agentConnection* connection = context;
+    int percent = transfer->size > 0 ? (int)((long long)transfer->sent * 100 / transfer->size) : 100;
+    uint8_t payload[8];
+    
+    if (percent == connection->lastReported)
+        return;
+    
+    connection->lastReported = percent;
+    
+    putLong(payload, transfer->sent);
+    putLong(payload + 4, transfer->size);
+    sendFrame(connection->socket, AGENT_PROGRESS, payload, sizeof(payload));
+}
+
+static bool handleControl(struct agentConnection* connection, const uint8_t* payload, uint32_t length)
+{
+    if (!connection->opened || length < 8)
+        return sendResult(connection, kIOReturnNotOpen, NULL, 0);
+    
+    IOUSBDevRequestTO request;
+    bool in = payload[0] & 0x80;
+    
+    request.bmRequestType = payload[0];
+    request.bRequest = payload[1];
+    request.wValue = payload[2] | (payload[3] << 8);
+    request.wIndex = payload[4] | (payload[5] << 8);
+    request.wLength = payload[6] | (payload[7] << 8);
+    request.wLenDone = 0;
+    
+    if (!in && length - 8 < request.wLength)
+        return sendResult(connection, kIOReturnBadArgument, NULL, 0);
+    
+    uint8_t* reply = malloc(4 + request.wLength);
+    
+    if (reply == NULL)
+        return false;
+    
+    if (!in)
+        memcpy(reply + 4, payload + 8, request.wLength);
+    
+    request.pData = request.wLength > 0 ? reply + 4 : NULL;
+    
+    // Requests are addressed to the local interface whatever the controller thinks
+    request.wIndex = connection->dif->index;
+    
+    IOReturn result = dfu_control(connection->dif, &request);
+    
+    putLong(reply, result);
+    
+    bool sent = sendFrame(connection->socket, AGENT_CONTROL_REPLY, reply, 4 + (in ? request.wLenDone : 0));
+    
+    free(reply);
+    
+    return sent;
+}
+
+static bool handleImage(struct agentConnection* connection, uint8_t* payload, uint32_t length)
+{
+    if (!connection->opened)
+        return sendResult(connection, kIOReturnNotOpen, NULL, 0);
+    
+    printf("[i] Agent flashing %u bytes.\n", length);
+    
+    connection->lastReported = -1;
+    
+    if (connection->simulate)
+    {
+        struct dfu_transfer transfer;
+        
+        dfu_transfer_init(&transfer, connection->dif, payload, length, connection->descriptor.wTransferSize);
+        transfer.progress = sendProgress;
+        transfer.context = connection;
+        
+        IOReturn result = dfu_transfer_download(&transfer);
+        
+        if (result == kIOReturnSuccess)
+            result = dfu_transfer_manifest(&transfer);
+        
+        // The simulator must hold exactly what was sent
+        if (result == kIOReturnSuccess &&
+            (connection->sim.image_size != (int)length || memcmp(connection->simMemory, payload, length) != 0))
+        {
+            fprintf(stderr, "[!] Simulated device contents do not match the image.\n");
+            result = kIOReturnIOError;
+        }
+        
+        return sendResult(connection, result, &transfer.status, transfer.sent);
+    }
+    
+    struct dfu_file file;
+    
+    memset(&file, 0, sizeof(file));
+    file.name = "remote image";
+    file.firmware = payload;
+    file.size.total = length;
+    
+    // Download claims the interface itself
+    dfu_session_close_interface(&connection->session);
+    
+    connection->session.progress = sendProgress;
+    connection->session.context = connection;
+    
+    IOReturn result = dfu_session_download(&connection->session, &file);
+    struct dfu_status status = connection->session.transfer.status;
+    int sent = connection->session.transfer.sent;
+    
+    // Device resets into its new firmware
+    closeDevice(connection);
+    
+    return sendResult(connection, result, &status, sent);
+}
+
+static void* connectionThread(void* context)
+{
+    struct agentConnection* connection = context;
+    int type;
+    uint8_t* payload;
+    uint32_t length;
+    bool alive = authenticate(connection);
+    
+    if (!alive)
+        fprintf(stderr, "[!] Agent connection failed authentication.\n");
+    
+    while (alive && receiveFrame(connection->socket, &type, &payload, &length))
+    {
+        switch (type)
+        {
+            case AGENT_OPEN:
+            {
+                IOReturn result = length < 4 ? kIOReturnBadArgument :
+                    openDevice(connection, getShort(payload), getShort(payload + 2));
+                
+                alive = sendResult(connection, result, NULL, 0);
+                break;
+            }
+            case AGENT_CONTROL:
+                alive = handleControl(connection, payload, length);
+                break;
+            case AGENT_RESET:
+                alive = sendResult(connection, connection->opened ? dfu_reset(connection->dif) : kIOReturnNotOpen, NULL, 0);
+                break;
+            case AGENT_IMAGE:
+                alive = handleImage(connection, payload, length);
+                break;
+            default:
+                fprintf(stderr, "[!] Unknown frame type 0x%02x.\n", type);
+                alive = false;
+                break;
+        }
+        
+        free(payload);
+    }
+    
+    closeDevice(connection);
+    close(connection->socket);
+    free(connection->simMemory);
+    free(connection);
+    
+    return NULL;
+}
+
+/*
+ *  Accept controller connections on a TCP port until killed, one device
+ *  session per connection
+ *
+ *  address   - IPv4 address to listen on
+ *  port      - TCP port to listen on
+ *  simulate  - serve a simulated device instead of USB devices
+ *  faults    - the simulated device loses a status reply and stalls a block
+ *
+ *  returns non-zero on error
+ */
+int runAgent(const char* bindAddress, unsigned short port, bool simulate, bool faults)
+{
+    struct sockaddr_in address;
+    const char* secret = getenv(AGENT_SECRET_VARIABLE);
+    int enable = 1;
+    
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    
+    if (inet_pton(AF_INET, bindAddress, &address.sin_addr) != 1)
+    {
+        fprintf(stderr, "[!] Invalid listen address %s.\n", bindAddress);
+        return -1;
+    }
+    
+    if (secret == NULL)
+        secret = "";
+    
+    // Anyone who can connect can flash the attached devices
+    if (*secret == '\0' && (ntohl(address.sin_addr.s_addr) >> 24) != 127)
+    {
+        fprintf(stderr, "[!] Set %s to listen on %s.\n", AGENT_SECRET_VARIABLE, bindAddress);
+        return -1;
+    }
+    
+    signal(SIGPIPE, SIG_IGN);
+    
+    int server = socket(AF_INET, SOCK_STREAM, 0);
+    
+    if (server < 0)
+    {
+        fprintf(stderr, "[!] Failed to create socket: %s.\n", strerror(errno));
+        return -1;
+    }
+    
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    
+    if (bind(server, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(server, 16) != 0)
+    {
+        fprintf(stderr, "[!] Failed to listen on %s:%d: %s.\n", bindAddress, port, strerror(errno));
+        close(server);
+        return -1;
+    }
+    
+    printf("[i] Agent listening on %s:%d%s%s.\n", bindAddress, port, simulate ? " with a simulated device" : "",
+           simulate && faults ? " injecting faults" : "");
+    
+    for (;;)
+    {
+        int client = accept(server, NULL, NULL);
+        
+        if (client < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            
+            fprintf(stderr, "[!] Failed to accept connection: %s.\n", strerror(errno));
+            break;
+        }
+        
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+        
+        struct agentConnection* connection = calloc(1, sizeof(*connection));
+        pthread_t thread;
+        
+        if (connection == NULL)
+        {
+            close(client);
+            continue;
+        }
+        
+        connection->socket = client;
+        connection->secret = secret;
+        connection->simulate = simulate;
+        connection->faults = faults;
+        
+        if (pthread_create(&thread, NULL, connectionThread, connection) != 0)
+        {
+            close(client);
+            free(connection);
+            continue;
+        }
+        
+        pthread_detach(thread);
+    }
+    
+    close(server);
+    
+    return -1;
+}
+
+/* Controller side of an agent connection */
+struct remoteLink
+{
+    int socket;
+};
+
+static IOReturn remoteControl(void* context, IOUSBDevRequestTO* request)
+{
+    struct remoteLink* link = context;
+    bool in = request->bmRequestType & 0x80;
+    uint32_t length = 8 + (in ? 0 : request->wLength);
+    uint8_t* payload = malloc(length);
+    
+    if (payload == NULL)
+        return kIOReturnNoMemory;
+    
+    payload[0] = request->bmRequestType;
+    payload[1] = request->bRequest;
+    payload[2] = request->wValue & 0xff;
+    payload[3] = request->wValue >> 8;
+    payload[4] = request->wIndex & 0xff;
+    payload[5] = request->wIndex >> 8;
+    payload[6] = request->wLength & 0xff;
+    payload[7] = request->wLength >> 8;
+    
+    if (!in && request->wLength > 0)
+        memcpy(payload + 8, request->pData, request->wLength);
+    
+    bool sent = sendFrame(link->socket, AGENT_CONTROL, payload, length);
+    
+    free(payload);
+    
+    int type;
+    uint8_t* reply;
+    uint32_t replyLength;
+    
+    if (!sent || !receiveFrame(link->socket, &type, &reply, &replyLength))
+        return kIOReturnNotResponding;
+    
+    IOReturn result = kIOReturnError;
+    
+    if (type == AGENT_CONTROL_REPLY && replyLength >= 4)
+    {
+        result = getLong(reply);
+        request->wLenDone = replyLength - 4;
+        
+        if (in && request->wLenDone > request->wLength)
+            request->wLenDone = request->wLength;
+        
+        if (in)
+            memcpy(request->pData, reply + 4, request->wLenDone);
+    }
+    else if (type == AGENT_RESULT && replyLength >= 4)
+        result = getLong(reply);
+    
+    free(reply);
+    
+    return result;
+}
+
+static IOReturn remoteReset(void* context)
+{
+    struct remoteLink* link = context;
+    int type;
+    uint8_t* reply;
+    uint32_t length;
+    
+    if (!sendFrame(link->socket, AGENT_RESET, NULL, 0) || !receiveFrame(link->socket, &type, &reply, &length))
+        return kIOReturnNotResponding;
+    
+    IOReturn result = (type == AGENT_RESULT && length >= 4) ? getLong(reply) : kIOReturnError;
+    
+    free(reply);
+    
+    return result;
+}
+
+static int connectAgent(const char* host, unsigned short port)
+{
+    struct addrinfo hints;
+    struct addrinfo* addresses;
+    struct addrinfo* address;
+    char service[8];
+    int enable = 1;
+    int client = -1;
+    
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%u", port);
+    
+    if (getaddrinfo(host, service, &hints, &addresses) != 0)
+    {
+        fprintf(stderr, "[!] Failed to resolve %s.\n", host);
+        return -1;
+    }
+    
+    for (address = addresses; address != NULL; address = address->ai_next)
+    {
+        client = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        
+        if (client < 0)
+            continue;
+        
+        if (connect(client, address->ai_addr, address->ai_addrlen) == 0)
+            break;
+        
+        close(client);
+        client = -1;
+    }
+    
+    freeaddrinfo(addresses);
+    
+    if (client < 0)
+        fprintf(stderr, "[!] Failed to connect to %s:%u.\n", host, port);
+    else
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    
+    return client;
+}
+
+/*
+ *  Answer the challenge an agent opens every connection with
+ *
+ *  socket    - new agent connection
+ *
+ *  returns false if the connection was lost
+ */
+static bool answerChallenge(int socket)
+{
+    const char* secret = getenv(AGENT_SECRET_VARIABLE);
+    uint8_t digest[DFU_SHA256_LENGTH];
+    uint8_t* nonce;
+    uint32_t length;
+    int type;
+    
+    if (!receiveFrame(socket, &type, &nonce, &length))
+        return false;
+    
+    bool valid = type == AGENT_CHALLENGE && length == AGENT_NONCE_SIZE;
+    
+    if (valid)
+        authDigest(nonce, secret != NULL ? secret : "", digest);
+    
+    free(nonce);
+    
+    return valid && sendFrame(socket, AGENT_AUTH, digest, sizeof(digest));
+}
+
+static bool receiveResult(int socket, uint8_t* result)
+{
+    int type;
+    uint8_t* payload;
+    uint32_t length;
+    
+    for (;;)
+    {
+        if (!receiveFrame(socket, &type, &payload, &length))
+            return false;
+        
+        if (type == AGENT_PROGRESS && length >= 8)
+            printf("[i] Remote progress %u / %u bytes.\n", getLong(payload), getLong(payload + 4));
+        
+        if (type == AGENT_RESULT && length >= AGENT_RESULT_SIZE)
+        {
+            memcpy(result, payload, AGENT_RESULT_SIZE);
+            free(payload);
+            return true;
+        }
+        
+        free(payload);
+    }
+}
+
+/*
+ *  Flash a device attached to a remote agent
+ *
+ *  host      - agent host name or address
+ *  port      - agent TCP port
+ *  idVendor  - USB vendor id of the device
+ *  idProduct - USB product id of the device
+ *  file      - firmware, the DFU suffix is not sent
+ *
+ *  returns zero on success
+ */
+int flashRemote(const char* host, unsigned short port,
+                unsigned short idVendor, unsigned short idProduct,
+                const struct dfu_file* file)
+{
+    uint8_t result[AGENT_RESULT_SIZE];
+    uint8_t open[4];
+    int client = connectAgent(host, port);
+    
+    if (client < 0)
+        return -1;
+    
+    putShort(open, idVendor);
+    putShort(open + 2, idProduct);
+    
+    // A wrong secret makes the agent close the connection
+    if (!answerChallenge(client) || !sendFrame(client, AGENT_OPEN, open, sizeof(open)) || !receiveResult(client, result))
+    {
+        fprintf(stderr, "[!] Agent connection lost, check %s.\n", AGENT_SECRET_VARIABLE);
+        close(client);
+        return -1;
+    }
+    
+    if (getLong(result) != kIOReturnSuccess)
+    {
+        fprintf(stderr, "[!] Agent failed to open device [%04x:%04x]: 0x%08x.\n", idVendor, idProduct, getLong(result));
+        close(client);
+        return -1;
+    }
+    
+    printf("[i] Remote device attributes 0x%02x, Timeout: %d, Transfer Size: %d\n",
+           result[6], getShort(result + 10), getShort(result + 8));
+    
+    // Individual requests travel through the agent like a local transport
+    struct remoteLink link = { client };
+    struct dfu_if dif;
+    struct dfu_status status;
+    
+    memset(&dif, 0, sizeof(dif));
+    dif.timeout = DFU_DEFAULT_TIMEOUT;
+    dif.transport.control = remoteControl;
+    dif.transport.reset = remoteReset;
+    dif.transport.context = &link;
+    
+    if (dfu_get_status(&dif, &status) == kIOReturnSuccess)
+        printf("[i] Remote device State %s, Status %s\n",
+               dfu_state_to_string(status.bState), dfu_status_to_string(status.bStatus));
+    
+    int size = file->size.total - file->size.suffix;
+    
+    printf("[i] Sending %d bytes to agent %s:%u.\n", size, host, port);
+    
+    if (!sendFrame(client, AGENT_IMAGE, file->firmware, size) || !receiveResult(client, result))
+    {
+        fprintf(stderr, "[!] Agent connection lost.\n");
+        close(client);
+        return -1;
+    }
+    
+    close(client);
+    
+    if (getLong(result) != kIOReturnSuccess)
+    {
+        fprintf(stderr, "[!] Remote flash failed: 0x%08x (state %s, status %s), %u / %d bytes sent.\n",
+                getLong(result), dfu_state_to_string(result[5]), dfu_status_to_string(result[4]),
+                getLong(result + 12), size);
+        return -1;
+    }
+    
+    printf("[i] Remote firmware upload complete, %u bytes.\n", getLong(result + 12));
+    
+    return 0;
+}
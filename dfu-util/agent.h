@@ -0,0 +1,80 @@
+/*
+ *  Remote flashing agent, serves DFU devices over TCP
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef __dfu_util__agent__
+#define __dfu_util__agent__
+
+#include <stdbool.h>
+
+#include "dfu_file.h"
+
+#define AGENT_DEFAULT_PORT      4242
+#define AGENT_DEFAULT_ADDRESS   "127.0.0.1"
+#define AGENT_SECRET_VARIABLE   "DFU_AGENT_SECRET"
+#define AGENT_NONCE_SIZE        32
+#define AGENT_HEADER_SIZE       8
+#define AGENT_RESULT_SIZE       16
+#define AGENT_MAX_IMAGE         (64 * 1024 * 1024)
+#define AGENT_SIM_MEMORY        (4 * 1024 * 1024)
+#define AGENT_SIM_DROP_STATUS   3     /* DFU_GETSTATUS reply lost with --faults */
+#define AGENT_SIM_STALL_DOWNLOAD 7    /* DFU_DNLOAD stalled with --faults */
+
+/*
+ *  Every frame starts with an 8 byte header: type, flags, two reserved
+ *  bytes and the payload length, multi-byte fields in network order.
+ *  The setup packet inside AGENT_CONTROL keeps USB (little endian) order.
+ *  Payloads are limited per type, only AGENT_IMAGE may exceed a control
+ *  transfer and the header, up to AGENT_MAX_IMAGE.
+ *
+ *  The agent opens every connection with AGENT_CHALLENGE, the controller
+ *  answers with AGENT_AUTH before any other frame. The shared secret comes
+ *  from the environment on both sides and is empty if unset, an agent
+ *  without a secret only listens on loopback addresses.
+ *
+ *  The image is sent once with AGENT_IMAGE and the agent runs the whole
+ *  DFU_DNLOAD / DFU_GETSTATUS loop next to the device, so only progress
+ *  and the result cross the network.
+ */
+enum agentFrame
+{
+    AGENT_OPEN          = 0x01,  /* u16 idVendor, u16 idProduct */
+    AGENT_CONTROL       = 0x02,  /* 8 byte setup packet, OUT data */
+    AGENT_RESET         = 0x03,  /* no payload */
+    AGENT_IMAGE         = 0x04,  /* image without DFU suffix */
+    AGENT_AUTH          = 0x05,  /* SHA-256 of the nonce followed by the secret */
+    AGENT_CONTROL_REPLY = 0x81,  /* u32 IOReturn, IN data */
+    AGENT_RESULT        = 0x82,  /* see below */
+    AGENT_PROGRESS      = 0x83,  /* u32 sent, u32 total */
+    AGENT_CHALLENGE     = 0x84   /* random nonce */
+};
+
+/*
+ *  AGENT_RESULT payload: u32 IOReturn, u8 bStatus, u8 bState,
+ *  u8 bmAttributes, u8 reserved, u16 wTransferSize, u16 wDetachTimeout,
+ *  u32 bytes transferred.
+ */
+
+int runAgent(const char* address, unsigned short port, bool simulate, bool faults);
+int flashRemote(const char* host, unsigned short port,
+                unsigned short idVendor, unsigned short idProduct,
+                const struct dfu_file* file);
+
+#endif /* defined(__dfu_util__agent__) */
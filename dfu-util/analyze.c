@@ -0,0 +1,796 @@
+/*
+ *  Analysis of usbmon captures of DFU sessions
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "analyze.h"
+#include "libdfu.h"
+
+#define PCAP_MAGIC              0xa1b2c3d4
+#define PCAP_MAGIC_NS           0xa1b23c4d
+#define PCAPNG_SECTION          0x0a0d0d0a
+#define PCAPNG_BYTE_ORDER       0x1a2b3c4d
+#define PCAPNG_INTERFACE        1
+#define PCAPNG_ENHANCED_PACKET  6
+
+#define LINKTYPE_USB_LINUX      189   /* 48 byte usbmon header */
+#define LINKTYPE_USB_MMAPPED    220   /* 64 byte usbmon header */
+
+#define USBMON_CONTROL          2
+#define USBMON_STALL            -32   /* -EPIPE */
+
+#define ANALYZE_SNAP            128   /* usbmon header and the start of the data */
+#define ANALYZE_INTERFACES      16
+#define ANALYZE_PENDING         256
+#define ANALYZE_DEVICES         64
+#define ANALYZE_REQUESTS        (DFU_ABORT + 1)
+#define ANALYZE_STATES          (STATE_DFU_ERROR + 1)
+#define ANALYZE_LATE_US         1000  /* slack before a poll counts as late */
+
+/* Sequential reader of one capture, classic pcap or pcapng */
+struct captureReader
+{
+    FILE* file;
+    bool pcapng;
+    bool bigEndian;
+    /* Classic pcap */
+    int linkType;
+    bool nanoseconds;
+    /* pcapng, per interface of the current section */
+    int interfaceCount;
+    int linkTypes[ANALYZE_INTERFACES];
+    double unitsPerSecond[ANALYZE_INTERFACES];
+    unsigned long packets;
+};
+
+struct capturePacket
+{
+    uint64_t time;
+    int linkType;
+    uint32_t length;
+    uint8_t data[ANALYZE_SNAP];
+};
+
+/* Control URB submitted and not completed yet */
+struct pendingRequest
+{
+    uint64_t id;
+    uint16_t bus;
+    uint8_t address;
+    uint8_t bRequest;
+    uint16_t wLength;
+    uint64_t submitted;
+    bool early;
+    bool used;
+};
+
+struct requestStats
+{
+    unsigned long count;
+    uint64_t total;
+    uint64_t max;
+    unsigned long stalls;
+    unsigned long errors;
+};
+
+/* Everything learned about one bus address */
+struct deviceTrace
+{
+    uint16_t bus;
+    uint8_t address;
+    uint64_t first;
+    uint64_t last;
+    /* Time from a DETACH on another address to the first request on this one */
+    uint64_t reenumeration;
+    /* Last state reported, -1 before the first */
+    int state;
+    uint64_t stateSince;
+    uint64_t stateTime[ANALYZE_STATES];
+    struct requestStats requests[ANALYZE_REQUESTS];
+    /* Completion of a busy DFU_GETSTATUS and the bwPollTimeout it asked for */
+    bool polling;
+    uint64_t pollFrom;
+    uint64_t pollTimeout;
+    unsigned long earlyPolls;
+    uint64_t earlyTime;
+    unsigned long latePolls;
+    uint64_t lateTime;
+    /* First block sent to last block acknowledged */
+    uint64_t downloaded;
+    uint64_t downloadStart;
+    uint64_t downloadEnd;
+    uint64_t uploaded;
+    uint64_t uploadStart;
+    uint64_t uploadEnd;
+};
+
+struct captureAnalysis
+{
+    bool timeline;
+    uint64_t start;
+    unsigned long controls;
+    unsigned long requests;
+    struct pendingRequest pending[ANALYZE_PENDING];
+    struct deviceTrace devices[ANALYZE_DEVICES];
+    int deviceCount;
+    /* Completion of the last DFU_DETACH, until a new address shows up */
+    uint64_t detached;
+};
+
+static const char* requestNames[ANALYZE_REQUESTS] =
+{
+    "DFU_DETACH", "DFU_DNLOAD", "DFU_UPLOAD", "DFU_GETSTATUS", "DFU_CLRSTATUS", "DFU_GETSTATE", "DFU_ABORT"
+};
+
+static uint16_t get16(const uint8_t* p, bool bigEndian)
+{
+    return bigEndian ? (p[0] << 8) | p[1] : p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t* p, bool bigEndian)
+{
+    return bigEndian ? ((uint32_t)get16(p, true) << 16) | get16(p + 2, true)
+                     : get16(p, false) | ((uint32_t)get16(p + 2, false) << 16);
+}
+
+static uint64_t get64(const uint8_t* p, bool bigEndian)
+{
+    return bigEndian ? ((uint64_t)get32(p, true) << 32) | get32(p + 4, true)
+                     : get32(p, false) | ((uint64_t)get32(p + 4, false) << 32);
+}
+
+static double ms(uint64_t us)
+{
+    return us / 1000.0;
+}
+
+/*
+ *  Skip bytes of the capture, pipes cannot seek
+ */
+static bool skipBytes(FILE* file, uint64_t length)
+{
+    uint8_t scratch[4096];
+    
+    if (length == 0 || fseeko(file, length, SEEK_CUR) == 0)
+        return true;
+    
+    while (length > 0)
+    {
+        size_t chunk = length < sizeof(scratch) ? length : sizeof(scratch);
+        
+        if (fread(scratch, 1, chunk, file) != chunk)
+            return false;
+        
+        length -= chunk;
+    }
+    
+    return true;
+}
+
+/*
+ *  Read the first bytes of a packet into the snapshot and skip the rest
+ */
+static bool readPacketData(struct captureReader* reader, struct capturePacket* packet, uint32_t captured)
+{
+    packet->length = captured < ANALYZE_SNAP ? captured : ANALYZE_SNAP;
+    
+    if (fread(packet->data, 1, packet->length, reader->file) != packet->length)
+        return false;
+    
+    return skipBytes(reader->file, captured - packet->length);
+}
+
+/*
+ *  Rest of a section header block, a new section may change the byte
+ *  order and drops all interfaces
+ *
+ *  reader    - reader positioned after the block length
+ *  length    - block length as read, its byte order is not known yet
+ */
+static bool readSection(struct captureReader* reader, const uint8_t* length)
+{
+    uint8_t magic[4];
+    
+    if (fread(magic, 1, 4, reader->file) != 4)
+        return false;
+    
+    reader->bigEndian = get32(magic, true) == PCAPNG_BYTE_ORDER;
+    reader->interfaceCount = 0;
+    
+    uint32_t total = get32(length, reader->bigEndian);
+    
+    return total >= 28 && (total & 3) == 0 && skipBytes(reader->file, total - 12);
+}
+
+/*
+ *  Identify the capture format from its first block
+ *
+ *  returns false if it is neither pcap nor pcapng
+ */
+static bool openCapture(struct captureReader* reader, FILE* file)
+{
+    uint8_t header[24];
+    
+    memset(reader, 0, sizeof(*reader));
+    reader->file = file;
+    
+    if (fread(header, 1, 4, file) != 4)
+        return false;
+    
+    if (get32(header, false) == PCAPNG_SECTION)
+    {
+        reader->pcapng = true;
+        return fread(header + 4, 1, 4, file) == 4 && readSection(reader, header + 4);
+    }
+    
+    if (fread(header + 4, 1, 20, file) != 20)
+        return false;
+    
+    for (int order = 0; order < 2; order++)
+    {
+        uint32_t magic = get32(header, order == 1);
+        
+        if (magic == PCAP_MAGIC || magic == PCAP_MAGIC_NS)
+        {
+            reader->bigEndian = order == 1;
+            reader->nanoseconds = magic == PCAP_MAGIC_NS;
+            reader->linkType = get32(header + 20, reader->bigEndian) & 0xffff;
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+/*
+ *  Interface description block, only the link type and the timestamp
+ *  resolution matter
+ */
+static void readInterface(struct captureReader* reader, const uint8_t* body, uint32_t length)
+{
+    if (reader->interfaceCount == ANALYZE_INTERFACES || length < 8)
+        return;
+    
+    int index = reader->interfaceCount++;
+    
+    reader->linkTypes[index] = get16(body, reader->bigEndian);
+    reader->unitsPerSecond[index] = 1e6;
+    
+    for (uint32_t offset = 8; offset + 4 <= length; )
+    {
+        uint16_t code = get16(body + offset, reader->bigEndian);
+        uint16_t size = get16(body + offset + 2, reader->bigEndian);
+        
+        if (code == 0 || offset + 4 + size > length)
+            break;
+        
+        // if_tsresol, a power of ten or of two
+        if (code == 9 && size >= 1)
+        {
+            uint8_t resolution = body[offset + 4];
+            double units = 1;
+            
+            for (int i = 0; i < (resolution & 0x7f); i++)
+                units *= (resolution & 0x80) ? 2 : 10;
+            
+            reader->unitsPerSecond[index] = units;
+        }
+        
+        offset += 4 + ((size + 3) & ~3);
+    }
+}
+
+/*
+ *  Next packet of a usbmon link type
+ *
+ *  returns 1 with a packet, 0 at the end of the capture, -1 if it is damaged
+ */
+static int readPacket(struct captureReader* reader, struct capturePacket* packet)
+{
+    uint8_t header[28];
+    
+    if (!reader->pcapng)
+    {
+        while (fread(header, 1, 16, reader->file) == 16)
+        {
+            uint32_t fraction = get32(header + 4, reader->bigEndian);
+            
+            packet->time = get32(header, reader->bigEndian) * 1000000ULL +
+                           (reader->nanoseconds ? fraction / 1000 : fraction);
+            packet->linkType = reader->linkType;
+            
+            if (!readPacketData(reader, packet, get32(header + 8, reader->bigEndian)))
+                return -1;
+            
+            reader->packets++;
+            
+            if (packet->linkType == LINKTYPE_USB_LINUX || packet->linkType == LINKTYPE_USB_MMAPPED)
+                return 1;
+        }
+        
+        return 0;
+    }
+    
+    while (fread(header, 1, 8, reader->file) == 8)
+    {
+        uint32_t type = get32(header, reader->bigEndian);
+        
+        if (type == PCAPNG_SECTION)
+        {
+            if (!readSection(reader, header + 4))
+                return -1;
+            
+            continue;
+        }
+        
+        uint32_t total = get32(header + 4, reader->bigEndian);
+        
+        if (total < 12 || (total & 3) != 0)
+            return -1;
+        
+        uint32_t body = total - 12;
+        
+        if (type == PCAPNG_INTERFACE && body <= 4096)
+        {
+            uint8_t block[4096];
+            
+            if (fread(block, 1, body, reader->file) != body)
+                return -1;
+            
+            readInterface(reader, block, body);
+            
+            if (!skipBytes(reader->file, 4))
+                return -1;
+            
+            continue;
+        }
+        
+        if (type != PCAPNG_ENHANCED_PACKET || body < 20)
+        {
+            if (!skipBytes(reader->file, body + 4))
+                return -1;
+            
+            continue;
+        }
+        
+        if (fread(header + 8, 1, 20, reader->file) != 20)
+            return -1;
+        
+        uint32_t interface = get32(header + 8, reader->bigEndian);
+        uint64_t timestamp = ((uint64_t)get32(header + 12, reader->bigEndian) << 32) | get32(header + 16, reader->bigEndian);
+        uint32_t captured = get32(header + 20, reader->bigEndian);
+        
+        if (captured > body - 20)
+            return -1;
+        
+        if (!readPacketData(reader, packet, captured) || !skipBytes(reader->file, body - 20 - captured + 4))
+            return -1;
+        
+        reader->packets++;
+        
+        if (interface >= (uint32_t)reader->interfaceCount)
+            continue;
+        
+        packet->linkType = reader->linkTypes[interface];
+        packet->time = (uint64_t)(timestamp * (1e6 / reader->unitsPerSecond[interface]));
+        
+        if (packet->linkType == LINKTYPE_USB_LINUX || packet->linkType == LINKTYPE_USB_MMAPPED)
+            return 1;
+    }
+    
+    return 0;
+}
+
+/*
+ *  Class requests to the interface with the direction and length DFU
+ *  uses, which keeps HID requests with the same numbers out
+ */
+static bool isDfuRequest(const uint8_t* setup)
+{
+    uint8_t bRequest = setup[1];
+    uint16_t wLength = get16(setup + 6, false);
+    bool in = setup[0] == 0xa1;
+    
+    if (setup[0] != 0x21 && setup[0] != 0xa1)
+        return false;
+    
+    switch (bRequest)
+    {
+        case DFU_DETACH:
+        case DFU_CLRSTATUS:
+        case DFU_ABORT:
+            return !in && wLength == 0;
+        case DFU_DNLOAD:
+            return !in;
+        case DFU_UPLOAD:
+            return in && wLength > 1;
+        case DFU_GETSTATUS:
+            return in && wLength == 6;
+        case DFU_GETSTATE:
+            return in && wLength == 1;
+        default:
+            return false;
+    }
+}
+
+static struct deviceTrace* findDevice(struct captureAnalysis* analysis, uint16_t bus, uint8_t address, uint64_t time)
+{
+    for (int i = 0; i < analysis->deviceCount; i++)
+        if (analysis->devices[i].bus == bus && analysis->devices[i].address == address)
+            return &analysis->devices[i];
+    
+    if (analysis->deviceCount == ANALYZE_DEVICES)
+        return NULL;
+    
+    struct deviceTrace* device = &analysis->devices[analysis->deviceCount++];
+    
+    memset(device, 0, sizeof(*device));
+    device->bus = bus;
+    device->address = address;
+    device->first = time;
+    device->state = -1;
+    
+    // The device came back under a new address after detaching
+    if (analysis->detached != 0)
+    {
+        device->reenumeration = time - analysis->detached;
+        analysis->detached = 0;
+    }
+    
+    return device;
+}
+
+static struct pendingRequest* findPending(struct captureAnalysis* analysis, uint64_t id, bool insert)
+{
+    unsigned int home = (unsigned int)((id >> 4) ^ (id >> 20)) % ANALYZE_PENDING;
+    
+    for (unsigned int probe = 0; probe < 16; probe++)
+    {
+        struct pendingRequest* pending = &analysis->pending[(home + probe) % ANALYZE_PENDING];
+        
+        if (insert ? !pending->used : pending->used && pending->id == id)
+            return pending;
+    }
+    
+    // Completions lost from the capture leave stale entries, reuse them
+    return insert ? &analysis->pending[home] : NULL;
+}
+
+static void observeState(struct captureAnalysis* analysis, struct deviceTrace* device, int state, uint64_t time)
+{
+    if (state >= ANALYZE_STATES)
+        return;
+    
+    if (device->state >= 0)
+        device->stateTime[device->state] += time - device->stateSince;
+    
+    if (analysis->timeline && state != device->state)
+        printf("  %12.6f  %03u:%03u  %s -> %s\n", (time - analysis->start) / 1000000.0, device->bus, device->address,
+               device->state >= 0 ? dfu_state_to_string(device->state) : "-", dfu_state_to_string(state));
+    
+    device->state = state;
+    device->stateSince = time;
+}
+
+static void submitRequest(struct captureAnalysis* analysis, const uint8_t* usb, uint64_t id, uint64_t time,
+                          uint16_t bus, uint8_t address)
+{
+    struct deviceTrace* device = findDevice(analysis, bus, address, time);
+    struct pendingRequest* pending = findPending(analysis, id, true);
+    
+    if (device == NULL)
+        return;
+    
+    pending->used = true;
+    pending->id = id;
+    pending->bus = bus;
+    pending->address = address;
+    pending->bRequest = usb[41];
+    pending->wLength = get16(usb + 46, false);
+    pending->submitted = time;
+    pending->early = false;
+    
+    // The first request after a busy status shows how well the host kept bwPollTimeout
+    if (device->polling)
+    {
+        uint64_t waited = time - device->pollFrom;
+        
+        if (waited < device->pollTimeout)
+        {
+            pending->early = true;
+            device->earlyPolls++;
+        }
+        else
+        {
+            device->lateTime += waited - device->pollTimeout;
+            
+            if (waited - device->pollTimeout > ANALYZE_LATE_US)
+                device->latePolls++;
+        }
+        
+        device->polling = false;
+    }
+    
+    if (pending->bRequest == DFU_DNLOAD && pending->wLength > 0 && device->downloadStart == 0)
+        device->downloadStart = time;
+    
+    if (pending->bRequest == DFU_UPLOAD && device->uploadStart == 0)
+        device->uploadStart = time;
+}
+
+static void completeRequest(struct captureAnalysis* analysis, struct pendingRequest* pending, int32_t status,
+                            const uint8_t* data, uint32_t length, uint32_t actual, uint64_t time)
+{
+    struct deviceTrace* device = findDevice(analysis, pending->bus, pending->address, time);
+    
+    pending->used = false;
+    
+    if (device == NULL)
+        return;
+    
+    struct requestStats* stats = &device->requests[pending->bRequest];
+    uint64_t duration = time - pending->submitted;
+    
+    analysis->requests++;
+    device->last = time;
+    stats->count++;
+    stats->total += duration;
+    
+    if (duration > stats->max)
+        stats->max = duration;
+    
+    if (pending->early)
+        device->earlyTime += duration;
+    
+    if (status == USBMON_STALL)
+        stats->stalls++;
+    else if (status != 0)
+        stats->errors++;
+    
+    if (status != 0)
+        return;
+    
+    switch (pending->bRequest)
+    {
+        case DFU_DETACH:
+            analysis->detached = time;
+            break;
+        case DFU_DNLOAD:
+            if (pending->wLength > 0)
+            {
+                device->downloaded += pending->wLength;
+                device->downloadEnd = time;
+            }
+            break;
+        case DFU_UPLOAD:
+            device->uploaded += actual;
+            device->uploadEnd = time;
+            break;
+        case DFU_GETSTATE:
+            if (length >= 1)
+                observeState(analysis, device, data[0], time);
+            break;
+        case DFU_GETSTATUS:
+            if (length >= 6)
+            {
+                observeState(analysis, device, data[4], time);
+            
+                // Only busy states ask the host to wait before polling again
+                if (data[4] == STATE_DFU_DOWNLOAD_BUSY || data[4] == STATE_DFU_MANIFEST)
+                {
+                    device->polling = true;
+                    device->pollFrom = time;
+                    device->pollTimeout = (data[1] | (data[2] << 8) | (data[3] << 16)) * 1000ULL;
+                }
+            }
+            break;
+    }
+}
+
+/*
+ *  Feed one usbmon event into the analysis
+ */
+static void analyzePacket(struct captureAnalysis* analysis, const struct captureReader* reader,
+                          const struct capturePacket* packet)
+{
+    unsigned int headerSize = packet->linkType == LINKTYPE_USB_MMAPPED ? 64 : 48;
+    const uint8_t* usb = packet->data;
+    bool bigEndian = reader->bigEndian;
+    
+    if (packet->length < headerSize || usb[9] != USBMON_CONTROL)
+        return;
+    
+    if (analysis->start == 0)
+        analysis->start = packet->time;
+    
+    uint64_t id = get64(usb, bigEndian);
+    uint16_t bus = get16(usb + 12, bigEndian);
+    int32_t status = (int32_t)get32(usb + 28, bigEndian);
+    
+    if (usb[8] == 'S')
+    {
+        analysis->controls++;
+        
+        // flag_setup is 0 when the setup packet was captured
+        if (usb[14] == 0 && isDfuRequest(usb + 40))
+            submitRequest(analysis, usb, id, packet->time, bus, usb[11]);
+        
+        return;
+    }
+    
+    struct pendingRequest* pending = findPending(analysis, id, false);
+    
+    if (pending == NULL || pending->bus != bus || pending->address != usb[11])
+        return;
+    
+    uint32_t captured = get32(usb + 36, bigEndian);
+    uint32_t available = packet->length - headerSize;
+    
+    completeRequest(analysis, pending, usb[8] == 'E' ? -1 : status, usb + headerSize,
+                    captured < available ? captured : available, get32(usb + 32, bigEndian), packet->time);
+}
+
+static void printPhase(const char* name, uint64_t time, uint64_t total)
+{
+    if (time > 0)
+        printf("    %-16s %10.1f ms  %5.1f%%\n", name, ms(time), total > 0 ? 100.0 * time / total : 0);
+}
+
+static void printRate(const char* name, uint64_t bytes, uint64_t start, uint64_t end)
+{
+    if (bytes == 0)
+        return;
+    
+    uint64_t span = end > start ? end - start : 1;
+    
+    printf("    %s %llu bytes in %.1f ms, %.0f bytes/s\n", name, (unsigned long long)bytes, ms(span), bytes * 1000000.0 / span);
+}
+
+static void printDevice(const struct deviceTrace* device)
+{
+    uint64_t states[ANALYZE_STATES];
+    
+    memcpy(states, device->stateTime, sizeof(states));
+    
+    // The last state lasts until the device went quiet
+    if (device->state >= 0 && device->last > device->stateSince)
+        states[device->state] += device->last - device->stateSince;
+    
+    uint64_t detach = states[STATE_APP_IDLE] + states[STATE_APP_DETACH];
+    uint64_t download = states[STATE_DFU_DOWNLOAD_SYNC] + states[STATE_DFU_DOWNLOAD_BUSY] + states[STATE_DFU_DOWNLOAD_IDLE];
+    uint64_t manifest = states[STATE_DFU_MANIFEST_SYNC] + states[STATE_DFU_MANIFEST] + states[STATE_DFU_MANIFEST_WAIT_RESET];
+    uint64_t total = device->reenumeration + (device->last - device->first);
+    
+    printf("\n[i] Device %03u:%03u, %.1f ms of DFU traffic.\n", device->bus, device->address, ms(device->last - device->first));
+    printf("    Phase            Time          Share\n");
+    printPhase("re-enumeration", device->reenumeration, total);
+    printPhase("detach", detach, total);
+    printPhase("idle", states[STATE_DFU_IDLE], total);
+    printPhase("download", download, total);
+    printPhase("manifest", manifest, total);
+    printPhase("upload", states[STATE_DFU_UPLOAD_IDLE], total);
+    printPhase("error", states[STATE_DFU_ERROR], total);
+    
+    printf("    Request          Count    Mean ms     Max ms  Stalls  Errors\n");
+    
+    for (int i = 0; i < ANALYZE_REQUESTS; i++)
+    {
+        const struct requestStats* stats = &device->requests[i];
+        
+        if (stats->count > 0)
+            printf("    %-14s %7lu %10.3f %10.3f %7lu %7lu\n", requestNames[i], stats->count,
+                   ms(stats->total) / stats->count, ms(stats->max), stats->stalls, stats->errors);
+    }
+    
+    if (device->earlyPolls > 0 || device->lateTime > 0)
+        printf("    Polls: %lu early (%.1f ms wasted), %lu late (%.1f ms past bwPollTimeout)\n",
+               device->earlyPolls, ms(device->earlyTime), device->latePolls, ms(device->lateTime));
+    
+    printRate("Download:", device->downloaded, device->downloadStart, device->downloadEnd);
+    printRate("Upload:", device->uploaded, device->uploadStart, device->uploadEnd);
+}
+
+/*
+ *  Analyze one capture in a single pass
+ *
+ *  returns 0 or -1 if it could not be read
+ */
+static int analyzeCapture(const char* path, bool timeline)
+{
+    FILE* file = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    
+    if (file == NULL)
+    {
+        fprintf(stderr, "[!] Could not open %s.\n", path);
+        return -1;
+    }
+    
+    // Large reads, captures of a whole shift run into gigabytes
+    setvbuf(file, NULL, _IOFBF, 1 << 20);
+    
+    struct captureReader reader;
+    struct captureAnalysis* analysis = calloc(1, sizeof(*analysis));
+    struct capturePacket packet;
+    int result = 0;
+    
+    if (analysis == NULL || !openCapture(&reader, file))
+    {
+        fprintf(stderr, "[!] %s is not a pcap or pcapng capture.\n", path);
+        result = -1;
+        goto done;
+    }
+    
+    analysis->timeline = timeline;
+    
+    if (timeline)
+        printf("[i] %s state changes:\n", path);
+    
+    while ((result = readPacket(&reader, &packet)) > 0)
+        analyzePacket(analysis, &reader, &packet);
+    
+    if (result < 0)
+        fprintf(stderr, "[!] %s is damaged after %lu packets, reporting what was read.\n", path, reader.packets);
+    
+    printf("[i] %s: %lu packets, %lu control transfers, %lu DFU requests on %d devices.\n",
+           path, reader.packets, analysis->controls, analysis->requests, analysis->deviceCount);
+    
+    for (int i = 0; i < analysis->deviceCount; i++)
+        if (analysis->devices[i].last > 0)
+            printDevice(&analysis->devices[i]);
+    
+done:
+    free(analysis);
+    
+    if (file != stdin)
+        fclose(file);
+    
+    return result;
+}
+
+int runAnalyze(int argc, const char* argv[])
+{
+    bool timeline = false;
+    int failed = 0;
+    int i = 0;
+    
+    if (argc > 0 && strcmp(argv[0], "--timeline") == 0)
+    {
+        timeline = true;
+        i++;
+    }
+    
+    if (i == argc)
+    {
+        printf("Usage: dfu-util analyze [--timeline] <capture>...\n");
+        printf("\nCaptures are usbmon pcap or pcapng files, - reads standard input.\n");
+        return -1;
+    }
+    
+    for (; i < argc; i++)
+        if (analyzeCapture(argv[i], timeline) != 0)
+            failed++;
+    
+    return failed == 0 ? 0 : -1;
+}
@@ -0,0 +1,36 @@
+/*
+ *  Analysis of usbmon captures of DFU sessions
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef __dfu_util__analyze__
+#define __dfu_util__analyze__
+
+/*
+ *  analyze [--timeline] <capture>...
+ *
+ *    --timeline        print every state change as it is found
+ *
+ *  Captures are usbmon pcap or pcapng files (LINKTYPE_USB_LINUX or
+ *  LINKTYPE_USB_LINUX_MMAPPED), "-" reads standard input. Each is read
+ *  once from start to end in constant memory.
+ */
+int runAnalyze(int argc, const char* argv[]);
+
+#endif /* defined(__dfu_util__analyze__) */
@@ -0,0 +1,288 @@
+/*
+ *  Deduplicated backups of device flash
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <dirent.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "backup.h"
+#include "libdfu.h"
+
+static void printUsage(void)
+{
+    printf("Usage: dfu-util backup <archive> store [--serial s] <vendorId hex> <productId hex> <length>\n");
+    printf("       dfu-util backup <archive> restore [--force] <manifest> <vendorId hex> <productId hex>\n");
+    printf("       dfu-util backup <archive> list\n");
+}
+
+static void printManifest(const char* name, const struct dfu_manifest* manifest)
+{
+    char date[32];
+    time_t seconds = (time_t)manifest->time;
+    
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&seconds));
+    printf("%04x:%04x:%04x  %-20s  %s  %10u  %5d chunks  %s\n", manifest->idVendor, manifest->idProduct,
+           manifest->bcdDevice, manifest->serial, date, manifest->size, manifest->count, name);
+}
+
+static int storeBackup(const struct dfu_archive* archive, int argc, const char* argv[])
+{
+    const char* serial = NULL;
+    
+    if (argc >= 2 && strcmp(argv[0], "--serial") == 0)
+    {
+        serial = argv[1];
+        argc -= 2;
+        argv += 2;
+    }
+    
+    if (argc != 3)
+    {
+        printUsage();
+        return -1;
+    }
+    
+    struct dfu_manifest manifest = { 0 };
+    struct dfu_session session;
+    int length = atoi(argv[2]);
+    int received = 0;
+    uint8_t* buffer = malloc(length > 0 ? length : 1);
+    
+    manifest.idVendor = strtoul(argv[0], NULL, 16);
+    manifest.idProduct = strtoul(argv[1], NULL, 16);
+    manifest.time = time(NULL);
+    
+    if (length <= 0 || buffer == NULL)
+    {
+        fprintf(stderr, "[!] Invalid length %s.\n", argv[2]);
+        free(buffer);
+        return -1;
+    }
+    
+    dfu_session_init(&session, manifest.idVendor, manifest.idProduct);
+    
+    IOReturn result = dfu_session_prepare(&session);
+    
+    if (result == kIOReturnSuccess)
+    {
+        unsigned char stringIndex = 0;
+        
+        (*session.device)->GetDeviceReleaseNumber(session.device, &manifest.bcdDevice);
+        
+        if (serial != NULL)
+            strlcpy(manifest.serial, serial, sizeof(manifest.serial));
+        else if ((*session.device)->USBGetSerialNumberStringIndex(session.device, &stringIndex) == kIOReturnSuccess &&
+                 stringIndex != 0)
+            retrieveString(session.device, stringIndex, manifest.serial, sizeof(manifest.serial));
+        
+        result = dfu_session_upload(&session, buffer, length, &received);
+    }
+    
+    dfu_session_close(&session);
+    
+    if (result != kIOReturnSuccess || received == 0)
+    {
+        fprintf(stderr, "[!] Failed to read the device flash: 0x%08x.\n", result);
+        free(buffer);
+        return -1;
+    }
+    
+    struct dfu_archive_stats stats;
+    char name[NAME_MAX];
+    int stored = dfu_archive_store(archive, &manifest, buffer, received, &stats, name, sizeof(name));
+    
+    free(buffer);
+    
+    if (stored != 0)
+    {
+        fprintf(stderr, "[!] Failed to write the backup to %s.\n", archive->path);
+        dfu_manifest_free(&manifest);
+        return -1;
+    }
+    
+    printf("[i] %d bytes in %d chunks, %d new (%llu bytes, %llu compressed), %d already archived.\n",
+           received, stats.chunks, stats.stored, (unsigned long long)stats.stored_bytes,
+           (unsigned long long)stats.compressed_bytes, stats.chunks - stats.stored);
+    printf("[i] Backup of \"%s\" written to %s.\n", manifest.serial, name);
+    
+    dfu_manifest_free(&manifest);
+    
+    return 0;
+}
+
+static int restoreBackup(const struct dfu_archive* archive, int argc, const char* argv[])
+{
+    bool force = false;
+    
+    if (argc >= 1 && strcmp(argv[0], "--force") == 0)
+    {
+        force = true;
+        argc--;
+        argv++;
+    }
+    
+    if (argc != 3)
+    {
+        printUsage();
+        return -1;
+    }
+    
+    char path[PATH_MAX];
+    struct dfu_manifest manifest;
+    
+    // A bare name is looked up in the archive
+    if (strchr(argv[0], '/') == NULL)
+        snprintf(path, sizeof(path), "%s/manifests/%s", archive->path, argv[0]);
+    else
+        strlcpy(path, argv[0], sizeof(path));
+    
+    if (dfu_manifest_load(&manifest, path) != 0)
+    {
+        fprintf(stderr, "[!] Failed to read manifest %s.\n", path);
+        return -1;
+    }
+    
+    unsigned short idVendor = strtoul(argv[1], NULL, 16);
+    unsigned short idProduct = strtoul(argv[2], NULL, 16);
+    
+    // Flash of another product is no backup of this one
+    if ((manifest.idVendor != idVendor || manifest.idProduct != idProduct) && !force)
+    {
+        fprintf(stderr, "[!] Backup was taken from [%04x:%04x], --force to restore it anyway.\n",
+                manifest.idVendor, manifest.idProduct);
+        dfu_manifest_free(&manifest);
+        return -1;
+    }
+    
+    struct dfu_restore restore;
+    struct dfu_session session;
+    struct dfu_file firmware = { 0 };
+    IOReturn result = kIOReturnNoMemory;
+    
+    // Chunks stream into the download, the image is never put together
+    firmware.name = path;
+    firmware.size.total = manifest.size;
+    
+    if (dfu_restore_init(&restore, archive, &manifest) == 0)
+    {
+        dfu_session_init(&session, idVendor, idProduct);
+        session.source = &restore.source;
+        
+        result = dfu_session_prepare(&session);
+        
+        UInt16 bcdDevice = manifest.bcdDevice;
+        
+        // Read in DFU mode, like when the backup was stored
+        if (result == kIOReturnSuccess)
+            (*session.device)->GetDeviceReleaseNumber(session.device, &bcdDevice);
+        
+        if (result == kIOReturnSuccess && bcdDevice != manifest.bcdDevice && !force)
+        {
+            fprintf(stderr, "[!] Backup was taken from bcdDevice %04x, the device is %04x, --force to restore it anyway.\n",
+                    manifest.bcdDevice, bcdDevice);
+            result = kIOReturnBadArgument;
+        }
+        else if (result == kIOReturnSuccess)
+            result = dfu_session_download(&session, &firmware);
+        
+        dfu_session_close(&session);
+    }
+    
+    dfu_restore_free(&restore);
+    dfu_manifest_free(&manifest);
+    
+    return result == kIOReturnSuccess ? 0 : -1;
+}
+
+static int listBackups(const struct dfu_archive* archive)
+{
+    char path[PATH_MAX];
+    
+    snprintf(path, sizeof(path), "%s/manifests", archive->path);
+    
+    DIR* directory = opendir(path);
+    
+    if (directory == NULL)
+    {
+        fprintf(stderr, "[!] Failed to read %s.\n", path);
+        return -1;
+    }
+    
+    struct dirent* entry;
+    
+    while ((entry = readdir(directory)) != NULL)
+    {
+        struct dfu_manifest manifest;
+        size_t length = strlen(entry->d_name);
+        
+        if (entry->d_name[0] == '.' || length < 9 || strcmp(entry->d_name + length - 9, ".manifest") != 0)
+            continue;
+        
+        snprintf(path, sizeof(path), "%s/manifests/%s", archive->path, entry->d_name);
+        
+        if (dfu_manifest_load(&manifest, path) != 0)
+        {
+            fprintf(stderr, "[!] Failed to read manifest %s.\n", entry->d_name);
+            continue;
+        }
+        
+        printManifest(entry->d_name, &manifest);
+        dfu_manifest_free(&manifest);
+    }
+    
+    closedir(directory);
+    
+    return 0;
+}
+
+int runBackup(int argc, const char* argv[])
+{
+    struct dfu_archive archive;
+    
+    if (argc < 2)
+    {
+        printUsage();
+        return -1;
+    }
+    
+    if (dfu_archive_open(&archive, argv[0]) != 0)
+    {
+        fprintf(stderr, "[!] Failed to open archive %s.\n", argv[0]);
+        return -1;
+    }
+    
+    if (strcmp(argv[1], "store") == 0)
+        return storeBackup(&archive, argc - 2, argv + 2);
+    
+    if (strcmp(argv[1], "restore") == 0)
+        return restoreBackup(&archive, argc - 2, argv + 2);
+    
+    if (strcmp(argv[1], "list") == 0)
+        return listBackups(&archive);
+    
+    printUsage();
+    
+    return -1;
+}
@@ -0,0 +1,34 @@
+/*
+ *  Deduplicated backups of device flash
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef __dfu_util__backup__
+#define __dfu_util__backup__
+
+/*
+ *  backup <archive> store [--serial s] <vendorId hex> <productId hex> <length>
+ *  backup <archive> restore <manifest> <vendorId hex> <productId hex>
+ *  backup <archive> list
+ *
+ *  Chunks shared with earlier backups of any device are stored once.
+ */
+int runBackup(int argc, const char* argv[]);
+
+#endif /* defined(__dfu_util__backup__) */
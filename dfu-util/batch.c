@@ -0,0 +1,292 @@
+/*
+ *  Flashing every attached device of a model at once
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "batch.h"
+#include "libdfu.h"
+#include "personalize.h"
+
+/* One attached device and how its flash went */
+struct batchDevice
+{
+    struct usbLocation location;
+    struct dfu_scheduler_slot slot;
+    IOReturn result;
+    uint64_t elapsed;
+};
+
+struct batchState
+{
+    unsigned short idVendor;
+    unsigned short idProduct;
+    const struct dfu_file* firmware;
+    /* Patch file per device, {location} is replaced, may be NULL */
+    const char* patches;
+    struct batchDevice* devices;
+    /* Start order, spread over controllers and hubs */
+    int* order;
+    int count;
+    /* Next device to flash, taken by the workers */
+    int next;
+    int failed;
+};
+
+static void printUsage(void)
+{
+    printf("Usage: dfu-util batch [options] <vendorId hex> <productId hex> <firmware>\n");
+    printf("\nOptions:\n");
+    printf("  --jobs <n>              devices flashed at once (default all)\n");
+    printf("  --window <n>            blocks in flight per hub at most (default %d)\n", DFU_SCHEDULER_MAX_WINDOW);
+    printf("  --patches <file>        personalize each device, {location} in the name is its location id\n");
+    printf("  --list                  print the devices in start order without flashing\n");
+}
+
+static const char* speedName(UInt8 speed)
+{
+    switch (speed)
+    {
+        case kUSBDeviceSpeedLow:
+            return "low";
+        case kUSBDeviceSpeedFull:
+            return "full";
+        case kUSBDeviceSpeedHigh:
+            return "high";
+        default:
+            return "super";
+    }
+}
+
+static void flashDevice(struct batchState* batch, struct batchDevice* device)
+{
+    struct dfu_session session;
+    struct dfu_overlay overlay = { 0 };
+    char path[PATH_MAX];
+    uint64_t started = dfu_time_us();
+    
+    dfu_session_init(&session, batch->idVendor, batch->idProduct);
+    session.locationID = device->location.locationID;
+    session.gate = &device->slot.gate;
+    session.fast = true;
+    
+    // Every device shares the image, only its patches are its own
+    if (batch->patches != NULL)
+    {
+        patchPath(path, sizeof(path), batch->patches, device->location.locationID);
+        
+        if (loadPatches(&overlay, path, batch->firmware) != 0)
+        {
+            device->result = kIOReturnBadArgument;
+            fprintf(stderr, "[!] Device at 0x%08x skipped.\n", device->location.locationID);
+            return;
+        }
+        
+        session.source = &overlay.source;
+    }
+    
+    device->result = dfu_session_prepare(&session);
+    
+    if (device->result == kIOReturnSuccess)
+        device->result = dfu_session_download(&session, batch->firmware);
+    
+    dfu_session_close(&session);
+    dfu_overlay_free(&overlay);
+    
+    device->elapsed = dfu_time_us() - started;
+    
+    if (device->result == kIOReturnSuccess)
+        printf("[i] Device at 0x%08x flashed in %.1f s.\n", device->location.locationID, device->elapsed / 1000000.0);
+    else
+        fprintf(stderr, "[!] Device at 0x%08x failed: 0x%08x.\n", device->location.locationID, device->result);
+}
+
+static void* batchWorker(void* argument)
+{
+    struct batchState* batch = argument;
+    
+    for (;;)
+    {
+        int index = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED);
+        
+        if (index >= batch->count)
+            break;
+        
+        struct batchDevice* device = &batch->devices[batch->order[index]];
+        
+        flashDevice(batch, device);
+        
+        if (device->result != kIOReturnSuccess)
+            __atomic_fetch_add(&batch->failed, 1, __ATOMIC_RELAXED);
+    }
+    
+    return NULL;
+}
+
+int runBatch(int argc, const char* argv[])
+{
+    int jobs = 0;
+    int window = 0;
+    bool listOnly = false;
+    struct batchState batch = { 0 };
+    
+    while (argc > 0 && strncmp(argv[0], "--", 2) == 0)
+    {
+        if (strcmp(argv[0], "--list") == 0)
+            listOnly = true;
+        else if (strcmp(argv[0], "--jobs") == 0 && argc > 1)
+        {
+            jobs = atoi(argv[1]);
+            argc--;
+            argv++;
+        }
+        else if (strcmp(argv[0], "--patches") == 0 && argc > 1)
+        {
+            batch.patches = argv[1];
+            argc--;
+            argv++;
+        }
+        else if (strcmp(argv[0], "--window") == 0 && argc > 1)
+        {
+            window = atoi(argv[1]);
+            argc--;
+            argv++;
+        }
+        else
+        {
+            fprintf(stderr, "[!] Unknown option %s.\n", argv[0]);
+            return -1;
+        }
+        
+        argc--;
+        argv++;
+    }
+    
+    if (argc != 3 && !(listOnly && argc == 2))
+    {
+        printUsage();
+        return -1;
+    }
+    
+    struct usbLocation locations[USB_MAX_DEVICES];
+    
+    batch.idVendor = strtoul(argv[0], NULL, 16);
+    batch.idProduct = strtoul(argv[1], NULL, 16);
+    batch.count = getDevices(batch.idVendor, batch.idProduct, locations, USB_MAX_DEVICES, false);
+    
+    if (batch.count == 0)
+    {
+        fprintf(stderr, "[!] No USB device [%04x:%04x] attached.\n", batch.idVendor, batch.idProduct);
+        return -1;
+    }
+    
+    struct batchDevice devices[batch.count];
+    uint32_t locationIDs[batch.count];
+    int order[batch.count];
+    struct dfu_scheduler scheduler;
+    
+    if (dfu_scheduler_init(&scheduler, window) != 0)
+        return -1;
+    
+    memset(devices, 0, sizeof(devices));
+    
+    for (int i = 0; i < batch.count; i++)
+    {
+        devices[i].location = locations[i];
+        locationIDs[i] = locations[i].locationID;
+        
+        if (dfu_scheduler_attach(&scheduler, &devices[i].slot, locations[i].locationID, locations[i].speed) != 0)
+        {
+            fprintf(stderr, "[!] Out of memory.\n");
+            dfu_scheduler_free(&scheduler);
+            return -1;
+        }
+    }
+    
+    dfu_scheduler_spread(locationIDs, batch.count, order);
+    
+    batch.devices = devices;
+    batch.order = order;
+    
+    printf("[i] %d devices [%04x:%04x] in start order:\n", batch.count, batch.idVendor, batch.idProduct);
+    
+    for (int i = 0; i < batch.count; i++)
+    {
+        const struct usbLocation* location = &devices[order[i]].location;
+        
+        printf("    0x%08x  %s speed, hub 0x%08x\n", location->locationID, speedName(location->speed),
+               dfu_location_parent(location->locationID));
+    }
+    
+    if (listOnly)
+    {
+        dfu_scheduler_free(&scheduler);
+        return 0;
+    }
+    
+    struct dfu_file firmware = { 0 };
+    
+    firmware.name = argv[2];
+    firmware.allocator = &dfu_wired_allocator;
+    
+    if (dfu_load_any_file(&firmware, batch.idVendor, batch.idProduct) != DFU_FILE_OK)
+    {
+        dfu_scheduler_free(&scheduler);
+        return -1;
+    }
+    
+    batch.firmware = &firmware;
+    
+    // Most of the time a device waits for the bus or its flash, a thread each is cheap
+    if (jobs < 1 || jobs > batch.count)
+        jobs = batch.count;
+    
+    pthread_t threads[jobs];
+    int started;
+    uint64_t start = dfu_time_us();
+    
+    for (started = 0; started < jobs - 1; started++)
+        if (pthread_create(&threads[started], NULL, batchWorker, &batch) != 0)
+            break;
+    
+    // The calling thread works too, and alone if no thread could be created
+    batchWorker(&batch);
+    
+    for (int t = 0; t < started; t++)
+        pthread_join(threads[t], NULL);
+    
+    uint64_t elapsed = dfu_time_us() - start;
+    int bytes = firmware.size.total - firmware.size.suffix;
+    
+    printf("[i] %d of %d devices flashed in %.1f s, %.1f KB/s in total.\n",
+           batch.count - batch.failed, batch.count, elapsed / 1000000.0,
+           elapsed > 0 ? (double)bytes * (batch.count - batch.failed) * 1000000.0 / elapsed / 1024 : 0);
+    
+    dfu_scheduler_print(&scheduler);
+    dfu_scheduler_free(&scheduler);
+    dfu_free_file(&firmware);
+    
+    return batch.failed > 0 ? -1 : 0;
+}
@@ -0,0 +1,180 @@
+/*
+ *  Firmware catalog commands
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "catalog.h"
+#include "libdfu.h"
+
+static void printUsage(void)
+{
+    printf("Usage: dfu-util catalog <index> scan [--jobs n] <directory>...\n");
+    printf("       dfu-util catalog <index> list\n");
+    printf("       dfu-util catalog <index> find <vendorId hex> <productId hex> [bcdDevice hex]\n");
+}
+
+static void printEntry(const struct dfu_catalog_entry* entry)
+{
+    printf("%04x:%04x:%04x  %10lld  %08x  %s\n", entry->idVendor, entry->idProduct, entry->bcdDevice,
+           (long long)entry->size, entry->crc, entry->path);
+}
+
+static int scanCatalog(struct dfu_catalog* catalog, int argc, const char* argv[])
+{
+    int jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    struct dfu_catalog_stats stats;
+    
+    if (argc >= 2 && strcmp(argv[0], "--jobs") == 0)
+    {
+        jobs = atoi(argv[1]);
+        argc -= 2;
+        argv += 2;
+    }
+    
+    if (argc == 0)
+    {
+        printUsage();
+        return -1;
+    }
+    
+    if (dfu_catalog_scan(catalog, argv, argc, jobs, &stats) != 0)
+    {
+        fprintf(stderr, "[!] Scan failed, out of memory.\n");
+        return -1;
+    }
+    
+    int images = 0;
+    
+    for (int i = 0; i < catalog->count; i++)
+        images += catalog->entries[i].suffixed;
+    
+    printf("[i] %d files, %d read, %d unchanged, %d removed, %d unreadable. %d images indexed.\n",
+           stats.files, stats.read, stats.unchanged, stats.removed, stats.unreadable, images);
+    
+    if (dfu_catalog_save(catalog) != 0)
+    {
+        fprintf(stderr, "[!] Failed to write %s.\n", catalog->path);
+        return -1;
+    }
+    
+    return 0;
+}
+
+int runCatalog(int argc, const char* argv[])
+{
+    struct dfu_catalog catalog;
+    int result = 0;
+    
+    if (argc < 2)
+    {
+        printUsage();
+        return -1;
+    }
+    
+    if (dfu_catalog_open(&catalog, argv[0]) != 0)
+    {
+        fprintf(stderr, "[!] Failed to read catalog %s.\n", argv[0]);
+        return -1;
+    }
+    
+    if (strcmp(argv[1], "scan") == 0)
+        result = scanCatalog(&catalog, argc - 2, argv + 2);
+    else if (strcmp(argv[1], "list") == 0)
+    {
+        for (int i = 0; i < catalog.count; i++)
+            if (catalog.entries[i].suffixed)
+                printEntry(&catalog.entries[i]);
+    }
+    else if (strcmp(argv[1], "find") == 0 && (argc == 4 || argc == 5))
+    {
+        bool changed = false;
+        const struct dfu_catalog_entry* entry = dfu_catalog_select(&catalog, strtoul(argv[2], NULL, 16),
+                                                                   strtoul(argv[3], NULL, 16),
+                                                                   argc == 5 ? strtoul(argv[4], NULL, 16) : 0xffff,
+                                                                   &changed);
+        
+        if (entry != NULL)
+            printEntry(entry);
+        else
+        {
+            fprintf(stderr, "[!] No image for %s:%s in %s.\n", argv[2], argv[3], argv[0]);
+            result = -1;
+        }
+        
+        if (changed)
+            dfu_catalog_save(&catalog);
+    }
+    else
+    {
+        printUsage();
+        result = -1;
+    }
+    
+    dfu_catalog_close(&catalog);
+    
+    return result;
+}
+
+int catalogSelect(const char* index, unsigned short idVendor, unsigned short idProduct, char* path, size_t size)
+{
+    IOUSBDeviceInterface300** device = getDevice(idVendor, idProduct);
+    UInt16 bcdDevice = 0xffff;
+    
+    if (device == NULL)
+    {
+        fprintf(stderr, "[!] Failed to retrieve USB device [%04x:%04x].\n", idVendor, idProduct);
+        return -1;
+    }
+    
+    // Available from the device descriptor without opening the device
+    (*device)->GetDeviceReleaseNumber(device, &bcdDevice);
+    (*device)->Release(device);
+    
+    struct dfu_catalog catalog;
+    bool changed = false;
+    
+    if (dfu_catalog_open(&catalog, index) != 0)
+    {
+        fprintf(stderr, "[!] Failed to read catalog %s.\n", index);
+        return -1;
+    }
+    
+    const struct dfu_catalog_entry* entry = dfu_catalog_select(&catalog, idVendor, idProduct, bcdDevice, &changed);
+    
+    if (entry != NULL)
+    {
+        strlcpy(path, entry->path, size);
+        printf("[i] Catalog image for [%04x:%04x] bcdDevice %04x: %s\n", idVendor, idProduct, bcdDevice, path);
+    }
+    else
+        fprintf(stderr, "[!] No image for [%04x:%04x] bcdDevice %04x in %s.\n", idVendor, idProduct, bcdDevice, index);
+    
+    if (changed && dfu_catalog_save(&catalog) != 0)
+        fprintf(stderr, "[!] Failed to update %s.\n", index);
+    
+    dfu_catalog_close(&catalog);
+    
+    return entry != NULL ? 0 : -1;
+}
@@ -0,0 +1,42 @@
+/*
+ *  Firmware catalog commands
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef __dfu_util__catalog__
+#define __dfu_util__catalog__
+
+#include <stddef.h>
+
+/*
+ *  catalog <index> scan [--jobs n] <directory>...
+ *  catalog <index> list
+ *  catalog <index> find <vendorId hex> <productId hex> [bcdDevice hex]
+ *
+ *  scan only reads files that are new or changed since the last scan.
+ */
+int runCatalog(int argc, const char* argv[]);
+
+/*
+ *  Pick the image for an attached device by its bcdDevice, refreshing
+ *  the index entry if the file changed. Returns 0 with the image path.
+ */
+int catalogSelect(const char* index, unsigned short idVendor, unsigned short idProduct, char* path, size_t size);
+
+#endif /* defined(__dfu_util__catalog__) */
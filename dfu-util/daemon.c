@@ -0,0 +1,935 @@
+/*
+ *  Flashing daemon, jobs are submitted over a Unix socket
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "daemon.h"
+#include "libdfu.h"
+
+enum jobType
+{
+    JOB_FLASH,
+    JOB_READBACK,
+    JOB_STATUS
+};
+
+struct job
+{
+    unsigned long id;
+    int priority;
+    enum jobType type;
+    unsigned short idVendor;
+    unsigned short idProduct;
+    /* Bus location, 0 if no device with the ids was attached when queued */
+    UInt32 locationID;
+    char path[PATH_MAX];
+    int length;
+    /* Expected image digest of a flash job */
+    bool verify;
+    uint8_t sha256[DFU_SHA256_LENGTH];
+    /* Connection progress and result are streamed to */
+    int client;
+    struct job* next;
+};
+
+/* Parsed image, kept until evicted or changed on disk */
+struct cachedImage
+{
+    char path[PATH_MAX];
+    time_t mtime;
+    off_t size;
+    int references;
+    unsigned long lastUsed;
+    struct dfu_file file;
+    struct cachedImage* next;
+};
+
+/*
+ *  Device session, kept open between jobs while the device stays in DFU mode.
+ *  Devices are told apart by their bus location, several devices with the
+ *  same ids are flashed side by side.
+ */
+struct warmDevice
+{
+    UInt32 locationID;
+    /* Ids the session was opened with, only compared without a location */
+    unsigned short idVendor;
+    unsigned short idProduct;
+    bool busy;
+    bool prepared;
+    struct dfu_session session;
+    struct warmDevice* next;
+};
+
+struct daemonState
+{
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    /* Sorted by priority, then submission order */
+    struct job* queue;
+    struct cachedImage* images;
+    struct warmDevice* devices;
+    unsigned long nextJob;
+    unsigned long clock;
+    int workers;
+    int running;
+    unsigned long completed;
+    unsigned long failed;
+    /* Prometheus text file rewritten after every job, NULL if not exported */
+    const char* metricsPath;
+};
+
+struct jobProgress
+{
+    struct job* job;
+    int lastReported;
+};
+
+static void reply(int client, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+static void reply(int client, const char* format, ...)
+{
+    char line[DAEMON_MAX_LINE];
+    va_list args;
+    
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    
+    if (length <= 0)
+        return;
+    
+    if (length >= (int)sizeof(line))
+        length = sizeof(line) - 1;
+    
+    // Client may have gone away, the job still completes
+    if (write(client, line, length) < 0 && errno != EPIPE)
+        fprintf(stderr, "[!] Failed to reply to client: %s.\n", strerror(errno));
+}
+
+static void enqueueJob(struct daemonState* state, struct job* job)
+{
+    struct job** position = &state->queue;
+    
+    while (*position != NULL && (*position)->priority >= job->priority)
+        position = &(*position)->next;
+    
+    job->next = *position;
+    *position = job;
+}
+
+static struct warmDevice* findDevice(struct daemonState* state, const struct job* job)
+{
+    struct warmDevice* device;
+    
+    for (device = state->devices; device != NULL; device = device->next)
+    {
+        // The ids of a device change with its mode, its location does not
+        if (job->locationID != 0 && device->locationID == job->locationID)
+            return device;
+        
+        if (job->locationID == 0 && device->locationID == 0 &&
+            device->idVendor == job->idVendor && device->idProduct == job->idProduct)
+            return device;
+    }
+    
+    device = calloc(1, sizeof(*device));
+    
+    if (device == NULL)
+        return NULL;
+    
+    device->locationID = job->locationID;
+    device->idVendor = job->idVendor;
+    device->idProduct = job->idProduct;
+    device->next = state->devices;
+    state->devices = device;
+    
+    return device;
+}
+
+/*
+ *  Take the first queued job whose device is idle, marking the device busy
+ *
+ *  state     - daemon state, locked by the caller
+ *  device    - receives the device of the job
+ *
+ *  returns the job or NULL if nothing can run right now
+ */
+static struct job* dequeueJob(struct daemonState* state, struct warmDevice** device)
+{
+    struct job** position;
+    
+    for (position = &state->queue; *position != NULL; position = &(*position)->next)
+    {
+        struct warmDevice* candidate = findDevice(state, *position);
+        
+        if (candidate == NULL || candidate->busy)
+            continue;
+        
+        struct job* job = *position;
+        
+        *position = job->next;
+        candidate->busy = true;
+        *device = candidate;
+        
+        return job;
+    }
+    
+    return NULL;
+}
+
+static void evictImages(struct daemonState* state)
+{
+    int count = 0;
+    struct cachedImage* image;
+    
+    for (image = state->images; image != NULL; image = image->next)
+        count++;
+    
+    while (count > DAEMON_MAX_IMAGES)
+    {
+        struct cachedImage** oldest = NULL;
+        struct cachedImage** position;
+        
+        for (position = &state->images; *position != NULL; position = &(*position)->next)
+            if ((*position)->references == 0 && (oldest == NULL || (*position)->lastUsed < (*oldest)->lastUsed))
+                oldest = position;
+        
+        // Everything is in use
+        if (oldest == NULL)
+            return;
+        
+        image = *oldest;
+        *oldest = image->next;
+        
+        dfu_free_file(&image->file);
+        free(image);
+        count--;
+    }
+}
+
+/*
+ *  Get a parsed image from the cache, loading it if it is missing or
+ *  changed on disk since it was loaded
+ *
+ *  state     - daemon state
+ *  path      - firmware file
+ *  idVendor  - vendor id for the suffix of converted images
+ *  idProduct - product id for the suffix of converted images
+ *
+ *  returns referenced image or NULL on error
+ */
+static struct cachedImage* acquireImage(struct daemonState* state, const char* path,
+                                        unsigned short idVendor, unsigned short idProduct)
+{
+    struct stat info;
+    struct cachedImage* image;
+    
+    if (stat(path, &info) != 0)
+        return NULL;
+    
+    pthread_mutex_lock(&state->lock);
+    
+    for (image = state->images; image != NULL; image = image->next)
+    {
+        if (strcmp(image->path, path) == 0 && image->mtime == info.st_mtime && image->size == info.st_size)
+        {
+            image->references++;
+            image->lastUsed = ++state->clock;
+            
+            pthread_mutex_unlock(&state->lock);
+            
+            return image;
+        }
+    }
+    
+    pthread_mutex_unlock(&state->lock);
+    
+    // Load outside the lock, other jobs keep running meanwhile
+    image = calloc(1, sizeof(*image));
+    
+    if (image == NULL)
+        return NULL;
+    
+    strlcpy(image->path, path, sizeof(image->path));
+    image->mtime = info.st_mtime;
+    image->size = info.st_size;
+    image->references = 1;
+    image->file.name = image->path;
+    image->file.allocator = &dfu_wired_allocator;
+    
+    if (dfu_load_any_file(&image->file, idVendor, idProduct) != DFU_FILE_OK)
+    {
+        free(image);
+        return NULL;
+    }
+    
+    pthread_mutex_lock(&state->lock);
+    
+    image->lastUsed = ++state->clock;
+    image->next = state->images;
+    state->images = image;
+    
+    evictImages(state);
+    
+    pthread_mutex_unlock(&state->lock);
+    
+    return image;
+}
+
+static void releaseImage(struct daemonState* state, struct cachedImage* image)
+{
+    pthread_mutex_lock(&state->lock);
+    
+    image->references--;
+    evictImages(state);
+    
+    pthread_mutex_unlock(&state->lock);
+}
+
+static void jobProgress(const struct dfu_transfer* transfer, int block_size, void* context)
+{
+    struct jobProgress* progress = context;
+    int percent = transfer->size > 0 ? (int)((long long)transfer->sent * 100 / transfer->size) : 100;
+    
+    // One line per percent is plenty for any client
+    if (percent == progress->lastReported)
+        return;
+    
+    progress->lastReported = percent;
+    reply(progress->job->client, "progress %lu %d %d\n", progress->job->id, transfer->sent, transfer->size);
+}
+
+static void closeDevice(struct warmDevice* device)
+{
+    if (!device->prepared)
+        return;
+    
+    dfu_session_close(&device->session);
+    device->prepared = false;
+}
+
+static IOReturn prepareDevice(struct warmDevice* device, struct jobProgress* progress)
+{
+    const struct job* job = progress->job;
+    
+    // Same location, but the job names the device by its other ids
+    if (device->prepared && (device->idVendor != job->idVendor || device->idProduct != job->idProduct))
+        closeDevice(device);
+    
+    if (!device->prepared)
+    {
+        device->idVendor = job->idVendor;
+        device->idProduct = job->idProduct;
+        
+        dfu_session_init(&device->session, device->idVendor, device->idProduct);
+        device->session.locationID = device->locationID;
+        
+        IOReturn result = dfu_session_prepare(&device->session);
+        
+        if (result != kIOReturnSuccess)
+        {
+            dfu_session_close(&device->session);
+            return result;
+        }
+        
+        device->prepared = true;
+    }
+    
+    device->session.progress = jobProgress;
+    device->session.context = progress;
+    
+    return kIOReturnSuccess;
+}
+
+static bool runFlash(struct daemonState* state, struct job* job, struct warmDevice* device, struct jobProgress* progress)
+{
+    struct cachedImage* image = acquireImage(state, job->path, job->idVendor, job->idProduct);
+    
+    if (image == NULL)
+    {
+        reply(job->client, "done %lu error cannot load %s\n", job->id, job->path);
+        return false;
+    }
+    
+    IOReturn result = prepareDevice(device, progress);
+    
+    device->session.sha256 = job->verify ? job->sha256 : NULL;
+    
+    if (result == kIOReturnSuccess)
+        result = dfu_session_download(&device->session, &image->file);
+    
+    releaseImage(state, image);
+    
+    // Device resets into its new firmware either way
+    closeDevice(device);
+    
+    if (result != kIOReturnSuccess)
+    {
+        reply(job->client, "done %lu error flash failed 0x%08x\n", job->id, result);
+        return false;
+    }
+    
+    reply(job->client, "done %lu ok\n", job->id);
+    
+    return true;
+}
+
+static bool runReadback(struct daemonState* state, struct job* job, struct warmDevice* device, struct jobProgress* progress)
+{
+    uint8_t* buffer = malloc(job->length);
+    
+    if (buffer == NULL)
+    {
+        reply(job->client, "done %lu error cannot allocate %d bytes\n", job->id, job->length);
+        return false;
+    }
+    
+    int received = 0;
+    IOReturn result = prepareDevice(device, progress);
+    
+    if (result == kIOReturnSuccess)
+        result = dfu_session_upload(&device->session, buffer, job->length, &received);
+    
+    if (result != kIOReturnSuccess)
+    {
+        closeDevice(device);
+        free(buffer);
+        reply(job->client, "done %lu error readback failed 0x%08x\n", job->id, result);
+        return false;
+    }
+    
+    // A link planted at the output path must not redirect the write
+    int f = open(job->path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0644);
+    bool written = f >= 0 && write(f, buffer, received) == received;
+    
+    if (f >= 0)
+        close(f);
+    
+    free(buffer);
+    
+    if (!written)
+    {
+        reply(job->client, "done %lu error cannot write %s\n", job->id, job->path);
+        return false;
+    }
+    
+    reply(job->client, "done %lu ok %d\n", job->id, received);
+    
+    return true;
+}
+
+static bool runStatus(struct daemonState* state, struct job* job, struct warmDevice* device, struct jobProgress* progress)
+{
+    struct dfu_status status;
+    IOReturn result = prepareDevice(device, progress);
+    
+    if (result == kIOReturnSuccess)
+        result = dfu_session_status(&device->session, &status);
+    
+    if (result != kIOReturnSuccess)
+    {
+        closeDevice(device);
+        reply(job->client, "done %lu error status failed 0x%08x\n", job->id, result);
+        return false;
+    }
+    
+    reply(job->client, "state %lu %s %s\n", job->id,
+          dfu_state_to_string(status.bState), dfu_status_to_string(status.bStatus));
+    reply(job->client, "done %lu ok\n", job->id);
+    
+    return true;
+}
+
+static void* workerThread(void* context)
+{
+    struct daemonState* state = context;
+    
+    for (;;)
+    {
+        struct warmDevice* device = NULL;
+        struct job* job;
+        
+        pthread_mutex_lock(&state->lock);
+        
+        while ((job = dequeueJob(state, &device)) == NULL)
+            pthread_cond_wait(&state->wake, &state->lock);
+        
+        state->running++;
+        
+        pthread_mutex_unlock(&state->lock);
+        
+        struct jobProgress progress = { job, -1 };
+        bool success = false;
+        
+        switch (job->type)
+        {
+            case JOB_FLASH:
+                success = runFlash(state, job, device, &progress);
+                break;
+            case JOB_READBACK:
+                success = runReadback(state, job, device, &progress);
+                break;
+            case JOB_STATUS:
+                success = runStatus(state, job, device, &progress);
+                break;
+        }
+        
+        close(job->client);
+        
+        pthread_mutex_lock(&state->lock);
+        
+        device->busy = false;
+        state->running--;
+        
+        if (success)
+            state->completed++;
+        else
+            state->failed++;
+        
+        // Jobs for this device may be waiting
+        pthread_cond_broadcast(&state->wake);
+        pthread_mutex_unlock(&state->lock);
+        
+        if (state->metricsPath != NULL && dfu_metrics_export(state->metricsPath) != 0)
+            fprintf(stderr, "[!] Failed to export metrics to %s.\n", state->metricsPath);
+        
+        free(job);
+    }
+    
+    return NULL;
+}
+
+static void replyDaemonStatus(struct daemonState* state, int client)
+{
+    int queued = 0, images = 0, devices = 0;
+    struct job* job;
+    struct cachedImage* image;
+    struct warmDevice* device;
+    
+    pthread_mutex_lock(&state->lock);
+    
+    for (job = state->queue; job != NULL; job = job->next)
+        queued++;
+    
+    for (image = state->images; image != NULL; image = image->next)
+        images++;
+    
+    for (device = state->devices; device != NULL; device = device->next)
+        if (device->prepared)
+            devices++;
+    
+    reply(client, "daemon workers %d running %d queued %d images %d devices %d completed %lu failed %lu\n",
+          state->workers, state->running, queued, images, devices, state->completed, state->failed);
+    
+    for (job = state->queue; job != NULL; job = job->next)
+        reply(client, "job %lu priority %d device %04x:%04x@%08x\n", job->id, job->priority,
+              job->idVendor, job->idProduct, (unsigned int)job->locationID);
+    
+    pthread_mutex_unlock(&state->lock);
+    
+    reply(client, "done 0 ok\n");
+}
+
+static void replyMetrics(int client)
+{
+    FILE* out = fdopen(dup(client), "w");
+    
+    if (out == NULL)
+    {
+        reply(client, "done 0 error %s\n", strerror(errno));
+        return;
+    }
+    
+    int result = dfu_metrics_write(out);
+    
+    fclose(out);
+    
+    reply(client, result == 0 ? "done 0 ok\n" : "done 0 error write failed\n");
+}
+
+/*
+ *  Parse a request line into a job
+ *
+ *  line      - request without line terminator
+ *  job       - job to fill in
+ *
+ *  returns true if the line is a valid job request
+ */
+static bool parseJob(char* line, struct job* job)
+{
+    char* words[6];
+    int count = 0;
+    char* word;
+    
+    while (count < 6 && (word = strsep(&line, " \t")) != NULL)
+        if (*word != '\0')
+            words[count++] = word;
+    
+    if ((count == 5 || count == 6) && strcmp(words[0], "flash") == 0)
+        job->type = JOB_FLASH;
+    else if (count == 6 && strcmp(words[0], "readback") == 0)
+        job->type = JOB_READBACK;
+    else if (count == 4 && strcmp(words[0], "status") == 0)
+        job->type = JOB_STATUS;
+    else
+        return false;
+    
+    char* location;
+    
+    job->priority = atoi(words[1]);
+    job->idVendor = strtoul(words[2], NULL, 16);
+    job->idProduct = strtoul(words[3], &location, 16);
+    
+    // Optional "@<location hex>" picks one of several devices with the ids
+    if (*location == '@')
+        job->locationID = strtoul(location + 1, &location, 16);
+    
+    if (*location != '\0')
+        return false;
+    
+    // The daemon runs in its own directory, relative paths are meaningless
+    if (job->type != JOB_STATUS && words[4][0] != '/')
+        return false;
+    
+    // Images are cached by their canonical path, without links or ".."
+    if (job->type == JOB_FLASH && realpath(words[4], job->path) == NULL)
+        return false;
+    
+    if (job->type == JOB_READBACK)
+        strlcpy(job->path, words[4], sizeof(job->path));
+    
+    if (job->type == JOB_FLASH && count == 6)
+    {
+        job->verify = dfu_sha256_parse(words[5], job->sha256);
+        
+        if (!job->verify)
+            return false;
+    }
+    
+    if (job->type == JOB_READBACK)
+    {
+        job->length = atoi(words[5]);
+        
+        if (job->length <= 0)
+            return false;
+    }
+    
+    return true;
+}
+
+/*
+ *  Read one line from a socket
+ *
+ *  client    - socket
+ *  line      - receives the line without terminator
+ *  size      - size of line
+ *  deadline  - time the whole line has to arrive by, 0 for none
+ *
+ *  returns false on end of stream, error or timeout
+ */
+static bool readLine(int client, char* line, int size, time_t deadline)
+{
+    int length = 0;
+    
+    while (length < size - 1)
+    {
+        ssize_t count = read(client, line + length, 1);
+        
+        // A client trickling bytes runs into the deadline between reads
+        if (count <= 0 || (deadline != 0 && time(NULL) > deadline))
+            return false;
+        
+        if (line[length] == '\n')
+            break;
+        
+        length++;
+    }
+    
+    if (length > 0 && line[length - 1] == '\r')
+        length--;
+    
+    line[length] = '\0';
+    
+    return true;
+}
+
+static void acceptRequest(struct daemonState* state, int client)
+{
+    char line[DAEMON_MAX_LINE];
+    struct timeval timeout = { DAEMON_REQUEST_TIMEOUT, 0 };
+    
+    // Requests are read on the accept thread, a client that never finishes
+    // its line or never reads its replies must not hold up everyone else
+    if (setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0 ||
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) != 0 ||
+        !readLine(client, line, sizeof(line), time(NULL) + DAEMON_REQUEST_TIMEOUT))
+    {
+        close(client);
+        return;
+    }
+    
+    if (strcmp(line, "status") == 0)
+    {
+        replyDaemonStatus(state, client);
+        close(client);
+        return;
+    }
+    
+    if (strcmp(line, "metrics") == 0)
+    {
+        replyMetrics(client);
+        close(client);
+        return;
+    }
+    
+    struct job* job = calloc(1, sizeof(*job));
+    
+    if (job == NULL || !parseJob(line, job))
+    {
+        reply(client, "done 0 error invalid request\n");
+        close(client);
+        free(job);
+        return;
+    }
+    
+    job->client = client;
+    
+    // Jobs naming the same device by ids and by location must not run side by side
+    if (job->locationID == 0)
+    {
+        struct usbLocation location;
+        
+        if (getDevices(job->idVendor, job->idProduct, &location, 1, false) > 0)
+            job->locationID = location.locationID;
+    }
+    
+    pthread_mutex_lock(&state->lock);
+    
+    job->id = ++state->nextJob;
+    enqueueJob(state, job);
+    reply(client, "queued %lu\n", job->id);
+    
+    pthread_cond_signal(&state->wake);
+    pthread_mutex_unlock(&state->lock);
+}
+
+static int listenSocket(const char* socketPath)
+{
+    struct sockaddr_un address;
+    
+    if (strlen(socketPath) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "[!] Socket path too long: %s.\n", socketPath);
+        return -1;
+    }
+    
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    
+    if (server < 0)
+    {
+        fprintf(stderr, "[!] Failed to create socket: %s.\n", strerror(errno));
+        return -1;
+    }
+    
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strlcpy(address.sun_path, socketPath, sizeof(address.sun_path));
+    
+    // Stale socket of a previous daemon
+    unlink(socketPath);
+    
+    // Jobs read and write files with the rights of the daemon, so only its
+    // owner may connect: the socket is created 0600 instead of under the umask
+    mode_t mask = umask(0177);
+    int bound = bind(server, (struct sockaddr*)&address, sizeof(address));
+    
+    umask(mask);
+    
+    if (bound != 0 || listen(server, 64) != 0)
+    {
+        fprintf(stderr, "[!] Failed to listen on %s: %s.\n", socketPath, strerror(errno));
+        close(server);
+        return -1;
+    }
+    
+    return server;
+}
+
+/*
+ *  Serve jobs on a Unix socket until killed
+ *
+ *  socketPath  - path of the socket to create
+ *  workers     - number of jobs run concurrently
+ *  metricsPath - Prometheus text file updated after every job, or NULL
+ *
+ *  returns non-zero on error
+ */
+int runDaemon(const char* socketPath, int workers, const char* metricsPath)
+{
+    struct daemonState state;
+    int i;
+    
+    memset(&state, 0, sizeof(state));
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.wake, NULL);
+    state.workers = workers > 0 ? workers : DAEMON_DEFAULT_WORKERS;
+    state.metricsPath = metricsPath;
+    
+    signal(SIGPIPE, SIG_IGN);
+    
+    int server = listenSocket(socketPath);
+    
+    if (server < 0)
+        return -1;
+    
+    for (i = 0; i < state.workers; i++)
+    {
+        pthread_t thread;
+        
+        if (pthread_create(&thread, NULL, workerThread, &state) != 0)
+        {
+            fprintf(stderr, "[!] Failed to start worker %d.\n", i);
+            return -1;
+        }
+        
+        pthread_detach(thread);
+    }
+    
+    printf("[i] Daemon listening on %s with %d workers.\n", socketPath, state.workers);
+    
+    for (;;)
+    {
+        int client = accept(server, NULL, NULL);
+        
+        if (client < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            
+            fprintf(stderr, "[!] Failed to accept connection: %s.\n", strerror(errno));
+            break;
+        }
+        
+        acceptRequest(&state, client);
+    }
+    
+    close(server);
+    unlink(socketPath);
+    
+    return -1;
+}
+
+/*
+ *  Send one request to a running daemon and print its replies
+ *
+ *  socketPath - path of the daemon socket
+ *  argc       - number of request words
+ *  argv       - request words, see daemon.h
+ *
+ *  returns zero if the job succeeded
+ */
+int submitJob(const char* socketPath, int argc, const char* argv[])
+{
+    struct sockaddr_un address;
+    char line[DAEMON_MAX_LINE];
+    char directory[PATH_MAX];
+    int length = 0;
+    int i;
+    
+    if (getcwd(directory, sizeof(directory)) == NULL)
+        directory[0] = '\0';
+    
+    for (i = 0; i < argc; i++)
+    {
+        // Files are named relative to the client, the daemon takes absolute paths only
+        bool relative = i == 4 && argv[i][0] != '/' &&
+                        (strcmp(argv[0], "flash") == 0 || strcmp(argv[0], "readback") == 0);
+        
+        int written = snprintf(line + length, sizeof(line) - length, "%s%s%s%s", i > 0 ? " " : "",
+                               relative ? directory : "", relative ? "/" : "", argv[i]);
+        
+        // Room must be left for the line terminator
+        if (written < 0 || written >= (int)sizeof(line) - 1 - length)
+        {
+            fprintf(stderr, "[!] Request too long.\n");
+            return -1;
+        }
+        
+        length += written;
+    }
+    
+    line[length++] = '\n';
+    
+    int client = socket(AF_UNIX, SOCK_STREAM, 0);
+    
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strlcpy(address.sun_path, socketPath, sizeof(address.sun_path));
+    
+    if (client < 0 || connect(client, (struct sockaddr*)&address, sizeof(address)) != 0)
+    {
+        fprintf(stderr, "[!] Failed to connect to %s: %s.\n", socketPath, strerror(errno));
+        
+        if (client >= 0)
+            close(client);
+        
+        return -1;
+    }
+    
+    if (write(client, line, length) != length)
+    {
+        close(client);
+        return -1;
+    }
+    
+    int result = -1;
+    
+    while (readLine(client, line, sizeof(line), 0))
+    {
+        printf("%s\n", line);
+        
+        if (strncmp(line, "done ", 5) == 0)
+        {
+            char* status = strchr(line + 5, ' ');
+            result = (status != NULL && strncmp(status, " ok", 3) == 0) ? 0 : -1;
+        }
+    }
+    
+    close(client);
+    
+    return result;
+}
@@ -0,0 +1,50 @@
+/*
+ *  Flashing daemon, jobs are submitted over a Unix socket
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef __dfu_util__daemon__
+#define __dfu_util__daemon__
+
+#define DAEMON_DEFAULT_WORKERS  4
+#define DAEMON_MAX_IMAGES       16
+#define DAEMON_MAX_LINE         1024
+#define DAEMON_REQUEST_TIMEOUT  5     /* seconds a client has to send its request line */
+
+/*
+ *  Protocol, one request line per connection:
+ *
+ *    flash <priority> <vendorId hex> <productId hex>[@location hex] <firmware> [sha256]
+ *    readback <priority> <vendorId hex> <productId hex>[@location hex] <output> <length>
+ *    status [<priority> <vendorId hex> <productId hex>[@location hex]]
+ *    metrics
+ *
+ *  Without a location the first device with the ids is taken. Paths are
+ *  absolute, the socket is only accessible to the user running
+ *  the daemon. The daemon answers with "queued <job>", any number of
+ *  "progress <job> <bytes> <total>" lines and a final
+ *  "done <job> ok" or "done <job> error <reason>". Higher priorities run
+ *  first, jobs of equal priority in submission order. "metrics" replies
+ *  with all counters in Prometheus text format followed by "done 0 ok".
+ */
+
+int runDaemon(const char* socketPath, int workers, const char* metricsPath);
+int submitJob(const char* socketPath, int argc, const char* argv[]);
+
+#endif /* defined(__dfu_util__daemon__) */
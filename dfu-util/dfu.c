@@ -26,11 +26,79 @@
  *
  */
 
+#include <unistd.h>
+
 #include "dfu.h"
+#include "dfu_metrics.h"
+
+static IOReturn iokit_control(void* context, IOUSBDevRequestTO* request)
+{
+    struct dfu_if* dif = context;
+    
+    return (*dif->interface)->ControlRequestTO(dif->interface, 0, request);
+}
+
+static IOReturn iokit_reset(void* context)
+{
+    struct dfu_if* dif = context;
+    
+    return (*dif->device)->ResetDevice(dif->device);
+}
+
+/*
+ *  Initialize a DFU interface context with the IOKit transport
+ *
+ *  dif       - context to initialize, timeouts are kept
+ *  device    - USB device pointer
+ *  interface - USB interface pointer
+ *  index     - the interface number requests are addressed to
+ */
+void dfu_init(struct dfu_if* dif,
+              IOUSBDeviceInterface300** device,
+              IOUSBInterfaceInterface300** interface,
+              const unsigned char index)
+{
+    dif->device = device;
+    dif->interface = interface;
+    dif->index = index;
+    
+    // Keep a timeout chosen before the interface was opened
+    if (dif->timeout == 0)
+        dif->timeout = DFU_DEFAULT_TIMEOUT;
+    
+    dif->transport.control = iokit_control;
+    dif->transport.reset = iokit_reset;
+    dif->transport.wait = NULL;
+    dif->transport.context = dif;
+}
 
-static int dfu_timeout = 5000;  /* 5 seconds - default */
+/*
+ *  Issue a control request on the interface through its transport
+ *
+ *  dif       - DFU interface
+ *  request   - setup, data and length, timeouts are filled in
+ *
+ *  returns IOReturn value, request->wLenDone holds the bytes transferred
+ */
+IOReturn dfu_control(struct dfu_if* dif, IOUSBDevRequestTO* request)
+{
+    unsigned int timeout = dfu_timeouts_get(&dif->timeouts, request->bRequest, dif->timeout);
+    
+    request->completionTimeout = timeout;
+    request->noDataTimeout = timeout;
+    
+    uint64_t start = dfu_time_us();
+    IOReturn result = dif->transport.control(dif->transport.context, request);
+    uint64_t elapsed = dfu_time_us() - start;
+    
+    dfu_metrics_request(request->bRequest, result, elapsed);
+    dfu_timeouts_record(&dif->timeouts, request->bRequest,
+                        result == kIOReturnTimeout || result == kIOUSBTransactionTimeout, elapsed);
+    
+    return result;
+}
 
-IOReturn control_transfer(IOUSBInterfaceInterface300** interface,
+IOReturn control_transfer(struct dfu_if* dif,
                           UInt8 requestType,
                           UInt8 request,
                           UInt16 value,
@@ -45,31 +113,62 @@ IOReturn control_transfer(IOUSBInterfaceInterface300** interface,
     usbRequest.wIndex = index;
     usbRequest.wLength = length;
     usbRequest.pData = data;
-    usbRequest.completionTimeout = dfu_timeout;
-    usbRequest.noDataTimeout = dfu_timeout;
+    usbRequest.wLenDone = 0;
+    
+    return dfu_control(dif, &usbRequest);
+}
+
+/*
+ *  USB reset of the device behind the interface
+ *
+ *  dif       - DFU interface
+ *
+ *  returns IOReturn value
+ */
+IOReturn dfu_reset(struct dfu_if* dif)
+{
+    if (dif->transport.reset == NULL)
+        return kIOReturnUnsupported;
+    
+    IOReturn result = dif->transport.reset(dif->transport.context);
+    
+    if (result == kIOReturnSuccess)
+        dif->resets++;
     
-    return (*interface)->ControlRequestTO(interface, 0, &usbRequest);
+    return result;
+}
+
+/*
+ *  Wait on behalf of the device, a transport may run on its own clock
+ *
+ *  dif       - DFU interface
+ *  ms        - milliseconds to wait
+ */
+void dfu_wait(struct dfu_if* dif, unsigned int ms)
+{
+    if (dif->transport.wait != NULL)
+        dif->transport.wait(dif->transport.context, ms);
+    else
+        usleep(ms * 1000);
 }
 
 /*
  *  DFU_DETACH Request (DFU Spec 1.0, Section 5.1)
  *
- *  device    - USB device pointer
- *  interface - the interface to communicate with
+ *  dif       - DFU interface
  *  timeout   - the timeout in ms the USB device should wait for a pending
  *              USB reset before giving up and terminating the operation
  *
  *  returns IOReturn value
  */
-IOReturn dfu_detach(IOUSBInterfaceInterface300** interface,
-                    const unsigned char index,
+IOReturn dfu_detach(struct dfu_if* dif,
                     const unsigned short timeout)
 {
-    IOReturn result = control_transfer(interface,
+    IOReturn result = control_transfer(dif,
                                        /* bmRequestType */ USBmakebmRequestType(kUSBOut, kUSBClass, kUSBInterface),
                                        /* bRequest      */ DFU_DETACH,
-                                       /* wValu:ne        */ timeout,
-                                       /* wIndex        */ index,
+                                       /* wValue        */ timeout,
+                                       /* wIndex        */ dif->index,
                                        /* Data          */ NULL,
                                        /* wLength       */ 0);
     
@@ -83,25 +182,23 @@ IOReturn dfu_detach(IOUSBInterfaceInterface300** interface,
 /*
  *  DFU_DNLOAD Request (DFU Spec 1.0, Section 6.1.1)
  *
- *  device    - USB device pointer
- *  interface - the interface to communicate with
+ *  dif       - DFU interface
  *  length    - the total number of bytes to transfer to the USB
  *              device - must be less than wTransferSize
  *  data      - the data to transfer
  *
  *  returns IOReturn value
  */
-IOReturn dfu_download(IOUSBInterfaceInterface300** interface,
-                      const unsigned char index,
+IOReturn dfu_download(struct dfu_if* dif,
                       const unsigned short length,
                       const unsigned short transaction,
                       unsigned char* data)
 {
-    IOReturn result = control_transfer(interface,
+    IOReturn result = control_transfer(dif,
                                        /* bmRequestType */ USBmakebmRequestType(kUSBOut, kUSBClass, kUSBInterface),
                                        /* bRequest      */ DFU_DNLOAD,
                                        /* wValue        */ transaction,
-                                       /* wIndex        */ index,
+                                       /* wIndex        */ dif->index,
                                        /* Data          */ data,
                                        /* wLength       */ length);
     
@@ -115,31 +212,37 @@ IOReturn dfu_download(IOUSBInterfaceInterface300** interface,
 /*
  *  DFU_UPLOAD Request (DFU Spec 1.0, Section 6.2)
  *
- *  device    - USB device pointer
- *  interface - the interface to communicate with
+ *  dif       - DFU interface
  *  length    - the maximum number of bytes to receive from the USB
  *              device - must be less than wTransferSize
  *  data      - the buffer to put the received data in
+ *  received  - the number of bytes received, may be NULL
  *
  *  returns IOReturn value
  */
-IOReturn dfu_upload(IOUSBInterfaceInterface300** interface,
-               const unsigned char index,
+IOReturn dfu_upload(struct dfu_if* dif,
                const unsigned short length,
                const unsigned short transaction,
-               unsigned char* data)
+               unsigned char* data,
+               unsigned short* received)
 {
-    IOReturn result= control_transfer(interface,
-                                      /* bmRequestType */ USBmakebmRequestType(kUSBIn, kUSBClass, kUSBInterface),
-                                      /* bRequest      */ DFU_UPLOAD,
-                                      /* wValue        */ transaction,
-                                      /* wIndex        */ index,
-                                      /* Data          */ data,
-                                      /* wLength       */ length);
+    IOUSBDevRequestTO usbRequest;
+    usbRequest.bmRequestType = USBmakebmRequestType(kUSBIn, kUSBClass, kUSBInterface);
+    usbRequest.bRequest = DFU_UPLOAD;
+    usbRequest.wValue = transaction;
+    usbRequest.wIndex = dif->index;
+    usbRequest.wLength = length;
+    usbRequest.pData = data;
+    usbRequest.wLenDone = 0;
+    
+    IOReturn result = dfu_control(dif, &usbRequest);
     
     if (result != kIOReturnSuccess)
         fprintf(stderr, "[!] Failed DFU_UPLOAD: 0x%08x.\n", result);
     
+    if (received != NULL)
+        *received = usbRequest.wLenDone;
+    
     return result;
 }
 
@@ -147,13 +250,12 @@ IOReturn dfu_upload(IOUSBInterfaceInterface300** interface,
 /*
  *  DFU_GETSTATUS Request (DFU Spec 1.0, Section 6.1.2)
  *
- *  device    - USB device pointer
- *  interface - the interface to communicate with
+ *  dif       - DFU interface
  *  status    - the data structure to be populated with the results
  *
  *  returns IOReturn value
  */
-IOReturn dfu_get_status(IOUSBInterfaceInterface300** interface, const unsigned char index, struct dfu_status *status)
+IOReturn dfu_get_status(struct dfu_if* dif, struct dfu_status *status)
 {
     unsigned char buffer[6];
     
@@ -163,11 +265,11 @@ IOReturn dfu_get_status(IOUSBInterfaceInterface300** interface, const unsigned c
     status->bState        = STATE_DFU_ERROR;
     status->iString       = 0;
     
-    IOReturn result = control_transfer(interface,
+    IOReturn result = control_transfer(dif,
                                        /* bmRequestType */ USBmakebmRequestType(kUSBIn, kUSBClass, kUSBInterface),
                                        /* bRequest      */ DFU_GETSTATUS,
                                        /* wValue        */ 0,
-                                       /* wIndex        */ index,
+                                       /* wIndex        */ dif->index,
                                        /* Data          */ buffer,
                                        /* wLength       */ sizeof(buffer));
     
@@ -177,6 +279,11 @@ IOReturn dfu_get_status(IOUSBInterfaceInterface300** interface, const unsigned c
         status->bwPollTimeout = ((0xff & buffer[3]) << 16) | ((0xff & buffer[2]) << 8) | (0xff & buffer[1]);
         status->bState = buffer[4];
         status->iString = buffer[5];
+        
+        dif->timeouts.poll_timeout = status->bwPollTimeout;
+        
+        if (status->bStatus != DFU_STATUS_OK)
+            dfu_metrics_status(status->bStatus);
     }
     else
         fprintf(stderr, "[!] Failed DFU_GETSTATUS: 0x%08x.\n", result);
@@ -188,21 +295,20 @@ IOReturn dfu_get_status(IOUSBInterfaceInterface300** interface, const unsigned c
 /*
  *  DFU_CLRSTATUS Request (DFU Spec 1.0, Section 6.1.3)
  *
- *  device    - the usb_dev_handle to communicate with
- *  interface - the interface to communicate with
+ *  dif       - DFU interface
  *
  *  returns IOReturn value
  */
-IOReturn dfu_clear_status(IOUSBInterfaceInterface300** interface, const unsigned char index)
+IOReturn dfu_clear_status(struct dfu_if* dif)
 {
-    IOReturn result = control_transfer(interface,
+    IOReturn result = control_transfer(dif,
                             /* bmRequestType */ USBmakebmRequestType(kUSBOut, kUSBClass, kUSBInterface),
                             /* bRequest      */ DFU_CLRSTATUS,
                             /* wValue        */ 0,
-                            /* wIndex        */ index,
+                            /* wIndex        */ dif->index,
                             /* Data          */ NULL,
                             /* wLength       */ 0);
-
+    
     if (result != kIOReturnSuccess)
         fprintf(stderr, "[!] Failed DFU_CLRSTATUS: 0x%08x.\n", result);
     
@@ -212,20 +318,19 @@ IOReturn dfu_clear_status(IOUSBInterfaceInterface300** interface, const unsigned
 /*
  *  DFU_GETSTATE Request (DFU Spec 1.0, Section 6.1.5)
  *
- *  device    - USB device pointer
- *  interface - the interface to communicate with
+ *  dif       - DFU interface
  *
  *  returns the state or < 0 on error
  */
-IOReturn dfu_get_state(IOUSBInterfaceInterface300** interface, const unsigned char index)
+IOReturn dfu_get_state(struct dfu_if* dif)
 {
     unsigned char buffer[1];
     
-    IOReturn result = control_transfer(interface,
+    IOReturn result = control_transfer(dif,
                                        /* bmRequestType */ USBmakebmRequestType(kUSBIn, kUSBClass, kUSBInterface),
                                        /* bRequest      */ DFU_GETSTATE,
                                        /* wValue        */ 0,
-                                       /* wIndex        */ index,
+                                       /* wIndex        */ dif->index,
                                        /* Data          */ buffer,
                                        /* wLength       */ 1);
     
@@ -246,18 +351,17 @@ IOReturn dfu_get_state(IOUSBInterfaceInterface300** interface, const unsigned ch
 /*
  *  DFU_ABORT Request (DFU Spec 1.0, Section 6.1.4)
  *
- *  device    - USB device pointer
- *  interface - the interface to communicate with
+ *  dif       - DFU interface
  *
  *  returns 0 or < 0 on an error
  */
-IOReturn dfu_abort(IOUSBInterfaceInterface300** interface, const unsigned char index)
+IOReturn dfu_abort(struct dfu_if* dif)
 {
-    IOReturn result = control_transfer(interface,
+    IOReturn result = control_transfer(dif,
                             /* bmRequestType */ USBmakebmRequestType(kUSBOut, kUSBClass, kUSBInterface),
                             /* bRequest      */ DFU_ABORT,
                             /* wValue        */ 0,
-                            /* wIndex        */ index,
+                            /* wIndex        */ dif->index,
                             /* Data          */ NULL,
                             /* wLength       */ 0);
     
@@ -34,6 +34,8 @@
 #include <CoreFoundation/CoreFoundation.h>
 #include <stdio.h>
 
+#include "dfu_timeout.h"
+
 /* This is based off of DFU_GETSTATUS
  *
  *  1 unsigned byte bStatus
@@ -95,15 +97,56 @@ struct dfu_status {
 #define DFU_ABORT       6
 
 
-IOReturn dfu_detach(IOUSBInterfaceInterface300** interface, const unsigned char index, const unsigned short timeout);
-IOReturn dfu_download(IOUSBInterfaceInterface300** interface, const unsigned char index, const unsigned short length,
-                      const unsigned short transaction, unsigned char* data);
-IOReturn dfu_upload(IOUSBInterfaceInterface300** interface, const unsigned char index, const unsigned short length,
-                    const unsigned short transaction, unsigned char* data);
-IOReturn dfu_get_status(IOUSBInterfaceInterface300** interface, const unsigned char index, struct dfu_status *status);
-IOReturn dfu_clear_status(IOUSBInterfaceInterface300** interface, const unsigned char index);
-IOReturn dfu_get_state(IOUSBInterfaceInterface300** interface, const unsigned char index);
-IOReturn dfu_abort(IOUSBInterfaceInterface300** interface, const unsigned char index);
+#define DFU_DEFAULT_TIMEOUT             5000  /* 5 seconds */
+
+/* Carries the DFU class requests of one interface, IOKit unless replaced */
+struct dfu_transport
+{
+    IOReturn (*control)(void* context, IOUSBDevRequestTO* request);
+    IOReturn (*reset)(void* context);
+    /* Waits of the request logic (bwPollTimeout, retry backoff), NULL sleeps */
+    void (*wait)(void* context, unsigned int ms);
+    void* context;
+};
+
+/*
+ *  DFU interface context, every request goes through it so any number of
+ *  devices can be driven from the same process. The IOKit transport points
+ *  back at the structure, do not copy it after dfu_init().
+ */
+struct dfu_if
+{
+    IOUSBDeviceInterface300** device;
+    IOUSBInterfaceInterface300** interface;
+    unsigned char index;
+    /* Fixed timeout in ms, used until adaptive timeouts have enough samples */
+    unsigned int timeout;
+    struct dfu_timeouts timeouts;
+    struct dfu_transport transport;
+    /* USB resets issued, the interface has to be claimed again after one */
+    unsigned int resets;
+};
+
+void dfu_init(struct dfu_if* dif,
+              IOUSBDeviceInterface300** device,
+              IOUSBInterfaceInterface300** interface,
+              const unsigned char index);
+
+IOReturn dfu_control(struct dfu_if* dif, IOUSBDevRequestTO* request);
+IOReturn control_transfer(struct dfu_if* dif, UInt8 requestType, UInt8 request, UInt16 value, UInt16 index,
+                          void* data, UInt16 length);
+
+IOReturn dfu_detach(struct dfu_if* dif, const unsigned short timeout);
+IOReturn dfu_download(struct dfu_if* dif, const unsigned short length, const unsigned short transaction,
+                      unsigned char* data);
+IOReturn dfu_upload(struct dfu_if* dif, const unsigned short length, const unsigned short transaction,
+                    unsigned char* data, unsigned short* received);
+IOReturn dfu_get_status(struct dfu_if* dif, struct dfu_status *status);
+IOReturn dfu_clear_status(struct dfu_if* dif);
+IOReturn dfu_get_state(struct dfu_if* dif);
+IOReturn dfu_abort(struct dfu_if* dif);
+IOReturn dfu_reset(struct dfu_if* dif);
+void dfu_wait(struct dfu_if* dif, unsigned int ms);
 
 const char* dfu_state_to_string(int state);
 const char* dfu_status_to_string(int status);
@@ -0,0 +1,570 @@
+/*
+ *  Deduplicated archive of device flash backups
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "dfu_archive.h"
+
+#define DFU_ARCHIVE_CUT_MASK    (((1ULL << DFU_ARCHIVE_CHUNK_BITS) - 1) << (64 - DFU_ARCHIVE_CHUNK_BITS))
+
+static const uint8_t *dfu_restore_read(void *context, int offset, int size);
+
+static uint64_t splitmix64(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    
+    return z ^ (z >> 31);
+}
+
+static int dfu_archive_mkdir(const char *path)
+{
+    return mkdir(path, 0755) == 0 || errno == EEXIST ? 0 : -1;
+}
+
+/*
+ *  Open an archive directory, created if missing
+ *
+ *  archive   - archive to open
+ *  path      - archive directory
+ *
+ *  returns 0 or -1
+ */
+int dfu_archive_open(struct dfu_archive *archive, const char *path)
+{
+    char directory[PATH_MAX];
+    uint64_t seed = 0x6466752d7574696cULL;
+    
+    archive->path = path;
+    
+    // Fixed table, the same data has to cut into the same chunks in every run
+    for (int i = 0; i < 256; i++)
+        archive->gear[i] = splitmix64(&seed);
+    
+    if (dfu_archive_mkdir(path) != 0)
+        return -1;
+    
+    snprintf(directory, sizeof(directory), "%s/chunks", path);
+    
+    if (dfu_archive_mkdir(directory) != 0)
+        return -1;
+    
+    snprintf(directory, sizeof(directory), "%s/manifests", path);
+    
+    return dfu_archive_mkdir(directory);
+}
+
+/*
+ *  Length of the next chunk. A gear hash rolls over the data and a chunk
+ *  ends where its top bits are zero, so a change only moves the cut points
+ *  next to it and the chunks behind it are found again.
+ *
+ *  archive   - open archive
+ *  data      - rest of the data
+ *  size      - bytes left
+ *
+ *  returns chunk length, size at most
+ */
+size_t dfu_archive_cut(const struct dfu_archive *archive, const uint8_t *data, size_t size)
+{
+    uint64_t hash = 0;
+    size_t limit = size < DFU_ARCHIVE_MAX_CHUNK ? size : DFU_ARCHIVE_MAX_CHUNK;
+    
+    if (size <= DFU_ARCHIVE_MIN_CHUNK)
+        return size;
+    
+    // Bytes before the minimum still roll into the hash
+    for (size_t i = DFU_ARCHIVE_MIN_CHUNK - 64; i < DFU_ARCHIVE_MIN_CHUNK; i++)
+        hash = (hash << 1) + archive->gear[data[i]];
+    
+    for (size_t i = DFU_ARCHIVE_MIN_CHUNK; i < limit; i++)
+    {
+        hash = (hash << 1) + archive->gear[data[i]];
+        
+        if ((hash & DFU_ARCHIVE_CUT_MASK) == 0)
+            return i + 1;
+    }
+    
+    return limit;
+}
+
+static void dfu_archive_chunk_path(const struct dfu_archive *archive, const uint8_t *digest,
+                                   char *path, size_t size)
+{
+    char hex[DFU_SHA256_HEX_LENGTH + 1];
+    
+    dfu_sha256_format(digest, hex);
+    snprintf(path, size, "%s/chunks/%.2s/%s", archive->path, hex, hex);
+}
+
+/* Write a file under a temporary name and move it in place, never replacing one */
+static int dfu_archive_write(const char *path, const void *data, size_t size)
+{
+    char temporary[PATH_MAX];
+    
+    snprintf(temporary, sizeof(temporary), "%s.XXXXXX", path);
+    
+    int fd = mkstemp(temporary);
+    
+    if (fd < 0)
+        return -1;
+    
+    int result = write(fd, data, size) == (ssize_t)size ? 0 : -1;
+    
+    if (close(fd) != 0)
+        result = -1;
+    
+    // Another backup may have stored the same chunk meanwhile
+    if (result == 0 && link(temporary, path) != 0 && errno != EEXIST)
+        result = -1;
+    
+    unlink(temporary);
+    
+    return result;
+}
+
+static int dfu_archive_put(const struct dfu_archive *archive, const uint8_t *data, uint32_t length,
+                           const uint8_t *digest, struct dfu_archive_stats *stats)
+{
+    char path[PATH_MAX];
+    struct stat info;
+    
+    dfu_archive_chunk_path(archive, digest, path, sizeof(path));
+    
+    if (stat(path, &info) == 0)
+        return 0;
+    
+    // chunks/ab
+    char directory[PATH_MAX];
+    
+    snprintf(directory, sizeof(directory), "%.*s", (int)(strrchr(path, '/') - path), path);
+    
+    if (dfu_archive_mkdir(directory) != 0)
+        return -1;
+    
+    uLongf compressed_size = compressBound(length);
+    uint8_t *compressed = malloc(compressed_size);
+    
+    if (compressed == NULL)
+        return -1;
+    
+    int result = compress2(compressed, &compressed_size, data, length, Z_BEST_COMPRESSION) == Z_OK ? 0 : -1;
+    
+    if (result == 0)
+        result = dfu_archive_write(path, compressed, compressed_size);
+    
+    free(compressed);
+    
+    if (result == 0)
+    {
+        stats->stored++;
+        stats->stored_bytes += length;
+        stats->compressed_bytes += compressed_size;
+    }
+    
+    return result;
+}
+
+static int dfu_manifest_add(struct dfu_manifest *manifest, const uint8_t *digest, uint32_t length)
+{
+    if (manifest->count == manifest->capacity)
+    {
+        int capacity = manifest->capacity > 0 ? manifest->capacity * 2 : 64;
+        struct dfu_archive_chunk *chunks = realloc(manifest->chunks, capacity * sizeof(*chunks));
+        
+        if (chunks == NULL)
+            return -1;
+        
+        manifest->chunks = chunks;
+        manifest->capacity = capacity;
+    }
+    
+    memcpy(manifest->chunks[manifest->count].digest, digest, DFU_SHA256_LENGTH);
+    manifest->chunks[manifest->count].length = length;
+    manifest->count++;
+    
+    return 0;
+}
+
+static void dfu_manifest_print(FILE *out, const struct dfu_manifest *manifest)
+{
+    char hex[DFU_SHA256_HEX_LENGTH + 1];
+    
+    fprintf(out, "# dfu-util backup manifest\n");
+    fprintf(out, "serial %s\n", manifest->serial);
+    fprintf(out, "device %04x:%04x:%04x\n", manifest->idVendor, manifest->idProduct, manifest->bcdDevice);
+    fprintf(out, "time %lld\n", (long long)manifest->time);
+    fprintf(out, "size %u\n", manifest->size);
+    
+    dfu_sha256_format(manifest->digest, hex);
+    fprintf(out, "sha256 %s\n", hex);
+    
+    for (int i = 0; i < manifest->count; i++)
+    {
+        dfu_sha256_format(manifest->chunks[i].digest, hex);
+        fprintf(out, "chunk %s %u\n", hex, manifest->chunks[i].length);
+    }
+}
+
+/*
+ *  Split a backup into chunks, store the ones the archive does not hold
+ *  yet and write its manifest
+ *
+ *  archive   - open archive
+ *  manifest  - serial, ids and time filled in, receives size, digest and chunks
+ *  data      - flash contents
+ *  size      - bytes read from the device
+ *  stats     - receives chunk counts
+ *  name      - receives the manifest file name
+ *  name_size - size of name
+ *
+ *  returns 0 or -1
+ */
+int dfu_archive_store(const struct dfu_archive *archive, struct dfu_manifest *manifest,
+                      const uint8_t *data, uint32_t size, struct dfu_archive_stats *stats,
+                      char *name, size_t name_size)
+{
+    char serial[sizeof(manifest->serial)];
+    char path[PATH_MAX];
+    uint32_t position = 0;
+    
+    memset(stats, 0, sizeof(*stats));
+    manifest->size = size;
+    manifest->count = 0;
+    dfu_sha256(data, size, manifest->digest);
+    
+    while (position < size)
+    {
+        uint8_t digest[DFU_SHA256_LENGTH];
+        uint32_t length = (uint32_t)dfu_archive_cut(archive, data + position, size - position);
+        
+        dfu_sha256(data + position, length, digest);
+        
+        if (dfu_archive_put(archive, data + position, length, digest, stats) != 0 ||
+            dfu_manifest_add(manifest, digest, length) != 0)
+            return -1;
+        
+        stats->chunks++;
+        position += length;
+    }
+    
+    // Serials end up in a file name
+    int i;
+    
+    for (i = 0; manifest->serial[i] != '\0'; i++)
+    {
+        char c = manifest->serial[i];
+        
+        serial[i] = (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '-' ? c : '_';
+    }
+    
+    serial[i] = '\0';
+    
+    char temporary[PATH_MAX];
+    
+    snprintf(temporary, sizeof(temporary), "%s/manifests/.manifest.XXXXXX", archive->path);
+    
+    int fd = mkstemp(temporary);
+    
+    if (fd < 0)
+        return -1;
+    
+    FILE *out = fdopen(fd, "w");
+    
+    if (out == NULL)
+    {
+        close(fd);
+        unlink(temporary);
+        return -1;
+    }
+    
+    dfu_manifest_print(out, manifest);
+    
+    int result = fclose(out) == 0 ? 0 : -1;
+    
+    // Backups of one unit within a second get a counter
+    for (int attempt = 0; result == 0 && attempt < 100; attempt++)
+    {
+        const char *prefix = serial[0] != '\0' ? serial : "unknown";
+        
+        if (attempt == 0)
+            snprintf(name, name_size, "%s-%lld.manifest", prefix, (long long)manifest->time);
+        else
+            snprintf(name, name_size, "%s-%lld-%d.manifest", prefix, (long long)manifest->time, attempt);
+        
+        snprintf(path, sizeof(path), "%s/manifests/%s", archive->path, name);
+        
+        if (link(temporary, path) == 0)
+            break;
+        
+        if (errno != EEXIST || attempt == 99)
+            result = -1;
+    }
+    
+    unlink(temporary);
+    
+    return result;
+}
+
+/*
+ *  Read a manifest
+ *
+ *  manifest  - receives the backup, free with dfu_manifest_free()
+ *  path      - manifest file
+ *
+ *  returns 0 or -1
+ */
+int dfu_manifest_load(struct dfu_manifest *manifest, const char *path)
+{
+    char line[256];
+    char hex[DFU_SHA256_HEX_LENGTH + 1];
+    uint64_t total = 0;
+    int result = 0;
+    FILE *in = fopen(path, "r");
+    
+    memset(manifest, 0, sizeof(*manifest));
+    
+    if (in == NULL)
+        return -1;
+    
+    while (result == 0 && fgets(line, sizeof(line), in) != NULL)
+    {
+        unsigned int vid, pid, bcd, length;
+        long long time;
+        
+        line[strcspn(line, "\r\n")] = '\0';
+        
+        if (line[0] == '#' || line[0] == '\0')
+            continue;
+        
+        if (strncmp(line, "serial ", 7) == 0)
+            strlcpy(manifest->serial, line + 7, sizeof(manifest->serial));
+        else if (sscanf(line, "device %x:%x:%x", &vid, &pid, &bcd) == 3)
+        {
+            manifest->idVendor = vid;
+            manifest->idProduct = pid;
+            manifest->bcdDevice = bcd;
+        }
+        else if (sscanf(line, "time %lld", &time) == 1)
+            manifest->time = time;
+        else if (sscanf(line, "size %u", &length) == 1)
+            manifest->size = length;
+        else if (sscanf(line, "sha256 %64s", hex) == 1)
+            result = dfu_sha256_parse(hex, manifest->digest) ? 0 : -1;
+        else if (sscanf(line, "chunk %64s %u", hex, &length) == 2)
+        {
+            uint8_t digest[DFU_SHA256_LENGTH];
+            
+            if (!dfu_sha256_parse(hex, digest) || length == 0 || length > DFU_ARCHIVE_MAX_CHUNK)
+                result = -1;
+            else
+                result = dfu_manifest_add(manifest, digest, length);
+            
+            total += length;
+        }
+        else
+            result = -1;
+    }
+    
+    fclose(in);
+    
+    // The chunks have to add up to the backup
+    if (result == 0 && total != manifest->size)
+        result = -1;
+    
+    if (result != 0)
+        dfu_manifest_free(manifest);
+    
+    return result;
+}
+
+void dfu_manifest_free(struct dfu_manifest *manifest)
+{
+    free(manifest->chunks);
+    
+    manifest->chunks = NULL;
+    manifest->count = 0;
+    manifest->capacity = 0;
+}
+
+/*
+ *  Start a restore, its source passed to dfu_session_download() with a
+ *  dfu_file of manifest->size bytes and no firmware buffer
+ *
+ *  restore   - restore to initialize
+ *  archive   - open archive
+ *  manifest  - backup to restore
+ *
+ *  returns 0 or -1
+ */
+int dfu_restore_init(struct dfu_restore *restore, const struct dfu_archive *archive,
+                     const struct dfu_manifest *manifest)
+{
+    memset(restore, 0, sizeof(*restore));
+    
+    restore->archive = archive;
+    restore->manifest = manifest;
+    restore->loaded = -1;
+    restore->block_offset = -1;
+    restore->source.read = dfu_restore_read;
+    restore->source.context = restore;
+    restore->data = malloc(DFU_ARCHIVE_MAX_CHUNK);
+    
+    return restore->data != NULL ? 0 : -1;
+}
+
+/* Decompress a chunk into restore->data and check it against its name */
+static int dfu_restore_load(struct dfu_restore *restore, int index)
+{
+    const struct dfu_archive_chunk *chunk = &restore->manifest->chunks[index];
+    char path[PATH_MAX];
+    struct stat info;
+    uint8_t digest[DFU_SHA256_LENGTH];
+    
+    dfu_archive_chunk_path(restore->archive, chunk->digest, path, sizeof(path));
+    
+    int fd = open(path, O_RDONLY);
+    
+    if (fd < 0)
+    {
+        fprintf(stderr, "[!] Chunk %s is missing.\n", strrchr(path, '/') + 1);
+        return -1;
+    }
+    
+    uint8_t *compressed = NULL;
+    int result = fstat(fd, &info) == 0 && (compressed = malloc(info.st_size)) != NULL &&
+                 read(fd, compressed, info.st_size) == info.st_size ? 0 : -1;
+    
+    close(fd);
+    
+    uLongf length = DFU_ARCHIVE_MAX_CHUNK;
+    
+    if (result == 0 && (uncompress(restore->data, &length, compressed, info.st_size) != Z_OK || length != chunk->length))
+        result = -1;
+    
+    free(compressed);
+    
+    if (result == 0)
+    {
+        dfu_sha256(restore->data, length, digest);
+        
+        if (memcmp(digest, chunk->digest, DFU_SHA256_LENGTH) != 0)
+            result = -1;
+    }
+    
+    if (result != 0)
+    {
+        fprintf(stderr, "[!] Chunk %s is damaged.\n", strrchr(path, '/') + 1);
+        restore->loaded = -1;
+        return -1;
+    }
+    
+    restore->loaded = index;
+    
+    return 0;
+}
+
+/*
+ *  dfu_source read hook, blocks are gathered from the chunks they span
+ */
+static const uint8_t *dfu_restore_read(void *context, int offset, int size)
+{
+    struct dfu_restore *restore = context;
+    const struct dfu_manifest *manifest = restore->manifest;
+    int copied = 0;
+    
+    // Retries ask for the same block again
+    if (offset == restore->block_offset && size == restore->block_length)
+        return restore->block;
+    
+    if (size > restore->block_size)
+    {
+        uint8_t *block = realloc(restore->block, size);
+        
+        if (block == NULL)
+            return NULL;
+        
+        restore->block = block;
+        restore->block_size = size;
+    }
+    
+    restore->block_offset = -1;
+    
+    while (copied < size)
+    {
+        uint32_t position = (uint32_t)(offset + copied);
+        
+        // Downloads only go forwards, anything else starts over
+        if (position < restore->chunk_start)
+        {
+            restore->chunk = 0;
+            restore->chunk_start = 0;
+        }
+        
+        while (restore->chunk < manifest->count &&
+               position >= restore->chunk_start + manifest->chunks[restore->chunk].length)
+        {
+            restore->chunk_start += manifest->chunks[restore->chunk].length;
+            restore->chunk++;
+        }
+        
+        if (restore->chunk == manifest->count)
+            return NULL;
+        
+        if (restore->loaded != restore->chunk && dfu_restore_load(restore, restore->chunk) != 0)
+            return NULL;
+        
+        uint32_t start = position - restore->chunk_start;
+        uint32_t length = manifest->chunks[restore->chunk].length - start;
+        
+        if (length > (uint32_t)(size - copied))
+            length = size - copied;
+        
+        memcpy(restore->block + copied, restore->data + start, length);
+        copied += length;
+    }
+    
+    restore->block_offset = offset;
+    restore->block_length = size;
+    
+    return restore->block;
+}
+
+void dfu_restore_free(struct dfu_restore *restore)
+{
+    free(restore->data);
+    free(restore->block);
+    
+    restore->data = NULL;
+    restore->block = NULL;
+    restore->block_size = 0;
+    restore->loaded = -1;
+}
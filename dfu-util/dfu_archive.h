@@ -0,0 +1,113 @@
+/*
+ *  Deduplicated archive of device flash backups
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef __dfu_util__dfu_archive__
+#define __dfu_util__dfu_archive__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "dfu_sha256.h"
+#include "dfu_transfer.h"
+
+/* Content-defined chunk sizes, cut points depend on the last bytes only */
+#define DFU_ARCHIVE_MIN_CHUNK   1024
+#define DFU_ARCHIVE_CHUNK_BITS  12    /* 4 KiB on average */
+#define DFU_ARCHIVE_MAX_CHUNK   16384
+
+/*
+ *  Directory of zlib compressed chunks named by their SHA-256
+ *  (chunks/ab/ab01...), shared by every backup, and one manifest per
+ *  backup listing its chunks (manifests/<serial>-<time>.manifest).
+ */
+struct dfu_archive
+{
+    const char *path;
+    /* Gear hash table */
+    uint64_t gear[256];
+};
+
+struct dfu_archive_chunk
+{
+    uint8_t digest[DFU_SHA256_LENGTH];
+    uint32_t length;
+};
+
+/* One backup of a device */
+struct dfu_manifest
+{
+    char serial[128];
+    uint16_t idVendor;
+    uint16_t idProduct;
+    uint16_t bcdDevice;
+    /* Seconds since the epoch */
+    int64_t time;
+    uint32_t size;
+    uint8_t digest[DFU_SHA256_LENGTH];
+    struct dfu_archive_chunk *chunks;
+    int count;
+    int capacity;
+};
+
+struct dfu_archive_stats
+{
+    int chunks;
+    /* Not in the archive before, written */
+    int stored;
+    uint64_t stored_bytes;
+    uint64_t compressed_bytes;
+};
+
+/*
+ *  dfu_source of a restore, chunks are read and decompressed as the
+ *  download reaches them
+ */
+struct dfu_restore
+{
+    const struct dfu_archive *archive;
+    const struct dfu_manifest *manifest;
+    /* Chunk the position is in and where it starts */
+    int chunk;
+    uint32_t chunk_start;
+    /* Chunk held in data, -1 if none */
+    int loaded;
+    uint8_t *data;
+    /* Last block, served again on retries */
+    uint8_t *block;
+    int block_size;
+    int block_offset;
+    int block_length;
+    /* Passed as dfu_session.source */
+    struct dfu_source source;
+};
+
+int dfu_archive_open(struct dfu_archive *archive, const char *path);
+size_t dfu_archive_cut(const struct dfu_archive *archive, const uint8_t *data, size_t size);
+int dfu_archive_store(const struct dfu_archive *archive, struct dfu_manifest *manifest,
+                      const uint8_t *data, uint32_t size, struct dfu_archive_stats *stats,
+                      char *name, size_t name_size);
+int dfu_manifest_load(struct dfu_manifest *manifest, const char *path);
+void dfu_manifest_free(struct dfu_manifest *manifest);
+int dfu_restore_init(struct dfu_restore *restore, const struct dfu_archive *archive,
+                     const struct dfu_manifest *manifest);
+void dfu_restore_free(struct dfu_restore *restore);
+
+#endif /* defined(__dfu_util__dfu_archive__) */
@@ -0,0 +1,96 @@
+/*
+ *  Page aligned, wired image buffers
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <sys/mman.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "dfu_buffer.h"
+
+/* Stored right in front of every buffer */
+struct dfu_buffer_header
+{
+    /* Whole mapping including the header page, 0 for malloc() */
+    size_t mapped;
+    bool wired;
+};
+
+/*
+ *  Every DFU_DNLOAD hands a block of the image to the kernel, which wires
+ *  its pages for the transfer. Pages that are locked already are wired
+ *  without faulting them in, and page alignment keeps a block from
+ *  touching more pages than its size needs.
+ */
+static void *dfu_wired_alloc(void *context, size_t size)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t mapped = page + (size + page - 1) / page * page;
+    struct dfu_buffer_header *header;
+    
+    uint8_t *pages = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    
+    if (pages == MAP_FAILED)
+    {
+        header = malloc(sizeof(*header) + size);
+        
+        if (header == NULL)
+            return NULL;
+        
+        header->mapped = 0;
+        header->wired = false;
+        
+        return header + 1;
+    }
+    
+    // The header ends the first page, the data starts the second
+    header = (struct dfu_buffer_header *)(pages + page) - 1;
+    header->mapped = mapped;
+    header->wired = mlock(pages + page, mapped - page) == 0;
+    
+    return pages + page;
+}
+
+static void dfu_wired_release(void *context, void *ptr)
+{
+    struct dfu_buffer_header *header = (struct dfu_buffer_header *)ptr - 1;
+    
+    if (header->mapped == 0)
+    {
+        free(header);
+        return;
+    }
+    
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    uint8_t *pages = (uint8_t *)ptr - page;
+    
+    if (header->wired)
+        munlock(ptr, header->mapped - page);
+    
+    munmap(pages, header->mapped);
+}
+
+const struct dfu_allocator dfu_wired_allocator =
+{
+    dfu_wired_alloc,
+    dfu_wired_release,
+    NULL
+};
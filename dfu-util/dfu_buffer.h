@@ -0,0 +1,34 @@
+/*
+ *  Page aligned, wired image buffers
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef __dfu_util__dfu_buffer__
+#define __dfu_util__dfu_buffer__
+
+#include "dfu_file.h"
+
+/*
+ *  Allocator for firmware buffers sent by many DFU_DNLOAD requests: whole
+ *  pages, locked in memory where the limit allows, from malloc() if
+ *  pages cannot be mapped. Set as dfu_file.allocator.
+ */
+extern const struct dfu_allocator dfu_wired_allocator;
+
+#endif /* defined(__dfu_util__dfu_buffer__) */
@@ -0,0 +1,635 @@
+/*
+ *  Persistent index of DFU images by device
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fts.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dfu_catalog.h"
+#include "dfu_file.h"
+
+#define DFU_CATALOG_WILDCARD    0xffff
+
+/* What became of a previous entry during a scan */
+enum dfu_catalog_seen
+{
+    DFU_CATALOG_UNSEEN,
+    DFU_CATALOG_KEPT,
+    DFU_CATALOG_CHANGED
+};
+
+/* Files of a scan waiting to be read */
+struct dfu_catalog_batch
+{
+    struct dfu_catalog_entry *entries;
+    int *pending;
+    int count;
+    int next;
+};
+
+static int64_t dfu_catalog_mtime(const struct stat *info)
+{
+    return info->st_mtimespec.tv_sec * 1000000000LL + info->st_mtimespec.tv_nsec;
+}
+
+/*
+ *  Parse one index line:
+ *
+ *    vid:pid:bcdDevice dfu=.. crc=.. size=.. mtime=.. path=..
+ *
+ *  Files without a valid suffix start with "-". The path is the rest of
+ *  the line.
+ *
+ *  returns false for lines that are not an entry
+ */
+static bool dfu_catalog_parse(char *line, struct dfu_catalog_entry *entry)
+{
+    unsigned int vid, pid, bcd;
+    int offset;
+    char *path = strstr(line, " path=");
+    
+    memset(entry, 0, sizeof(*entry));
+    
+    if (path == NULL)
+        return false;
+    
+    *path = 0;
+    path += strlen(" path=");
+    path[strcspn(path, "\n")] = 0;
+    
+    if (sscanf(line, "%x:%x:%x%n", &vid, &pid, &bcd, &offset) == 3)
+    {
+        entry->suffixed = true;
+        entry->idVendor = vid;
+        entry->idProduct = pid;
+        entry->bcdDevice = bcd;
+    }
+    else if (line[0] == '-')
+        offset = 1;
+    else
+        return false;
+    
+    line += offset;
+    
+    char key[32], value[64];
+    
+    while (sscanf(line, " %31[^= ]=%63s%n", key, value, &offset) == 2)
+    {
+        line += offset;
+        
+        if (strcmp(key, "dfu") == 0)
+            entry->bcdDFU = strtoul(value, NULL, 0);
+        else if (strcmp(key, "crc") == 0)
+            entry->crc = strtoul(value, NULL, 0);
+        else if (strcmp(key, "size") == 0)
+            entry->size = strtoll(value, NULL, 10);
+        else if (strcmp(key, "mtime") == 0)
+            entry->mtime_ns = strtoll(value, NULL, 10);
+    }
+    
+    entry->path = strdup(path);
+    
+    return entry->path != NULL;
+}
+
+static void dfu_catalog_print(FILE *out, const struct dfu_catalog_entry *entry)
+{
+    if (entry->suffixed)
+        fprintf(out, "%04x:%04x:%04x dfu=0x%04x crc=0x%08x", entry->idVendor, entry->idProduct, entry->bcdDevice,
+                entry->bcdDFU, entry->crc);
+    else
+        fprintf(out, "-");
+    
+    fprintf(out, " size=%lld mtime=%lld path=%s\n", (long long)entry->size, (long long)entry->mtime_ns, entry->path);
+}
+
+static struct dfu_catalog_entry *dfu_catalog_append(struct dfu_catalog *catalog, const struct dfu_catalog_entry *entry)
+{
+    if (catalog->count == catalog->capacity)
+    {
+        int capacity = catalog->capacity ? catalog->capacity * 2 : 256;
+        struct dfu_catalog_entry *entries = realloc(catalog->entries, capacity * sizeof(*entries));
+        
+        if (entries == NULL)
+            return NULL;
+        
+        catalog->entries = entries;
+        catalog->capacity = capacity;
+    }
+    
+    catalog->entries[catalog->count] = *entry;
+    
+    return &catalog->entries[catalog->count++];
+}
+
+static unsigned int dfu_catalog_hash(const struct dfu_catalog *catalog, uint16_t idVendor, uint16_t idProduct)
+{
+    uint32_t key = ((uint32_t)idVendor << 16) | idProduct;
+    
+    return (key * 2654435761u) & (catalog->bucket_count - 1);
+}
+
+/*
+ *  Chain the entries into buckets by idVendor and idProduct, at most two
+ *  entries per bucket on average
+ */
+static int dfu_catalog_index(struct dfu_catalog *catalog)
+{
+    unsigned int bucket_count = 16;
+    
+    while (bucket_count < (unsigned int)catalog->count)
+        bucket_count *= 2;
+    
+    int *buckets = realloc(catalog->buckets, bucket_count * sizeof(*buckets));
+    
+    if (buckets == NULL)
+        return -1;
+    
+    catalog->buckets = buckets;
+    catalog->bucket_count = bucket_count;
+    
+    for (unsigned int b = 0; b < bucket_count; b++)
+        buckets[b] = -1;
+    
+    for (int i = catalog->count - 1; i >= 0; i--)
+    {
+        struct dfu_catalog_entry *entry = &catalog->entries[i];
+        
+        if (!entry->suffixed)
+            continue;
+        
+        unsigned int bucket = dfu_catalog_hash(catalog, entry->idVendor, entry->idProduct);
+        
+        entry->next = buckets[bucket];
+        buckets[bucket] = i;
+    }
+    
+    return 0;
+}
+
+/*
+ *  Load an index, a missing file is an empty catalog
+ *
+ *  catalog   - catalog to initialize
+ *  path      - index file, kept by reference
+ *
+ *  returns 0 or -1 if the file could not be read
+ */
+int dfu_catalog_open(struct dfu_catalog *catalog, const char *path)
+{
+    memset(catalog, 0, sizeof(*catalog));
+    
+    catalog->path = path;
+    
+    FILE *in = fopen(path, "r");
+    
+    if (in == NULL)
+        return errno == ENOENT ? dfu_catalog_index(catalog) : -1;
+    
+    char line[PATH_MAX + 128];
+    struct dfu_catalog_entry entry;
+    
+    while (fgets(line, sizeof(line), in) != NULL)
+    {
+        if (line[0] != '#' && dfu_catalog_parse(line, &entry) && dfu_catalog_append(catalog, &entry) == NULL)
+            free(entry.path);
+    }
+    
+    fclose(in);
+    
+    return dfu_catalog_index(catalog);
+}
+
+/*
+ *  Read a file and check its suffix, the CRC covers all of it so this is
+ *  the part of a scan worth spreading over cores
+ *
+ *  returns false if the file could not be read
+ */
+static bool dfu_catalog_read(struct dfu_catalog_entry *entry)
+{
+    struct stat info;
+    int fd = open(entry->path, O_RDONLY);
+    
+    entry->suffixed = false;
+    
+    if (fd < 0)
+        return false;
+    
+    if (fstat(fd, &info) != 0)
+    {
+        close(fd);
+        return false;
+    }
+    
+    entry->size = info.st_size;
+    entry->mtime_ns = dfu_catalog_mtime(&info);
+    
+    if (info.st_size < DFU_SUFFIX_LENGTH)
+    {
+        close(fd);
+        return true;
+    }
+    
+    const uint8_t *data = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    
+    close(fd);
+    
+    if (data == MAP_FAILED)
+        return false;
+    
+    const uint8_t *suffix = data + info.st_size - DFU_SUFFIX_LENGTH;
+    
+    // Signature first, most files that are not images fail there without a full read
+    if (suffix[8] == 'U' && suffix[9] == 'F' && suffix[10] == 'D' && suffix[11] >= DFU_SUFFIX_LENGTH)
+    {
+        uint32_t stored = suffix[12] | (suffix[13] << 8) | (suffix[14] << 16) | ((uint32_t)suffix[15] << 24);
+        
+        madvise((void *)data, info.st_size, MADV_SEQUENTIAL);
+        
+        if (dfu_crc32(0xffffffff, data, info.st_size - 4) == stored)
+        {
+            entry->suffixed = true;
+            entry->crc = stored;
+            entry->bcdDevice = suffix[0] | (suffix[1] << 8);
+            entry->idProduct = suffix[2] | (suffix[3] << 8);
+            entry->idVendor = suffix[4] | (suffix[5] << 8);
+            entry->bcdDFU = suffix[6] | (suffix[7] << 8);
+        }
+    }
+    
+    munmap((void *)data, info.st_size);
+    
+    return true;
+}
+
+static void *dfu_catalog_worker(void *argument)
+{
+    struct dfu_catalog_batch *batch = argument;
+    
+    for (;;)
+    {
+        int index = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED);
+        
+        if (index >= batch->count)
+            break;
+        
+        struct dfu_catalog_entry *entry = &batch->entries[batch->pending[index]];
+        
+        // Unreadable files stay listed as without suffix, a later change reads them again
+        if (!dfu_catalog_read(entry))
+            entry->size = -1;
+    }
+    
+    return NULL;
+}
+
+static int dfu_catalog_compare(const void *a, const void *b)
+{
+    return strcmp(((const struct dfu_catalog_entry *)a)->path, ((const struct dfu_catalog_entry *)b)->path);
+}
+
+static bool dfu_catalog_below(const char *path, char *const *roots, int root_count)
+{
+    for (int r = 0; r < root_count; r++)
+    {
+        size_t length = strlen(roots[r]);
+        
+        if (strncmp(path, roots[r], length) == 0 && (path[length] == '/' || path[length] == 0))
+            return true;
+    }
+    
+    return false;
+}
+
+/*
+ *  Bring the catalog up to date with directories: files whose size and
+ *  modification time are unchanged keep their entry, new and changed ones
+ *  are read by jobs threads, and entries of deleted files are dropped.
+ *  Entries outside the directories are left alone.
+ *
+ *  catalog    - open catalog
+ *  roots      - directories or files to scan
+ *  root_count - number of roots
+ *  jobs       - threads reading files, at least one
+ *  stats      - what the scan found
+ *
+ *  returns 0 or -1 if out of memory
+ */
+int dfu_catalog_scan(struct dfu_catalog *catalog, const char *const *roots, int root_count, int jobs,
+                     struct dfu_catalog_stats *stats)
+{
+    struct dfu_catalog previous = *catalog;
+    char *absolute[root_count + 1];
+    int result = 0;
+    
+    memset(stats, 0, sizeof(*stats));
+    
+    // Entries are keyed by absolute path, however the directory was named
+    for (int r = 0; r < root_count; r++)
+    {
+        absolute[r] = realpath(roots[r], NULL);
+        
+        if (absolute[r] == NULL)
+            absolute[r] = strdup(roots[r]);
+    }
+    
+    absolute[root_count] = NULL;
+    
+    qsort(previous.entries, previous.count, sizeof(*previous.entries), dfu_catalog_compare);
+    
+    unsigned char *seen = calloc(previous.count + 1, 1);
+    
+    if (seen == NULL)
+    {
+        for (int r = 0; r < root_count; r++)
+            free(absolute[r]);
+        
+        return -1;
+    }
+    
+    catalog->entries = NULL;
+    catalog->count = 0;
+    catalog->capacity = 0;
+    
+    struct dfu_catalog_batch batch = { 0 };
+    int pending_capacity = 0;
+    FTS *fts = fts_open(absolute, FTS_PHYSICAL | FTS_NOCHDIR, NULL);
+    FTSENT *node;
+    
+    while (fts != NULL && (node = fts_read(fts)) != NULL)
+    {
+        if (node->fts_info == FTS_DNR || node->fts_info == FTS_ERR || node->fts_info == FTS_NS)
+        {
+            stats->unreadable++;
+            continue;
+        }
+        
+        if (node->fts_info != FTS_F)
+            continue;
+        
+        struct dfu_catalog_entry key = { .path = node->fts_path };
+        struct dfu_catalog_entry *known = bsearch(&key, previous.entries, previous.count,
+                                                  sizeof(*previous.entries), dfu_catalog_compare);
+        struct dfu_catalog_entry *entry;
+        
+        stats->files++;
+        
+        if (known != NULL && known->size == node->fts_statp->st_size &&
+            known->mtime_ns == dfu_catalog_mtime(node->fts_statp))
+        {
+            entry = dfu_catalog_append(catalog, known);
+            
+            if (entry != NULL)
+            {
+                // The path moves to the new entry
+                seen[known - previous.entries] = DFU_CATALOG_KEPT;
+                stats->unchanged++;
+                continue;
+            }
+        }
+        else
+        {
+            if (known != NULL)
+                seen[known - previous.entries] = DFU_CATALOG_CHANGED;
+            
+            struct dfu_catalog_entry fresh = { .path = strdup(node->fts_path) };
+            
+            entry = fresh.path != NULL ? dfu_catalog_append(catalog, &fresh) : NULL;
+            
+            if (entry == NULL)
+                free(fresh.path);
+            
+            if (entry != NULL && batch.count == pending_capacity)
+            {
+                pending_capacity = pending_capacity ? pending_capacity * 2 : 256;
+                
+                int *pending = realloc(batch.pending, pending_capacity * sizeof(*pending));
+                
+                if (pending == NULL)
+                    entry = NULL;
+                else
+                    batch.pending = pending;
+            }
+            
+            if (entry != NULL)
+            {
+                batch.pending[batch.count++] = (int)(entry - catalog->entries);
+                continue;
+            }
+        }
+        
+        result = -1;
+        break;
+    }
+    
+    if (fts != NULL)
+        fts_close(fts);
+    else
+        stats->unreadable += root_count;
+    
+    // Whatever was not seen again is kept only if it lies outside the scan
+    for (int i = 0; i < previous.count; i++)
+    {
+        struct dfu_catalog_entry *entry = &previous.entries[i];
+        
+        if (seen[i] == DFU_CATALOG_KEPT)
+            continue;
+        
+        bool removed = seen[i] == DFU_CATALOG_UNSEEN && result == 0 &&
+                       dfu_catalog_below(entry->path, absolute, root_count);
+        
+        if (seen[i] == DFU_CATALOG_UNSEEN && !removed && dfu_catalog_append(catalog, entry) != NULL)
+            continue;
+        
+        if (removed)
+            stats->removed++;
+        
+        // Deleted, or read again into a new entry
+        free(entry->path);
+    }
+    
+    batch.entries = catalog->entries;
+    
+    if (jobs > batch.count)
+        jobs = batch.count;
+    
+    if (jobs < 1)
+        jobs = 1;
+    
+    pthread_t threads[jobs];
+    int started;
+    
+    for (started = 0; started < jobs - 1; started++)
+        if (pthread_create(&threads[started], NULL, dfu_catalog_worker, &batch) != 0)
+            break;
+    
+    dfu_catalog_worker(&batch);
+    
+    for (int t = 0; t < started; t++)
+        pthread_join(threads[t], NULL);
+    
+    stats->read = batch.count;
+    
+    free(batch.pending);
+    free(previous.entries);
+    free(seen);
+    
+    for (int r = 0; r < root_count; r++)
+        free(absolute[r]);
+    
+    if (dfu_catalog_index(catalog) != 0)
+        result = -1;
+    
+    return result;
+}
+
+/*
+ *  Best image for a device: the one made for its bcdDevice, otherwise
+ *  one for any bcdDevice (0xffff), the newest file if several qualify
+ *
+ *  returns the entry or NULL if the catalog has no image for the device
+ */
+const struct dfu_catalog_entry *dfu_catalog_find(const struct dfu_catalog *catalog, uint16_t idVendor,
+                                                 uint16_t idProduct, uint16_t bcdDevice)
+{
+    const struct dfu_catalog_entry *exact = NULL;
+    const struct dfu_catalog_entry *wildcard = NULL;
+    
+    if (catalog->bucket_count == 0)
+        return NULL;
+    
+    for (int i = catalog->buckets[dfu_catalog_hash(catalog, idVendor, idProduct)]; i >= 0; i = catalog->entries[i].next)
+    {
+        const struct dfu_catalog_entry *entry = &catalog->entries[i];
+        
+        if (entry->idVendor != idVendor || entry->idProduct != idProduct)
+            continue;
+        
+        if (entry->bcdDevice == bcdDevice && (exact == NULL || entry->mtime_ns > exact->mtime_ns))
+            exact = entry;
+        else if (entry->bcdDevice == DFU_CATALOG_WILDCARD && (wildcard == NULL || entry->mtime_ns > wildcard->mtime_ns))
+            wildcard = entry;
+    }
+    
+    return exact != NULL ? exact : wildcard;
+}
+
+/*
+ *  Find the image of a device and make sure the file is still what was
+ *  indexed, reading it again if it changed and falling back to the next
+ *  best image if it no longer fits
+ *
+ *  catalog   - open catalog
+ *  changed   - set if entries were updated and the index should be saved
+ *
+ *  returns the entry or NULL if the catalog has no image for the device
+ */
+const struct dfu_catalog_entry *dfu_catalog_select(struct dfu_catalog *catalog, uint16_t idVendor,
+                                                   uint16_t idProduct, uint16_t bcdDevice, bool *changed)
+{
+    const struct dfu_catalog_entry *found;
+    struct stat info;
+    
+    while ((found = dfu_catalog_find(catalog, idVendor, idProduct, bcdDevice)) != NULL)
+    {
+        if (stat(found->path, &info) == 0 && info.st_size == found->size && dfu_catalog_mtime(&info) == found->mtime_ns)
+            return found;
+        
+        struct dfu_catalog_entry *entry = &catalog->entries[found - catalog->entries];
+        
+        if (!dfu_catalog_read(entry))
+        {
+            // Deleted, only a scan of its directory forgets the entry
+            entry->suffixed = false;
+            entry->size = -1;
+        }
+        
+        *changed = true;
+        
+        if (dfu_catalog_index(catalog) != 0)
+            return NULL;
+    }
+    
+    return NULL;
+}
+
+/*
+ *  Write the index back, atomically replacing the file
+ *
+ *  catalog   - open catalog
+ *
+ *  returns 0 or -1
+ */
+int dfu_catalog_save(struct dfu_catalog *catalog)
+{
+    char temporary[PATH_MAX];
+    
+    snprintf(temporary, sizeof(temporary), "%s.XXXXXX", catalog->path);
+    
+    int fd = mkstemp(temporary);
+    
+    if (fd < 0)
+        return -1;
+    
+    FILE *out = fdopen(fd, "w");
+    
+    if (out == NULL)
+    {
+        close(fd);
+        unlink(temporary);
+        return -1;
+    }
+    
+    fprintf(out, "# dfu-util firmware catalog, vid:pid:bcdDevice of the DFU suffix\n");
+    
+    for (int i = 0; i < catalog->count; i++)
+        dfu_catalog_print(out, &catalog->entries[i]);
+    
+    int result = fclose(out) == 0 ? 0 : -1;
+    
+    if (result == 0 && rename(temporary, catalog->path) != 0)
+        result = -1;
+    
+    if (result != 0)
+        unlink(temporary);
+    
+    return result;
+}
+
+void dfu_catalog_close(struct dfu_catalog *catalog)
+{
+    for (int i = 0; i < catalog->count; i++)
+        free(catalog->entries[i].path);
+    
+    free(catalog->entries);
+    free(catalog->buckets);
+    
+    memset(catalog, 0, sizeof(*catalog));
+}
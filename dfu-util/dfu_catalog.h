@@ -0,0 +1,82 @@
+/*
+ *  Persistent index of DFU images by device
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef __dfu_util__dfu_catalog__
+#define __dfu_util__dfu_catalog__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* One file below a scanned directory */
+struct dfu_catalog_entry
+{
+    /* Absolute path */
+    char *path;
+    /* Valid DFU suffix with a matching CRC, the fields below are from it */
+    bool suffixed;
+    uint16_t idVendor;
+    uint16_t idProduct;
+    uint16_t bcdDevice;
+    uint16_t bcdDFU;
+    uint32_t crc;
+    /* File state when it was read, any change makes it read again */
+    int64_t size;
+    int64_t mtime_ns;
+    /* Next image of the same idVendor and idProduct, -1 ends the chain */
+    int next;
+};
+
+/*
+ *  Images keyed by the idVendor and idProduct of their suffix, hashed so
+ *  that a device finds its image without touching the other entries.
+ */
+struct dfu_catalog
+{
+    const char *path;
+    struct dfu_catalog_entry *entries;
+    int count;
+    int capacity;
+    int *buckets;
+    unsigned int bucket_count;
+};
+
+struct dfu_catalog_stats
+{
+    int files;
+    /* New or changed, read and checked */
+    int read;
+    int unchanged;
+    /* Gone from a scanned directory */
+    int removed;
+    int unreadable;
+};
+
+int dfu_catalog_open(struct dfu_catalog *catalog, const char *path);
+int dfu_catalog_scan(struct dfu_catalog *catalog, const char *const *roots, int root_count, int jobs,
+                     struct dfu_catalog_stats *stats);
+const struct dfu_catalog_entry *dfu_catalog_find(const struct dfu_catalog *catalog, uint16_t idVendor,
+                                                 uint16_t idProduct, uint16_t bcdDevice);
+const struct dfu_catalog_entry *dfu_catalog_select(struct dfu_catalog *catalog, uint16_t idVendor,
+                                                   uint16_t idProduct, uint16_t bcdDevice, bool *changed);
+int dfu_catalog_save(struct dfu_catalog *catalog);
+void dfu_catalog_close(struct dfu_catalog *catalog);
+
+#endif /* defined(__dfu_util__dfu_catalog__) */
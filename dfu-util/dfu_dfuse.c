@@ -0,0 +1,541 @@
+/*
+ *  DfuSe memory layouts, erase planning and download
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <ctype.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dfu_dfuse.h"
+
+#define DFUSE_MAX_SECTORS       65536
+
+static int compare_sectors(const void *a, const void *b)
+{
+    const struct dfu_sector *left = a, *right = b;
+    
+    return left->address < right->address ? -1 : left->address > right->address;
+}
+
+/*
+ *  Parse the memory layout a DfuSe device reports as interface string
+ *
+ *    @<name>/<address>/<count>*<size><unit><type>[,...][/<address>/...]
+ *
+ *  unit is ' ', 'B', 'K' or 'M', type 'a' .. 'g' the readable (1),
+ *  erasable (2) and writeable (4) bits plus one.
+ *
+ *  layout      - receives the sectors
+ *  description - layout string
+ *
+ *  returns true on success
+ */
+bool dfu_layout_parse(struct dfu_layout *layout, const char *description)
+{
+    const char *p = description;
+    char *end;
+    int capacity = 0;
+    
+    memset(layout, 0, sizeof(*layout));
+    
+    if (*p++ != '@')
+    {
+        warnx("Not a DfuSe memory layout: %s", description);
+        return false;
+    }
+    
+    const char *slash = strchr(p, '/');
+    size_t length = slash != NULL ? (size_t)(slash - p) : strlen(p);
+    
+    while (length > 0 && isspace((unsigned char)p[length - 1]))
+        length--;
+    
+    if (length >= sizeof(layout->name))
+        length = sizeof(layout->name) - 1;
+    
+    memcpy(layout->name, p, length);
+    p = slash;
+    
+    while (p != NULL && *p == '/')
+    {
+        uint32_t address = strtoul(p + 1, &end, 0);
+        
+        if (end == p + 1 || *end != '/')
+            goto error;
+        
+        p = end + 1;
+        
+        for (;;)
+        {
+            unsigned long count = strtoul(p, &end, 10);
+            
+            if (end == p || *end != '*')
+                goto error;
+            
+            p = end + 1;
+            
+            unsigned long size = strtoul(p, &end, 10);
+            
+            if (end == p)
+                goto error;
+            
+            p = end;
+            
+            if (*p == 'K')
+                size *= 1024;
+            else if (*p == 'M')
+                size *= 1024 * 1024;
+            else if (*p != ' ' && *p != 'B')
+                goto error;
+            
+            p++;
+            
+            if (*p < 'a' || *p > 'g' || size == 0 || layout->count + count > DFUSE_MAX_SECTORS)
+                goto error;
+            
+            if (layout->count + (int)count > capacity)
+            {
+                capacity = (layout->count + count) * 2;
+                
+                struct dfu_sector *sectors = realloc(layout->sectors, capacity * sizeof(*sectors));
+                
+                if (sectors == NULL)
+                    goto error;
+                
+                layout->sectors = sectors;
+            }
+            
+            for (unsigned long i = 0; i < count; i++, address += size)
+            {
+                struct dfu_sector *sector = &layout->sectors[layout->count++];
+                
+                sector->address = address;
+                sector->size = size;
+                sector->attributes = *p - 'a' + 1;
+            }
+            
+            if (*++p != ',')
+                break;
+            
+            p++;
+        }
+    }
+    
+    if (layout->count == 0)
+        goto error;
+    
+    qsort(layout->sectors, layout->count, sizeof(*layout->sectors), compare_sectors);
+    
+    return true;
+    
+error:
+    warnx("Invalid DfuSe memory layout: %s", description);
+    dfu_layout_free(layout);
+    
+    return false;
+}
+
+void dfu_layout_free(struct dfu_layout *layout)
+{
+    free(layout->sectors);
+    
+    layout->sectors = NULL;
+    layout->count = 0;
+}
+
+void dfu_erase_timing_init(struct dfu_erase_timing *timing)
+{
+    timing->sector_us = DFUSE_ERASE_SECTOR_US;
+    timing->us_per_kb = DFUSE_ERASE_US_PER_KB;
+    timing->mass_us_per_kb = DFUSE_MASS_US_PER_KB;
+}
+
+static bool dfu_dfuse_plan_add(struct dfu_dfuse_plan *plan, enum dfu_dfuse_op op,
+                               uint32_t address, uint32_t length, const uint8_t *data)
+{
+    if (plan->count == plan->capacity)
+    {
+        int capacity = plan->capacity ? plan->capacity * 2 : 64;
+        struct dfu_dfuse_step *steps = realloc(plan->steps, capacity * sizeof(*steps));
+        
+        if (steps == NULL)
+            return false;
+        
+        plan->steps = steps;
+        plan->capacity = capacity;
+    }
+    
+    struct dfu_dfuse_step *step = &plan->steps[plan->count++];
+    
+    step->op = op;
+    step->address = address;
+    step->length = length;
+    step->data = data;
+    
+    return true;
+}
+
+/*
+ *  Plan the erases and writes of an image, each page is erased at most
+ *  once and written in blocks that start at its boundary
+ *
+ *  plan      - receives the steps
+ *  layout    - memory layout of the device
+ *  image     - sorted, non overlapping address ranges
+ *  timing    - erase time estimates
+ *  mode      - DFU_ERASE_AUTO picks the faster of mass and page erase
+ *
+ *  returns false if the image does not fit writeable sectors
+ */
+bool dfu_dfuse_plan_build(struct dfu_dfuse_plan *plan, const struct dfu_layout *layout,
+                          const struct dfu_image *image, const struct dfu_erase_timing *timing,
+                          enum dfu_erase_mode mode)
+{
+    int sector = 0;
+    int last = -1;
+    uint64_t erasable = 0;
+    uint64_t covered = 0;
+    int i;
+    
+    memset(plan, 0, sizeof(*plan));
+    
+    for (i = 0; i < layout->count; i++)
+        if (layout->sectors[i].attributes & DFUSE_SECTOR_ERASABLE)
+            erasable += layout->sectors[i].size;
+    
+    // One mass erase command, charged like a sector
+    plan->mass_erase_us = timing->sector_us + erasable * timing->mass_us_per_kb / 1024;
+    
+    for (i = 0; i < image->count; i++)
+    {
+        const struct dfu_range *range = &image->ranges[i];
+        uint64_t position = range->address;
+        uint64_t end = position + range->length;
+        
+        while (position < end)
+        {
+            while (sector < layout->count &&
+                   (uint64_t)layout->sectors[sector].address + layout->sectors[sector].size <= position)
+                sector++;
+            
+            const struct dfu_sector *page = &layout->sectors[sector];
+            
+            if (sector == layout->count || page->address > position)
+            {
+                warnx("%s: 0x%08llx is outside of %s", image->name, (unsigned long long)position, layout->name);
+                goto error;
+            }
+            
+            if (!(page->attributes & DFUSE_SECTOR_WRITEABLE))
+            {
+                warnx("%s: 0x%08llx is in a read-only sector", image->name, (unsigned long long)position);
+                goto error;
+            }
+            
+            uint64_t piece = (uint64_t)page->address + page->size < end ? (uint64_t)page->address + page->size : end;
+            
+            if (sector != last)
+            {
+                last = sector;
+                plan->pages++;
+                
+                if (page->attributes & DFUSE_SECTOR_ERASABLE)
+                {
+                    covered += page->size;
+                    plan->page_erase_us += timing->sector_us + (uint64_t)page->size * timing->us_per_kb / 1024;
+                    
+                    if (!dfu_dfuse_plan_add(plan, DFUSE_OP_ERASE_PAGE, page->address, page->size, NULL))
+                        goto error;
+                }
+            }
+            
+            if (!dfu_dfuse_plan_add(plan, DFUSE_OP_WRITE, (uint32_t)position, (uint32_t)(piece - position),
+                                    range->data + (position - range->address)))
+                goto error;
+            
+            plan->bytes += piece - position;
+            position = piece;
+        }
+    }
+    
+    plan->partial = covered < erasable;
+    
+    // Data in sectors the image does not cover is only given up when asked for
+    plan->mass_erase = mode == DFU_ERASE_MASS ||
+                       (mode == DFU_ERASE_AUTO && !plan->partial && plan->mass_erase_us < plan->page_erase_us);
+    
+    if (plan->mass_erase)
+    {
+        int kept = 1;
+        
+        // Drop the page erases, the mass erase goes first
+        if (!dfu_dfuse_plan_add(plan, DFUSE_OP_MASS_ERASE, 0, 0, NULL))
+            goto error;
+        
+        struct dfu_dfuse_step mass = plan->steps[plan->count - 1];
+        
+        for (i = plan->count - 2; i >= 0; i--)
+            plan->steps[i + 1] = plan->steps[i];
+        
+        plan->steps[0] = mass;
+        
+        for (i = 1; i < plan->count; i++)
+            if (plan->steps[i].op != DFUSE_OP_ERASE_PAGE)
+                plan->steps[kept++] = plan->steps[i];
+        
+        plan->count = kept;
+    }
+    
+    return true;
+    
+error:
+    dfu_dfuse_plan_free(plan);
+    
+    return false;
+}
+
+/*
+ *  Leave a page out of a page erase plan, e.g. because it already holds
+ *  the data
+ *
+ *  plan      - plan without mass erase
+ *  page      - sector to leave alone
+ *  timing    - timing the plan was built with
+ */
+void dfu_dfuse_plan_drop(struct dfu_dfuse_plan *plan, const struct dfu_sector *page,
+                         const struct dfu_erase_timing *timing)
+{
+    int kept = 0;
+    bool dropped = false;
+    
+    for (int i = 0; i < plan->count; i++)
+    {
+        const struct dfu_dfuse_step *step = &plan->steps[i];
+        
+        if (step->op == DFUSE_OP_MASS_ERASE || step->address < page->address ||
+            step->address - page->address >= page->size)
+        {
+            plan->steps[kept++] = *step;
+            continue;
+        }
+        
+        dropped = true;
+        
+        if (step->op == DFUSE_OP_ERASE_PAGE)
+            plan->page_erase_us -= timing->sector_us + (uint64_t)page->size * timing->us_per_kb / 1024;
+        else
+            plan->bytes -= step->length;
+    }
+    
+    plan->count = kept;
+    
+    if (dropped)
+        plan->pages--;
+}
+
+/*
+ *  Print the chosen erase strategy and, if asked, every step
+ */
+void dfu_dfuse_plan_print(const struct dfu_dfuse_plan *plan, bool steps)
+{
+    printf("[i] DfuSe plan: %u bytes in %d pages, %s erase (%.1f s) instead of %s erase (%.1f s).\n",
+           plan->bytes, plan->pages,
+           plan->mass_erase ? "mass" : "page", (plan->mass_erase ? plan->mass_erase_us : plan->page_erase_us) / 1e6,
+           plan->mass_erase ? "page" : "mass", (plan->mass_erase ? plan->page_erase_us : plan->mass_erase_us) / 1e6);
+    
+    if (!plan->mass_erase && plan->partial && plan->mass_erase_us < plan->page_erase_us)
+        printf("[i] A mass erase would clear sectors outside of the image, --erase mass to allow it.\n");
+    
+    for (int i = 0; steps && i < plan->count; i++)
+    {
+        const struct dfu_dfuse_step *step = &plan->steps[i];
+        
+        if (step->op == DFUSE_OP_MASS_ERASE)
+            printf("    mass erase\n");
+        else if (step->op == DFUSE_OP_ERASE_PAGE)
+            printf("    erase 0x%08x (%u bytes)\n", step->address, step->length);
+        else
+            printf("    write 0x%08x (%u bytes)\n", step->address, step->length);
+    }
+}
+
+void dfu_dfuse_plan_free(struct dfu_dfuse_plan *plan)
+{
+    free(plan->steps);
+    
+    memset(plan, 0, sizeof(*plan));
+}
+
+/*
+ *  Poll until the device has executed the last DFU_DNLOAD
+ */
+static IOReturn dfu_dfuse_wait(struct dfu_if *dif)
+{
+    struct dfu_status status;
+    
+    for (int poll = 0; poll < DFUSE_MAX_POLLS; poll++)
+    {
+        IOReturn result = dfu_get_status(dif, &status);
+        
+        if (result != kIOReturnSuccess)
+            return result;
+        
+        if (status.bStatus != DFU_STATUS_OK)
+        {
+            fprintf(stderr, "[!] DfuSe command failed (state %s, status %s).\n",
+                    dfu_state_to_string(status.bState), dfu_status_to_string(status.bStatus));
+            return kIOReturnError;
+        }
+        
+        if (status.bState != STATE_DFU_DOWNLOAD_BUSY)
+            return kIOReturnSuccess;
+        
+        dfu_wait(dif, status.bwPollTimeout);
+    }
+    
+    return kIOReturnTimeout;
+}
+
+/*
+ *  Send a DfuSe command, DFU_DNLOAD with wValue 0
+ */
+static IOReturn dfu_dfuse_command(struct dfu_if *dif, unsigned char command, bool has_address, uint32_t address)
+{
+    unsigned char buffer[5] = { command, address & 0xff, (address >> 8) & 0xff, (address >> 16) & 0xff, address >> 24 };
+    IOReturn result = dfu_download(dif, has_address ? 5 : 1, 0, buffer);
+    
+    if (result != kIOReturnSuccess)
+        return result;
+    
+    return dfu_dfuse_wait(dif);
+}
+
+/*
+ *  Run a plan on a device in dfuIDLE
+ *
+ *  dif           - DFU interface
+ *  plan          - planned steps
+ *  transfer_size - wTransferSize of the device
+ *
+ *  returns IOReturn value
+ */
+IOReturn dfu_dfuse_execute(struct dfu_if *dif, const struct dfu_dfuse_plan *plan, unsigned short transfer_size)
+{
+    IOReturn result = kIOReturnSuccess;
+    uint32_t written = 0;
+    
+    for (int i = 0; i < plan->count && result == kIOReturnSuccess; i++)
+    {
+        const struct dfu_dfuse_step *step = &plan->steps[i];
+        
+        switch (step->op)
+        {
+            case DFUSE_OP_MASS_ERASE:
+                printf("[i] Mass erase.\n");
+                result = dfu_dfuse_command(dif, DFUSE_ERASE, false, 0);
+                break;
+            case DFUSE_OP_ERASE_PAGE:
+                result = dfu_dfuse_command(dif, DFUSE_ERASE, true, step->address);
+                break;
+            case DFUSE_OP_WRITE:
+                result = dfu_dfuse_command(dif, DFUSE_SET_ADDRESS, true, step->address);
+            
+                // Block n goes to address + (n - 2) * transfer_size
+                for (uint32_t offset = 0; offset < step->length && result == kIOReturnSuccess; offset += transfer_size)
+                {
+                    uint32_t size = step->length - offset < transfer_size ? step->length - offset : transfer_size;
+                
+                    result = dfu_download(dif, size, 2 + offset / transfer_size, (unsigned char *)step->data + offset);
+                
+                    if (result == kIOReturnSuccess)
+                        result = dfu_dfuse_wait(dif);
+                }
+            
+                written += step->length;
+            
+                if (result == kIOReturnSuccess)
+                    printf("[i] Written 0x%08x (%u bytes) - %u / %u bytes.\n", step->address, step->length, written, plan->bytes);
+                break;
+        }
+    }
+    
+    return result;
+}
+
+/*
+ *  Read memory of a device in dfuIDLE, the device is back in dfuIDLE after
+ *
+ *  dif       - DFU interface
+ *  address   - start address
+ *  data      - receives the bytes
+ *  length    - bytes to read, wTransferSize at most
+ *
+ *  returns IOReturn value, kIOReturnUnderrun if fewer bytes came back
+ */
+IOReturn dfu_dfuse_read(struct dfu_if *dif, uint32_t address, uint8_t *data, unsigned short length)
+{
+    unsigned short received = 0;
+    IOReturn result = dfu_dfuse_command(dif, DFUSE_SET_ADDRESS, true, address);
+    
+    // Uploads start from dfuIDLE
+    if (result == kIOReturnSuccess)
+        result = dfu_abort(dif);
+    
+    // Block 2 is the address pointer
+    if (result == kIOReturnSuccess)
+        result = dfu_upload(dif, length, 2, data, &received);
+    
+    if (result == kIOReturnSuccess)
+        result = dfu_abort(dif);
+    
+    if (result == kIOReturnSuccess && received != length)
+        result = kIOReturnUnderrun;
+    
+    return result;
+}
+
+/*
+ *  Leave DfuSe mode and start the firmware at an address
+ *
+ *  dif       - DFU interface
+ *  address   - start address, usually the vector table
+ *
+ *  returns IOReturn value
+ */
+IOReturn dfu_dfuse_leave(struct dfu_if *dif, uint32_t address)
+{
+    struct dfu_status status;
+    IOReturn result = dfu_dfuse_command(dif, DFUSE_SET_ADDRESS, true, address);
+    
+    if (result != kIOReturnSuccess)
+        return result;
+    
+    result = dfu_download(dif, 0, 2, NULL);
+    
+    if (result != kIOReturnSuccess)
+        return result;
+    
+    // The device may be gone before it answers
+    dfu_get_status(dif, &status);
+    
+    return kIOReturnSuccess;
+}
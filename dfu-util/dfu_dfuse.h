@@ -0,0 +1,126 @@
+/*
+ *  DfuSe memory layouts, erase planning and download
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef __dfu_util__dfu_dfuse__
+#define __dfu_util__dfu_dfuse__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dfu.h"
+#include "dfu_image.h"
+
+#define DFUSE_SET_ADDRESS       0x21
+#define DFUSE_ERASE             0x41
+#define DFUSE_MAX_POLLS         10000 /* DFU_GETSTATUS per command, a mass erase takes seconds */
+
+#define DFUSE_SECTOR_READABLE   0x01
+#define DFUSE_SECTOR_ERASABLE   0x02
+#define DFUSE_SECTOR_WRITEABLE  0x04
+
+/* Sector erase time is a fixed cost plus a cost per KiB, STM32F4 class flash */
+#define DFUSE_ERASE_SECTOR_US   100000
+#define DFUSE_ERASE_US_PER_KB   7800
+#define DFUSE_MASS_US_PER_KB    7800
+
+struct dfu_sector
+{
+    uint32_t address;
+    uint32_t size;
+    uint8_t attributes;
+};
+
+/* Parsed memory layout string, e.g. "@Internal Flash /0x08000000/04*016Kg,01*064Kg" */
+struct dfu_layout
+{
+    char name[64];
+    /* Sorted by address */
+    struct dfu_sector *sectors;
+    int count;
+};
+
+enum dfu_erase_mode
+{
+    DFU_ERASE_AUTO,
+    DFU_ERASE_MASS,
+    DFU_ERASE_PAGE
+};
+
+struct dfu_erase_timing
+{
+    uint32_t sector_us;
+    uint32_t us_per_kb;
+    uint32_t mass_us_per_kb;
+};
+
+enum dfu_dfuse_op
+{
+    DFUSE_OP_MASS_ERASE,
+    DFUSE_OP_ERASE_PAGE,
+    DFUSE_OP_WRITE
+};
+
+/* A write starts with a set address pointer, its blocks never leave the page */
+struct dfu_dfuse_step
+{
+    enum dfu_dfuse_op op;
+    uint32_t address;
+    uint32_t length;
+    const uint8_t *data;
+};
+
+/*
+ *  Every touched page is erased once, right before its data is written,
+ *  so programming starts after the first erase instead of after all of
+ *  them. A mass erase, if cheaper, comes first; it is only picked on its
+ *  own when the image covers every erasable sector, since it also clears
+ *  sectors the image leaves alone (calibration, EEPROM emulation).
+ */
+struct dfu_dfuse_plan
+{
+    struct dfu_dfuse_step *steps;
+    int count;
+    int capacity;
+    bool mass_erase;
+    int pages;
+    uint32_t bytes;
+    /* Erasable sectors outside of the image, a mass erase would clear them */
+    bool partial;
+    /* Estimated erase time of both strategies */
+    uint64_t page_erase_us;
+    uint64_t mass_erase_us;
+};
+
+bool dfu_layout_parse(struct dfu_layout *layout, const char *description);
+void dfu_layout_free(struct dfu_layout *layout);
+void dfu_erase_timing_init(struct dfu_erase_timing *timing);
+bool dfu_dfuse_plan_build(struct dfu_dfuse_plan *plan, const struct dfu_layout *layout,
+                          const struct dfu_image *image, const struct dfu_erase_timing *timing,
+                          enum dfu_erase_mode mode);
+void dfu_dfuse_plan_drop(struct dfu_dfuse_plan *plan, const struct dfu_sector *page,
+                         const struct dfu_erase_timing *timing);
+void dfu_dfuse_plan_print(const struct dfu_dfuse_plan *plan, bool steps);
+void dfu_dfuse_plan_free(struct dfu_dfuse_plan *plan);
+IOReturn dfu_dfuse_execute(struct dfu_if *dif, const struct dfu_dfuse_plan *plan, unsigned short transfer_size);
+IOReturn dfu_dfuse_read(struct dfu_if *dif, uint32_t address, uint8_t *data, unsigned short length);
+IOReturn dfu_dfuse_leave(struct dfu_if *dif, uint32_t address);
+
+#endif /* defined(__dfu_util__dfu_dfuse__) */
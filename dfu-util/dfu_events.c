@@ -0,0 +1,331 @@
+/*
+ *  Machine readable event stream
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dfu_events.h"
+#include "dfu_metrics.h"
+
+#define DFU_EVENT_LINE      512
+
+static const char *dfu_event_names[] =
+{
+    "device", "state", "block", "progress", "error", "done"
+};
+
+/* Append a JSON string, the texts are constants but may still hold quotes */
+static int dfu_event_string(char *line, size_t size, const char *text)
+{
+    size_t length = 0;
+    
+    if (length < size)
+        line[length++] = '"';
+    
+    for (; *text != '\0' && length + 2 < size; text++)
+    {
+        if (*text == '"' || *text == '\\')
+            line[length++] = '\\';
+        
+        line[length++] = (unsigned char)*text < 0x20 ? ' ' : *text;
+    }
+    
+    if (length < size)
+        line[length++] = '"';
+    
+    return (int)length;
+}
+
+/*
+ *  Format one event as a line of JSON
+ *
+ *  events    - stream the event was posted to
+ *  event     - event to format
+ *  line      - receives the line including its newline
+ *  size      - size of line
+ *
+ *  returns length of the line
+ */
+static int dfu_event_format(const struct dfu_events *events, const struct dfu_event *event, char *line, size_t size)
+{
+    int length = snprintf(line, size, "{\"event\":\"%s\",\"time\":%.6f,\"device\":\"%04x:%04x\"",
+                          dfu_event_names[event->type], (event->time_us - events->epoch) / 1000000.0,
+                          event->idVendor, event->idProduct);
+    
+    switch (event->type)
+    {
+        case DFU_EVENT_DEVICE:
+            length += snprintf(line + length, size - length, ",\"location\":\"0x%08x\"", event->location);
+            break;
+        case DFU_EVENT_BLOCK:
+            length += snprintf(line + length, size - length, ",\"transaction\":%u,\"size\":%d,\"sent\":%d,\"total\":%d",
+                               event->transaction, event->size, event->sent, event->total);
+            break;
+        case DFU_EVENT_PROGRESS:
+            length += snprintf(line + length, size - length,
+                               ",\"sent\":%d,\"total\":%d,\"bytes_per_second\":%llu,\"eta\":%.3f",
+                               event->sent, event->total, (unsigned long long)event->bytes_per_second,
+                               event->eta_us / 1000000.0);
+            break;
+        case DFU_EVENT_DONE:
+            length += snprintf(line + length, size - length,
+                               ",\"result\":\"%s\",\"sent\":%d,\"total\":%d,\"elapsed\":%.3f,\"bytes_per_second\":%llu,\"dropped\":%llu",
+                               event->result == kIOReturnSuccess ? "ok" : "error", event->sent, event->total,
+                               event->elapsed_us / 1000000.0, (unsigned long long)event->bytes_per_second,
+                               (unsigned long long)events->dropped);
+            break;
+        case DFU_EVENT_ERROR:
+            length += snprintf(line + length, size - length, ",\"result\":\"0x%08x\",\"message\":", event->result);
+            length += dfu_event_string(line + length, size - length, event->message != NULL ? event->message : "");
+            // Fall through to the state
+        case DFU_EVENT_STATE:
+            if (event->has_status)
+            {
+                length += snprintf(line + length, size - length, ",\"state\":\"%s\",\"status\":%u,\"status_text\":",
+                                   dfu_state_to_string(event->state), event->status);
+                length += dfu_event_string(line + length, size - length, dfu_status_to_string(event->status));
+            }
+            break;
+    }
+    
+    length += snprintf(line + length, size - length, "}\n");
+    
+    return length < (int)size ? length : (int)size - 1;
+}
+
+static bool dfu_events_write(struct dfu_events *events, const char *buffer, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = write(events->fd, buffer, length);
+        
+        if (written < 0 && errno == EINTR)
+            continue;
+        
+        if (written <= 0)
+            return false;
+        
+        buffer += written;
+        length -= written;
+    }
+    
+    return true;
+}
+
+static void *dfu_events_writer(void *context)
+{
+    struct dfu_events *events = context;
+    struct dfu_event batch[DFU_EVENTS_BATCH];
+    char *buffer = malloc(DFU_EVENTS_BATCH * DFU_EVENT_LINE);
+    
+    for (;;)
+    {
+        pthread_mutex_lock(&events->lock);
+        
+        while (events->head == events->tail && !events->closing)
+            pthread_cond_wait(&events->wake, &events->lock);
+        
+        unsigned int count = events->head - events->tail;
+        
+        if (count == 0)
+        {
+            pthread_mutex_unlock(&events->lock);
+            break;
+        }
+        
+        if (count > DFU_EVENTS_BATCH)
+            count = DFU_EVENTS_BATCH;
+        
+        for (unsigned int i = 0; i < count; i++)
+            batch[i] = events->ring[(events->tail + i) % DFU_EVENTS_CAPACITY];
+        
+        events->tail += count;
+        
+        // Producers waiting for room
+        pthread_cond_broadcast(&events->wake);
+        pthread_mutex_unlock(&events->lock);
+        
+        // Formatting and the system call happen outside the lock
+        size_t length = 0;
+        
+        for (unsigned int i = 0; buffer != NULL && i < count; i++)
+            length += dfu_event_format(events, &batch[i], buffer + length, DFU_EVENT_LINE);
+        
+        if (!events->broken && (buffer == NULL || !dfu_events_write(events, buffer, length)))
+        {
+            fprintf(stderr, "[!] Event stream closed: %s.\n", buffer == NULL ? "out of memory" : strerror(errno));
+            events->broken = true;
+        }
+        
+        if (!events->broken)
+            events->written += count;
+    }
+    
+    free(buffer);
+    
+    return NULL;
+}
+
+/*
+ *  Start streaming events to a file descriptor
+ *
+ *  events    - stream to initialize
+ *  fd        - open for writing, not closed by the stream
+ *
+ *  returns 0 or -1 on error
+ */
+int dfu_events_open(struct dfu_events *events, int fd)
+{
+    memset(events, 0, sizeof(*events));
+    
+    events->fd = fd;
+    events->epoch = dfu_time_us();
+    events->ring = calloc(DFU_EVENTS_CAPACITY, sizeof(*events->ring));
+    
+    if (events->ring == NULL)
+        return -1;
+    
+    pthread_mutex_init(&events->lock, NULL);
+    pthread_cond_init(&events->wake, NULL);
+    
+    if (pthread_create(&events->writer, NULL, dfu_events_writer, events) != 0)
+    {
+        pthread_cond_destroy(&events->wake);
+        pthread_mutex_destroy(&events->lock);
+        free(events->ring);
+        events->ring = NULL;
+        return -1;
+    }
+    
+    return 0;
+}
+
+/*
+ *  Queue an event, stamped with the current time
+ *
+ *  events    - open stream
+ *  event     - event to copy
+ */
+void dfu_events_post(struct dfu_events *events, struct dfu_event *event)
+{
+    // Block and progress events are frequent and superseded by the next one
+    bool droppable = event->type == DFU_EVENT_BLOCK || event->type == DFU_EVENT_PROGRESS;
+    
+    event->time_us = dfu_time_us();
+    
+    pthread_mutex_lock(&events->lock);
+    
+    while (!droppable && events->head - events->tail == DFU_EVENTS_CAPACITY)
+        pthread_cond_wait(&events->wake, &events->lock);
+    
+    if (events->head - events->tail < DFU_EVENTS_CAPACITY)
+    {
+        events->ring[events->head % DFU_EVENTS_CAPACITY] = *event;
+        events->head++;
+        
+        pthread_cond_broadcast(&events->wake);
+    }
+    else
+        events->dropped++;
+    
+    pthread_mutex_unlock(&events->lock);
+}
+
+/*
+ *  Write the queued events and stop the writer
+ *
+ *  events    - open stream
+ *
+ *  returns 0 or -1 if events could not be written
+ */
+int dfu_events_close(struct dfu_events *events)
+{
+    if (events->ring == NULL)
+        return -1;
+    
+    pthread_mutex_lock(&events->lock);
+    events->closing = true;
+    pthread_cond_broadcast(&events->wake);
+    pthread_mutex_unlock(&events->lock);
+    
+    pthread_join(events->writer, NULL);
+    
+    pthread_cond_destroy(&events->wake);
+    pthread_mutex_destroy(&events->lock);
+    free(events->ring);
+    events->ring = NULL;
+    
+    return events->broken ? -1 : 0;
+}
+
+/*
+ *  Start measuring a transfer
+ *
+ *  meter     - meter to reset
+ */
+void dfu_event_meter_start(struct dfu_event_meter *meter)
+{
+    meter->started = dfu_time_us();
+    meter->last = 0;
+}
+
+/*
+ *  Check whether the next progress report of a transfer is due and fill in
+ *  its rate and remaining time
+ *
+ *  meter       - started meter
+ *  sent        - bytes acknowledged so far
+ *  total       - bytes of the transfer
+ *  interval_ms - time between reports, the last block is always reported
+ *  event       - receives sent, total, rate, elapsed time and ETA
+ *
+ *  returns true if a report is due
+ */
+bool dfu_event_meter_due(struct dfu_event_meter *meter, int sent, int total, unsigned int interval_ms,
+                         struct dfu_event *event)
+{
+    uint64_t now = dfu_time_us();
+    
+    if (sent < total && meter->last != 0 && now - meter->last < interval_ms * 1000ULL)
+        return false;
+    
+    // The first block only starts the clock, a rate from it would be noise
+    if (meter->last == 0 && sent < total)
+    {
+        meter->last = now;
+        return false;
+    }
+    
+    meter->last = now;
+    
+    uint64_t elapsed = now - meter->started;
+    
+    event->sent = sent;
+    event->total = total;
+    event->elapsed_us = elapsed;
+    event->bytes_per_second = elapsed > 0 ? (uint64_t)sent * 1000000 / elapsed : 0;
+    event->eta_us = sent > 0 && sent < total ? (uint64_t)(total - sent) * elapsed / sent : 0;
+    
+    return true;
+}
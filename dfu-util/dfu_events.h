@@ -0,0 +1,113 @@
+/*
+ *  Machine readable event stream
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef __dfu_util__dfu_events__
+#define __dfu_util__dfu_events__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dfu.h"
+
+#define DFU_EVENTS_CAPACITY         1024  /* events buffered for the writer */
+#define DFU_EVENTS_BATCH            64    /* events formatted per write() */
+#define DFU_EVENTS_PROGRESS_MS      250   /* between progress events of a transfer */
+#define DFU_EVENTS_SUMMARY_MS       1000  /* between console summaries while events are streamed */
+
+enum dfu_event_type
+{
+    DFU_EVENT_DEVICE,
+    DFU_EVENT_STATE,
+    DFU_EVENT_BLOCK,
+    DFU_EVENT_PROGRESS,
+    DFU_EVENT_ERROR,
+    DFU_EVENT_DONE
+};
+
+/* One line of the stream, fields not used by the type are ignored */
+struct dfu_event
+{
+    enum dfu_event_type type;
+    /* dfu_time_us(), set by dfu_events_post() */
+    uint64_t time_us;
+    unsigned short idVendor;
+    unsigned short idProduct;
+    uint32_t location;
+    /* State and error, has_status is false when no status was read */
+    bool has_status;
+    unsigned char state;
+    unsigned char status;
+    IOReturn result;
+    /* wValue and size of an acknowledged block */
+    unsigned short transaction;
+    int size;
+    /* Bytes acknowledged out of total */
+    int sent;
+    int total;
+    /* Progress and done */
+    uint64_t bytes_per_second;
+    uint64_t eta_us;
+    uint64_t elapsed_us;
+    /* Error description, a string constant */
+    const char *message;
+};
+
+/* Rate of one transfer, spaces its progress reports */
+struct dfu_event_meter
+{
+    uint64_t started;
+    uint64_t last;
+};
+
+/*
+ *  NDJSON events written to a file descriptor by their own thread. Posting
+ *  copies the event into a bounded ring, block and progress events are
+ *  dropped rather than holding up the transfer when the reader falls
+ *  behind.
+ */
+struct dfu_events
+{
+    int fd;
+    pthread_mutex_t lock;
+    /* Signalled when events are posted and when the writer made room */
+    pthread_cond_t wake;
+    pthread_t writer;
+    struct dfu_event *ring;
+    /* Free running, head - tail events are queued */
+    unsigned int head;
+    unsigned int tail;
+    bool closing;
+    /* A write failed, later events are discarded */
+    bool broken;
+    uint64_t epoch;
+    uint64_t written;
+    uint64_t dropped;
+};
+
+int dfu_events_open(struct dfu_events *events, int fd);
+void dfu_events_post(struct dfu_events *events, struct dfu_event *event);
+int dfu_events_close(struct dfu_events *events);
+void dfu_event_meter_start(struct dfu_event_meter *meter);
+bool dfu_event_meter_due(struct dfu_event_meter *meter, int sent, int total, unsigned int interval_ms,
+                         struct dfu_event *event);
+
+#endif /* defined(__dfu_util__dfu_events__) */
@@ -29,12 +29,10 @@
 #include <time.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <sysexits.h>
 #include <err.h>
 
 #include "dfu_file.h"
 
-#define DFU_SUFFIX_LENGTH 16
 #define STDIN_CHUNK_SIZE 65536
 
 static const uint32_t crc32_table[] =
@@ -88,19 +86,186 @@ static uint32_t crc32_byte(uint32_t accum, uint8_t delta)
     return crc32_table[(accum ^ delta) & 0xff] ^ (accum >> 8);
 }
 
-void *dfu_malloc(size_t size)
+/*
+ *  Continue a DFU suffix CRC (no final inversion) over a buffer
+ *
+ *  crc       - running CRC, 0xffffffff to start
+ *  data      - bytes to add
+ *  length    - number of bytes
+ *
+ *  returns updated CRC
+ */
+uint32_t dfu_crc32(uint32_t crc, const uint8_t *data, size_t length)
+{
+    size_t i;
+    
+    for (i = 0; i < length; i++)
+        crc = crc32_byte(crc, data[i]);
+    
+    return crc;
+}
+
+/*
+ *  Take bytes back out of the end of a DFU suffix CRC. Every table entry
+ *  has a distinct top byte, which identifies the entry each step used.
+ *
+ *  crc       - CRC after the bytes
+ *  data      - the last bytes that went into the CRC
+ *  length    - number of bytes to remove
+ *
+ *  returns CRC before the bytes
+ */
+uint32_t dfu_crc32_unwind(uint32_t crc, const uint8_t *data, size_t length)
+{
+    while (length-- > 0)
+    {
+        int index;
+        
+        for (index = 0; index < 256; index++)
+            if ((crc32_table[index] >> 24) == (crc >> 24))
+                break;
+        
+        crc = ((crc ^ crc32_table[index]) << 8) | (index ^ data[length]);
+    }
+    
+    return crc;
+}
+
+static uint32_t gf2_matrix_times(const uint32_t *matrix, uint32_t vector)
+{
+    uint32_t sum = 0;
+    
+    for (; vector != 0; vector >>= 1, matrix++)
+        if (vector & 1)
+            sum ^= *matrix;
+    
+    return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *matrix)
+{
+    for (int n = 0; n < 32; n++)
+        square[n] = gf2_matrix_times(matrix, matrix[n]);
+}
+
+/*
+ *  Continue a CRC over zero bytes without reading them, in O(log length).
+ *  With the CRC being linear, the CRC of an image with a changed range is
+ *  the old CRC xor the CRC of the changed bits started at 0 and continued
+ *  over the bytes behind the range.
+ *
+ *  crc       - running CRC
+ *  length    - number of zero bytes
+ *
+ *  returns updated CRC
+ */
+uint32_t dfu_crc32_zeros(uint32_t crc, size_t length)
+{
+    uint32_t even[32], odd[32];
+    uint32_t row = 1;
+    
+    if (length == 0)
+        return crc;
+    
+    // Operator for one zero bit, then squared to two and four bits
+    odd[0] = 0xedb88320;
+    
+    for (int n = 1; n < 32; n++, row <<= 1)
+        odd[n] = row;
+    
+    gf2_matrix_square(even, odd);
+    gf2_matrix_square(odd, even);
+    
+    // Apply the operators for one byte, two bytes, four bytes ... as set in length
+    do
+    {
+        gf2_matrix_square(even, odd);
+        
+        if (length & 1)
+            crc = gf2_matrix_times(even, crc);
+        
+        length >>= 1;
+        
+        if (length == 0)
+            break;
+        
+        gf2_matrix_square(odd, even);
+        
+        if (length & 1)
+            crc = gf2_matrix_times(odd, crc);
+        
+        length >>= 1;
+    } while (length != 0);
+    
+    return crc;
+}
+
+/*
+ *  Fill in a DFU suffix behind an image
+ *
+ *  suffix    - DFU_SUFFIX_LENGTH bytes following the image
+ *  crc       - dfu_crc32() of the image, started at 0xffffffff
+ *  idVendor  - vendor id, 0xffff matches any device
+ *  idProduct - product id, 0xffff matches any device
+ *  bcdDevice - device release, 0xffff matches any release
+ *  bcdDFU    - DFU specification release, DFU_SUFFIX_BCD_DFU
+ */
+void dfu_suffix_build(uint8_t *suffix, uint32_t crc, uint16_t idVendor, uint16_t idProduct,
+                      uint16_t bcdDevice, uint16_t bcdDFU)
+{
+    suffix[0] = bcdDevice & 0xff;
+    suffix[1] = bcdDevice >> 8;
+    suffix[2] = idProduct & 0xff;
+    suffix[3] = idProduct >> 8;
+    suffix[4] = idVendor & 0xff;
+    suffix[5] = idVendor >> 8;
+    suffix[6] = bcdDFU & 0xff;
+    suffix[7] = bcdDFU >> 8;
+    suffix[8] = 'U';
+    suffix[9] = 'F';
+    suffix[10] = 'D';
+    suffix[11] = DFU_SUFFIX_LENGTH;
+    
+    crc = dfu_crc32(crc, suffix, 12);
+    
+    suffix[12] = crc & 0xff;
+    suffix[13] = (crc >> 8) & 0xff;
+    suffix[14] = (crc >> 16) & 0xff;
+    suffix[15] = crc >> 24;
+}
+
+void *dfu_malloc(const struct dfu_allocator *allocator, size_t size)
+{
+    if (allocator == NULL)
+        return malloc(size);
+    
+    return allocator->alloc(allocator->context, size);
+}
+
+void dfu_free(const struct dfu_allocator *allocator, void *ptr)
 {
-    void *ptr = malloc(size);
     if (ptr == NULL)
-        errx(EX_SOFTWARE, "Cannot allocate memory of size %d bytes", (int)size);
-    return (ptr);
+        return;
+    
+    if (allocator == NULL)
+        free(ptr);
+    else
+        allocator->release(allocator->context, ptr);
 }
 
-void dfu_load_file(struct dfu_file *file, enum suffix_req check_suffix)
+/*
+ *  Load a firmware file into memory and parse its DFU suffix
+ *
+ *  file         - name and allocator set by the caller, firmware NULL or from
+ *                 a previous load, the rest is filled in
+ *  check_suffix - whether a suffix is required, optional or forbidden
+ *
+ *  returns DFU_FILE_OK or a negative dfu_file_error
+ */
+int dfu_load_file(struct dfu_file *file, enum suffix_req check_suffix)
 {
     off_t offset;
     int f;
-    int i;
     
     file->size.suffix = 0;
     
@@ -110,28 +275,49 @@ void dfu_load_file(struct dfu_file *file, enum suffix_req check_suffix)
     file->idProduct = 0xffff; /* wildcard value */
     file->bcdDevice = 0xffff; /* wildcard value */
     
-    free(file->firmware);
+    dfu_free_file(file);
     
     f = open(file->name, O_RDONLY);
     
     if (f < 0)
-        err(EX_IOERR, "Could not open file %s for reading", file->name);
+    {
+        warn("Could not open file %s for reading", file->name);
+        return DFU_FILE_ERROR_OPEN;
+    }
    
     offset = lseek(f, 0, SEEK_END);
         
     if ((int)offset < 0 || (int)offset != offset)
-        err(EX_IOERR, "[!] File size is too big");
+    {
+        warnx("[!] File size is too big");
+        close(f);
+        return DFU_FILE_ERROR_SIZE;
+    }
         
     if (lseek(f, 0, SEEK_SET) != 0)
-           err(EX_IOERR, "Could not seek to beginning");
+    {
+        warn("Could not seek to beginning");
+        close(f);
+        return DFU_FILE_ERROR_READ;
+    }
         
     file->size.total = offset;
-    file->firmware = dfu_malloc(file->size.total);
+    file->firmware = dfu_malloc(file->allocator, file->size.total);
+    
+    if (file->firmware == NULL)
+    {
+        warnx("Cannot allocate memory of size %d bytes", file->size.total);
+        close(f);
+        return DFU_FILE_ERROR_MEMORY;
+    }
         
     if (read(f, file->firmware, file->size.total) != file->size.total)
     {
-        err(EX_IOERR, "Could not read %d bytes from %s",
-            file->size.total, file->name);
+        warn("Could not read %d bytes from %s",
+             file->size.total, file->name);
+        close(f);
+        dfu_free_file(file);
+        return DFU_FILE_ERROR_READ;
     }
     
     close(f);
@@ -152,8 +338,7 @@ void dfu_load_file(struct dfu_file *file, enum suffix_req check_suffix)
         
         dfusuffix = file->firmware + file->size.total - DFU_SUFFIX_LENGTH;
         
-        for (i = 0; i < file->size.total - 4; i++)
-            crc = crc32_byte(crc, file->firmware[i]);
+        crc = dfu_crc32(crc, file->firmware, file->size.total - 4);
         
         if (dfusuffix[10] != 'D' ||
             dfusuffix[9]  != 'F' ||
@@ -185,14 +370,18 @@ void dfu_load_file(struct dfu_file *file, enum suffix_req check_suffix)
         
         if (file->size.suffix < DFU_SUFFIX_LENGTH)
         {
-            errx(EX_IOERR, "Unsupported DFU suffix length %d",
-                 file->size.suffix);
+            warnx("Unsupported DFU suffix length %d",
+                  file->size.suffix);
+            dfu_free_file(file);
+            return DFU_FILE_ERROR_SUFFIX_LENGTH;
         }
         
         if (file->size.suffix > file->size.total)
         {
-            errx(EX_IOERR, "Invalid DFU suffix length %d",
-                 file->size.suffix);
+            warnx("Invalid DFU suffix length %d",
+                  file->size.suffix);
+            dfu_free_file(file);
+            return DFU_FILE_ERROR_SUFFIX_LENGTH;
         }
         
         file->idVendor	= (dfusuffix[5] << 8) + dfusuffix[4];
@@ -205,7 +394,9 @@ void dfu_load_file(struct dfu_file *file, enum suffix_req check_suffix)
             if (check_suffix == NEEDS_SUFFIX)
             {
                 warnx("%s", reason);
-                errx(EX_IOERR, "Valid DFU suffix needed");
+                warnx("Valid DFU suffix needed");
+                dfu_free_file(file);
+                return DFU_FILE_ERROR_NO_SUFFIX;
             }
             else if (check_suffix == MAYBE_SUFFIX)
             {
@@ -218,10 +409,54 @@ void dfu_load_file(struct dfu_file *file, enum suffix_req check_suffix)
         {
             if (check_suffix == NO_SUFFIX)
             {
-                errx(EX_SOFTWARE, "Please remove existing DFU suffix before adding a new one.\n");
+                warnx("Please remove existing DFU suffix before adding a new one.");
+                dfu_free_file(file);
+                return DFU_FILE_ERROR_HAS_SUFFIX;
             }
         }
     }
+    
+    return DFU_FILE_OK;
+}
+
+/*
+ *  Release the firmware buffer of a file loaded by dfu_load_file()
+ */
+void dfu_free_file(struct dfu_file *file)
+{
+    dfu_free(file->allocator, file->firmware);
+    file->firmware = NULL;
+}
+
+const char *dfu_file_error_to_string(int error)
+{
+    switch (error)
+    {
+        case DFU_FILE_OK:
+            return "No error";
+        case DFU_FILE_ERROR_OPEN:
+            return "Could not open file";
+        case DFU_FILE_ERROR_SIZE:
+            return "File size is too big";
+        case DFU_FILE_ERROR_READ:
+            return "Could not read file";
+        case DFU_FILE_ERROR_MEMORY:
+            return "Cannot allocate memory";
+        case DFU_FILE_ERROR_NO_SUFFIX:
+            return "Valid DFU suffix needed";
+        case DFU_FILE_ERROR_SUFFIX_LENGTH:
+            return "Invalid DFU suffix length";
+        case DFU_FILE_ERROR_HAS_SUFFIX:
+            return "File already has a DFU suffix";
+        case DFU_FILE_ERROR_FORMAT:
+            return "Malformed image file";
+        case DFU_FILE_ERROR_CHECKSUM:
+            return "Record checksum mismatch";
+        case DFU_FILE_ERROR_OVERLAP:
+            return "Image segments overlap";
+        default:
+            return "Unknown";
+    }
 }
 
 void show_suffix_and_prefix(struct dfu_file *file)
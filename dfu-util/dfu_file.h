@@ -25,11 +25,40 @@
 #define __dfu_util__dfu_file__
 
 #include <stdint.h>
+#include <stddef.h>
+
+#define DFU_SUFFIX_LENGTH 16
+#define DFU_SUFFIX_BCD_DFU 0x0100
+
+/* Caller-provided memory allocator, NULL selects malloc() / free() */
+struct dfu_allocator
+{
+    void *(*alloc)(void *context, size_t size);
+    void (*release)(void *context, void *ptr);
+    void *context;
+};
+
+enum dfu_file_error
+{
+    DFU_FILE_OK = 0,
+    DFU_FILE_ERROR_OPEN = -1,
+    DFU_FILE_ERROR_SIZE = -2,
+    DFU_FILE_ERROR_READ = -3,
+    DFU_FILE_ERROR_MEMORY = -4,
+    DFU_FILE_ERROR_NO_SUFFIX = -5,
+    DFU_FILE_ERROR_SUFFIX_LENGTH = -6,
+    DFU_FILE_ERROR_HAS_SUFFIX = -7,
+    DFU_FILE_ERROR_FORMAT = -8,
+    DFU_FILE_ERROR_CHECKSUM = -9,
+    DFU_FILE_ERROR_OVERLAP = -10
+};
 
 struct dfu_file
 {
     /* File name */
     const char *name;
+    /* Allocator used for the firmware buffer */
+    const struct dfu_allocator *allocator;
     /* Pointer to file loaded into memory */
     uint8_t *firmware;
     /* Different sizes */
@@ -52,8 +81,16 @@ enum suffix_req {
     MAYBE_SUFFIX
 };
 
-void dfu_load_file(struct dfu_file *file, enum suffix_req check_suffix);
-void *dfu_malloc(size_t size);
+int dfu_load_file(struct dfu_file *file, enum suffix_req check_suffix);
+void dfu_free_file(struct dfu_file *file);
+void *dfu_malloc(const struct dfu_allocator *allocator, size_t size);
+void dfu_free(const struct dfu_allocator *allocator, void *ptr);
+uint32_t dfu_crc32(uint32_t crc, const uint8_t *data, size_t length);
+uint32_t dfu_crc32_unwind(uint32_t crc, const uint8_t *data, size_t length);
+uint32_t dfu_crc32_zeros(uint32_t crc, size_t length);
+void dfu_suffix_build(uint8_t *suffix, uint32_t crc, uint16_t idVendor, uint16_t idProduct,
+                      uint16_t bcdDevice, uint16_t bcdDFU);
+const char *dfu_file_error_to_string(int error);
 void show_suffix_and_prefix(struct dfu_file *file);
 
 #endif /* defined(__dfu_util__dfu_file__) */
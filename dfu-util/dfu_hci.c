@@ -0,0 +1,282 @@
+/*
+ *  Bluetooth HCI command transport
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <string.h>
+#include <unistd.h>
+
+#include "dfu_hci.h"
+#include "usb_device.h"
+
+/*
+ *  Initialize an HCI context without a transport
+ *
+ *  hci       - context to initialize
+ */
+void dfu_hci_init(struct dfu_hci *hci)
+{
+    memset(hci, 0, sizeof(*hci));
+    
+    hci->timeout = HCI_DEFAULT_TIMEOUT;
+    
+    // A controller accepts one command until it says otherwise
+    hci->credits = 1;
+}
+
+static IOReturn dfu_hci_usb_command(void *context, const uint8_t *packet, int length)
+{
+    struct dfu_hci *hci = context;
+    IOUSBDevRequestTO request;
+    
+    request.bmRequestType = USBmakebmRequestType(kUSBOut, kUSBClass, kUSBDevice);
+    request.bRequest = 0;
+    request.wValue = 0;
+    request.wIndex = 0;
+    request.wLength = length;
+    request.pData = (void *)packet;
+    request.wLenDone = 0;
+    request.noDataTimeout = hci->timeout;
+    request.completionTimeout = hci->timeout;
+    
+    return (*hci->device)->DeviceRequestTO(hci->device, &request);
+}
+
+static IOReturn dfu_hci_usb_event(void *context, uint8_t *buffer, int size, int *received, unsigned int timeout)
+{
+    struct dfu_hci *hci = context;
+    UInt32 length = size;
+    
+    IOReturn result = (*hci->interface)->ReadPipeTO(hci->interface, hci->pipe, buffer, &length, timeout, timeout);
+    
+    // A stalled interrupt pipe would fail every later read as well
+    if (result == kIOUSBPipeStalled)
+        (*hci->interface)->ClearPipeStallBothEnds(hci->interface, hci->pipe);
+    
+    *received = result == kIOReturnSuccess ? (int)length : 0;
+    
+    return result;
+}
+
+/*
+ *  Open the HCI interface of a Bluetooth controller and find the
+ *  interrupt endpoint its events arrive on
+ *
+ *  hci       - initialized context
+ *  device    - opened USB device
+ *
+ *  returns IOReturn value
+ */
+IOReturn dfu_hci_open_usb(struct dfu_hci *hci, IOUSBDeviceInterface300 **device)
+{
+    hci->device = device;
+    hci->interface = getHCIInterface(device);
+    
+    if (hci->interface == NULL)
+    {
+        fprintf(stderr, "[!] Failed to locate Bluetooth HCI interface.\n");
+        return kIOReturnNotFound;
+    }
+    
+    IOReturn result = claimInterface(hci->interface);
+    
+    if (result != kIOReturnSuccess)
+    {
+        dfu_hci_close_usb(hci);
+        return result;
+    }
+    
+    unsigned char endpoints = 0;
+    
+    (*hci->interface)->GetNumEndpoints(hci->interface, &endpoints);
+    
+    for (unsigned char pipe = 1; pipe <= endpoints; pipe++)
+    {
+        UInt8 direction, number, type, interval;
+        UInt16 max_packet;
+        
+        if ((*hci->interface)->GetPipeProperties(hci->interface, pipe, &direction, &number, &type,
+                                                 &max_packet, &interval) != kIOReturnSuccess)
+            continue;
+        
+        if (direction == kUSBIn && type == kUSBInterrupt)
+        {
+            hci->pipe = pipe;
+            hci->max_packet = max_packet;
+            break;
+        }
+    }
+    
+    if (hci->pipe == 0)
+    {
+        fprintf(stderr, "[!] Bluetooth HCI interface has no event endpoint.\n");
+        (*hci->interface)->USBInterfaceClose(hci->interface);
+        dfu_hci_close_usb(hci);
+        return kIOReturnNotFound;
+    }
+    
+    hci->transport.command = dfu_hci_usb_command;
+    hci->transport.event = dfu_hci_usb_event;
+    hci->transport.wait = NULL;
+    hci->transport.context = hci;
+    
+    return kIOReturnSuccess;
+}
+
+/*
+ *  Close and release the HCI interface
+ *
+ *  hci       - context opened by dfu_hci_open_usb()
+ */
+void dfu_hci_close_usb(struct dfu_hci *hci)
+{
+    if (hci->interface == NULL)
+        return;
+    
+    if (hci->pipe != 0)
+        (*hci->interface)->USBInterfaceClose(hci->interface);
+    
+    (*hci->interface)->Release(hci->interface);
+    
+    hci->interface = NULL;
+    hci->pipe = 0;
+}
+
+/*
+ *  Send one command, the caller keeps track of the credits
+ *
+ *  hci        - context with a transport
+ *  opcode     - OGF and OCF
+ *  parameters - command parameters
+ *  length     - parameter length
+ *
+ *  returns IOReturn value
+ */
+IOReturn dfu_hci_send(struct dfu_hci *hci, uint16_t opcode, const uint8_t *parameters, uint8_t length)
+{
+    uint8_t packet[3 + HCI_MAX_PARAMETERS];
+    
+    packet[0] = opcode & 0xff;
+    packet[1] = opcode >> 8;
+    packet[2] = length;
+    
+    if (length > 0)
+        memcpy(packet + 3, parameters, length);
+    
+    IOReturn result = hci->transport.command(hci->transport.context, packet, 3 + length);
+    
+    if (result == kIOReturnSuccess && hci->credits > 0)
+        hci->credits--;
+    
+    return result;
+}
+
+/*
+ *  Wait for the next Command Complete or Command Status event, other
+ *  events are skipped. Every one of them updates the credits.
+ *
+ *  hci        - context with a transport
+ *  completion - opcode and status of the completed command
+ *
+ *  returns IOReturn value
+ */
+IOReturn dfu_hci_receive(struct dfu_hci *hci, struct dfu_hci_completion *completion)
+{
+    for (;;)
+    {
+        int length = hci->event_length >= 2 ? 2 + hci->event[1] : HCI_MAX_EVENT;
+        
+        if (hci->event_length < length)
+        {
+            int received = 0;
+            IOReturn result = hci->transport.event(hci->transport.context, hci->event + hci->event_length,
+                                                   sizeof(hci->event) - hci->event_length, &received, hci->timeout);
+            
+            if (result != kIOReturnSuccess)
+                return result;
+            
+            if (received == 0)
+                return kIOReturnUnderrun;
+            
+            hci->event_length += received;
+            continue;
+        }
+        
+        const uint8_t *event = hci->event;
+        bool complete = event[0] == HCI_EVENT_COMMAND_COMPLETE && event[1] >= 3;
+        bool status = event[0] == HCI_EVENT_COMMAND_STATUS && event[1] >= 4;
+        
+        if (complete)
+        {
+            hci->credits = event[2];
+            completion->opcode = event[3] | (event[4] << 8);
+            completion->status = event[1] >= 4 ? event[5] : 0;
+        }
+        else if (status)
+        {
+            hci->credits = event[3];
+            completion->opcode = event[4] | (event[5] << 8);
+            completion->status = event[2];
+        }
+        
+        // Keep what belongs to the next event
+        hci->event_length -= length;
+        memmove(hci->event, hci->event + length, hci->event_length);
+        
+        // Opcode 0 only hands out credits
+        if ((complete || status) && completion->opcode != 0)
+            return kIOReturnSuccess;
+    }
+}
+
+/*
+ *  Send a command and wait for its completion
+ *
+ *  returns IOReturn value, kIOReturnError if the controller rejected it
+ */
+IOReturn dfu_hci_command(struct dfu_hci *hci, uint16_t opcode, const uint8_t *parameters, uint8_t length)
+{
+    struct dfu_hci_completion completion;
+    IOReturn result = dfu_hci_send(hci, opcode, parameters, length);
+    
+    if (result != kIOReturnSuccess)
+        return result;
+    
+    do
+    {
+        result = dfu_hci_receive(hci, &completion);
+    }
+    while (result == kIOReturnSuccess && completion.opcode != opcode);
+    
+    if (result == kIOReturnSuccess && completion.status != 0)
+    {
+        fprintf(stderr, "[!] HCI command 0x%04x failed with status 0x%02x.\n", opcode, completion.status);
+        return kIOReturnError;
+    }
+    
+    return result;
+}
+
+void dfu_hci_wait(struct dfu_hci *hci, unsigned int ms)
+{
+    if (hci->transport.wait != NULL)
+        hci->transport.wait(hci->transport.context, ms);
+    else
+        usleep(ms * 1000);
+}
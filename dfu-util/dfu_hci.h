@@ -0,0 +1,85 @@
+/*
+ *  Bluetooth HCI command transport
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef __dfu_util__dfu_hci__
+#define __dfu_util__dfu_hci__
+
+#include <IOKit/IOKitLib.h>
+#include <IOKit/usb/IOUSBLib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define HCI_RESET                       0x0c03
+
+#define HCI_EVENT_COMMAND_COMPLETE      0x0e
+#define HCI_EVENT_COMMAND_STATUS        0x0f
+
+#define HCI_MAX_PARAMETERS              255
+#define HCI_MAX_EVENT                   (2 + HCI_MAX_PARAMETERS)
+#define HCI_DEFAULT_TIMEOUT             2000  /* 2 seconds */
+
+/*
+ *  Moves HCI command packets to a controller and event bytes back. Over
+ *  USB commands are class requests on the control endpoint and events
+ *  arrive on the interrupt endpoint, possibly split over several reads.
+ */
+struct dfu_hci_transport
+{
+    IOReturn (*command)(void *context, const uint8_t *packet, int length);
+    IOReturn (*event)(void *context, uint8_t *buffer, int size, int *received, unsigned int timeout);
+    /* Sleep, NULL selects usleep() */
+    void (*wait)(void *context, unsigned int ms);
+    void *context;
+};
+
+struct dfu_hci
+{
+    struct dfu_hci_transport transport;
+    /* Event timeout in ms */
+    unsigned int timeout;
+    /* Commands the controller accepts, from the last Num_HCI_Command_Packets */
+    int credits;
+    /* Bytes of an event not completely read yet */
+    uint8_t event[HCI_MAX_EVENT];
+    int event_length;
+    /* USB transport */
+    IOUSBDeviceInterface300 **device;
+    IOUSBInterfaceInterface300 **interface;
+    unsigned char pipe;
+    unsigned short max_packet;
+};
+
+/* Command Complete or Command Status event */
+struct dfu_hci_completion
+{
+    uint16_t opcode;
+    uint8_t status;
+};
+
+void dfu_hci_init(struct dfu_hci *hci);
+IOReturn dfu_hci_open_usb(struct dfu_hci *hci, IOUSBDeviceInterface300 **device);
+void dfu_hci_close_usb(struct dfu_hci *hci);
+IOReturn dfu_hci_send(struct dfu_hci *hci, uint16_t opcode, const uint8_t *parameters, uint8_t length);
+IOReturn dfu_hci_receive(struct dfu_hci *hci, struct dfu_hci_completion *completion);
+IOReturn dfu_hci_command(struct dfu_hci *hci, uint16_t opcode, const uint8_t *parameters, uint8_t length);
+void dfu_hci_wait(struct dfu_hci *hci, unsigned int ms);
+
+#endif /* defined(__dfu_util__dfu_hci__) */
@@ -0,0 +1,177 @@
+/*
+ *  Simulated Broadcom Bluetooth controller behind a struct dfu_hci transport
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <string.h>
+
+#include "dfu_hci_sim.h"
+#include "dfu_file.h"
+#include "dfu_patchram.h"
+
+#define HCI_STATUS_UNKNOWN_COMMAND      0x01
+#define HCI_STATUS_DISALLOWED           0x0c
+#define HCI_STATUS_INVALID_PARAMETERS   0x12
+
+/*
+ *  Initialize a simulated controller running its ROM firmware
+ *
+ *  sim       - controller to initialize
+ *  capacity  - commands it buffers, at most DFU_HCI_SIM_QUEUE
+ */
+void dfu_hci_sim_init(struct dfu_hci_sim *sim, int capacity)
+{
+    memset(sim, 0, sizeof(*sim));
+    
+    sim->capacity = capacity < 1 ? 1 : capacity > DFU_HCI_SIM_QUEUE ? DFU_HCI_SIM_QUEUE : capacity;
+    sim->packet_size = DFU_HCI_SIM_PACKET;
+    sim->crc = 0xffffffff;
+}
+
+static uint8_t dfu_hci_sim_execute(struct dfu_hci_sim *sim, uint16_t opcode, const uint8_t *parameters, int length)
+{
+    switch (opcode)
+    {
+        case HCI_BRCM_DOWNLOAD_MINIDRIVER:
+            sim->download = true;
+            sim->waited = 0;
+            return 0;
+        
+        case HCI_BRCM_WRITE_RAM:
+            if (!sim->download || sim->waited < DFU_PATCHRAM_MINIDRIVER_DELAY)
+                return HCI_STATUS_DISALLOWED;
+        
+            if (length < 4)
+                return HCI_STATUS_INVALID_PARAMETERS;
+        
+            sim->crc = dfu_crc32(sim->crc, parameters + 4, length - 4);
+            sim->written += length - 4;
+            return 0;
+        
+        case HCI_BRCM_LAUNCH_RAM:
+            if (!sim->download)
+                return HCI_STATUS_DISALLOWED;
+        
+            sim->download = false;
+            sim->launched = true;
+            sim->waited = 0;
+            return 0;
+        
+        case HCI_RESET:
+            sim->running = sim->launched && sim->waited >= DFU_PATCHRAM_LAUNCH_DELAY;
+            sim->download = false;
+            return 0;
+        
+        default:
+            return HCI_STATUS_UNKNOWN_COMMAND;
+    }
+}
+
+static IOReturn dfu_hci_sim_command(void *context, const uint8_t *packet, int length)
+{
+    struct dfu_hci_sim *sim = context;
+    
+    if (length < 3 || length != 3 + packet[2])
+        return kIOReturnBadArgument;
+    
+    sim->commands++;
+    
+    if (sim->queued == sim->capacity)
+    {
+        sim->overruns++;
+        return kIOReturnSuccess;
+    }
+    
+    struct dfu_hci_sim_command *command = &sim->queue[(sim->head + sim->queued++) % DFU_HCI_SIM_QUEUE];
+    
+    command->opcode = packet[0] | (packet[1] << 8);
+    command->status = dfu_hci_sim_execute(sim, command->opcode, packet + 3, packet[2]);
+    
+    if (sim->queued > sim->max_queued)
+        sim->max_queued = sim->queued;
+    
+    return kIOReturnSuccess;
+}
+
+static IOReturn dfu_hci_sim_event(void *context, uint8_t *buffer, int size, int *received, unsigned int timeout)
+{
+    struct dfu_hci_sim *sim = context;
+    
+    *received = 0;
+    
+    if (sim->event_offset == sim->event_length)
+    {
+        // Nothing to complete, a real read would time out
+        if (sim->queued == 0)
+            return kIOReturnTimeout;
+        
+        struct dfu_hci_sim_command *command = &sim->queue[sim->head];
+        
+        sim->head = (sim->head + 1) % DFU_HCI_SIM_QUEUE;
+        sim->queued--;
+        
+        sim->event[0] = HCI_EVENT_COMMAND_COMPLETE;
+        sim->event[1] = 4;
+        sim->event[2] = sim->capacity - sim->queued;
+        sim->event[3] = command->opcode & 0xff;
+        sim->event[4] = command->opcode >> 8;
+        sim->event[5] = command->status;
+        sim->event_length = 6;
+        sim->event_offset = 0;
+    }
+    
+    int length = sim->event_length - sim->event_offset;
+    
+    if (length > sim->packet_size)
+        length = sim->packet_size;
+    
+    if (length > size)
+        return kIOReturnOverrun;
+    
+    memcpy(buffer, sim->event + sim->event_offset, length);
+    
+    sim->event_offset += length;
+    *received = length;
+    
+    return kIOReturnSuccess;
+}
+
+static void dfu_hci_sim_wait(void *context, unsigned int ms)
+{
+    struct dfu_hci_sim *sim = context;
+    
+    sim->waited += ms;
+}
+
+/*
+ *  Route all commands and events of an HCI context to a simulated
+ *  controller, waits only advance its clock
+ *
+ *  sim       - simulated controller
+ *  hci       - context, no IOKit objects are needed
+ */
+void dfu_hci_sim_attach(struct dfu_hci_sim *sim, struct dfu_hci *hci)
+{
+    dfu_hci_init(hci);
+    
+    hci->transport.command = dfu_hci_sim_command;
+    hci->transport.event = dfu_hci_sim_event;
+    hci->transport.wait = dfu_hci_sim_wait;
+    hci->transport.context = sim;
+}
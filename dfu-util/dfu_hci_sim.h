@@ -0,0 +1,76 @@
+/*
+ *  Simulated Broadcom Bluetooth controller behind a struct dfu_hci transport
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef __dfu_util__dfu_hci_sim__
+#define __dfu_util__dfu_hci_sim__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dfu_hci.h"
+
+#define DFU_HCI_SIM_QUEUE       16
+#define DFU_HCI_SIM_CAPACITY    4     /* commands buffered by default */
+#define DFU_HCI_SIM_PACKET      16    /* interrupt endpoint packet size */
+
+/* Command received and not completed yet */
+struct dfu_hci_sim_command
+{
+    uint16_t opcode;
+    uint8_t status;
+};
+
+/*
+ *  Buffers up to capacity commands and completes them in order, one per
+ *  event read, announcing the free slots as Num_HCI_Command_Packets.
+ *  Commands beyond the announced slots are lost like on real hardware.
+ *  Write_RAM is only accepted in download mode and after the minidriver
+ *  delay, HCI_Reset only starts the patch after the launch delay.
+ */
+struct dfu_hci_sim
+{
+    int capacity;
+    int packet_size;
+    struct dfu_hci_sim_command queue[DFU_HCI_SIM_QUEUE];
+    int head;
+    int queued;
+    int max_queued;
+    /* Commands sent without a free slot */
+    unsigned long overruns;
+    /* Event being read in packet_size pieces */
+    uint8_t event[HCI_MAX_EVENT];
+    int event_length;
+    int event_offset;
+    bool download;
+    bool launched;
+    bool running;
+    /* ms waited since the last mode change */
+    unsigned int waited;
+    /* Write_RAM data in the order received */
+    uint32_t written;
+    uint32_t crc;
+    unsigned long commands;
+};
+
+void dfu_hci_sim_init(struct dfu_hci_sim *sim, int capacity);
+void dfu_hci_sim_attach(struct dfu_hci_sim *sim, struct dfu_hci *hci);
+
+#endif /* defined(__dfu_util__dfu_hci_sim__) */
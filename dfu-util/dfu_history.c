@@ -0,0 +1,413 @@
+/*
+ *  Per-device record of the pages last written
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dfu_history.h"
+
+static int dfu_history_append(struct dfu_history *history, struct dfu_history_entry *entry)
+{
+    if (history->count == history->capacity)
+    {
+        int capacity = history->capacity > 0 ? history->capacity * 2 : 16;
+        struct dfu_history_entry *entries = realloc(history->entries, capacity * sizeof(*entries));
+        
+        if (entries == NULL)
+            return -1;
+        
+        history->entries = entries;
+        history->capacity = capacity;
+    }
+    
+    history->entries[history->count++] = *entry;
+    
+    return 0;
+}
+
+static int dfu_history_add_page(struct dfu_history_entry *entry, int *capacity, const struct dfu_history_page *page)
+{
+    if (entry->count == *capacity)
+    {
+        int grown = *capacity > 0 ? *capacity * 2 : 16;
+        struct dfu_history_page *pages = realloc(entry->pages, grown * sizeof(*pages));
+        
+        if (pages == NULL)
+            return -1;
+        
+        entry->pages = pages;
+        *capacity = grown;
+    }
+    
+    entry->pages[entry->count++] = *page;
+    
+    return 0;
+}
+
+/*
+ *  Read a history file, a missing file is an empty history
+ *
+ *  history   - history to fill
+ *  path      - history file
+ *
+ *  returns 0 or -1
+ */
+int dfu_history_open(struct dfu_history *history, const char *path)
+{
+    struct dfu_history_entry entry;
+    int capacity = 0;
+    bool open = false;
+    char line[512];
+    int result = 0;
+    
+    memset(history, 0, sizeof(*history));
+    history->path = path;
+    
+    FILE *in = fopen(path, "r");
+    
+    if (in == NULL)
+        return errno == ENOENT ? 0 : -1;
+    
+    // An entry runs from its device line to the next one
+    while (result == 0 && fgets(line, sizeof(line), in) != NULL)
+    {
+        char hex[DFU_SHA256_HEX_LENGTH + 1];
+        unsigned int vid, pid, address, size;
+        long long time;
+        int consumed = 0;
+        
+        line[strcspn(line, "\r\n")] = '\0';
+        
+        if (line[0] == '#' || line[0] == '\0')
+            continue;
+        
+        if (sscanf(line, "device %x:%x %n", &vid, &pid, &consumed) == 2 && consumed > 0)
+        {
+            if (open)
+                result = dfu_history_append(history, &entry);
+            
+            memset(&entry, 0, sizeof(entry));
+            entry.idVendor = vid;
+            entry.idProduct = pid;
+            strlcpy(entry.serial, line + consumed, sizeof(entry.serial));
+            capacity = 0;
+            open = true;
+        }
+        else if (!open)
+            result = -1;
+        else if (strcmp(line, "state pending") == 0)
+            entry.pending = true;
+        else if (strcmp(line, "state ok") == 0)
+            entry.pending = false;
+        else if (sscanf(line, "time %lld", &time) == 1)
+            entry.time = time;
+        else if (strncmp(line, "layout ", 7) == 0)
+            strlcpy(entry.layout, line + 7, sizeof(entry.layout));
+        else if (sscanf(line, "image %64s", hex) == 1)
+            result = dfu_sha256_parse(hex, entry.image) ? 0 : -1;
+        else if (sscanf(line, "page %x %u %64s", &address, &size, hex) == 3)
+        {
+            struct dfu_history_page page = { .address = address, .size = size };
+            
+            if (!dfu_sha256_parse(hex, page.digest))
+                result = -1;
+            else
+                result = dfu_history_add_page(&entry, &capacity, &page);
+        }
+        else
+            result = -1;
+    }
+    
+    fclose(in);
+    
+    if (open && result == 0)
+        result = dfu_history_append(history, &entry);
+    else if (open)
+        dfu_history_entry_free(&entry);
+    
+    if (result != 0)
+        dfu_history_close(history);
+    
+    return result;
+}
+
+/*
+ *  Look up the entry of a device
+ *
+ *  returns the entry or NULL if the device was never written through this history
+ */
+struct dfu_history_entry *dfu_history_find(struct dfu_history *history, const char *serial,
+                                           uint16_t idVendor, uint16_t idProduct)
+{
+    for (int i = 0; i < history->count; i++)
+    {
+        struct dfu_history_entry *entry = &history->entries[i];
+        
+        if (entry->idVendor == idVendor && entry->idProduct == idProduct && strcmp(entry->serial, serial) == 0)
+            return entry;
+    }
+    
+    return NULL;
+}
+
+/*
+ *  Contents of a sector after the image was written to it, bytes outside
+ *  of the image stay erased
+ *
+ *  image     - image, ranges sorted by address
+ *  address   - start of the bytes
+ *  data      - receives the bytes
+ *  length    - number of bytes
+ */
+static void dfu_history_page_data(const struct dfu_image *image, uint32_t address, uint8_t *data, uint32_t length)
+{
+    uint64_t end = (uint64_t)address + length;
+    
+    memset(data, DFU_IMAGE_FILL, length);
+    
+    for (int i = 0; i < image->count; i++)
+    {
+        const struct dfu_range *range = &image->ranges[i];
+        uint64_t from = range->address > address ? range->address : address;
+        uint64_t to = (uint64_t)range->address + range->length < end ? (uint64_t)range->address + range->length : end;
+        
+        if (from < to)
+            memcpy(data + (from - address), range->data + (from - range->address), to - from);
+    }
+}
+
+/*
+ *  Fill in the layout, image digest and page digests an image leaves on a
+ *  device, one page per sector it touches
+ *
+ *  entry     - serial and ids set by the caller, pages replaced
+ *  layout    - memory layout of the device
+ *  image     - image to write
+ *
+ *  returns 0 or -1
+ */
+int dfu_history_describe(struct dfu_history_entry *entry, const struct dfu_layout *layout,
+                         const struct dfu_image *image)
+{
+    struct dfu_sha256 sha;
+    int capacity = 0;
+    
+    dfu_history_entry_free(entry);
+    strlcpy(entry->layout, layout->name, sizeof(entry->layout));
+    
+    // Addresses are part of the image
+    dfu_sha256_init(&sha);
+    
+    for (int i = 0; i < image->count; i++)
+    {
+        const struct dfu_range *range = &image->ranges[i];
+        uint8_t header[8] = { range->address, range->address >> 8, range->address >> 16, range->address >> 24,
+                              range->length, range->length >> 8, range->length >> 16, range->length >> 24 };
+        
+        dfu_sha256_update(&sha, header, sizeof(header));
+        dfu_sha256_update(&sha, range->data, range->length);
+    }
+    
+    dfu_sha256_final(&sha, entry->image);
+    
+    uint8_t *data = NULL;
+    uint32_t data_size = 0;
+    int range = 0;
+    
+    for (int i = 0; i < layout->count; i++)
+    {
+        const struct dfu_sector *sector = &layout->sectors[i];
+        uint64_t end = (uint64_t)sector->address + sector->size;
+        
+        while (range < image->count &&
+               (uint64_t)image->ranges[range].address + image->ranges[range].length <= sector->address)
+            range++;
+        
+        if (range == image->count)
+            break;
+        
+        if (image->ranges[range].address >= end)
+            continue;
+        
+        if (sector->size > data_size)
+        {
+            uint8_t *grown = realloc(data, sector->size);
+            
+            if (grown == NULL)
+                goto error;
+            
+            data = grown;
+            data_size = sector->size;
+        }
+        
+        struct dfu_history_page page = { .address = sector->address, .size = sector->size };
+        
+        dfu_history_page_data(image, sector->address, data, sector->size);
+        dfu_sha256(data, sector->size, page.digest);
+        
+        if (dfu_history_add_page(entry, &capacity, &page) != 0)
+            goto error;
+    }
+    
+    free(data);
+    
+    return 0;
+    
+error:
+    free(data);
+    dfu_history_entry_free(entry);
+    
+    return -1;
+}
+
+/*
+ *  Page of an entry that starts at an address
+ *
+ *  returns the page or NULL
+ */
+const struct dfu_history_page *dfu_history_page(const struct dfu_history_entry *entry, uint32_t address)
+{
+    int low = 0;
+    int high = entry->count;
+    
+    while (low < high)
+    {
+        int middle = (low + high) / 2;
+        
+        if (entry->pages[middle].address < address)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    
+    return low < entry->count && entry->pages[low].address == address ? &entry->pages[low] : NULL;
+}
+
+/*
+ *  Replace the entry of a device, the history takes over its pages
+ *
+ *  history   - open history
+ *  entry     - new entry, emptied
+ *
+ *  returns 0 or -1
+ */
+int dfu_history_store(struct dfu_history *history, struct dfu_history_entry *entry)
+{
+    struct dfu_history_entry *stored = dfu_history_find(history, entry->serial, entry->idVendor, entry->idProduct);
+    
+    if (stored != NULL)
+    {
+        if (stored != entry)
+        {
+            dfu_history_entry_free(stored);
+            *stored = *entry;
+        }
+    }
+    else if (dfu_history_append(history, entry) != 0)
+        return -1;
+    
+    entry->pages = NULL;
+    entry->count = 0;
+    
+    return 0;
+}
+
+/*
+ *  Write the history back, atomically replacing the file
+ *
+ *  history   - open history
+ *
+ *  returns 0 or -1
+ */
+int dfu_history_save(struct dfu_history *history)
+{
+    char temporary[PATH_MAX];
+    char hex[DFU_SHA256_HEX_LENGTH + 1];
+    
+    snprintf(temporary, sizeof(temporary), "%s.XXXXXX", history->path);
+    
+    int fd = mkstemp(temporary);
+    
+    if (fd < 0)
+        return -1;
+    
+    FILE *out = fdopen(fd, "w");
+    
+    if (out == NULL)
+    {
+        close(fd);
+        unlink(temporary);
+        return -1;
+    }
+    
+    fprintf(out, "# dfu-util flash history, pages as left by the last download of each device\n");
+    
+    for (int i = 0; i < history->count; i++)
+    {
+        const struct dfu_history_entry *entry = &history->entries[i];
+        
+        fprintf(out, "device %04x:%04x %s\n", entry->idVendor, entry->idProduct, entry->serial);
+        fprintf(out, "state %s\n", entry->pending ? "pending" : "ok");
+        fprintf(out, "time %lld\n", (long long)entry->time);
+        fprintf(out, "layout %s\n", entry->layout);
+        
+        dfu_sha256_format(entry->image, hex);
+        fprintf(out, "image %s\n", hex);
+        
+        for (int p = 0; p < entry->count; p++)
+        {
+            dfu_sha256_format(entry->pages[p].digest, hex);
+            fprintf(out, "page %08x %u %s\n", entry->pages[p].address, entry->pages[p].size, hex);
+        }
+    }
+    
+    int result = fclose(out) == 0 ? 0 : -1;
+    
+    if (result == 0 && rename(temporary, history->path) != 0)
+        result = -1;
+    
+    if (result != 0)
+        unlink(temporary);
+    
+    return result;
+}
+
+void dfu_history_entry_free(struct dfu_history_entry *entry)
+{
+    free(entry->pages);
+    
+    entry->pages = NULL;
+    entry->count = 0;
+}
+
+void dfu_history_close(struct dfu_history *history)
+{
+    for (int i = 0; i < history->count; i++)
+        dfu_history_entry_free(&history->entries[i]);
+    
+    free(history->entries);
+    
+    memset(history, 0, sizeof(*history));
+}
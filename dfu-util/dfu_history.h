@@ -0,0 +1,79 @@
+/*
+ *  Per-device record of the pages last written
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef __dfu_util__dfu_history__
+#define __dfu_util__dfu_history__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dfu_dfuse.h"
+#include "dfu_image.h"
+#include "dfu_sha256.h"
+
+/* Contents of one sector after a download, erased bytes included */
+struct dfu_history_page
+{
+    uint32_t address;
+    uint32_t size;
+    uint8_t digest[DFU_SHA256_LENGTH];
+};
+
+/*
+ *  What the last download through this host left on a device, keyed by
+ *  serial number, idVendor and idProduct. A pending entry was being
+ *  written when the process stopped and says nothing about the device.
+ */
+struct dfu_history_entry
+{
+    char serial[128];
+    uint16_t idVendor;
+    uint16_t idProduct;
+    bool pending;
+    /* Seconds since the epoch */
+    int64_t time;
+    /* Layout name, the sectors have to match as well */
+    char layout[64];
+    uint8_t image[DFU_SHA256_LENGTH];
+    struct dfu_history_page *pages;
+    int count;
+};
+
+struct dfu_history
+{
+    const char *path;
+    struct dfu_history_entry *entries;
+    int count;
+    int capacity;
+};
+
+int dfu_history_open(struct dfu_history *history, const char *path);
+struct dfu_history_entry *dfu_history_find(struct dfu_history *history, const char *serial,
+                                           uint16_t idVendor, uint16_t idProduct);
+int dfu_history_describe(struct dfu_history_entry *entry, const struct dfu_layout *layout,
+                         const struct dfu_image *image);
+const struct dfu_history_page *dfu_history_page(const struct dfu_history_entry *entry, uint32_t address);
+int dfu_history_store(struct dfu_history *history, struct dfu_history_entry *entry);
+int dfu_history_save(struct dfu_history *history);
+void dfu_history_entry_free(struct dfu_history_entry *entry);
+void dfu_history_close(struct dfu_history *history);
+
+#endif /* defined(__dfu_util__dfu_history__) */
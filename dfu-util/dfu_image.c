@@ -0,0 +1,750 @@
+/*
+ *  Intel HEX, Motorola S-record and ELF firmware images
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dfu_image.h"
+
+#define DFU_IMAGE_MAX_SPAN      (64 * 1024 * 1024)
+
+/* ELF identification and program header fields used here */
+#define ELF_CLASS_32            1
+#define ELF_CLASS_64            2
+#define ELF_DATA_LSB            1
+#define ELF_PT_LOAD             1
+
+/* Eight hex digits are decoded at once on little endian hosts */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define DFU_IMAGE_SWAR          1
+#endif
+
+#define SWAR_ONES               0x0101010101010101ULL
+#define SWAR_HIGH               0x8080808080808080ULL
+
+static int hex_digit(uint8_t c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    
+    c |= 0x20;
+    
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    
+    return -1;
+}
+
+#ifdef DFU_IMAGE_SWAR
+/*
+ *  Bytes of x within [low, high] get their high bit set, all bytes of x
+ *  must be below 0x80 so no carry crosses a byte
+ */
+static inline uint64_t swar_in_range(uint64_t x, uint8_t low, uint8_t high)
+{
+    uint64_t at_least_low = x + SWAR_ONES * (0x80 - low);
+    uint64_t above_high = x + SWAR_ONES * (0x7f - high);
+    
+    return at_least_low & ~above_high & SWAR_HIGH;
+}
+
+/*
+ *  Decode eight hex digits into four bytes
+ *
+ *  text      - eight ASCII hex digits
+ *  out       - receives four bytes
+ *
+ *  returns false if any character is not a hex digit
+ */
+static inline bool swar_decode8(const uint8_t *text, uint8_t *out)
+{
+    uint64_t x;
+    
+    memcpy(&x, text, sizeof(x));
+    
+    if (x & SWAR_HIGH)
+        return false;
+    
+    uint64_t digits = swar_in_range(x, '0', '9');
+    uint64_t letters = swar_in_range(x | (SWAR_ONES * 0x20), 'a', 'f');
+    
+    if ((digits | letters) != SWAR_HIGH)
+        return false;
+    
+    // Letters have 0x40 set, their low nibble plus 9 is their value
+    uint64_t nibbles = (x & (SWAR_ONES * 0x0f)) + (letters >> 7) * 9;
+    
+    // First digit of each pair is the high nibble, then squeeze out the gaps
+    uint64_t packed = ((nibbles << 4) | (nibbles >> 8)) & 0x00ff00ff00ff00ffULL;
+    
+    packed = (packed | (packed >> 8)) & 0x0000ffff0000ffffULL;
+    packed = (packed | (packed >> 16)) & 0x00000000ffffffffULL;
+    
+    uint32_t bytes = (uint32_t)packed;
+    
+    memcpy(out, &bytes, sizeof(bytes));
+    
+    return true;
+}
+#endif
+
+/*
+ *  Decode a run of hex digits
+ *
+ *  text      - hex digits, all of them readable
+ *  digits    - number of digits, even
+ *  out       - receives digits / 2 bytes
+ *
+ *  returns false if any character is not a hex digit
+ */
+static bool decode_hex(const uint8_t *text, size_t digits, uint8_t *out)
+{
+    size_t i = 0;
+    
+#ifdef DFU_IMAGE_SWAR
+    for (; i + 8 <= digits; i += 8)
+        if (!swar_decode8(text + i, out + i / 2))
+            return false;
+#endif
+    
+    for (; i < digits; i += 2)
+    {
+        int high = hex_digit(text[i]);
+        int low = hex_digit(text[i + 1]);
+        
+        if (high < 0 || low < 0)
+            return false;
+        
+        out[i / 2] = (high << 4) | low;
+    }
+    
+    return true;
+}
+
+static uint32_t read_le16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t read_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t read_le64(const uint8_t *p)
+{
+    return read_le32(p) | ((uint64_t)read_le32(p + 4) << 32);
+}
+
+/*
+ *  Guess the format of an image from its contents
+ *
+ *  data      - start of the file
+ *  size      - file size
+ *
+ *  returns format, DFU_IMAGE_RAW for binaries and .dfu files
+ */
+enum dfu_image_format dfu_image_detect(const uint8_t *data, size_t size)
+{
+    // Anything carrying a DFU suffix is flashed as it is
+    if (size >= DFU_SUFFIX_LENGTH &&
+        data[size - 8] == 'U' && data[size - 7] == 'F' && data[size - 6] == 'D')
+        return DFU_IMAGE_RAW;
+    
+    if (size >= 16 && memcmp(data, "\177ELF", 4) == 0)
+        return DFU_IMAGE_ELF;
+    
+    if (size >= 11 && data[0] == ':' && hex_digit(data[1]) >= 0 && hex_digit(data[2]) >= 0)
+        return DFU_IMAGE_IHEX;
+    
+    if (size >= 10 && data[0] == 'S' && data[1] >= '0' && data[1] <= '9' &&
+        hex_digit(data[2]) >= 0 && hex_digit(data[3]) >= 0)
+        return DFU_IMAGE_SREC;
+    
+    return DFU_IMAGE_RAW;
+}
+
+static int add_range(struct dfu_image *image, uint32_t address, const uint8_t *data, uint32_t length)
+{
+    if (length == 0)
+        return DFU_FILE_OK;
+    
+    // Consecutive records usually continue the previous range
+    if (image->count > 0)
+    {
+        struct dfu_range *last = &image->ranges[image->count - 1];
+        
+        if (last->address + last->length == address && last->data + last->length == data)
+        {
+            last->length += length;
+            return DFU_FILE_OK;
+        }
+    }
+    
+    if (image->count == image->capacity)
+    {
+        int capacity = image->capacity > 0 ? image->capacity * 2 : 16;
+        struct dfu_range *ranges = realloc(image->ranges, capacity * sizeof(*ranges));
+        
+        if (ranges == NULL)
+            return DFU_FILE_ERROR_MEMORY;
+        
+        image->ranges = ranges;
+        image->capacity = capacity;
+    }
+    
+    image->ranges[image->count].address = address;
+    image->ranges[image->count].data = data;
+    image->ranges[image->count].length = length;
+    image->count++;
+    
+    return DFU_FILE_OK;
+}
+
+static int append_data(struct dfu_image *image, uint32_t address, const uint8_t *data, uint32_t length)
+{
+    uint8_t *destination = image->decoded + image->decoded_size;
+    
+    memcpy(destination, data, length);
+    image->decoded_size += length;
+    
+    return add_range(image, address, destination, length);
+}
+
+static bool is_space(uint8_t c)
+{
+    return c == '\r' || c == '\n' || c == ' ' || c == '\t';
+}
+
+static int parse_ihex(struct dfu_image *image, const uint8_t *text, size_t size)
+{
+    uint8_t record[5 + 255];
+    uint32_t base = 0;
+    size_t position = 0;
+    int line = 0;
+    
+    while (position < size)
+    {
+        if (is_space(text[position]))
+        {
+            position++;
+            continue;
+        }
+        
+        line++;
+        
+        // Colon, byte count, address, type and checksum at least
+        if (text[position] != ':' || size - position < 11 || !decode_hex(text + position + 1, 2, record))
+        {
+            warnx("%s:%d: Invalid Intel HEX record", image->name, line);
+            return DFU_FILE_ERROR_FORMAT;
+        }
+        
+        size_t digits = 2 * (record[0] + 5);
+        
+        position++;
+        
+        if (size - position < digits || !decode_hex(text + position, digits, record))
+        {
+            warnx("%s:%d: Invalid Intel HEX record", image->name, line);
+            return DFU_FILE_ERROR_FORMAT;
+        }
+        
+        position += digits;
+        
+        uint8_t sum = 0;
+        size_t i;
+        
+        for (i = 0; i < digits / 2; i++)
+            sum += record[i];
+        
+        if (sum != 0)
+        {
+            warnx("%s:%d: Intel HEX checksum mismatch", image->name, line);
+            return DFU_FILE_ERROR_CHECKSUM;
+        }
+        
+        uint8_t length = record[0];
+        uint32_t offset = (record[1] << 8) | record[2];
+        const uint8_t *data = record + 4;
+        int result = DFU_FILE_OK;
+        
+        switch (record[3])
+        {
+            case 0x00:  // Data
+                result = append_data(image, base + offset, data, length);
+                break;
+            case 0x01:  // End of file
+                return DFU_FILE_OK;
+            case 0x02:  // Extended segment address
+                if (length == 2)
+                    base = ((data[0] << 8) | data[1]) << 4;
+                break;
+            case 0x03:  // Start segment address, CS:IP
+                if (length == 4)
+                    image->entry = (((data[0] << 8) | data[1]) << 4) + ((data[2] << 8) | data[3]);
+                break;
+            case 0x04:  // Extended linear address
+                if (length == 2)
+                    base = ((uint32_t)data[0] << 24) | (data[1] << 16);
+                break;
+            case 0x05:  // Start linear address
+                if (length == 4)
+                    image->entry = ((uint32_t)data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+                break;
+            default:
+                warnx("%s:%d: Unknown Intel HEX record type %02x", image->name, line, record[3]);
+                return DFU_FILE_ERROR_FORMAT;
+        }
+        
+        if (result != DFU_FILE_OK)
+            return result;
+    }
+    
+    return DFU_FILE_OK;
+}
+
+static int parse_srec(struct dfu_image *image, const uint8_t *text, size_t size)
+{
+    // Address bytes of record types S0 .. S9, 0 for unsupported types
+    static const int address_bytes[10] = { 2, 2, 3, 4, 0, 2, 3, 4, 3, 2 };
+    uint8_t record[1 + 255];
+    size_t position = 0;
+    int line = 0;
+    
+    while (position < size)
+    {
+        if (is_space(text[position]))
+        {
+            position++;
+            continue;
+        }
+        
+        line++;
+        
+        if (text[position] != 'S' || size - position < 4 ||
+            text[position + 1] < '0' || text[position + 1] > '9' ||
+            !decode_hex(text + position + 2, 2, record))
+        {
+            warnx("%s:%d: Invalid S-record", image->name, line);
+            return DFU_FILE_ERROR_FORMAT;
+        }
+        
+        int type = text[position + 1] - '0';
+        int count = record[0];
+        size_t digits = 2 * (count + 1);
+        
+        position += 2;
+        
+        if (address_bytes[type] == 0 || count < address_bytes[type] + 1 ||
+            size - position < digits || !decode_hex(text + position, digits, record))
+        {
+            warnx("%s:%d: Invalid S-record", image->name, line);
+            return DFU_FILE_ERROR_FORMAT;
+        }
+        
+        position += digits;
+        
+        // Count, address and data bytes add up to the inverted checksum
+        uint8_t sum = 0;
+        int i;
+        
+        for (i = 0; i <= count; i++)
+            sum += record[i];
+        
+        if (sum != 0xff)
+        {
+            warnx("%s:%d: S-record checksum mismatch", image->name, line);
+            return DFU_FILE_ERROR_CHECKSUM;
+        }
+        
+        uint32_t address = 0;
+        
+        for (i = 0; i < address_bytes[type]; i++)
+            address = (address << 8) | record[1 + i];
+        
+        const uint8_t *data = record + 1 + address_bytes[type];
+        int length = count - address_bytes[type] - 1;
+        
+        if (type >= 1 && type <= 3)
+        {
+            int result = append_data(image, address, data, length);
+            
+            if (result != DFU_FILE_OK)
+                return result;
+        }
+        else if (type >= 7)
+            image->entry = address;
+    }
+    
+    return DFU_FILE_OK;
+}
+
+static int parse_elf(struct dfu_image *image, const uint8_t *data, size_t size)
+{
+    bool elf64 = data[4] == ELF_CLASS_64;
+    
+    if ((data[4] != ELF_CLASS_32 && data[4] != ELF_CLASS_64) || data[5] != ELF_DATA_LSB ||
+        size < (elf64 ? 64 : 52))
+    {
+        warnx("%s: Only little endian ELF files are supported", image->name);
+        return DFU_FILE_ERROR_FORMAT;
+    }
+    
+    uint64_t phoff = elf64 ? read_le64(data + 32) : read_le32(data + 28);
+    uint32_t phentsize = read_le16(data + (elf64 ? 54 : 42));
+    uint32_t phnum = read_le16(data + (elf64 ? 56 : 44));
+    
+    image->entry = elf64 ? (uint32_t)read_le64(data + 24) : read_le32(data + 24);
+    
+    if (phentsize < (elf64 ? 56 : 32) || phoff > size || (uint64_t)phnum * phentsize > size - phoff)
+    {
+        warnx("%s: Invalid ELF program headers", image->name);
+        return DFU_FILE_ERROR_FORMAT;
+    }
+    
+    uint32_t i;
+    
+    for (i = 0; i < phnum; i++)
+    {
+        const uint8_t *header = data + phoff + i * phentsize;
+        
+        if (read_le32(header) != ELF_PT_LOAD)
+            continue;
+        
+        // Load (physical) address is where the segment lives in flash
+        uint64_t offset = elf64 ? read_le64(header + 8) : read_le32(header + 4);
+        uint64_t address = elf64 ? read_le64(header + 24) : read_le32(header + 12);
+        uint64_t length = elf64 ? read_le64(header + 32) : read_le32(header + 16);
+        
+        if (offset > size || length > size - offset || address + length > 0x100000000ULL)
+        {
+            warnx("%s: Invalid ELF segment %u", image->name, i);
+            return DFU_FILE_ERROR_FORMAT;
+        }
+        
+        // Segment data is used in place, the mapping stays alive
+        int result = add_range(image, (uint32_t)address, data + offset, (uint32_t)length);
+        
+        if (result != DFU_FILE_OK)
+            return result;
+    }
+    
+    return DFU_FILE_OK;
+}
+
+static int compare_ranges(const void *a, const void *b)
+{
+    const struct dfu_range *first = a;
+    const struct dfu_range *second = b;
+    
+    return first->address < second->address ? -1 : first->address > second->address;
+}
+
+/*
+ *  Load an Intel HEX, S-record or ELF file into a sparse image
+ *
+ *  image     - name and allocator set by the caller, the rest zeroed or
+ *              from a previous load
+ *
+ *  returns DFU_FILE_OK or a negative dfu_file_error, DFU_FILE_ERROR_FORMAT
+ *  with image->format DFU_IMAGE_RAW for files of none of these formats
+ */
+int dfu_image_load(struct dfu_image *image)
+{
+    struct stat info;
+    int result;
+    
+    dfu_image_free(image);
+    
+    int f = open(image->name, O_RDONLY);
+    
+    if (f < 0)
+    {
+        warn("Could not open file %s for reading", image->name);
+        return DFU_FILE_ERROR_OPEN;
+    }
+    
+    if (fstat(f, &info) != 0 || info.st_size == 0)
+    {
+        close(f);
+        image->format = DFU_IMAGE_RAW;
+        return DFU_FILE_ERROR_FORMAT;
+    }
+    
+    image->mapping_size = info.st_size;
+    image->mapping = mmap(NULL, image->mapping_size, PROT_READ, MAP_PRIVATE, f, 0);
+    
+    close(f);
+    
+    if (image->mapping == MAP_FAILED)
+    {
+        warn("Could not map %s", image->name);
+        image->mapping = NULL;
+        return DFU_FILE_ERROR_READ;
+    }
+    
+    const uint8_t *data = image->mapping;
+    
+    image->format = dfu_image_detect(data, image->mapping_size);
+    
+    switch (image->format)
+    {
+        case DFU_IMAGE_IHEX:
+        case DFU_IMAGE_SREC:
+            // Two digits per byte, decoded data never exceeds half the text
+            image->decoded = dfu_malloc(image->allocator, image->mapping_size / 2 + 1);
+        
+            if (image->decoded == NULL)
+            {
+                result = DFU_FILE_ERROR_MEMORY;
+                break;
+            }
+        
+            madvise(image->mapping, image->mapping_size, MADV_SEQUENTIAL);
+        
+            if (image->format == DFU_IMAGE_IHEX)
+                result = parse_ihex(image, data, image->mapping_size);
+            else
+                result = parse_srec(image, data, image->mapping_size);
+        
+            munmap(image->mapping, image->mapping_size);
+            image->mapping = NULL;
+            image->mapping_size = 0;
+            break;
+        case DFU_IMAGE_ELF:
+            result = parse_elf(image, data, image->mapping_size);
+            break;
+        default:
+            result = DFU_FILE_ERROR_FORMAT;
+            break;
+    }
+    
+    if (result == DFU_FILE_OK && image->count == 0)
+    {
+        warnx("%s: Image contains no data", image->name);
+        result = DFU_FILE_ERROR_FORMAT;
+    }
+    
+    if (result == DFU_FILE_OK)
+    {
+        int i;
+        
+        qsort(image->ranges, image->count, sizeof(*image->ranges), compare_ranges);
+        
+        for (i = 0; i + 1 < image->count; i++)
+        {
+            if ((uint64_t)image->ranges[i].address + image->ranges[i].length > image->ranges[i + 1].address)
+            {
+                warnx("%s: Data at 0x%08x overlaps previous segment", image->name, image->ranges[i + 1].address);
+                result = DFU_FILE_ERROR_OVERLAP;
+                break;
+            }
+        }
+    }
+    
+    if (result != DFU_FILE_OK)
+    {
+        enum dfu_image_format format = image->format;
+        
+        dfu_image_free(image);
+        image->format = format;
+    }
+    
+    return result;
+}
+
+/*
+ *  Place the firmware of a DFU file at an address, the image refers to
+ *  the file buffer and must not outlive it
+ *
+ *  image     - image to fill, name and allocator are kept
+ *  file      - loaded DFU file
+ *  address   - device address of the first byte
+ *
+ *  returns DFU_FILE_OK or a negative dfu_file_error
+ */
+int dfu_image_from_file(struct dfu_image *image, const struct dfu_file *file, uint32_t address)
+{
+    dfu_image_free(image);
+    
+    image->ranges = malloc(sizeof(*image->ranges));
+    
+    if (image->ranges == NULL)
+        return DFU_FILE_ERROR_MEMORY;
+    
+    image->format = DFU_IMAGE_RAW;
+    image->ranges[0].address = address;
+    image->ranges[0].length = file->size.total - file->size.suffix;
+    image->ranges[0].data = file->firmware;
+    image->count = 1;
+    image->capacity = 1;
+    
+    return DFU_FILE_OK;
+}
+
+/*
+ *  Release the ranges, decoded data and mapping of an image
+ */
+void dfu_image_free(struct dfu_image *image)
+{
+    if (image->mapping != NULL)
+        munmap(image->mapping, image->mapping_size);
+    
+    dfu_free(image->allocator, image->decoded);
+    free(image->ranges);
+    
+    image->mapping = NULL;
+    image->mapping_size = 0;
+    image->decoded = NULL;
+    image->decoded_size = 0;
+    image->ranges = NULL;
+    image->count = 0;
+    image->capacity = 0;
+    image->entry = 0;
+}
+
+/*
+ *  Bytes from the lowest to the highest address of an image
+ */
+uint32_t dfu_image_span(const struct dfu_image *image)
+{
+    if (image->count == 0)
+        return 0;
+    
+    const struct dfu_range *last = &image->ranges[image->count - 1];
+    
+    return last->address + last->length - image->ranges[0].address;
+}
+
+/*
+ *  Flatten an image into a DFU file, gaps filled with DFU_IMAGE_FILL and
+ *  a DFU suffix appended, the CRC computed while the data is copied
+ *
+ *  image     - loaded image
+ *  file      - receives the firmware, allocated with file->allocator
+ *  idVendor  - vendor id for the suffix
+ *  idProduct - product id for the suffix
+ *
+ *  returns DFU_FILE_OK or a negative dfu_file_error
+ */
+int dfu_image_to_file(const struct dfu_image *image, struct dfu_file *file,
+                      uint16_t idVendor, uint16_t idProduct)
+{
+    uint32_t span = dfu_image_span(image);
+    uint32_t position = 0;
+    uint32_t crc = 0xffffffff;
+    int i;
+    
+    if (span > DFU_IMAGE_MAX_SPAN)
+    {
+        warnx("%s: Segments span %u bytes, too sparse to flatten", image->name, span);
+        return DFU_FILE_ERROR_SIZE;
+    }
+    
+    dfu_free_file(file);
+    
+    file->firmware = dfu_malloc(file->allocator, span + DFU_SUFFIX_LENGTH);
+    
+    if (file->firmware == NULL)
+    {
+        warnx("Cannot allocate memory of size %u bytes", span + DFU_SUFFIX_LENGTH);
+        return DFU_FILE_ERROR_MEMORY;
+    }
+    
+    for (i = 0; i < image->count; i++)
+    {
+        const struct dfu_range *range = &image->ranges[i];
+        uint32_t gap = range->address - image->ranges[0].address - position;
+        
+        memset(file->firmware + position, DFU_IMAGE_FILL, gap);
+        memcpy(file->firmware + position + gap, range->data, range->length);
+        
+        crc = dfu_crc32(crc, file->firmware + position, gap + range->length);
+        position += gap + range->length;
+    }
+    
+    dfu_suffix_build(file->firmware + span, crc, idVendor, idProduct, 0xffff, DFU_SUFFIX_BCD_DFU);
+    
+    file->size.total = span + DFU_SUFFIX_LENGTH;
+    file->size.suffix = DFU_SUFFIX_LENGTH;
+    file->idVendor = idVendor;
+    file->idProduct = idProduct;
+    file->bcdDevice = 0xffff;
+    file->bcdDFU = DFU_SUFFIX_BCD_DFU;
+    file->dwCRC = read_le32(file->firmware + span + 12);
+    
+    return DFU_FILE_OK;
+}
+
+/*
+ *  Load a .dfu file, or an Intel HEX, S-record or ELF file converted to one
+ *
+ *  file      - name and allocator set by the caller
+ *  idVendor  - vendor id for the suffix of converted images
+ *  idProduct - product id for the suffix of converted images
+ *
+ *  returns DFU_FILE_OK or a negative dfu_file_error
+ */
+int dfu_load_any_file(struct dfu_file *file, uint16_t idVendor, uint16_t idProduct)
+{
+    struct dfu_image image;
+    
+    memset(&image, 0, sizeof(image));
+    image.name = file->name;
+    image.allocator = file->allocator;
+    
+    int result = dfu_image_load(&image);
+    
+    if (result == DFU_FILE_ERROR_FORMAT && image.format == DFU_IMAGE_RAW)
+        return dfu_load_file(file, NEEDS_SUFFIX);
+    
+    if (result == DFU_FILE_OK)
+    {
+        show_image_ranges(&image);
+        result = dfu_image_to_file(&image, file, idVendor, idProduct);
+    }
+    
+    dfu_image_free(&image);
+    
+    return result;
+}
+
+void show_image_ranges(const struct dfu_image *image)
+{
+    static const char *formats[] = { "binary", "Intel HEX", "S-record", "ELF" };
+    int i;
+    
+    printf("The file %s is an %s image with %d segments:\n", image->name, formats[image->format], image->count);
+    
+    for (i = 0; i < image->count; i++)
+        printf("\t0x%08X - 0x%08X (%u bytes)\n", image->ranges[i].address,
+               image->ranges[i].address + image->ranges[i].length - 1, image->ranges[i].length);
+    
+    if (image->entry != 0)
+        printf("Entry:\t\t0x%08X\n", image->entry);
+}
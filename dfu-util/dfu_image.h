@@ -0,0 +1,83 @@
+/*
+ *  Intel HEX, Motorola S-record and ELF firmware images
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef __dfu_util__dfu_image__
+#define __dfu_util__dfu_image__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "dfu_file.h"
+
+#define DFU_IMAGE_FILL          0xff  /* gaps between segments, erased flash */
+
+enum dfu_image_format
+{
+    DFU_IMAGE_RAW,
+    DFU_IMAGE_IHEX,
+    DFU_IMAGE_SREC,
+    DFU_IMAGE_ELF
+};
+
+/* Contiguous bytes at a device address */
+struct dfu_range
+{
+    uint32_t address;
+    uint32_t length;
+    const uint8_t *data;
+};
+
+/*
+ *  Sparse image, ranges sorted by address and never overlapping. ELF
+ *  segments point straight into the file mapping, HEX and S-record data
+ *  is decoded into one buffer.
+ */
+struct dfu_image
+{
+    /* File name */
+    const char *name;
+    /* Allocator used for decoded data, NULL selects malloc() / free() */
+    const struct dfu_allocator *allocator;
+    enum dfu_image_format format;
+    struct dfu_range *ranges;
+    int count;
+    int capacity;
+    /* Start address from the file, 0 if none */
+    uint32_t entry;
+    /* Backing storage */
+    void *mapping;
+    size_t mapping_size;
+    uint8_t *decoded;
+    size_t decoded_size;
+};
+
+enum dfu_image_format dfu_image_detect(const uint8_t *data, size_t size);
+int dfu_image_load(struct dfu_image *image);
+void dfu_image_free(struct dfu_image *image);
+int dfu_image_from_file(struct dfu_image *image, const struct dfu_file *file, uint32_t address);
+uint32_t dfu_image_span(const struct dfu_image *image);
+int dfu_image_to_file(const struct dfu_image *image, struct dfu_file *file,
+                      uint16_t idVendor, uint16_t idProduct);
+int dfu_load_any_file(struct dfu_file *file, uint16_t idVendor, uint16_t idProduct);
+void show_image_ranges(const struct dfu_image *image);
+
+#endif /* defined(__dfu_util__dfu_image__) */
@@ -0,0 +1,418 @@
+/*
+ *  Aggregated DFU metrics, exported in Prometheus text format
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <mach/mach_time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dfu_metrics.h"
+
+static const char *request_names[DFU_METRICS_REQUESTS] =
+{
+    "DETACH", "DNLOAD", "UPLOAD", "GETSTATUS", "CLRSTATUS", "GETSTATE", "ABORT"
+};
+
+static const char *status_names[DFU_METRICS_STATUSES] =
+{
+    "OK", "errTARGET", "errFILE", "errWRITE", "errERASE", "errCHECK_ERASED", "errPROG", "errVERIFY",
+    "errADDRESS", "errNOTDONE", "errFIRMWARE", "errVENDOR", "errUSBR", "errPOR", "errUNKNOWN", "errSTALLEDPKT"
+};
+
+static struct dfu_metrics_collector *collectors;
+static struct dfu_metrics_device *devices;
+
+static __thread struct dfu_metrics_collector *local_collector;
+static pthread_key_t collector_key;
+static pthread_once_t collector_once = PTHREAD_ONCE_INIT;
+
+/*
+ *  Monotonic time
+ *
+ *  returns microseconds since an arbitrary point
+ */
+uint64_t dfu_time_us(void)
+{
+    static mach_timebase_info_data_t timebase;
+    
+    if (timebase.denom == 0)
+        mach_timebase_info(&timebase);
+    
+    return mach_absolute_time() * timebase.numer / timebase.denom / 1000;
+}
+
+static void release_collector(void *context)
+{
+    struct dfu_metrics_collector *collector = context;
+    
+    __atomic_store_n(&collector->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void create_collector_key(void)
+{
+    pthread_key_create(&collector_key, release_collector);
+}
+
+/*
+ *  Collector of the calling thread, taken over from an exited thread or
+ *  allocated and pushed onto the list on first use
+ *
+ *  returns collector or NULL if out of memory
+ */
+static struct dfu_metrics_collector *get_collector(void)
+{
+    struct dfu_metrics_collector *collector = local_collector;
+    
+    if (collector != NULL)
+        return collector;
+    
+    pthread_once(&collector_once, create_collector_key);
+    
+    for (collector = __atomic_load_n(&collectors, __ATOMIC_ACQUIRE); collector != NULL; collector = collector->next)
+    {
+        int expected = 0;
+        
+        if (__atomic_compare_exchange_n(&collector->in_use, &expected, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    
+    if (collector == NULL)
+    {
+        collector = calloc(1, sizeof(*collector));
+        
+        if (collector == NULL)
+            return NULL;
+        
+        collector->in_use = 1;
+        collector->next = __atomic_load_n(&collectors, __ATOMIC_RELAXED);
+        
+        while (!__atomic_compare_exchange_n(&collectors, &collector->next, collector, true,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+    
+    local_collector = collector;
+    pthread_setspecific(collector_key, collector);
+    
+    return collector;
+}
+
+// Single writer, a plain load and store is enough
+static inline void counter_add(uint64_t *counter, uint64_t value)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t counter_get(const uint64_t *counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void histogram_add(struct dfu_histogram *histogram, uint64_t value_us)
+{
+    // Bit length of value - 1 is the smallest i with value <= 2^i
+    int bucket = value_us > 1 ? 64 - __builtin_clzll(value_us - 1) : 0;
+    
+    if (bucket >= DFU_METRICS_BUCKETS)
+        bucket = DFU_METRICS_BUCKETS - 1;
+    
+    counter_add(&histogram->buckets[bucket], 1);
+    counter_add(&histogram->count, 1);
+    counter_add(&histogram->sum_us, value_us);
+}
+
+/*
+ *  Record a completed control request
+ *
+ *  request    - bRequest
+ *  result     - IOReturn of the transfer
+ *  elapsed_us - time from submission to completion
+ */
+void dfu_metrics_request(unsigned char request, IOReturn result, uint64_t elapsed_us)
+{
+    struct dfu_metrics_collector *collector = get_collector();
+    
+    if (collector == NULL || request >= DFU_METRICS_REQUESTS)
+        return;
+    
+    histogram_add(&collector->latency[request], elapsed_us);
+    
+    if (result == kIOUSBPipeStalled)
+        counter_add(&collector->stalls, 1);
+    else if (result != kIOReturnSuccess)
+        counter_add(&collector->request_errors[request], 1);
+}
+
+/*
+ *  Record an error status reported by DFU_GETSTATUS
+ *
+ *  status    - bStatus
+ */
+void dfu_metrics_status(unsigned char status)
+{
+    struct dfu_metrics_collector *collector = get_collector();
+    
+    if (collector != NULL && status < DFU_METRICS_STATUSES)
+        counter_add(&collector->status_errors[status], 1);
+}
+
+/* Record one request resent after a transient error */
+void dfu_metrics_retry(void)
+{
+    struct dfu_metrics_collector *collector = get_collector();
+    
+    if (collector != NULL)
+        counter_add(&collector->retries, 1);
+}
+
+/*
+ *  Record the time a device took from DFU_DETACH back to dfuIDLE
+ *
+ *  elapsed_us - detach to ready time
+ */
+void dfu_metrics_detach_ready(uint64_t elapsed_us)
+{
+    struct dfu_metrics_collector *collector = get_collector();
+    
+    if (collector != NULL)
+        histogram_add(&collector->detach_ready, elapsed_us);
+}
+
+static struct dfu_metrics_device *get_device(unsigned short idVendor, unsigned short idProduct)
+{
+    struct dfu_metrics_device *head = __atomic_load_n(&devices, __ATOMIC_ACQUIRE);
+    struct dfu_metrics_device *device = NULL;
+    
+    for (;;)
+    {
+        struct dfu_metrics_device *entry;
+        
+        for (entry = head; entry != NULL; entry = entry->next)
+            if (entry->idVendor == idVendor && entry->idProduct == idProduct)
+            {
+                free(device);
+                return entry;
+            }
+        
+        if (device == NULL)
+        {
+            device = calloc(1, sizeof(*device));
+            
+            if (device == NULL)
+                return NULL;
+            
+            device->idVendor = idVendor;
+            device->idProduct = idProduct;
+        }
+        
+        device->next = head;
+        
+        // On failure head is reloaded and rescanned, another thread may have added the device
+        if (__atomic_compare_exchange_n(&devices, &head, device, false, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+            return device;
+    }
+}
+
+/*
+ *  Record a completed image transfer
+ *
+ *  idVendor   - USB vendor id of the device
+ *  idProduct  - USB product id of the device
+ *  bytes      - bytes transferred
+ *  elapsed_us - duration of the transfer
+ */
+void dfu_metrics_transfer(unsigned short idVendor, unsigned short idProduct, uint64_t bytes, uint64_t elapsed_us)
+{
+    struct dfu_metrics_device *device = get_device(idVendor, idProduct);
+    
+    if (device == NULL)
+        return;
+    
+    // Devices are shared between threads, once per transfer this is cheap
+    __atomic_fetch_add(&device->bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&device->transfer_us, elapsed_us, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&device->transfers, 1, __ATOMIC_RELAXED);
+}
+
+static void histogram_merge(struct dfu_histogram *total, const struct dfu_histogram *histogram)
+{
+    int i;
+    
+    for (i = 0; i < DFU_METRICS_BUCKETS; i++)
+        total->buckets[i] += counter_get(&histogram->buckets[i]);
+    
+    total->count += counter_get(&histogram->count);
+    total->sum_us += counter_get(&histogram->sum_us);
+}
+
+static void write_histogram(FILE *out, const char *name, const char *labels, const struct dfu_histogram *histogram)
+{
+    uint64_t cumulative = 0;
+    int i;
+    
+    for (i = 0; i < DFU_METRICS_BUCKETS - 1; i++)
+    {
+        cumulative += histogram->buckets[i];
+        fprintf(out, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, *labels ? "," : "",
+                (double)(1ULL << i) / 1e6, (unsigned long long)cumulative);
+    }
+    
+    fprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, *labels ? "," : "",
+            (unsigned long long)histogram->count);
+    fprintf(out, "%s_sum%s%s%s %g\n", name, *labels ? "{" : "", labels, *labels ? "}" : "", histogram->sum_us / 1e6);
+    fprintf(out, "%s_count%s%s%s %llu\n", name, *labels ? "{" : "", labels, *labels ? "}" : "",
+            (unsigned long long)histogram->count);
+}
+
+/*
+ *  Write all metrics in Prometheus text exposition format
+ *
+ *  out       - output stream
+ *
+ *  returns non-zero on write error
+ */
+int dfu_metrics_write(FILE *out)
+{
+    struct dfu_metrics_collector total;
+    struct dfu_metrics_collector *collector;
+    struct dfu_metrics_device *device;
+    char labels[64];
+    int i, j;
+    
+    memset(&total, 0, sizeof(total));
+    
+    for (collector = __atomic_load_n(&collectors, __ATOMIC_ACQUIRE); collector != NULL; collector = collector->next)
+    {
+        for (i = 0; i < DFU_METRICS_REQUESTS; i++)
+        {
+            histogram_merge(&total.latency[i], &collector->latency[i]);
+            total.request_errors[i] += counter_get(&collector->request_errors[i]);
+        }
+        
+        for (j = 0; j < DFU_METRICS_STATUSES; j++)
+            total.status_errors[j] += counter_get(&collector->status_errors[j]);
+        
+        histogram_merge(&total.detach_ready, &collector->detach_ready);
+        total.stalls += counter_get(&collector->stalls);
+        total.retries += counter_get(&collector->retries);
+    }
+    
+    fprintf(out, "# HELP dfu_request_duration_seconds DFU class request latency.\n");
+    fprintf(out, "# TYPE dfu_request_duration_seconds histogram\n");
+    
+    for (i = 0; i < DFU_METRICS_REQUESTS; i++)
+    {
+        snprintf(labels, sizeof(labels), "request=\"%s\"", request_names[i]);
+        write_histogram(out, "dfu_request_duration_seconds", labels, &total.latency[i]);
+    }
+    
+    fprintf(out, "# HELP dfu_request_errors_total DFU class requests failed by the transport, stalls excluded.\n");
+    fprintf(out, "# TYPE dfu_request_errors_total counter\n");
+    
+    for (i = 0; i < DFU_METRICS_REQUESTS; i++)
+        fprintf(out, "dfu_request_errors_total{request=\"%s\"} %llu\n", request_names[i],
+                (unsigned long long)total.request_errors[i]);
+    
+    fprintf(out, "# HELP dfu_stalls_total Requests stalled by the device.\n");
+    fprintf(out, "# TYPE dfu_stalls_total counter\n");
+    fprintf(out, "dfu_stalls_total %llu\n", (unsigned long long)total.stalls);
+    
+    fprintf(out, "# HELP dfu_retries_total Requests resent after a transient error.\n");
+    fprintf(out, "# TYPE dfu_retries_total counter\n");
+    fprintf(out, "dfu_retries_total %llu\n", (unsigned long long)total.retries);
+    
+    fprintf(out, "# HELP dfu_status_errors_total Error status reported by DFU_GETSTATUS.\n");
+    fprintf(out, "# TYPE dfu_status_errors_total counter\n");
+    
+    for (j = 1; j < DFU_METRICS_STATUSES; j++)
+        fprintf(out, "dfu_status_errors_total{status=\"%s\",description=\"%s\"} %llu\n",
+                status_names[j], dfu_status_to_string(j), (unsigned long long)total.status_errors[j]);
+    
+    fprintf(out, "# HELP dfu_detach_ready_seconds Time from DFU_DETACH until the device is in dfuIDLE.\n");
+    fprintf(out, "# TYPE dfu_detach_ready_seconds histogram\n");
+    write_histogram(out, "dfu_detach_ready_seconds", "", &total.detach_ready);
+    
+    fprintf(out, "# HELP dfu_device_bytes_total Firmware bytes transferred per device.\n");
+    fprintf(out, "# TYPE dfu_device_bytes_total counter\n");
+    
+    for (device = __atomic_load_n(&devices, __ATOMIC_ACQUIRE); device != NULL; device = device->next)
+        fprintf(out, "dfu_device_bytes_total{device=\"%04x:%04x\"} %llu\n", device->idVendor, device->idProduct,
+                (unsigned long long)__atomic_load_n(&device->bytes, __ATOMIC_RELAXED));
+    
+    fprintf(out, "# HELP dfu_device_bytes_per_second Average transfer rate per device.\n");
+    fprintf(out, "# TYPE dfu_device_bytes_per_second gauge\n");
+    
+    for (device = __atomic_load_n(&devices, __ATOMIC_ACQUIRE); device != NULL; device = device->next)
+    {
+        uint64_t bytes = __atomic_load_n(&device->bytes, __ATOMIC_RELAXED);
+        uint64_t elapsed = __atomic_load_n(&device->transfer_us, __ATOMIC_RELAXED);
+        
+        fprintf(out, "dfu_device_bytes_per_second{device=\"%04x:%04x\"} %g\n", device->idVendor, device->idProduct,
+                elapsed > 0 ? bytes * 1e6 / elapsed : 0.0);
+    }
+    
+    return ferror(out) ? -1 : 0;
+}
+
+/*
+ *  Replace a metrics file atomically, for the node exporter textfile
+ *  collector or any other reader polling it
+ *
+ *  path      - metrics file
+ *
+ *  returns non-zero on error
+ */
+int dfu_metrics_export(const char *path)
+{
+    char temporary[PATH_MAX];
+    
+    snprintf(temporary, sizeof(temporary), "%s.XXXXXX", path);
+    
+    int fd = mkstemp(temporary);
+    
+    if (fd < 0)
+        return -1;
+    
+    FILE *out = fdopen(fd, "w");
+    
+    if (out == NULL)
+    {
+        close(fd);
+        unlink(temporary);
+        return -1;
+    }
+    
+    int result = dfu_metrics_write(out);
+    
+    if (fclose(out) != 0)
+        result = -1;
+    
+    if (result == 0 && rename(temporary, path) != 0)
+        result = -1;
+    
+    if (result != 0)
+        unlink(temporary);
+    
+    return result;
+}
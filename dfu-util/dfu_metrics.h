@@ -0,0 +1,84 @@
+/*
+ *  Aggregated DFU metrics, exported in Prometheus text format
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef __dfu_util__dfu_metrics__
+#define __dfu_util__dfu_metrics__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "dfu.h"
+
+#define DFU_METRICS_REQUESTS    7     /* DFU_DETACH .. DFU_ABORT */
+#define DFU_METRICS_STATUSES    16    /* DFU_STATUS_OK .. DFU_STATUS_ERROR_STALLEDPKT */
+#define DFU_METRICS_BUCKETS     24    /* powers of two microseconds, 1 us .. 8 s */
+
+/* Bucket i counts values of at most 2^i microseconds */
+struct dfu_histogram
+{
+    uint64_t buckets[DFU_METRICS_BUCKETS];
+    uint64_t count;
+    uint64_t sum_us;
+};
+
+/*
+ *  Counters of one thread. Only the owning thread writes them, so the
+ *  transfer loop never takes a lock or a locked instruction; readers sum
+ *  all collectors with relaxed loads. Collectors of exited threads are
+ *  handed to new threads instead of being freed, counts keep accumulating.
+ */
+struct dfu_metrics_collector
+{
+    struct dfu_histogram latency[DFU_METRICS_REQUESTS];
+    uint64_t request_errors[DFU_METRICS_REQUESTS];
+    uint64_t stalls;
+    uint64_t retries;
+    /* Non-OK bStatus reported by DFU_GETSTATUS */
+    uint64_t status_errors[DFU_METRICS_STATUSES];
+    /* From DFU_DETACH until the device is back in dfuIDLE */
+    struct dfu_histogram detach_ready;
+    int in_use;
+    struct dfu_metrics_collector *next;
+};
+
+/* Throughput per device, updated once per transfer */
+struct dfu_metrics_device
+{
+    unsigned short idVendor;
+    unsigned short idProduct;
+    uint64_t bytes;
+    uint64_t transfer_us;
+    uint64_t transfers;
+    struct dfu_metrics_device *next;
+};
+
+uint64_t dfu_time_us(void);
+
+void dfu_metrics_request(unsigned char request, IOReturn result, uint64_t elapsed_us);
+void dfu_metrics_status(unsigned char status);
+void dfu_metrics_retry(void);
+void dfu_metrics_detach_ready(uint64_t elapsed_us);
+void dfu_metrics_transfer(unsigned short idVendor, unsigned short idProduct, uint64_t bytes, uint64_t elapsed_us);
+
+int dfu_metrics_write(FILE *out);
+int dfu_metrics_export(const char *path);
+
+#endif /* defined(__dfu_util__dfu_metrics__) */
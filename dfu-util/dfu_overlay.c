@@ -0,0 +1,353 @@
+/*
+ *  Per-device patches over a shared read-only image
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dfu_overlay.h"
+
+#define DFU_OVERLAY_MAX_PATCH   4096
+
+static const uint8_t *dfu_overlay_read(void *context, int offset, int size);
+
+/*
+ *  Start an overlay without patches
+ *
+ *  overlay   - overlay to initialize
+ *  base      - shared image, only read
+ *  size      - bytes of the image that are sent
+ */
+void dfu_overlay_init(struct dfu_overlay *overlay, const uint8_t *base, uint32_t size)
+{
+    memset(overlay, 0, sizeof(*overlay));
+    
+    overlay->base = base;
+    overlay->size = size;
+    overlay->source.read = dfu_overlay_read;
+    overlay->source.context = overlay;
+}
+
+/* Index of the first patch that ends after offset */
+static int dfu_overlay_find(const struct dfu_overlay *overlay, uint32_t offset)
+{
+    int low = 0;
+    int high = overlay->count;
+    
+    while (low < high)
+    {
+        int middle = (low + high) / 2;
+        const struct dfu_patch *patch = &overlay->patches[middle];
+        
+        if (patch->offset + patch->length <= offset)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    
+    return low;
+}
+
+/*
+ *  Replace bytes of the image for this overlay only
+ *
+ *  overlay   - initialized overlay
+ *  offset    - offset into the image
+ *  data      - replacement bytes, copied
+ *  length    - number of bytes
+ *
+ *  returns DFU_FILE_OK or a negative dfu_file_error
+ */
+int dfu_overlay_add(struct dfu_overlay *overlay, uint32_t offset, const uint8_t *data, uint32_t length)
+{
+    if (length == 0)
+        return DFU_FILE_OK;
+    
+    if (offset >= overlay->size || length > overlay->size - offset)
+        return DFU_FILE_ERROR_SIZE;
+    
+    int index = dfu_overlay_find(overlay, offset);
+    
+    if (index < overlay->count && overlay->patches[index].offset < offset + length)
+        return DFU_FILE_ERROR_OVERLAP;
+    
+    if (overlay->count == overlay->capacity)
+    {
+        int capacity = overlay->capacity > 0 ? overlay->capacity * 2 : 8;
+        struct dfu_patch *patches = realloc(overlay->patches, capacity * sizeof(*patches));
+        
+        if (patches == NULL)
+            return DFU_FILE_ERROR_MEMORY;
+        
+        overlay->patches = patches;
+        overlay->capacity = capacity;
+    }
+    
+    if (overlay->bytes_size + length > overlay->bytes_capacity)
+    {
+        uint32_t capacity = overlay->bytes_capacity > 0 ? overlay->bytes_capacity : 64;
+        
+        while (capacity < overlay->bytes_size + length)
+            capacity *= 2;
+        
+        uint8_t *bytes = realloc(overlay->bytes, capacity);
+        
+        if (bytes == NULL)
+            return DFU_FILE_ERROR_MEMORY;
+        
+        overlay->bytes = bytes;
+        overlay->bytes_capacity = capacity;
+    }
+    
+    memmove(&overlay->patches[index + 1], &overlay->patches[index],
+            (overlay->count - index) * sizeof(*overlay->patches));
+    
+    overlay->patches[index].offset = offset;
+    overlay->patches[index].length = length;
+    overlay->patches[index].position = overlay->bytes_size;
+    overlay->count++;
+    
+    memcpy(overlay->bytes + overlay->bytes_size, data, length);
+    overlay->bytes_size += length;
+    
+    return DFU_FILE_OK;
+}
+
+/* Replacement bytes of one line, hex digits or a quoted string */
+static int dfu_overlay_parse_data(const char *text, uint8_t *data, uint32_t *length)
+{
+    *length = 0;
+    
+    if (*text == '"')
+    {
+        const char *end = strrchr(text + 1, '"');
+        
+        if (end == NULL)
+            return DFU_FILE_ERROR_FORMAT;
+        
+        for (text++; text < end; text++)
+        {
+            if (*length == DFU_OVERLAY_MAX_PATCH)
+                return DFU_FILE_ERROR_SIZE;
+            
+            data[(*length)++] = *text;
+        }
+        
+        return DFU_FILE_OK;
+    }
+    
+    while (*text != '\0')
+    {
+        if (isspace((unsigned char)*text))
+        {
+            text++;
+            continue;
+        }
+        
+        if (!isxdigit((unsigned char)text[0]) || !isxdigit((unsigned char)text[1]))
+            return DFU_FILE_ERROR_FORMAT;
+        
+        if (*length == DFU_OVERLAY_MAX_PATCH)
+            return DFU_FILE_ERROR_SIZE;
+        
+        char digits[3] = { text[0], text[1], '\0' };
+        
+        data[(*length)++] = (uint8_t)strtoul(digits, NULL, 16);
+        text += 2;
+    }
+    
+    return *length > 0 ? DFU_FILE_OK : DFU_FILE_ERROR_FORMAT;
+}
+
+/*
+ *  Add the patches of a file, one per line as a hex offset followed by hex
+ *  bytes or a "quoted string", '#' starts a comment
+ *
+ *      0x3f00 "SN-000417"
+ *      0x3f10 a5 5a 01 00 7c 12
+ *
+ *  overlay   - initialized overlay
+ *  path      - patch file
+ *
+ *  returns DFU_FILE_OK or a negative dfu_file_error
+ */
+int dfu_overlay_load(struct dfu_overlay *overlay, const char *path)
+{
+    char line[2 * DFU_OVERLAY_MAX_PATCH + 64];
+    int result = DFU_FILE_OK;
+    int number = 0;
+    FILE *file = fopen(path, "r");
+    
+    if (file == NULL)
+        return DFU_FILE_ERROR_OPEN;
+    
+    uint8_t *data = malloc(DFU_OVERLAY_MAX_PATCH);
+    
+    if (data == NULL)
+    {
+        fclose(file);
+        return DFU_FILE_ERROR_MEMORY;
+    }
+    
+    while (result == DFU_FILE_OK && fgets(line, sizeof(line), file) != NULL)
+    {
+        char *text = line;
+        char *end;
+        uint32_t length;
+        
+        number++;
+        
+        // Comments end the line unless inside a string
+        char *quote = strchr(text, '"');
+        char *comment = strchr(text, '#');
+        
+        if (comment != NULL && (quote == NULL || comment < quote))
+            *comment = '\0';
+        
+        text[strcspn(text, "\r\n")] = '\0';
+        
+        while (isspace((unsigned char)*text))
+            text++;
+        
+        if (*text == '\0')
+            continue;
+        
+        unsigned long offset = strtoul(text, &end, 16);
+        
+        if (end == text || !isspace((unsigned char)*end))
+            result = DFU_FILE_ERROR_FORMAT;
+        else
+        {
+            while (isspace((unsigned char)*end))
+                end++;
+            
+            result = dfu_overlay_parse_data(end, data, &length);
+        }
+        
+        if (result == DFU_FILE_OK)
+            result = dfu_overlay_add(overlay, (uint32_t)offset, data, length);
+        
+        if (result != DFU_FILE_OK)
+            fprintf(stderr, "[!] %s:%d: %s.\n", path, number, dfu_file_error_to_string(result));
+    }
+    
+    free(data);
+    fclose(file);
+    
+    return result;
+}
+
+/*
+ *  dfu_source read hook, the base in place unless a patch is touched
+ */
+static const uint8_t *dfu_overlay_read(void *context, int offset, int size)
+{
+    struct dfu_overlay *overlay = context;
+    uint32_t start = (uint32_t)offset;
+    uint32_t end = start + (uint32_t)size;
+    int index = dfu_overlay_find(overlay, start);
+    
+    if (index == overlay->count || overlay->patches[index].offset >= end)
+        return overlay->base + start;
+    
+    if (size > overlay->block_size)
+    {
+        uint8_t *block = realloc(overlay->block, size);
+        
+        if (block == NULL)
+            return NULL;
+        
+        overlay->block = block;
+        overlay->block_size = size;
+    }
+    
+    memcpy(overlay->block, overlay->base + start, size);
+    
+    for (; index < overlay->count && overlay->patches[index].offset < end; index++)
+    {
+        const struct dfu_patch *patch = &overlay->patches[index];
+        uint32_t from = patch->offset > start ? patch->offset : start;
+        uint32_t to = patch->offset + patch->length < end ? patch->offset + patch->length : end;
+        
+        memcpy(overlay->block + (from - start),
+               overlay->bytes + patch->position + (from - patch->offset),
+               to - from);
+    }
+    
+    return overlay->block;
+}
+
+/*
+ *  CRC of the patched image from the CRC of the base without reading it.
+ *  The CRC is linear, so every patch changes it by the CRC of the bytes it
+ *  flips followed by as many zeros as there are bytes after it.
+ *
+ *  overlay   - overlay with patches
+ *  crc       - dfu_crc32() of the first length bytes of the base, e.g. the
+ *              suffix CRC
+ *  length    - bytes covered by crc
+ *
+ *  returns the CRC of the same bytes with the patches applied
+ */
+uint32_t dfu_overlay_crc(const struct dfu_overlay *overlay, uint32_t crc, uint32_t length)
+{
+    for (int i = 0; i < overlay->count; i++)
+    {
+        const struct dfu_patch *patch = &overlay->patches[i];
+        uint32_t delta = 0;
+        
+        if (patch->offset >= length)
+            break;
+        
+        uint32_t covered = patch->offset + patch->length <= length ? patch->length : length - patch->offset;
+        
+        for (uint32_t j = 0; j < covered; j++)
+        {
+            uint8_t flipped = overlay->base[patch->offset + j] ^ overlay->bytes[patch->position + j];
+            
+            delta = dfu_crc32(delta, &flipped, 1);
+        }
+        
+        crc ^= dfu_crc32_zeros(delta, length - (patch->offset + covered));
+    }
+    
+    return crc;
+}
+
+/*
+ *  Release the patches of an overlay, the base is left alone
+ */
+void dfu_overlay_free(struct dfu_overlay *overlay)
+{
+    free(overlay->patches);
+    free(overlay->bytes);
+    free(overlay->block);
+    
+    overlay->patches = NULL;
+    overlay->bytes = NULL;
+    overlay->block = NULL;
+    overlay->count = 0;
+    overlay->capacity = 0;
+    overlay->bytes_size = 0;
+    overlay->bytes_capacity = 0;
+    overlay->block_size = 0;
+}
@@ -0,0 +1,71 @@
+/*
+ *  Per-device patches over a shared read-only image
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef __dfu_util__dfu_overlay__
+#define __dfu_util__dfu_overlay__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "dfu_file.h"
+#include "dfu_transfer.h"
+
+/* Bytes replaced at an offset of the image */
+struct dfu_patch
+{
+    uint32_t offset;
+    uint32_t length;
+    /* Start of the replacement in the overlay's byte arena */
+    uint32_t position;
+};
+
+/*
+ *  Scatter-gather view of an image: blocks that touch no patch are read
+ *  from the base in place, only blocks with patched bytes are composed in
+ *  a one block buffer. The base is never written, so any number of
+ *  overlays can share one loaded image.
+ */
+struct dfu_overlay
+{
+    const uint8_t *base;
+    uint32_t size;
+    /* Sorted by offset, never overlapping */
+    struct dfu_patch *patches;
+    int count;
+    int capacity;
+    /* Replacement bytes of all patches */
+    uint8_t *bytes;
+    uint32_t bytes_size;
+    uint32_t bytes_capacity;
+    /* Composed block */
+    uint8_t *block;
+    int block_size;
+    /* Passed as dfu_session.source */
+    struct dfu_source source;
+};
+
+void dfu_overlay_init(struct dfu_overlay *overlay, const uint8_t *base, uint32_t size);
+int dfu_overlay_add(struct dfu_overlay *overlay, uint32_t offset, const uint8_t *data, uint32_t length);
+int dfu_overlay_load(struct dfu_overlay *overlay, const char *path);
+uint32_t dfu_overlay_crc(const struct dfu_overlay *overlay, uint32_t crc, uint32_t length);
+void dfu_overlay_free(struct dfu_overlay *overlay);
+
+#endif /* defined(__dfu_util__dfu_overlay__) */
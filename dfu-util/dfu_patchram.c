@@ -0,0 +1,229 @@
+/*
+ *  Broadcom PatchRAM download from .hcd files
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dfu_patchram.h"
+#include "dfu_file.h"
+#include "dfu_metrics.h"
+
+static const uint8_t launch_address[4] = { 0xff, 0xff, 0xff, 0xff };
+
+/*
+ *  Split an .hcd file into its commands
+ *
+ *  hcd       - records found, point into data
+ *  data      - file contents, without a DFU suffix
+ *  size      - file size
+ *
+ *  returns DFU_FILE_OK or a dfu_file_error
+ */
+int dfu_hcd_parse(struct dfu_hcd *hcd, const uint8_t *data, size_t size)
+{
+    int capacity = 0;
+    
+    memset(hcd, 0, sizeof(*hcd));
+    
+    for (size_t offset = 0; offset < size; )
+    {
+        if (size - offset < 3 || size - offset - 3 < data[offset + 2])
+        {
+            warnx("Truncated HCI command at offset %zu", offset);
+            dfu_hcd_free(hcd);
+            return DFU_FILE_ERROR_FORMAT;
+        }
+        
+        if (hcd->count == capacity)
+        {
+            capacity = capacity > 0 ? capacity * 2 : 256;
+            
+            struct dfu_hcd_record *records = realloc(hcd->records, capacity * sizeof(*records));
+            
+            if (records == NULL)
+            {
+                dfu_hcd_free(hcd);
+                return DFU_FILE_ERROR_MEMORY;
+            }
+            
+            hcd->records = records;
+        }
+        
+        struct dfu_hcd_record *record = &hcd->records[hcd->count++];
+        
+        record->opcode = data[offset] | (data[offset + 1] << 8);
+        record->length = data[offset + 2];
+        record->parameters = data + offset + 3;
+        
+        if (record->opcode == HCI_BRCM_WRITE_RAM)
+        {
+            if (record->length < 4)
+            {
+                warnx("Write_RAM without an address at offset %zu", offset);
+                dfu_hcd_free(hcd);
+                return DFU_FILE_ERROR_FORMAT;
+            }
+            
+            hcd->size += record->length - 4;
+        }
+        
+        offset += 3 + record->length;
+    }
+    
+    if (hcd->count == 0)
+    {
+        warnx("No HCI commands in file");
+        return DFU_FILE_ERROR_FORMAT;
+    }
+    
+    return DFU_FILE_OK;
+}
+
+void dfu_hcd_free(struct dfu_hcd *hcd)
+{
+    free(hcd->records);
+    
+    hcd->records = NULL;
+    hcd->count = 0;
+}
+
+/*
+ *  Wait for the oldest command in flight, completions come in order
+ */
+static IOReturn dfu_patchram_complete(struct dfu_hci *hci, const struct dfu_hcd *hcd, int record)
+{
+    struct dfu_hci_completion completion;
+    IOReturn result = dfu_hci_receive(hci, &completion);
+    
+    if (result != kIOReturnSuccess)
+    {
+        fprintf(stderr, "[!] No completion for PatchRAM record %d: 0x%08x.\n", record, result);
+        return result;
+    }
+    
+    if (completion.opcode != hcd->records[record].opcode || completion.status != 0)
+    {
+        fprintf(stderr, "[!] PatchRAM record %d (0x%04x) failed, controller completed 0x%04x with status 0x%02x.\n",
+                record, hcd->records[record].opcode, completion.opcode, completion.status);
+        return kIOReturnError;
+    }
+    
+    return kIOReturnSuccess;
+}
+
+/*
+ *  Load a patch into the RAM of a Broadcom controller and start it
+ *
+ *  Download_Minidriver switches the controller into download mode. The
+ *  Write_RAM records are then kept in flight as far as the credits of
+ *  the controller and in_flight allow, every other record waits for the
+ *  ones before it. Launch_RAM, added if the file lacks it, and HCI_Reset
+ *  start the patch.
+ *
+ *  hci       - context with a transport
+ *  hcd       - parsed patch
+ *  in_flight - Write_RAM commands sent ahead of their completion at most
+ *
+ *  returns IOReturn value
+ */
+IOReturn dfu_patchram_download(struct dfu_hci *hci, const struct dfu_hcd *hcd, int in_flight)
+{
+    IOReturn result = dfu_hci_command(hci, HCI_BRCM_DOWNLOAD_MINIDRIVER, NULL, 0);
+    
+    if (result != kIOReturnSuccess)
+    {
+        fprintf(stderr, "[!] Controller did not enter download mode: 0x%08x.\n", result);
+        return result;
+    }
+    
+    dfu_hci_wait(hci, DFU_PATCHRAM_MINIDRIVER_DELAY);
+    
+    if (in_flight < 1)
+        in_flight = 1;
+    
+    uint64_t start = dfu_time_us();
+    bool launched = false;
+    int completed = 0;
+    int deepest = 0;
+    
+    for (int sent = 0; sent < hcd->count; sent++)
+    {
+        const struct dfu_hcd_record *record = &hcd->records[sent];
+        bool pipelined = record->opcode == HCI_BRCM_WRITE_RAM &&
+                         (sent == 0 || hcd->records[sent - 1].opcode == HCI_BRCM_WRITE_RAM);
+        
+        // Ordinary commands run alone, Write_RAM waits for credits and a free slot
+        while (completed < sent && (!pipelined || hci->credits == 0 || sent - completed >= in_flight))
+        {
+            result = dfu_patchram_complete(hci, hcd, completed);
+            
+            if (result != kIOReturnSuccess)
+                return result;
+            
+            completed++;
+        }
+        
+        result = dfu_hci_send(hci, record->opcode, record->parameters, record->length);
+        
+        if (result != kIOReturnSuccess)
+        {
+            fprintf(stderr, "[!] Failed to send PatchRAM record %d: 0x%08x.\n", sent, result);
+            return result;
+        }
+        
+        launched |= record->opcode == HCI_BRCM_LAUNCH_RAM;
+        
+        if (sent + 1 - completed > deepest)
+            deepest = sent + 1 - completed;
+    }
+    
+    for (; completed < hcd->count; completed++)
+    {
+        result = dfu_patchram_complete(hci, hcd, completed);
+        
+        if (result != kIOReturnSuccess)
+            return result;
+    }
+    
+    uint64_t elapsed = dfu_time_us() - start;
+    
+    printf("[i] Wrote %d records (%u bytes) in %.1f ms, up to %d commands in flight.\n",
+           hcd->count, hcd->size, elapsed / 1000.0, deepest);
+    
+    if (!launched)
+    {
+        result = dfu_hci_command(hci, HCI_BRCM_LAUNCH_RAM, launch_address, sizeof(launch_address));
+        
+        if (result != kIOReturnSuccess)
+            return result;
+    }
+    
+    dfu_hci_wait(hci, DFU_PATCHRAM_LAUNCH_DELAY);
+    
+    result = dfu_hci_command(hci, HCI_RESET, NULL, 0);
+    
+    if (result != kIOReturnSuccess)
+        fprintf(stderr, "[!] Controller did not come back after launching the patch: 0x%08x.\n", result);
+    
+    return result;
+}
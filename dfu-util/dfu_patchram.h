@@ -0,0 +1,62 @@
+/*
+ *  Broadcom PatchRAM download from .hcd files
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef __dfu_util__dfu_patchram__
+#define __dfu_util__dfu_patchram__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dfu_hci.h"
+
+#define HCI_BRCM_DOWNLOAD_MINIDRIVER    0xfc2e
+#define HCI_BRCM_WRITE_RAM              0xfc4c
+#define HCI_BRCM_LAUNCH_RAM             0xfc4e
+
+#define DFU_PATCHRAM_MINIDRIVER_DELAY   50    /* ms before the first Write_RAM */
+#define DFU_PATCHRAM_LAUNCH_DELAY       250   /* ms for the patch to start */
+#define DFU_PATCHRAM_IN_FLIGHT          8     /* Write_RAM commands in flight at most */
+
+/* One HCI command of an .hcd file, parameters point into the file */
+struct dfu_hcd_record
+{
+    uint16_t opcode;
+    uint8_t length;
+    const uint8_t *parameters;
+};
+
+/*
+ *  .hcd files are a plain sequence of HCI command packets, Write_RAM
+ *  records carrying a 32-bit address and data, ending with Launch_RAM.
+ */
+struct dfu_hcd
+{
+    struct dfu_hcd_record *records;
+    int count;
+    /* Data bytes of all Write_RAM records */
+    uint32_t size;
+};
+
+int dfu_hcd_parse(struct dfu_hcd *hcd, const uint8_t *data, size_t size);
+void dfu_hcd_free(struct dfu_hcd *hcd);
+IOReturn dfu_patchram_download(struct dfu_hci *hci, const struct dfu_hcd *hcd, int in_flight);
+
+#endif /* defined(__dfu_util__dfu_patchram__) */
@@ -0,0 +1,260 @@
+/*
+ *  Flash time prediction on a virtual clock
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "dfu_predict.h"
+#include "dfu_sim.h"
+#include "dfu_state.h"
+#include "dfu_transfer.h"
+
+/* Simulated device whose requests take modeled time on a virtual clock */
+struct dfu_predictor
+{
+    struct dfu_sim sim;
+    const struct dfu_timing *timing;
+    uint64_t clock_us;
+    /* The device answers no request before this, it is programming a block */
+    uint64_t busy_until;
+    uint32_t random;
+};
+
+static uint64_t dfu_predict_bus_us(const struct dfu_timing *timing, int bytes)
+{
+    return timing->request_us + (uint64_t)bytes * 1000 / timing->bus_rate;
+}
+
+static unsigned int dfu_predict_poll(struct dfu_predictor *predictor)
+{
+    const struct dfu_timing *timing = predictor->timing;
+    
+    if (timing->poll_max <= timing->poll_min)
+        return timing->poll_min;
+    
+    // xorshift32, repeatable between runs
+    predictor->random ^= predictor->random << 13;
+    predictor->random ^= predictor->random >> 17;
+    predictor->random ^= predictor->random << 5;
+    
+    return timing->poll_min + predictor->random % (timing->poll_max - timing->poll_min + 1);
+}
+
+static IOReturn dfu_predict_control(void *context, IOUSBDevRequestTO *request)
+{
+    struct dfu_predictor *predictor = context;
+    
+    if (predictor->clock_us < predictor->busy_until)
+        predictor->clock_us = predictor->busy_until;
+    
+    predictor->clock_us += dfu_predict_bus_us(predictor->timing, request->wLength);
+    
+    if (request->bRequest == DFU_DNLOAD)
+    {
+        unsigned int busy = request->wLength > 0 ? dfu_predict_poll(predictor) : predictor->timing->manifest;
+        
+        predictor->sim.poll_timeout = busy;
+        predictor->busy_until = predictor->clock_us + (uint64_t)busy * 1000;
+    }
+    
+    return dfu_sim_control(&predictor->sim, request);
+}
+
+static IOReturn dfu_predict_reset(void *context)
+{
+    struct dfu_predictor *predictor = context;
+    
+    predictor->clock_us += (uint64_t)predictor->timing->detach * 1000;
+    
+    return dfu_sim_reset(&predictor->sim);
+}
+
+static void dfu_predict_wait(void *context, unsigned int ms)
+{
+    struct dfu_predictor *predictor = context;
+    
+    predictor->clock_us += (uint64_t)ms * 1000;
+}
+
+/*
+ *  Default timing of a full speed device
+ *
+ *  timing    - timing to initialize
+ */
+void dfu_timing_init(struct dfu_timing *timing)
+{
+    memset(timing, 0, sizeof(*timing));
+    
+    timing->transfer_size = DFU_SIM_TRANSFER_SIZE;
+    timing->poll_min = DFU_SIM_POLL_TIMEOUT;
+    timing->poll_max = DFU_SIM_POLL_TIMEOUT;
+    timing->detach = DFU_PREDICT_DETACH;
+    timing->manifest = DFU_PREDICT_MANIFEST;
+    timing->request_us = DFU_PREDICT_REQUEST_US;
+    timing->bus_rate = DFU_PREDICT_BUS_RATE;
+}
+
+/*
+ *  Take the timing a device model showed in earlier runs, fields the
+ *  profile did not observe keep their value
+ *
+ *  timing    - initialized timing
+ *  profile   - stored device profile
+ */
+void dfu_timing_from_profile(struct dfu_timing *timing, const struct dfu_profile *profile)
+{
+    if (profile->transfer_size > 0)
+        timing->transfer_size = profile->transfer_size;
+    else if (profile->wTransferSize > 0)
+        timing->transfer_size = profile->wTransferSize;
+    
+    if (profile->poll_timeout > 0)
+        timing->poll_min = timing->poll_max = profile->poll_timeout;
+    
+    if (profile->detach_ready > 0)
+        timing->detach = profile->detach_ready;
+    
+    // The status request carries no data, its latency is the request overhead
+    if (profile->latency[DFU_GETSTATUS] > 0)
+        timing->request_us = profile->latency[DFU_GETSTATUS];
+}
+
+/*
+ *  Closed form of what the transfer code does: one DFU_DNLOAD and one
+ *  DFU_GETSTATUS per block, the status waits for the block to be programmed
+ *
+ *  timing     - device timing
+ *  size       - image size without DFU suffix
+ *  prediction - model fields are filled in
+ */
+void dfu_predict_model(const struct dfu_timing *timing, int size, struct dfu_prediction *prediction)
+{
+    uint64_t poll_us = (uint64_t)(timing->poll_min + timing->poll_max) * 1000 / 2;
+    int full = size / timing->transfer_size;
+    int rest = size % timing->transfer_size;
+    
+    prediction->blocks = full + (rest > 0);
+    prediction->block_bus_us = dfu_predict_bus_us(timing, timing->transfer_size) + dfu_predict_bus_us(timing, 6);
+    prediction->block_device_us = poll_us;
+    
+    // DFU_GETSTATUS, then DFU_DETACH, reset and DFU_GETSTATUS from run-time mode
+    prediction->fixed_us = dfu_predict_bus_us(timing, 6);
+    
+    if (timing->detach > 0)
+        prediction->fixed_us += dfu_predict_bus_us(timing, 0) + dfu_predict_bus_us(timing, 6) +
+                                (uint64_t)timing->detach * 1000;
+    
+    // DFU_GETSTATUS, bwPollTimeout, zero length DFU_DNLOAD, DFU_GETSTATUS, reset
+    prediction->fixed_us += 2 * dfu_predict_bus_us(timing, 6) + poll_us + dfu_predict_bus_us(timing, 0) +
+                            (uint64_t)(timing->manifest + timing->detach) * 1000;
+    
+    prediction->model_us = prediction->fixed_us + full * (prediction->block_bus_us + poll_us);
+    
+    if (rest > 0)
+        prediction->model_us += dfu_predict_bus_us(timing, rest) + dfu_predict_bus_us(timing, 6) + poll_us;
+}
+
+/*
+ *  Flash a simulated device with the real transfer code, every request
+ *  and every wait advances a virtual clock instead of taking time
+ *
+ *  timing     - device timing
+ *  image      - firmware without DFU suffix
+ *  size       - image size
+ *  prediction - simulated fields are filled in
+ *
+ *  returns IOReturn value of the simulated flash
+ */
+IOReturn dfu_predict_simulate(const struct dfu_timing *timing, const uint8_t *image, int size,
+                              struct dfu_prediction *prediction)
+{
+    struct dfu_predictor predictor;
+    struct dfu_if dif;
+    struct dfu_status status;
+    struct dfu_transfer transfer;
+    uint8_t *memory = malloc(size > 0 ? size : 1);
+    
+    if (memory == NULL)
+        return kIOReturnNoMemory;
+    
+    dfu_sim_init(&predictor.sim, memory, size, timing->detach > 0 ? STATE_APP_IDLE : STATE_DFU_IDLE);
+    predictor.sim.transfer_size = timing->transfer_size;
+    predictor.timing = timing;
+    predictor.clock_us = 0;
+    predictor.busy_until = 0;
+    predictor.random = 0x9e3779b9;
+    
+    dfu_sim_attach(&predictor.sim, &dif);
+    dif.transport.control = dfu_predict_control;
+    dif.transport.reset = dfu_predict_reset;
+    dif.transport.wait = dfu_predict_wait;
+    dif.transport.context = &predictor;
+    
+    IOReturn result = dfu_get_status(&dif, &status);
+    
+    if (result == kIOReturnSuccess)
+        result = dfu_state_recover(&dif, predictor.sim.attributes, predictor.sim.detach_timeout, &status);
+    
+    prediction->detach_us = predictor.clock_us;
+    
+    if (result == kIOReturnSuccess)
+    {
+        dfu_transfer_init(&transfer, &dif, image, size, timing->transfer_size);
+        result = dfu_transfer_download(&transfer);
+    }
+    
+    prediction->download_us = predictor.clock_us - prediction->detach_us;
+    
+    if (result == kIOReturnSuccess)
+        result = dfu_transfer_manifest(&transfer);
+    
+    if (result == kIOReturnSuccess)
+        result = dfu_reset(&dif);
+    
+    prediction->simulated_us = predictor.clock_us;
+    prediction->manifest_us = prediction->simulated_us - prediction->detach_us - prediction->download_us;
+    
+    // The simulated flash must hold the image, or the timing means nothing
+    if (result == kIOReturnSuccess && (predictor.sim.image_size != size || memcmp(memory, image, size) != 0))
+        result = kIOReturnError;
+    
+    free(memory);
+    
+    return result;
+}
+
+/*
+ *  Unit time when several fixtures share the bus of one hub. Devices
+ *  program their blocks in parallel, bus time is taken in turns, so a
+ *  block cycle is bounded by one device or by all transfers on the bus.
+ *
+ *  prediction - single unit model
+ *  sharing    - fixtures on the same bus
+ *
+ *  returns microseconds per unit
+ */
+uint64_t dfu_predict_shared(const struct dfu_prediction *prediction, int sharing)
+{
+    uint64_t alone = prediction->block_bus_us + prediction->block_device_us;
+    uint64_t bus = prediction->block_bus_us * (sharing > 1 ? sharing : 1);
+    
+    return prediction->model_us + (uint64_t)prediction->blocks * (bus > alone ? bus - alone : 0);
+}
@@ -0,0 +1,75 @@
+/*
+ *  Flash time prediction on a virtual clock
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef __dfu_util__dfu_predict__
+#define __dfu_util__dfu_predict__
+
+#include <stdint.h>
+
+#include "dfu.h"
+#include "dfu_profile.h"
+
+#define DFU_PREDICT_REQUEST_US  250   /* setup and status stage of a control request */
+#define DFU_PREDICT_BUS_RATE    1216  /* bytes per ms, 19 full speed control packets per frame */
+#define DFU_PREDICT_MANIFEST    100   /* ms */
+#define DFU_PREDICT_DETACH      1000  /* ms */
+
+/* Timing of a device model, from a profile or given by hand */
+struct dfu_timing
+{
+    unsigned short transfer_size;
+    /* bwPollTimeout of a block is drawn uniformly from this range, ms */
+    unsigned int poll_min;
+    unsigned int poll_max;
+    /* Re-enumeration after DFU_DETACH or reset, 0 if the device starts in DFU mode */
+    unsigned int detach;
+    /* From the zero length DFU_DNLOAD until the device answers again, ms */
+    unsigned int manifest;
+    /* Overhead of every control request */
+    unsigned int request_us;
+    /* Data rate of the bus shared with other fixtures */
+    unsigned int bus_rate;
+};
+
+/* Single unit flash time, in microseconds */
+struct dfu_prediction
+{
+    int blocks;
+    /* Analytic model */
+    uint64_t block_bus_us;
+    uint64_t block_device_us;
+    uint64_t fixed_us;
+    uint64_t model_us;
+    /* Simulated device driven by the transfer code on a virtual clock */
+    uint64_t detach_us;
+    uint64_t download_us;
+    uint64_t manifest_us;
+    uint64_t simulated_us;
+};
+
+void dfu_timing_init(struct dfu_timing *timing);
+void dfu_timing_from_profile(struct dfu_timing *timing, const struct dfu_profile *profile);
+void dfu_predict_model(const struct dfu_timing *timing, int size, struct dfu_prediction *prediction);
+IOReturn dfu_predict_simulate(const struct dfu_timing *timing, const uint8_t *image, int size,
+                              struct dfu_prediction *prediction);
+uint64_t dfu_predict_shared(const struct dfu_prediction *prediction, int sharing);
+
+#endif /* defined(__dfu_util__dfu_predict__) */
@@ -0,0 +1,355 @@
+/*
+ *  Device capability profiles learned from previous runs
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dfu_profile.h"
+
+static const char *dfu_profile_detach_names[] = { "unknown", "honored", "ignored" };
+
+/*
+ *  Parse one profile line:
+ *
+ *    vid:pid:bcdDevice attributes=.. transfer=.. block=.. detach=.. will_detach=..
+ *                      poll=.. ready=.. latency=..,..,.. runs=..
+ *
+ *  returns false for lines that are not a profile
+ */
+static bool dfu_profile_parse(const char *line, struct dfu_profile *profile)
+{
+    unsigned int vid, pid, bcd;
+    int offset;
+    
+    memset(profile, 0, sizeof(*profile));
+    
+    if (sscanf(line, "%x:%x:%x%n", &vid, &pid, &bcd, &offset) != 3)
+        return false;
+    
+    profile->idVendor = vid;
+    profile->idProduct = pid;
+    profile->bcdDevice = bcd;
+    line += offset;
+    
+    char key[32], value[128];
+    
+    while (sscanf(line, " %31[^= ]=%127s%n", key, value, &offset) == 2)
+    {
+        unsigned long number = strtoul(value, NULL, 0);
+        
+        line += offset;
+        
+        if (strcmp(key, "attributes") == 0)
+            profile->bmAttributes = number;
+        else if (strcmp(key, "transfer") == 0)
+            profile->wTransferSize = number;
+        else if (strcmp(key, "detach") == 0)
+            profile->wDetachTimeout = number;
+        else if (strcmp(key, "block") == 0)
+            profile->transfer_size = number;
+        else if (strcmp(key, "poll") == 0)
+            profile->poll_timeout = number;
+        else if (strcmp(key, "ready") == 0)
+            profile->detach_ready = number;
+        else if (strcmp(key, "runs") == 0)
+            profile->runs = number;
+        else if (strcmp(key, "will_detach") == 0)
+        {
+            if (strcmp(value, "honored") == 0)
+                profile->will_detach = DFU_PROFILE_DETACH_HONORED;
+            else if (strcmp(value, "ignored") == 0)
+                profile->will_detach = DFU_PROFILE_DETACH_IGNORED;
+        }
+        else if (strcmp(key, "latency") == 0)
+        {
+            char *cursor = value;
+            
+            for (int i = 0; i < DFU_TIMEOUT_REQUESTS && *cursor; i++)
+            {
+                profile->latency[i] = strtoul(cursor, &cursor, 10);
+                
+                if (*cursor == ',')
+                    cursor++;
+            }
+        }
+    }
+    
+    return true;
+}
+
+static void dfu_profile_print(FILE *out, const struct dfu_profile *profile)
+{
+    fprintf(out, "%04x:%04x:%04x attributes=0x%02x transfer=%u detach=%u block=%u will_detach=%s poll=%u ready=%u latency=",
+            profile->idVendor, profile->idProduct, profile->bcdDevice,
+            profile->bmAttributes, profile->wTransferSize, profile->wDetachTimeout, profile->transfer_size,
+            dfu_profile_detach_names[profile->will_detach], profile->poll_timeout, profile->detach_ready);
+    
+    for (int i = 0; i < DFU_TIMEOUT_REQUESTS; i++)
+        fprintf(out, i ? ",%u" : "%u", profile->latency[i]);
+    
+    fprintf(out, " runs=%u\n", profile->runs);
+}
+
+static struct dfu_profile *dfu_profile_lookup(struct dfu_profile_store *store, const struct dfu_profile *key)
+{
+    for (int i = 0; i < store->count; i++)
+    {
+        struct dfu_profile *profile = &store->profiles[i];
+        
+        if (profile->idVendor == key->idVendor &&
+            profile->idProduct == key->idProduct &&
+            profile->bcdDevice == key->bcdDevice)
+            return profile;
+    }
+    
+    return NULL;
+}
+
+static struct dfu_profile *dfu_profile_append(struct dfu_profile_store *store, const struct dfu_profile *profile)
+{
+    if (store->count == store->capacity)
+    {
+        int capacity = store->capacity ? store->capacity * 2 : 16;
+        struct dfu_profile *profiles = realloc(store->profiles, capacity * sizeof(*profiles));
+        
+        if (profiles == NULL)
+            return NULL;
+        
+        store->profiles = profiles;
+        store->capacity = capacity;
+    }
+    
+    store->profiles[store->count] = *profile;
+    
+    return &store->profiles[store->count++];
+}
+
+/*
+ *  Load the profiles of a file, a missing file is an empty store
+ *
+ *  store     - store to initialize
+ *  path      - profile file, kept by reference
+ *
+ *  returns 0 or -1 if the file could not be read
+ */
+int dfu_profile_store_open(struct dfu_profile_store *store, const char *path)
+{
+    memset(store, 0, sizeof(*store));
+    
+    store->path = path;
+    pthread_mutex_init(&store->lock, NULL);
+    
+    FILE *in = fopen(path, "r");
+    
+    if (in == NULL)
+        return errno == ENOENT ? 0 : -1;
+    
+    char line[512];
+    struct dfu_profile profile;
+    
+    while (fgets(line, sizeof(line), in) != NULL)
+    {
+        if (line[0] != '#' && dfu_profile_parse(line, &profile))
+            dfu_profile_append(store, &profile);
+    }
+    
+    fclose(in);
+    
+    return 0;
+}
+
+/*
+ *  Look up the profile of a device
+ *
+ *  store     - open store
+ *  profile   - idVendor, idProduct and bcdDevice set, filled in if found
+ *
+ *  returns true if the device model was seen before
+ */
+bool dfu_profile_store_find(struct dfu_profile_store *store, struct dfu_profile *profile)
+{
+    pthread_mutex_lock(&store->lock);
+    
+    const struct dfu_profile *stored = dfu_profile_lookup(store, profile);
+    
+    if (stored != NULL)
+        *profile = *stored;
+    
+    pthread_mutex_unlock(&store->lock);
+    
+    return stored != NULL;
+}
+
+static void dfu_profile_drift(const struct dfu_profile *profile, const char *name, uint32_t from, uint32_t to)
+{
+    printf("[i] Device %04x:%04x:%04x drifted from its profile, %s %u -> %u.\n",
+           profile->idVendor, profile->idProduct, profile->bcdDevice, name, from, to);
+}
+
+/*
+ *  Move an average towards an observation, or replace it when the device
+ *  behaves differently enough that averaging would only lag behind
+ */
+static void dfu_profile_average(const struct dfu_profile *profile, const char *name, uint32_t *average, uint32_t observed)
+{
+    if (observed == 0)
+        return;
+    
+    if (*average == 0)
+        *average = observed;
+    else if (observed > *average * DFU_PROFILE_DRIFT || observed * DFU_PROFILE_DRIFT < *average)
+    {
+        dfu_profile_drift(profile, name, *average, observed);
+        *average = observed;
+    }
+    else
+        *average += ((int64_t)observed - *average) / DFU_PROFILE_WEIGHT;
+}
+
+/*
+ *  Whether a field that is replaced rather than averaged changed, a change
+ *  of a field that was known is reported
+ */
+static bool dfu_profile_changed(const struct dfu_profile *profile, const char *name, uint32_t stored, uint32_t observed)
+{
+    if (observed == 0 || observed == stored)
+        return false;
+    
+    if (stored != 0)
+        dfu_profile_drift(profile, name, stored, observed);
+    
+    return true;
+}
+
+/*
+ *  Fold the observations of a run into the stored profile of the device
+ *
+ *  store     - open store
+ *  observed  - what the run measured, zero fields were not observed
+ */
+void dfu_profile_store_merge(struct dfu_profile_store *store, const struct dfu_profile *observed)
+{
+    pthread_mutex_lock(&store->lock);
+    
+    struct dfu_profile *profile = dfu_profile_lookup(store, observed);
+    
+    if (profile == NULL)
+    {
+        profile = dfu_profile_append(store, observed);
+        
+        if (profile != NULL)
+            profile->runs = 1;
+        
+        pthread_mutex_unlock(&store->lock);
+        return;
+    }
+    
+    if (dfu_profile_changed(profile, "bmAttributes", profile->bmAttributes, observed->bmAttributes))
+        profile->bmAttributes = observed->bmAttributes;
+    
+    if (dfu_profile_changed(profile, "wTransferSize", profile->wTransferSize, observed->wTransferSize))
+        profile->wTransferSize = observed->wTransferSize;
+    
+    if (dfu_profile_changed(profile, "wDetachTimeout", profile->wDetachTimeout, observed->wDetachTimeout))
+        profile->wDetachTimeout = observed->wDetachTimeout;
+    
+    if (dfu_profile_changed(profile, "block size", profile->transfer_size, observed->transfer_size))
+        profile->transfer_size = observed->transfer_size;
+    
+    if (observed->will_detach != DFU_PROFILE_DETACH_UNKNOWN && observed->will_detach != profile->will_detach)
+    {
+        if (profile->will_detach != DFU_PROFILE_DETACH_UNKNOWN)
+            printf("[i] Device %04x:%04x:%04x drifted from its profile, detach %s -> %s.\n",
+                   profile->idVendor, profile->idProduct, profile->bcdDevice,
+                   dfu_profile_detach_names[profile->will_detach], dfu_profile_detach_names[observed->will_detach]);
+        
+        profile->will_detach = observed->will_detach;
+    }
+    
+    dfu_profile_average(profile, "bwPollTimeout", &profile->poll_timeout, observed->poll_timeout);
+    dfu_profile_average(profile, "detach to ready", &profile->detach_ready, observed->detach_ready);
+    
+    for (int i = 0; i < DFU_TIMEOUT_REQUESTS; i++)
+        dfu_profile_average(profile, "request latency", &profile->latency[i], observed->latency[i]);
+    
+    profile->runs++;
+    
+    pthread_mutex_unlock(&store->lock);
+}
+
+/*
+ *  Write the store back, atomically replacing the file
+ *
+ *  store     - open store
+ *
+ *  returns 0 or -1
+ */
+int dfu_profile_store_save(struct dfu_profile_store *store)
+{
+    char temporary[PATH_MAX];
+    
+    snprintf(temporary, sizeof(temporary), "%s.XXXXXX", store->path);
+    
+    int fd = mkstemp(temporary);
+    
+    if (fd < 0)
+        return -1;
+    
+    FILE *out = fdopen(fd, "w");
+    
+    if (out == NULL)
+    {
+        close(fd);
+        unlink(temporary);
+        return -1;
+    }
+    
+    fprintf(out, "# dfu-util device profiles, vid:pid:bcdDevice\n");
+    
+    pthread_mutex_lock(&store->lock);
+    
+    for (int i = 0; i < store->count; i++)
+        dfu_profile_print(out, &store->profiles[i]);
+    
+    pthread_mutex_unlock(&store->lock);
+    
+    int result = fclose(out) == 0 ? 0 : -1;
+    
+    if (result == 0 && rename(temporary, store->path) != 0)
+        result = -1;
+    
+    if (result != 0)
+        unlink(temporary);
+    
+    return result;
+}
+
+void dfu_profile_store_close(struct dfu_profile_store *store)
+{
+    free(store->profiles);
+    pthread_mutex_destroy(&store->lock);
+    
+    memset(store, 0, sizeof(*store));
+}
@@ -0,0 +1,82 @@
+/*
+ *  Device capability profiles learned from previous runs
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef __dfu_util__dfu_profile__
+#define __dfu_util__dfu_profile__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dfu_timeout.h"
+
+#define DFU_PROFILE_WEIGHT      4     /* a run moves averages by 1/4 of its deviation */
+#define DFU_PROFILE_DRIFT       2     /* beyond this factor the average is replaced */
+#define DFU_PROFILE_MIN_BLOCK   64    /* transfer size is never halved below this */
+
+enum dfu_profile_detach
+{
+    DFU_PROFILE_DETACH_UNKNOWN,
+    DFU_PROFILE_DETACH_HONORED,
+    DFU_PROFILE_DETACH_IGNORED
+};
+
+/*
+ *  What a device model did in earlier runs, keyed by idVendor, idProduct
+ *  and bcdDevice. Zero means not observed.
+ */
+struct dfu_profile
+{
+    uint16_t idVendor;
+    uint16_t idProduct;
+    uint16_t bcdDevice;
+    /* DFU functional descriptor as last seen */
+    uint8_t bmAttributes;
+    uint16_t wTransferSize;
+    uint16_t wDetachTimeout;
+    /* Block size that downloads succeed with, at most wTransferSize */
+    uint16_t transfer_size;
+    /* Whether the device detaches on its own when USB_DFU_WILL_DETACH is set */
+    enum dfu_profile_detach will_detach;
+    /* Averages: bwPollTimeout in ms, detach to ready in ms, latency in us */
+    uint32_t poll_timeout;
+    uint32_t detach_ready;
+    uint32_t latency[DFU_TIMEOUT_REQUESTS];
+    uint32_t runs;
+};
+
+/* Profiles of one file, shared by the sessions of a process */
+struct dfu_profile_store
+{
+    const char *path;
+    struct dfu_profile *profiles;
+    int count;
+    int capacity;
+    pthread_mutex_t lock;
+};
+
+int dfu_profile_store_open(struct dfu_profile_store *store, const char *path);
+bool dfu_profile_store_find(struct dfu_profile_store *store, struct dfu_profile *profile);
+void dfu_profile_store_merge(struct dfu_profile_store *store, const struct dfu_profile *observed);
+int dfu_profile_store_save(struct dfu_profile_store *store);
+void dfu_profile_store_close(struct dfu_profile_store *store);
+
+#endif /* defined(__dfu_util__dfu_profile__) */
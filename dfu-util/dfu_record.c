@@ -0,0 +1,453 @@
+/*
+ *  Recording and replay of the control requests of a session
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <err.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dfu_record.h"
+#include "dfu_metrics.h"
+
+static void put_le16(uint8_t *p, uint16_t value)
+{
+    p[0] = value & 0xff;
+    p[1] = value >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t value)
+{
+    put_le16(p, value & 0xffff);
+    put_le16(p + 2, value >> 16);
+}
+
+static uint16_t get_le16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return get_le16(p) | ((uint32_t)get_le16(p + 2) << 16);
+}
+
+static uint32_t clamp_us(uint64_t us)
+{
+    return us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+}
+
+/*
+ *  FNV-1a, identifies the data of a request without storing it
+ */
+uint64_t dfu_record_hash(const void *data, size_t length)
+{
+    const uint8_t *p = data;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    
+    while (length-- > 0)
+        hash = (hash ^ *p++) * 0x100000001b3ULL;
+    
+    return hash;
+}
+
+static IOReturn dfu_recorder_control(void *context, IOUSBDevRequestTO *request)
+{
+    struct dfu_recorder *recorder = context;
+    uint8_t header[DFU_RECORD_HEADER + 8];
+    bool in = request->bmRequestType & 0x80;
+    bool hashed = !in && request->wLength > 0 && request->pData != NULL;
+    uint64_t start = dfu_time_us();
+    
+    IOReturn result = recorder->inner.control(recorder->inner.context, request);
+    
+    uint64_t end = dfu_time_us();
+    
+    header[0] = DFU_RECORD_CONTROL;
+    header[1] = request->bmRequestType;
+    header[2] = request->bRequest;
+    header[3] = hashed ? DFU_RECORD_HASHED : 0;
+    put_le16(header + 4, request->wValue);
+    put_le16(header + 6, request->wIndex);
+    put_le16(header + 8, request->wLength);
+    put_le16(header + 10, in && result == kIOReturnSuccess ? request->wLenDone : 0);
+    put_le32(header + 12, result);
+    put_le32(header + 16, clamp_us(recorder->last_us ? start - recorder->last_us : 0));
+    put_le32(header + 20, clamp_us(end - start));
+    
+    if (hashed)
+    {
+        uint64_t hash = dfu_record_hash(request->pData, request->wLength);
+        
+        put_le32(header + 24, (uint32_t)hash);
+        put_le32(header + 28, (uint32_t)(hash >> 32));
+    }
+    
+    fwrite(header, 1, hashed ? sizeof(header) : DFU_RECORD_HEADER, recorder->out);
+    
+    if (in && result == kIOReturnSuccess)
+        fwrite(request->pData, 1, request->wLenDone, recorder->out);
+    
+    recorder->last_us = end;
+    recorder->records++;
+    
+    return result;
+}
+
+static IOReturn dfu_recorder_reset(void *context)
+{
+    struct dfu_recorder *recorder = context;
+    uint8_t header[DFU_RECORD_HEADER] = { DFU_RECORD_RESET };
+    uint64_t start = dfu_time_us();
+    IOReturn result = recorder->inner.reset != NULL ? recorder->inner.reset(recorder->inner.context) : kIOReturnUnsupported;
+    uint64_t end = dfu_time_us();
+    
+    put_le32(header + 12, result);
+    put_le32(header + 16, clamp_us(recorder->last_us ? start - recorder->last_us : 0));
+    put_le32(header + 20, clamp_us(end - start));
+    
+    fwrite(header, 1, sizeof(header), recorder->out);
+    
+    recorder->last_us = end;
+    recorder->records++;
+    
+    return result;
+}
+
+static void dfu_recorder_wait(void *context, unsigned int ms)
+{
+    struct dfu_recorder *recorder = context;
+    
+    if (recorder->inner.wait != NULL)
+        recorder->inner.wait(recorder->inner.context, ms);
+    else
+        usleep(ms * 1000);
+}
+
+/*
+ *  Start a log
+ *
+ *  recorder  - recorder to initialize
+ *  path      - log file, replaced
+ *
+ *  returns 0 or -1
+ */
+int dfu_recorder_open(struct dfu_recorder *recorder, const char *path)
+{
+    memset(recorder, 0, sizeof(*recorder));
+    
+    recorder->out = fopen(path, "wb");
+    
+    if (recorder->out == NULL)
+    {
+        warn("Could not create %s", path);
+        return -1;
+    }
+    
+    fwrite(DFU_RECORD_MAGIC, 1, strlen(DFU_RECORD_MAGIC), recorder->out);
+    
+    return 0;
+}
+
+/*
+ *  Log the device and DFU descriptor the following requests go to, a
+ *  replay needs them to drive the same protocol logic
+ */
+void dfu_recorder_describe(struct dfu_recorder *recorder, uint16_t idVendor, uint16_t idProduct,
+                           const IOUSBDFUDescriptor *descriptor)
+{
+    uint8_t header[DFU_RECORD_HEADER] = { DFU_RECORD_DESCRIPTOR, descriptor->bmAttributes };
+    
+    put_le16(header + 4, idVendor);
+    put_le16(header + 6, idProduct);
+    put_le16(header + 8, descriptor->wTransferSize);
+    put_le16(header + 10, descriptor->wDetachTimeout);
+    
+    fwrite(header, 1, sizeof(header), recorder->out);
+}
+
+/*
+ *  Route the requests of an interface through the recorder, again after
+ *  every dfu_init() since it installs the IOKit transport
+ *
+ *  recorder  - open recorder
+ *  dif       - initialized DFU interface
+ */
+void dfu_recorder_attach(struct dfu_recorder *recorder, struct dfu_if *dif)
+{
+    if (dif->transport.control == dfu_recorder_control)
+        return;
+    
+    recorder->inner = dif->transport;
+    
+    dif->transport.control = dfu_recorder_control;
+    dif->transport.reset = dfu_recorder_reset;
+    dif->transport.wait = dfu_recorder_wait;
+    dif->transport.context = recorder;
+}
+
+int dfu_recorder_close(struct dfu_recorder *recorder)
+{
+    int result = fclose(recorder->out) == 0 ? 0 : -1;
+    
+    recorder->out = NULL;
+    
+    return result;
+}
+
+/*
+ *  Next record of the log, descriptor records are taken in passing
+ *
+ *  returns the record or NULL at the end of the log
+ */
+static const uint8_t *dfu_replay_next(struct dfu_replay *replay)
+{
+    while (replay->offset + DFU_RECORD_HEADER <= replay->size)
+    {
+        const uint8_t *record = replay->log + replay->offset;
+        
+        if (record[0] != DFU_RECORD_DESCRIPTOR)
+            return record;
+        
+        replay->descriptor.bmAttributes = record[1];
+        replay->descriptor.wTransferSize = get_le16(record + 8);
+        replay->descriptor.wDetachTimeout = get_le16(record + 10);
+        replay->idVendor = get_le16(record + 4);
+        replay->idProduct = get_le16(record + 6);
+        replay->offset += DFU_RECORD_HEADER;
+    }
+    
+    return NULL;
+}
+
+static size_t dfu_replay_length(const uint8_t *record)
+{
+    size_t length = DFU_RECORD_HEADER;
+    
+    if (record[3] & DFU_RECORD_HASHED)
+        length += 8;
+    
+    if (record[0] == DFU_RECORD_CONTROL && (record[1] & 0x80))
+        length += get_le16(record + 10);
+    
+    return length;
+}
+
+/*
+ *  Account the recorded time of a record and, when pacing, wait until
+ *  the same time has passed since the replay started
+ */
+static void dfu_replay_advance(struct dfu_replay *replay, const uint8_t *record)
+{
+    if (replay->requests++ == 0)
+        replay->start_us = dfu_time_us();
+    
+    replay->recorded_us += get_le32(record + 16) + get_le32(record + 20);
+    replay->offset += dfu_replay_length(record);
+    
+    if (!replay->paced)
+        return;
+    
+    uint64_t elapsed = dfu_time_us() - replay->start_us;
+    
+    if (elapsed < replay->recorded_us)
+        usleep((useconds_t)(replay->recorded_us - elapsed));
+}
+
+static IOReturn dfu_replay_diverged(struct dfu_replay *replay, const char *what)
+{
+    if (replay->divergences++ == 0)
+        fprintf(stderr, "[!] Replay diverged at request %lu: %s.\n", replay->requests + 1, what);
+    
+    return kIOReturnNotResponding;
+}
+
+static IOReturn dfu_replay_control(void *context, IOUSBDevRequestTO *request)
+{
+    struct dfu_replay *replay = context;
+    const uint8_t *record = dfu_replay_next(replay);
+    char expected[128];
+    
+    request->wLenDone = 0;
+    
+    if (record == NULL)
+        return dfu_replay_diverged(replay, "log ended");
+    
+    if (record[0] != DFU_RECORD_CONTROL ||
+        record[1] != request->bmRequestType || record[2] != request->bRequest ||
+        get_le16(record + 4) != request->wValue || get_le16(record + 6) != request->wIndex ||
+        get_le16(record + 8) != request->wLength)
+    {
+        snprintf(expected, sizeof(expected), "expected %s %02x/%02x value %u length %u, got %02x/%02x value %u length %u",
+                 record[0] == DFU_RECORD_RESET ? "reset" : "request",
+                 record[1], record[2], get_le16(record + 4), get_le16(record + 8),
+                 request->bmRequestType, request->bRequest, request->wValue, request->wLength);
+        return dfu_replay_diverged(replay, expected);
+    }
+    
+    if (replay->offset + dfu_replay_length(record) > replay->size)
+        return dfu_replay_diverged(replay, "log truncated");
+    
+    if ((record[3] & DFU_RECORD_HASHED) &&
+        dfu_record_hash(request->pData, request->wLength) !=
+        (get_le32(record + 24) | ((uint64_t)get_le32(record + 28) << 32)))
+        return dfu_replay_diverged(replay, "data differs from the recording");
+    
+    if (record[1] & 0x80)
+    {
+        request->wLenDone = get_le16(record + 10);
+        memcpy(request->pData, record + DFU_RECORD_HEADER + ((record[3] & DFU_RECORD_HASHED) ? 8 : 0), request->wLenDone);
+    }
+    
+    IOReturn result = get_le32(record + 12);
+    
+    dfu_replay_advance(replay, record);
+    
+    return result;
+}
+
+static IOReturn dfu_replay_reset(void *context)
+{
+    struct dfu_replay *replay = context;
+    const uint8_t *record = dfu_replay_next(replay);
+    
+    if (record == NULL || record[0] != DFU_RECORD_RESET)
+        return dfu_replay_diverged(replay, "expected a request, got reset");
+    
+    IOReturn result = get_le32(record + 12);
+    
+    dfu_replay_advance(replay, record);
+    
+    return result;
+}
+
+static void dfu_replay_wait(void *context, unsigned int ms)
+{
+    // Recorded gaps include the waits, pacing reproduces them
+}
+
+/*
+ *  Load a log for replay
+ *
+ *  replay    - replay to initialize
+ *  path      - log written by a recorder
+ *  paced     - reproduce the recorded timing
+ *
+ *  returns 0 or -1
+ */
+int dfu_replay_open(struct dfu_replay *replay, const char *path, bool paced)
+{
+    struct stat info;
+    size_t magic = strlen(DFU_RECORD_MAGIC);
+    
+    memset(replay, 0, sizeof(*replay));
+    replay->paced = paced;
+    
+    int f = open(path, O_RDONLY);
+    
+    if (f < 0 || fstat(f, &info) != 0)
+    {
+        warn("Could not open %s", path);
+        
+        if (f >= 0)
+            close(f);
+        
+        return -1;
+    }
+    
+    replay->size = info.st_size;
+    replay->log = replay->size > 0 ? mmap(NULL, replay->size, PROT_READ, MAP_PRIVATE, f, 0) : MAP_FAILED;
+    
+    close(f);
+    
+    if (replay->log == MAP_FAILED || replay->size < magic || memcmp(replay->log, DFU_RECORD_MAGIC, magic) != 0)
+    {
+        warnx("%s: Not a DFU recording", path);
+        
+        if (replay->log != MAP_FAILED)
+            munmap(replay->log, replay->size);
+        
+        replay->log = NULL;
+        return -1;
+    }
+    
+    replay->offset = magic;
+    
+    for (size_t offset = magic; offset + DFU_RECORD_HEADER <= replay->size; offset += dfu_replay_length(replay->log + offset))
+    {
+        const uint8_t *record = replay->log + offset;
+        
+        if (record[0] == DFU_RECORD_CONTROL && record[1] == USBmakebmRequestType(kUSBOut, kUSBClass, kUSBInterface) &&
+            record[2] == DFU_DNLOAD && get_le16(record + 8) > 0)
+        {
+            replay->transfer_size = get_le16(record + 8);
+            break;
+        }
+    }
+    
+    // Make the first descriptor available before the first request
+    dfu_replay_next(replay);
+    
+    return 0;
+}
+
+/*
+ *  Route all requests of a DFU interface to a replay
+ *
+ *  replay    - open replay
+ *  dif       - DFU interface, no IOKit objects are needed
+ */
+void dfu_replay_attach(struct dfu_replay *replay, struct dfu_if *dif)
+{
+    memset(dif, 0, sizeof(*dif));
+    
+    dif->timeout = DFU_DEFAULT_TIMEOUT;
+    dif->transport.control = dfu_replay_control;
+    dif->transport.reset = dfu_replay_reset;
+    dif->transport.wait = dfu_replay_wait;
+    dif->transport.context = replay;
+}
+
+/*
+ *  Take the descriptor records ahead of the next request, after a
+ *  re-enumeration the device describes itself again
+ *
+ *  returns false at the end of the log
+ */
+bool dfu_replay_describe(struct dfu_replay *replay)
+{
+    return dfu_replay_next(replay) != NULL;
+}
+
+bool dfu_replay_finished(const struct dfu_replay *replay)
+{
+    return replay->offset + DFU_RECORD_HEADER > replay->size;
+}
+
+void dfu_replay_close(struct dfu_replay *replay)
+{
+    if (replay->log != NULL)
+        munmap(replay->log, replay->size);
+    
+    replay->log = NULL;
+}
@@ -0,0 +1,103 @@
+/*
+ *  Recording and replay of the control requests of a session
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef __dfu_util__dfu_record__
+#define __dfu_util__dfu_record__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "dfu.h"
+
+#define DFU_RECORD_MAGIC        "DFUREC01"
+#define DFU_RECORD_HEADER       24    /* fixed part of every record */
+
+/*
+ *  A log is the magic followed by records, all integers little endian:
+ *
+ *    u8  type            DFU_RECORD_*
+ *    u8  bmRequestType   bmAttributes for DFU_RECORD_DESCRIPTOR
+ *    u8  bRequest
+ *    u8  flags           DFU_RECORD_HASHED
+ *    u16 wValue          idVendor for DFU_RECORD_DESCRIPTOR
+ *    u16 wIndex          idProduct
+ *    u16 wLength         wTransferSize
+ *    u16 wLenDone        wDetachTimeout
+ *    u32 result          IOReturn
+ *    u32 gap_us          since the previous record completed
+ *    u32 duration_us
+ *    u64 hash            FNV-1a of the data sent, if DFU_RECORD_HASHED
+ *    u8  data[wLenDone]  data received, device to host requests only
+ */
+enum dfu_record_type
+{
+    DFU_RECORD_CONTROL = 1,
+    DFU_RECORD_RESET = 2,
+    DFU_RECORD_DESCRIPTOR = 3
+};
+
+#define DFU_RECORD_HASHED       0x01
+
+/* Sits between a DFU interface and its transport and logs every request */
+struct dfu_recorder
+{
+    FILE *out;
+    struct dfu_transport inner;
+    /* Completion of the previous record */
+    uint64_t last_us;
+    unsigned long records;
+};
+
+/* Serves the responses of a log back, checking every request against it */
+struct dfu_replay
+{
+    uint8_t *log;
+    size_t size;
+    size_t offset;
+    /* Sleep to reproduce the recorded timing, otherwise run flat out */
+    bool paced;
+    uint64_t start_us;
+    /* Recorded time of the records served so far */
+    uint64_t recorded_us;
+    unsigned long requests;
+    unsigned long divergences;
+    /* From the first descriptor record */
+    uint16_t idVendor;
+    uint16_t idProduct;
+    IOUSBDFUDescriptor descriptor;
+    /* Block size of the first download, a profile may lower it below wTransferSize */
+    uint16_t transfer_size;
+};
+
+uint64_t dfu_record_hash(const void *data, size_t length);
+int dfu_recorder_open(struct dfu_recorder *recorder, const char *path);
+void dfu_recorder_describe(struct dfu_recorder *recorder, uint16_t idVendor, uint16_t idProduct,
+                           const IOUSBDFUDescriptor *descriptor);
+void dfu_recorder_attach(struct dfu_recorder *recorder, struct dfu_if *dif);
+int dfu_recorder_close(struct dfu_recorder *recorder);
+int dfu_replay_open(struct dfu_replay *replay, const char *path, bool paced);
+void dfu_replay_attach(struct dfu_replay *replay, struct dfu_if *dif);
+bool dfu_replay_describe(struct dfu_replay *replay);
+bool dfu_replay_finished(const struct dfu_replay *replay);
+void dfu_replay_close(struct dfu_replay *replay);
+
+#endif /* defined(__dfu_util__dfu_record__) */
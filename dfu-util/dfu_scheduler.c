@@ -0,0 +1,392 @@
+/*
+ *  Bus topology aware scheduling of downloads
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dfu_scheduler.h"
+#include "dfu_metrics.h"
+
+#define DFU_LOCATION_PORTS      6     /* port nibbles below the bus number */
+
+/* Start position of a device, see dfu_scheduler_spread() */
+struct dfu_spread_key
+{
+    int rank;
+    int hub_rank;
+    uint32_t bus;
+    uint32_t location;
+    int index;
+};
+
+static int dfu_location_depth(uint32_t location)
+{
+    int depth = 0;
+    
+    while (depth < DFU_LOCATION_PORTS && (location >> (20 - 4 * depth) & 0xf) != 0)
+        depth++;
+    
+    return depth;
+}
+
+/*
+ *  Location of the hub a device is attached to
+ *
+ *  location  - IOKit location, bus number in the top byte and one nibble
+ *              per port from the root hub down
+ *
+ *  returns the hub location, the bus number alone for a root port
+ */
+uint32_t dfu_location_parent(uint32_t location)
+{
+    int depth = dfu_location_depth(location);
+    
+    if (depth == 0)
+        return location & 0xff000000;
+    
+    return location & ~(0xfU << (24 - 4 * depth));
+}
+
+/*
+ *  Root port a device hangs off, every device below it shares its link
+ *
+ *  location  - IOKit location
+ *
+ *  returns the location of the device or hub on the root port
+ */
+uint32_t dfu_location_root_port(uint32_t location)
+{
+    return location & 0xfff00000;
+}
+
+/*
+ *  Set up a scheduler without domains
+ *
+ *  scheduler   - scheduler to initialize
+ *  max_window  - most blocks in flight per domain, 0 for the default
+ *
+ *  returns 0 or -1 on error
+ */
+int dfu_scheduler_init(struct dfu_scheduler *scheduler, int max_window)
+{
+    memset(scheduler, 0, sizeof(*scheduler));
+    
+    scheduler->max_window = max_window > 0 ? max_window : DFU_SCHEDULER_MAX_WINDOW;
+    
+    if (pthread_mutex_init(&scheduler->lock, NULL) != 0)
+        return -1;
+    
+    if (pthread_cond_init(&scheduler->wake, NULL) != 0)
+    {
+        pthread_mutex_destroy(&scheduler->lock);
+        return -1;
+    }
+    
+    return 0;
+}
+
+static int dfu_scheduler_domain(struct dfu_scheduler *scheduler, uint32_t location, int window)
+{
+    int i;
+    
+    for (i = 0; i < scheduler->count; i++)
+        if (scheduler->domains[i].location == location)
+            break;
+    
+    if (i == scheduler->count)
+    {
+        if (scheduler->count == scheduler->capacity)
+        {
+            int capacity = scheduler->capacity > 0 ? scheduler->capacity * 2 : 8;
+            struct dfu_bus_domain *domains = realloc(scheduler->domains, capacity * sizeof(*domains));
+            
+            if (domains == NULL)
+                return -1;
+            
+            scheduler->domains = domains;
+            scheduler->capacity = capacity;
+        }
+        
+        memset(&scheduler->domains[i], 0, sizeof(scheduler->domains[i]));
+        scheduler->domains[i].location = location;
+        scheduler->domains[i].window = window;
+        scheduler->count++;
+    }
+    
+    // Slower devices start the domain more carefully
+    if (scheduler->domains[i].window > window)
+        scheduler->domains[i].window = window;
+    
+    scheduler->domains[i].devices++;
+    
+    return i;
+}
+
+/* Every domain of the slot has room for another block, scheduler locked */
+static bool dfu_scheduler_admits(const struct dfu_scheduler *scheduler, const struct dfu_scheduler_slot *slot)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        if (slot->domains[i] < 0)
+            continue;
+        
+        const struct dfu_bus_domain *domain = &scheduler->domains[slot->domains[i]];
+        
+        // A window never closes completely
+        if (domain->active > 0 && domain->active >= (int)domain->window)
+            return false;
+    }
+    
+    return true;
+}
+
+static void dfu_scheduler_enter(void *context)
+{
+    struct dfu_scheduler_slot *slot = context;
+    struct dfu_scheduler *scheduler = slot->scheduler;
+    
+    pthread_mutex_lock(&scheduler->lock);
+    
+    while (!dfu_scheduler_admits(scheduler, slot))
+        pthread_cond_wait(&scheduler->wake, &scheduler->lock);
+    
+    for (int i = 0; i < 2; i++)
+    {
+        if (slot->domains[i] < 0)
+            continue;
+        
+        struct dfu_bus_domain *domain = &scheduler->domains[slot->domains[i]];
+        
+        if (++domain->active > domain->peak)
+            domain->peak = domain->active;
+    }
+    
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+/*
+ *  Additive increase, multiplicative decrease of the window from the
+ *  latency of one block
+ */
+static void dfu_scheduler_adjust(struct dfu_scheduler *scheduler, struct dfu_bus_domain *domain,
+                                 IOReturn result, uint64_t elapsed_us, uint64_t now)
+{
+    bool timeout = result == kIOReturnTimeout || result == kIOUSBTransactionTimeout || result == kIOUSBPipeStalled;
+    // A window that was not filled says nothing about a larger one
+    bool limited = domain->active >= (int)domain->window;
+    
+    domain->active--;
+    domain->blocks++;
+    
+    // Errors reported by the device say nothing about the bus
+    if (result != kIOReturnSuccess && !timeout)
+        return;
+    
+    if (!timeout)
+    {
+        if (domain->baseline_us == 0 || elapsed_us < domain->baseline_us)
+            domain->baseline_us = elapsed_us;
+        
+        domain->average_us = domain->average_us == 0 ? elapsed_us : (domain->average_us * 7 + elapsed_us) / 8;
+    }
+    
+    if (timeout || elapsed_us > domain->baseline_us * DFU_SCHEDULER_CONGESTED + DFU_SCHEDULER_SLACK_US)
+    {
+        // Blocks in flight at the time saw the same congestion, back off once per round trip
+        if (now - domain->backoff_at > domain->average_us)
+        {
+            domain->window = domain->window / 2 > 1 ? domain->window / 2 : 1;
+            domain->backoffs++;
+            domain->backoff_at = now;
+        }
+    }
+    else if (!limited)
+        return;
+    else if (domain->window + 1 / domain->window < scheduler->max_window)
+        domain->window += 1 / domain->window;
+    else
+        domain->window = scheduler->max_window;
+}
+
+static void dfu_scheduler_leave(void *context, IOReturn result, uint64_t elapsed_us)
+{
+    struct dfu_scheduler_slot *slot = context;
+    struct dfu_scheduler *scheduler = slot->scheduler;
+    uint64_t now = dfu_time_us();
+    
+    pthread_mutex_lock(&scheduler->lock);
+    
+    for (int i = 0; i < 2; i++)
+        if (slot->domains[i] >= 0)
+            dfu_scheduler_adjust(scheduler, &scheduler->domains[slot->domains[i]], result, elapsed_us, now);
+    
+    pthread_cond_broadcast(&scheduler->wake);
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+/*
+ *  Add a device to the domains of its hub and root port
+ *
+ *  scheduler - initialized scheduler
+ *  slot      - receives the gate of the device, lives as long as its transfers
+ *  location  - IOKit location of the device
+ *  speed     - kUSBDeviceSpeedLow .. kUSBDeviceSpeedSuper
+ *
+ *  returns 0 or -1 on error
+ */
+int dfu_scheduler_attach(struct dfu_scheduler *scheduler, struct dfu_scheduler_slot *slot,
+                         uint32_t location, uint8_t speed)
+{
+    int window = speed >= kUSBDeviceSpeedHigh ? DFU_SCHEDULER_WINDOW_HIGH_SPEED : DFU_SCHEDULER_WINDOW_FULL_SPEED;
+    uint32_t parent = dfu_location_parent(location);
+    uint32_t root_port = dfu_location_root_port(location);
+    
+    if (window > scheduler->max_window)
+        window = scheduler->max_window;
+    
+    slot->scheduler = scheduler;
+    slot->domains[0] = -1;
+    slot->domains[1] = -1;
+    slot->gate.enter = dfu_scheduler_enter;
+    slot->gate.leave = dfu_scheduler_leave;
+    slot->gate.context = slot;
+    
+    pthread_mutex_lock(&scheduler->lock);
+    
+    slot->domains[0] = dfu_scheduler_domain(scheduler, parent, window);
+    
+    // Behind a hub below the root port the root port link is shared as well
+    if (dfu_location_depth(location) > 2)
+        slot->domains[1] = dfu_scheduler_domain(scheduler, root_port, window);
+    
+    pthread_mutex_unlock(&scheduler->lock);
+    
+    if (slot->domains[0] < 0 || (dfu_location_depth(location) > 2 && slot->domains[1] < 0))
+        return -1;
+    
+    return 0;
+}
+
+static int dfu_spread_compare(const void *a, const void *b)
+{
+    const struct dfu_spread_key *x = a, *y = b;
+    
+    if (x->rank != y->rank)
+        return x->rank < y->rank ? -1 : 1;
+    
+    if (x->hub_rank != y->hub_rank)
+        return x->hub_rank < y->hub_rank ? -1 : 1;
+    
+    if (x->bus != y->bus)
+        return x->bus < y->bus ? -1 : 1;
+    
+    return x->location < y->location ? -1 : x->location > y->location;
+}
+
+/*
+ *  Order in which to start devices so that consecutive ones sit on
+ *  different controllers first and different hubs second
+ *
+ *  locations - IOKit location of each device
+ *  count     - number of devices
+ *  order     - receives count indices into locations
+ */
+void dfu_scheduler_spread(const uint32_t *locations, int count, int *order)
+{
+    struct dfu_spread_key keys[count > 0 ? count : 1];
+    
+    for (int i = 0; i < count; i++)
+    {
+        uint32_t parent = dfu_location_parent(locations[i]);
+        
+        keys[i].rank = 0;
+        keys[i].hub_rank = 0;
+        keys[i].bus = locations[i] >> 24;
+        keys[i].location = locations[i];
+        keys[i].index = i;
+        
+        for (int j = 0; j < count; j++)
+        {
+            uint32_t other = dfu_location_parent(locations[j]);
+            
+            // Devices before this one on the same hub
+            if (other == parent && locations[j] < locations[i])
+                keys[i].rank++;
+            
+            // Hubs before this one on the same bus, each counted at its first device
+            if (other >> 24 == keys[i].bus && other < parent)
+            {
+                int k;
+                
+                for (k = 0; k < j && dfu_location_parent(locations[k]) != other; k++)
+                    ;
+                
+                keys[i].hub_rank += k == j;
+            }
+        }
+    }
+    
+    qsort(keys, count, sizeof(keys[0]), dfu_spread_compare);
+    
+    for (int i = 0; i < count; i++)
+        order[i] = keys[i].index;
+}
+
+/*
+ *  Print the window and latencies each domain ended up with
+ *
+ *  scheduler - scheduler after the transfers
+ */
+void dfu_scheduler_print(struct dfu_scheduler *scheduler)
+{
+    pthread_mutex_lock(&scheduler->lock);
+    
+    for (int i = 0; i < scheduler->count; i++)
+    {
+        const struct dfu_bus_domain *domain = &scheduler->domains[i];
+        
+        printf("[i] %s 0x%08x: %d devices, %llu blocks, window %.1f (peak %d in flight), "
+               "block %.1f ms (fastest %.1f ms), %llu backoffs.\n",
+               (domain->location & 0x00ffffff) == 0 ? "Controller" : "Hub",
+               domain->location, domain->devices, (unsigned long long)domain->blocks, domain->window,
+               domain->peak, domain->average_us / 1000.0, domain->baseline_us / 1000.0,
+               (unsigned long long)domain->backoffs);
+    }
+    
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+/*
+ *  Release the domains, no transfer may still use a slot
+ *
+ *  scheduler - initialized scheduler
+ */
+void dfu_scheduler_free(struct dfu_scheduler *scheduler)
+{
+    free(scheduler->domains);
+    scheduler->domains = NULL;
+    scheduler->count = 0;
+    scheduler->capacity = 0;
+    
+    pthread_cond_destroy(&scheduler->wake);
+    pthread_mutex_destroy(&scheduler->lock);
+}
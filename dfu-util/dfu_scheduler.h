@@ -0,0 +1,90 @@
+/*
+ *  Bus topology aware scheduling of downloads
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef __dfu_util__dfu_scheduler__
+#define __dfu_util__dfu_scheduler__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dfu_transfer.h"
+
+#define DFU_SCHEDULER_WINDOW_FULL_SPEED   2     /* initial blocks in flight per domain, low and full speed */
+#define DFU_SCHEDULER_WINDOW_HIGH_SPEED   4     /* high and super speed */
+#define DFU_SCHEDULER_MAX_WINDOW          16
+#define DFU_SCHEDULER_CONGESTED           2     /* block latency over this many times the fastest one */
+#define DFU_SCHEDULER_SLACK_US            1000  /* latency jitter never taken for congestion */
+
+/*
+ *  Devices sharing an upstream link: the ports of one hub, one root port
+ *  or the root ports of one controller
+ */
+struct dfu_bus_domain
+{
+    /* IOKit location of the hub or root port, bus number only for a controller */
+    uint32_t location;
+    int devices;
+    /* Blocks in flight and the most seen at once */
+    int active;
+    int peak;
+    /* Blocks allowed in flight, grows by one per window of fast blocks and halves on congestion */
+    double window;
+    /* Fastest block and moving average, DFU_DNLOAD plus DFU_GETSTATUS */
+    uint64_t baseline_us;
+    uint64_t average_us;
+    uint64_t blocks;
+    uint64_t backoffs;
+    /* dfu_time_us() of the last backoff */
+    uint64_t backoff_at;
+};
+
+struct dfu_scheduler
+{
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    struct dfu_bus_domain *domains;
+    int count;
+    int capacity;
+    /* Upper bound of every window */
+    int max_window;
+};
+
+/* Admission of one device, its gate goes into the session or transfer */
+struct dfu_scheduler_slot
+{
+    struct dfu_scheduler *scheduler;
+    /* Parent hub and root port domain, -1 when unused */
+    int domains[2];
+    struct dfu_gate gate;
+};
+
+uint32_t dfu_location_parent(uint32_t location);
+uint32_t dfu_location_root_port(uint32_t location);
+
+int dfu_scheduler_init(struct dfu_scheduler *scheduler, int max_window);
+int dfu_scheduler_attach(struct dfu_scheduler *scheduler, struct dfu_scheduler_slot *slot,
+                         uint32_t location, uint8_t speed);
+void dfu_scheduler_spread(const uint32_t *locations, int count, int *order);
+void dfu_scheduler_print(struct dfu_scheduler *scheduler);
+void dfu_scheduler_free(struct dfu_scheduler *scheduler);
+
+#endif /* defined(__dfu_util__dfu_scheduler__) */
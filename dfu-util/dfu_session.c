@@ -0,0 +1,936 @@
+/*
+ *  DFU session on one USB device
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dfu_session.h"
+#include "dfu_metrics.h"
+#include "dfu_state.h"
+#include "usb_device.h"
+
+/*
+ *  Initialize a session for a device
+ *
+ *  session   - session to initialize
+ *  idVendor  - USB vendor id of the device
+ *  idProduct - USB product id of the device
+ */
+void dfu_session_init(struct dfu_session* session, unsigned short idVendor, unsigned short idProduct)
+{
+    memset(session, 0, sizeof(*session));
+    
+    session->idVendor = idVendor;
+    session->idProduct = idProduct;
+    
+    dfu_retry_policy_init(&session->retry);
+    
+    // Latency is learned per device and kept while the session lives
+    session->dif.timeout = DFU_DEFAULT_TIMEOUT;
+    dfu_timeouts_init(&session->dif.timeouts);
+}
+
+static IOReturn dfu_session_check_attributes(struct dfu_session* session, unsigned char required)
+{
+    if ((required & USB_DFU_CAN_DOWNLOAD) && !(session->descriptor.bmAttributes & USB_DFU_CAN_DOWNLOAD))
+    {
+        fprintf(stderr, "[!] Device is not able to receive firmware through DFU.\n");
+        return kIOReturnUnsupported;
+    }
+    
+    if ((required & USB_DFU_CAN_UPLOAD) && !(session->descriptor.bmAttributes & USB_DFU_CAN_UPLOAD))
+    {
+        fprintf(stderr, "[!] Device is not able to send firmware through DFU.\n");
+        return kIOReturnUnsupported;
+    }
+    
+    return kIOReturnSuccess;
+}
+
+/*
+ *  Locate and open the DFU interface of the session device. An interface
+ *  still open from an earlier step of the same enumeration is kept, every
+ *  close gives its driver a chance to claim it back.
+ *
+ *  session   - session with an opened device
+ *  required  - bmAttributes bits the interface must have
+ *
+ *  returns IOReturn value
+ */
+IOReturn dfu_session_open_interface(struct dfu_session* session, unsigned char required)
+{
+    if (session->interface != NULL)
+    {
+        // Each step of a recording starts with the descriptor it used
+        if (session->recorder != NULL)
+            dfu_recorder_describe(session->recorder, session->idVendor, session->idProduct, &session->descriptor);
+        
+        return dfu_session_check_attributes(session, required);
+    }
+    
+    session->interface = getDFUInterface(session->device);
+    
+    if (session->interface == NULL)
+    {
+        fprintf(stderr, "[!] Failed to locate DFU interface.\n");
+        return kIOReturnNotFound;
+    }
+    
+    // Parsed once per enumeration
+    if (!session->described)
+    {
+        IOUSBDFUDescriptor* descriptor = getDFUDescriptor(session->interface);
+        
+        if (descriptor == NULL)
+        {
+            fprintf(stderr, "[!] Failed to locate DFU descriptor for interface.\n");
+            return kIOReturnNotFound;
+        }
+        
+        session->descriptor = *descriptor;
+        session->described = true;
+        session->observed.bmAttributes = descriptor->bmAttributes;
+        session->observed.wTransferSize = descriptor->wTransferSize;
+        session->observed.wDetachTimeout = descriptor->wDetachTimeout;
+    }
+    
+    IOReturn result = dfu_session_check_attributes(session, required);
+    
+    if (result != kIOReturnSuccess)
+        return result;
+    
+    result = claimInterface(session->interface);
+    
+    if (result != kIOReturnSuccess)
+        return result;
+    
+    unsigned char intfIndex;
+    
+    result = (*session->interface)->GetInterfaceNumber(session->interface, &intfIndex);
+    
+    if (result != kIOReturnSuccess)
+        return result;
+    
+    dfu_init(&session->dif, session->device, session->interface, intfIndex);
+    
+    if (session->recorder != NULL)
+    {
+        dfu_recorder_describe(session->recorder, session->idVendor, session->idProduct, &session->descriptor);
+        dfu_recorder_attach(session->recorder, &session->dif);
+    }
+    
+    return kIOReturnSuccess;
+}
+
+/*
+ *  Close and release the DFU interface of the session device
+ *
+ *  session   - session whose interface may be open
+ */
+void dfu_session_close_interface(struct dfu_session* session)
+{
+    if (session->interface == NULL)
+        return;
+    
+    (*session->interface)->USBInterfaceClose(session->interface);
+    (*session->interface)->Release(session->interface);
+    
+    session->interface = NULL;
+}
+
+/*
+ *  Look up the profile of the device and let it choose timeouts from the
+ *  first request on
+ *
+ *  session   - session with an opened device
+ */
+static void dfu_session_load_profile(struct dfu_session* session)
+{
+    UInt16 bcdDevice = 0;
+    
+    (*session->device)->GetDeviceReleaseNumber(session->device, &bcdDevice);
+    
+    session->observed.idVendor = session->idVendor;
+    session->observed.idProduct = session->idProduct;
+    session->observed.bcdDevice = bcdDevice;
+    
+    if (session->profiles == NULL)
+        return;
+    
+    session->profile = session->observed;
+    session->profiled = dfu_profile_store_find(session->profiles, &session->profile);
+    
+    if (!session->profiled)
+        return;
+    
+    printf("[i] Using profile of %04x:%04x:%04x from %u runs.\n",
+           session->idVendor, session->idProduct, bcdDevice, session->profile.runs);
+    
+    for (int request = 0; request < DFU_TIMEOUT_REQUESTS; request++)
+        dfu_timeouts_seed(&session->dif.timeouts, request, session->profile.latency[request]);
+    
+    session->dif.timeouts.poll_timeout = session->profile.poll_timeout;
+}
+
+/*
+ *  Stream an event of the session device
+ *
+ *  session   - session with an event stream or none
+ *  type      - event type
+ *  status    - status for state and error events, may be NULL
+ *  result    - IOReturn of an error event
+ *  message   - string constant describing an error, may be NULL
+ */
+static void dfu_session_post(struct dfu_session* session, enum dfu_event_type type, const struct dfu_status* status,
+                             IOReturn result, const char* message)
+{
+    struct dfu_event event;
+    
+    if (session->events == NULL)
+        return;
+    
+    memset(&event, 0, sizeof(event));
+    event.type = type;
+    event.idVendor = session->idVendor;
+    event.idProduct = session->idProduct;
+    event.result = result;
+    event.message = message;
+    
+    if (status != NULL)
+    {
+        event.has_status = true;
+        event.state = status->bState;
+        event.status = status->bStatus;
+    }
+    
+    if (type == DFU_EVENT_DEVICE)
+        (*session->device)->GetLocationID(session->device, &event.location);
+    
+    dfu_events_post(session->events, &event);
+}
+
+/*
+ *  Final event of a download
+ *
+ *  session   - session with an event stream or none
+ *  result    - IOReturn of the download
+ *  sent      - bytes acknowledged
+ *  total     - bytes of the image
+ *  start     - dfu_time_us() at the first block
+ */
+static void dfu_session_post_done(struct dfu_session* session, IOReturn result, int sent, int total, uint64_t start)
+{
+    struct dfu_event event;
+    
+    if (session->events == NULL)
+        return;
+    
+    memset(&event, 0, sizeof(event));
+    event.type = DFU_EVENT_DONE;
+    event.idVendor = session->idVendor;
+    event.idProduct = session->idProduct;
+    event.result = result;
+    event.sent = sent;
+    event.total = total;
+    event.elapsed_us = dfu_time_us() - start;
+    event.bytes_per_second = event.elapsed_us > 0 ? (uint64_t)sent * 1000000 / event.elapsed_us : 0;
+    
+    dfu_events_post(session->events, &event);
+}
+
+/* Progress of a download with an event stream, ahead of the caller's callback */
+static void dfu_session_block(const struct dfu_transfer* transfer, int block_size, void* context)
+{
+    struct dfu_session* session = context;
+    struct dfu_event event;
+    
+    memset(&event, 0, sizeof(event));
+    event.type = DFU_EVENT_BLOCK;
+    event.idVendor = session->idVendor;
+    event.idProduct = session->idProduct;
+    event.transaction = transfer->transaction - 1;
+    event.size = block_size;
+    event.sent = transfer->sent;
+    event.total = transfer->size;
+    
+    dfu_events_post(session->events, &event);
+    
+    if (dfu_event_meter_due(&session->meter, transfer->sent, transfer->size, DFU_EVENTS_PROGRESS_MS, &event))
+    {
+        event.type = DFU_EVENT_PROGRESS;
+        dfu_events_post(session->events, &event);
+    }
+    
+    if (session->progress != NULL)
+        session->progress(transfer, block_size, session->context);
+}
+
+static IOReturn dfu_session_enter_dfu(struct dfu_session* session)
+{
+    IOReturn result;
+    
+    session->device = getDeviceAt(session->idVendor, session->idProduct, session->locationID);
+    
+    if (session->device == NULL)
+    {
+        fprintf(stderr, "[!] Failed to retrieve USB device [%04x:%04x].\n", session->idVendor, session->idProduct);
+        return kIOReturnNoDevice;
+    }
+    
+    dfu_session_post(session, DFU_EVENT_DEVICE, NULL, kIOReturnSuccess, NULL);
+    
+    if (session->startup.launch == 0)
+        session->startup.launch = dfu_time_us();
+    
+    // Three string descriptor requests, only for the log
+    if (!session->fast)
+        printDeviceInfo(session->device);
+    
+    result = claimDevice(session->device);
+    
+    if (result != kIOReturnSuccess)
+        return result;
+    
+    session->startup.opened = dfu_time_us();
+    
+    dfu_session_load_profile(session);
+    
+    if (session->fast)
+        ensureConfiguration(session->device);
+    else
+        setConfiguration(session->device);
+    
+    session->startup.configured = dfu_time_us();
+    session->described = false;
+    
+    result = dfu_session_open_interface(session, 0);
+    
+    if (result != kIOReturnSuccess)
+        goto error;
+    
+    session->startup.described = dfu_time_us();
+    
+    struct dfu_status status;
+    
+    result = dfu_get_status(&session->dif, &status);
+    
+    if (result != kIOReturnSuccess)
+        goto error;
+    
+    printf("[i] Device State %s, Status %s\n",
+           dfu_state_to_string(status.bState), dfu_status_to_string(status.bStatus));
+    dfu_session_post(session, DFU_EVENT_STATE, &status, kIOReturnSuccess, NULL);
+    
+    unsigned char initialState = status.bState;
+    unsigned char attributes = session->descriptor.bmAttributes;
+    unsigned int resets = session->dif.resets;
+    uint64_t detached = dfu_time_us();
+    
+    // Known to stay in appDETACH, reset it right away
+    if (session->profiled && session->profile.will_detach == DFU_PROFILE_DETACH_IGNORED)
+        attributes &= ~USB_DFU_WILL_DETACH;
+    
+    // E.g. the image failed to load, the device stays in its current mode
+    if (session->proceed != NULL && !session->proceed(session->proceed_context))
+    {
+        result = kIOReturnAborted;
+        goto error;
+    }
+    
+    // A replay has to take the same path
+    if (session->recorder != NULL && attributes != session->descriptor.bmAttributes)
+    {
+        IOUSBDFUDescriptor effective = session->descriptor;
+        
+        effective.bmAttributes = attributes;
+        dfu_recorder_describe(session->recorder, session->idVendor, session->idProduct, &effective);
+    }
+    
+    result = dfu_state_recover(&session->dif, attributes, session->descriptor.wDetachTimeout, &status);
+    
+    if (result != kIOReturnSuccess && status.bState == STATE_APP_DETACH && (attributes & USB_DFU_WILL_DETACH))
+    {
+        printf("[i] Device did not detach on its own, resetting it.\n");
+        
+        session->observed.will_detach = DFU_PROFILE_DETACH_IGNORED;
+        attributes &= ~USB_DFU_WILL_DETACH;
+        
+        result = dfu_state_recover(&session->dif, attributes, session->descriptor.wDetachTimeout, &status);
+    }
+    else if (result == kIOReturnSuccess && initialState == STATE_APP_IDLE && (attributes & USB_DFU_WILL_DETACH))
+        session->observed.will_detach = DFU_PROFILE_DETACH_HONORED;
+    
+    dfu_session_post(session, DFU_EVENT_STATE, &status, kIOReturnSuccess, NULL);
+    
+    if (result != kIOReturnSuccess)
+    {
+        fprintf(stderr, "[!] Device is not in dfu mode (state %s).\n", dfu_state_to_string(status.bState));
+        goto error;
+    }
+    
+    // Device was already in DFU mode, no re-enumeration happened and the
+    // interface stays claimed for the download. A reset out of e.g.
+    // dfuMANIFEST-WAIT-RESET re-enumerates the device like a detach.
+    if (initialState != STATE_APP_IDLE && initialState != STATE_APP_DETACH && session->dif.resets == resets)
+    {
+        printf("[i] Device is already in DFU mode.\n");
+        session->startup.ready = dfu_time_us();
+        return kIOReturnSuccess;
+    }
+    
+    dfu_session_close_interface(session);
+    
+    // The DFU mode descriptor replaces the run-time one
+    session->described = false;
+    
+    result = (*session->device)->USBDeviceClose(session->device);
+    
+    if (result != kIOReturnSuccess)
+        return result;
+    
+    result = claimDevice(session->device);
+    
+    // Only a detach from run-time mode is what the profile times
+    if (result == kIOReturnSuccess && (initialState == STATE_APP_IDLE || initialState == STATE_APP_DETACH))
+    {
+        uint64_t elapsed = dfu_time_us() - detached;
+        
+        dfu_metrics_detach_ready(elapsed);
+        session->observed.detach_ready = elapsed / 1000 > 0 ? elapsed / 1000 : 1;
+    }
+    
+    if (result == kIOReturnSuccess)
+        session->startup.ready = dfu_time_us();
+    
+    return result;
+    
+error:
+    dfu_session_close_interface(session);
+    
+    return result;
+}
+
+/*
+ *  Open the device and bring it into dfuIDLE, detaching it from its
+ *  run-time firmware if required
+ *
+ *  session   - initialized session
+ *
+ *  returns IOReturn value
+ */
+IOReturn dfu_session_prepare(struct dfu_session* session)
+{
+    IOReturn result = dfu_session_enter_dfu(session);
+    
+    if (result != kIOReturnSuccess)
+        dfu_session_post(session, DFU_EVENT_ERROR, NULL, result, "Failed to enter DFU mode");
+    
+    return result;
+}
+
+/*
+ *  Download a firmware image into a prepared device and reset it
+ *
+ *  session   - session prepared by dfu_session_prepare()
+ *  file      - firmware, the DFU suffix is not sent
+ *
+ *  returns IOReturn value
+ */
+IOReturn dfu_session_download(struct dfu_session* session, const struct dfu_file* file)
+{
+    IOReturn result = dfu_session_open_interface(session, USB_DFU_CAN_DOWNLOAD);
+    
+    if (result != kIOReturnSuccess)
+    {
+        dfu_session_close_interface(session);
+        return result;
+    }
+    
+    struct dfu_transfer* transfer = &session->transfer;
+    int firmware_size = file->size.total - file->size.suffix;
+    unsigned short transfer_size = session->descriptor.wTransferSize;
+    
+    // A profile may hold a smaller block size than the descriptor claims
+    if (session->profiled && session->profile.transfer_size > 0 && session->profile.transfer_size < transfer_size)
+        transfer_size = session->profile.transfer_size;
+    
+    dfu_transfer_init(transfer, &session->dif, file->firmware, firmware_size, transfer_size);
+    transfer->progress = session->progress;
+    transfer->context = session->context;
+    transfer->retry = session->retry;
+    transfer->gate = session->gate;
+    transfer->source = session->source;
+    
+    if (session->events != NULL)
+    {
+        transfer->progress = dfu_session_block;
+        transfer->context = session;
+    }
+    
+    // Hashed while the blocks go out, checked before manifestation
+    struct dfu_verify verify;
+    
+    if (session->sha256 != NULL)
+    {
+        dfu_verify_start(&verify, file->firmware, file->size.total, session->sha256);
+        transfer->verify = &verify;
+    }
+    
+    printf("[i] Initiating firmware upload (%d bytes, %d bytes transfer size).\n",
+           firmware_size, transfer_size);
+    
+    uint64_t start = dfu_time_us();
+    
+    if (session->startup.first_block == 0)
+        session->startup.first_block = start;
+    
+    dfu_event_meter_start(&session->meter);
+    
+    result = dfu_transfer_download(transfer);
+    
+    dfu_metrics_transfer(session->idVendor, session->idProduct, transfer->sent, dfu_time_us() - start);
+    
+    // Never manifest a partial image
+    if (result == kIOReturnSuccess)
+        result = dfu_transfer_manifest(transfer);
+    
+    if (result == kIOReturnSuccess)
+        session->observed.transfer_size = transfer_size;
+    
+    if (session->sha256 != NULL)
+    {
+        if (dfu_verify_finish(&verify) && result == kIOReturnSuccess)
+            printf("[i] Image SHA-256 verified.\n");
+        
+        transfer->verify = NULL;
+    }
+    
+    if (transfer->retries > 0)
+        printf("[i] Recovered from %d transient errors.\n", transfer->retries);
+    
+    if (transfer->sent < firmware_size)
+        fprintf(stderr, "[!] Error while flashing: \"%s\", %d / %d bytes remaining.\n",
+                dfu_status_to_string(transfer->status.bStatus), firmware_size - transfer->sent, firmware_size);
+    else if (result != kIOReturnSuccess)
+        fprintf(stderr, "[!] Error while flashing, %s.\n", dfu_status_to_string(transfer->status.bStatus));
+    else
+    {
+        printf("[i] Firmware upload complete, resetting device.\n");
+        
+        dfu_reset(&session->dif);
+    }
+    
+    if (result != kIOReturnSuccess)
+        dfu_session_post(session, DFU_EVENT_ERROR, &transfer->status, result,
+                         transfer->sent < firmware_size ? "Download failed" : "Manifestation failed");
+    else
+        dfu_session_post(session, DFU_EVENT_STATE, &transfer->status, result, NULL);
+    
+    dfu_session_post_done(session, result, transfer->sent, firmware_size, start);
+    
+    dfu_session_close_interface(session);
+    
+    return result;
+}
+
+/*
+ *  Shrink a plan to the pages that differ from what the history says the
+ *  device holds. Some of the pages left out are read back first, so that
+ *  a device flashed by other means since is written in full.
+ *
+ *  session   - session with the interface claimed
+ *  previous  - history entry of the device, NULL if none
+ *  next      - pages the image leaves on the device
+ *  layout    - memory layout of the device
+ *  image     - image to write
+ *  timing    - erase timing of the plan
+ *  plan      - full plan, replaced by a page erase plan on success
+ *
+ *  returns true if the plan was shrunk
+ */
+static bool dfu_session_differential(struct dfu_session* session, const struct dfu_history_entry* previous,
+                                     const struct dfu_history_entry* next, const struct dfu_layout* layout,
+                                     const struct dfu_image* image, const struct dfu_erase_timing* timing,
+                                     struct dfu_dfuse_plan* plan)
+{
+    const char* reason = NULL;
+    
+    if (previous == NULL)
+        reason = "no flash history for this device";
+    else if (previous->pending)
+        reason = "the last download did not finish";
+    else if (strcmp(previous->layout, next->layout) != 0)
+        reason = "the memory layout changed";
+    
+    if (reason != NULL)
+    {
+        printf("[i] Writing every page, %s.\n", reason);
+        return false;
+    }
+    
+    bool* unchanged = malloc(next->count * sizeof(*unchanged));
+    int same = 0;
+    
+    if (unchanged == NULL)
+        return false;
+    
+    for (int i = 0; i < next->count; i++)
+    {
+        const struct dfu_history_page* page = dfu_history_page(previous, next->pages[i].address);
+        
+        unchanged[i] = page != NULL && page->size == next->pages[i].size &&
+                       memcmp(page->digest, next->pages[i].digest, DFU_SHA256_LENGTH) == 0;
+        same += unchanged[i];
+    }
+    
+    if (same == 0)
+    {
+        printf("[i] Writing every page, all of them changed.\n");
+        free(unchanged);
+        return false;
+    }
+    
+    // Every page that would be skipped is read back in transfer size pieces
+    // and hashed against the recorded digest, reading is far cheaper than
+    // erasing and programming and a page left out could have been reflashed
+    unsigned short length = session->descriptor.wTransferSize;
+    uint8_t* actual = length > 0 ? malloc(length) : NULL;
+    
+    if (actual == NULL)
+        reason = "pages cannot be read back";
+    
+    for (int i = 0; i < next->count && reason == NULL; i++)
+    {
+        if (!unchanged[i])
+            continue;
+        
+        const struct dfu_history_page* page = &next->pages[i];
+        uint8_t digest[DFU_SHA256_LENGTH];
+        struct dfu_sha256 sha;
+        
+        dfu_sha256_init(&sha);
+        
+        for (uint32_t offset = 0; offset < page->size && reason == NULL; offset += length)
+        {
+            unsigned short size = page->size - offset < length ? page->size - offset : length;
+            
+            if (dfu_dfuse_read(&session->dif, page->address + offset, actual, size) != kIOReturnSuccess)
+            {
+                // Read protected devices stall uploads, get back to dfuIDLE
+                dfu_clear_status(&session->dif);
+                dfu_abort(&session->dif);
+                reason = "pages cannot be read back";
+            }
+            else
+                dfu_sha256_update(&sha, actual, size);
+        }
+        
+        dfu_sha256_final(&sha, digest);
+        
+        if (reason == NULL && memcmp(digest, page->digest, DFU_SHA256_LENGTH) != 0)
+            reason = "the device was flashed since";
+    }
+    
+    free(actual);
+    
+    // A mass erase would take the unchanged pages with it
+    struct dfu_dfuse_plan pages;
+    
+    if (reason != NULL || !dfu_dfuse_plan_build(&pages, layout, image, timing, DFU_ERASE_PAGE))
+    {
+        if (reason != NULL)
+            printf("[i] Writing every page, %s.\n", reason);
+        
+        free(unchanged);
+        return false;
+    }
+    
+    for (int i = 0; i < next->count; i++)
+    {
+        struct dfu_sector sector = { next->pages[i].address, next->pages[i].size, 0 };
+        
+        if (unchanged[i])
+            dfu_dfuse_plan_drop(&pages, &sector, timing);
+    }
+    
+    free(unchanged);
+    
+    dfu_dfuse_plan_free(plan);
+    *plan = pages;
+    
+    printf("[i] %d of %d pages unchanged since the last download, writing %d.\n",
+           same, next->count, next->count - same);
+    
+    return true;
+}
+
+/*
+ *  Download an image into a prepared DfuSe device following an erase plan
+ *  and start it
+ *
+ *  session   - session prepared by dfu_session_prepare()
+ *  image     - address ranges to write
+ *  layout    - memory layout string, NULL reads it from the interface
+ *  mode      - erase strategy, DFU_ERASE_AUTO picks the faster one
+ *
+ *  returns IOReturn value
+ */
+IOReturn dfu_session_download_dfuse(struct dfu_session* session, const struct dfu_image* image,
+                                    const char* layout, enum dfu_erase_mode mode)
+{
+    char description[256];
+    struct dfu_layout parsed;
+    struct dfu_erase_timing timing;
+    struct dfu_dfuse_plan plan;
+    IOReturn result = dfu_session_open_interface(session, USB_DFU_CAN_DOWNLOAD);
+    
+    if (result != kIOReturnSuccess)
+    {
+        dfu_session_close_interface(session);
+        return result;
+    }
+    
+    if (layout == NULL)
+    {
+        if (!getInterfaceString(session->device, session->interface, description, sizeof(description)))
+        {
+            fprintf(stderr, "[!] Device reports no DfuSe memory layout.\n");
+            dfu_session_close_interface(session);
+            return kIOReturnUnsupported;
+        }
+        
+        layout = description;
+    }
+    
+    dfu_erase_timing_init(&timing);
+    
+    if (!dfu_layout_parse(&parsed, layout))
+    {
+        dfu_session_close_interface(session);
+        return kIOReturnBadArgument;
+    }
+    
+    if (!dfu_dfuse_plan_build(&plan, &parsed, image, &timing, mode))
+    {
+        dfu_layout_free(&parsed);
+        dfu_session_close_interface(session);
+        return kIOReturnBadArgument;
+    }
+    
+    printf("[i] Memory layout %s, %d sectors.\n", parsed.name, parsed.count);
+    
+    // Devices are told apart by serial number, DfuSe bootloaders report a unique one
+    struct dfu_history_entry entry = { .idVendor = session->idVendor, .idProduct = session->idProduct };
+    struct dfu_history_entry* previous = NULL;
+    unsigned char stringIndex = 0;
+    
+    if (session->history != NULL &&
+        (*session->device)->USBGetSerialNumberStringIndex(session->device, &stringIndex) == kIOReturnSuccess &&
+        stringIndex != 0)
+        retrieveString(session->device, stringIndex, entry.serial, sizeof(entry.serial));
+    
+    if (session->history != NULL && entry.serial[0] == '\0')
+        printf("[i] Device has no serial number, not keeping a flash history.\n");
+    else if (session->history != NULL && dfu_history_describe(&entry, &parsed, image) == 0)
+    {
+        previous = dfu_history_find(session->history, entry.serial, entry.idVendor, entry.idProduct);
+        
+        if (session->differential)
+            dfu_session_differential(session, previous, &entry, &parsed, image, &timing, &plan);
+        
+        // Until the download finishes the history says nothing about the device
+        if (previous != NULL)
+        {
+            previous->pending = true;
+            
+            if (dfu_history_save(session->history) != 0)
+                fprintf(stderr, "[!] Failed to write %s.\n", session->history->path);
+        }
+    }
+    
+    dfu_dfuse_plan_print(&plan, false);
+    
+    uint64_t start = dfu_time_us();
+    
+    result = dfu_dfuse_execute(&session->dif, &plan, session->descriptor.wTransferSize);
+    
+    if (result == kIOReturnSuccess && entry.count > 0)
+    {
+        entry.time = time(NULL);
+        
+        if (dfu_history_store(session->history, &entry) != 0 || dfu_history_save(session->history) != 0)
+            fprintf(stderr, "[!] Failed to write %s.\n", session->history->path);
+    }
+    
+    dfu_history_entry_free(&entry);
+    
+    dfu_metrics_transfer(session->idVendor, session->idProduct, plan.bytes, dfu_time_us() - start);
+    
+    if (result == kIOReturnSuccess)
+    {
+        printf("[i] Firmware download complete, leaving DfuSe mode.\n");
+        
+        result = dfu_dfuse_leave(&session->dif, image->ranges[0].address);
+    }
+    else
+        fprintf(stderr, "[!] Error while flashing (0x%08x).\n", result);
+    
+    if (result != kIOReturnSuccess)
+        dfu_session_post(session, DFU_EVENT_ERROR, NULL, result, "DfuSe download failed");
+    
+    dfu_session_post_done(session, result, result == kIOReturnSuccess ? (int)plan.bytes : 0, (int)plan.bytes, start);
+    
+    dfu_dfuse_plan_free(&plan);
+    dfu_layout_free(&parsed);
+    dfu_session_close_interface(session);
+    
+    return result;
+}
+
+/*
+ *  Read the memory of a prepared device back, the device stays in DFU mode
+ *
+ *  session   - session prepared by dfu_session_prepare()
+ *  buffer    - receives the data
+ *  length    - size of the buffer
+ *  received  - number of bytes read
+ *
+ *  returns IOReturn value
+ */
+IOReturn dfu_session_upload(struct dfu_session* session, uint8_t* buffer, int length, int* received)
+{
+    IOReturn result = dfu_session_open_interface(session, USB_DFU_CAN_UPLOAD);
+    
+    *received = 0;
+    
+    if (result != kIOReturnSuccess)
+    {
+        dfu_session_close_interface(session);
+        return result;
+    }
+    
+    struct dfu_transfer* transfer = &session->transfer;
+    
+    dfu_transfer_init(transfer, &session->dif, NULL, length, session->descriptor.wTransferSize);
+    transfer->progress = session->progress;
+    transfer->context = session->context;
+    
+    result = dfu_transfer_upload(transfer, buffer);
+    *received = transfer->sent;
+    
+    // Still in DFU mode, the interface stays claimed for the next step
+    if (result != kIOReturnSuccess)
+        dfu_session_close_interface(session);
+    
+    return result;
+}
+
+/*
+ *  Get the DFU status of a prepared device
+ *
+ *  session   - session prepared by dfu_session_prepare()
+ *  status    - the data structure to be populated with the results
+ *
+ *  returns IOReturn value
+ */
+IOReturn dfu_session_status(struct dfu_session* session, struct dfu_status* status)
+{
+    IOReturn result = dfu_session_open_interface(session, 0);
+    
+    if (result == kIOReturnSuccess)
+        result = dfu_get_status(&session->dif, status);
+    
+    if (result != kIOReturnSuccess)
+        dfu_session_close_interface(session);
+    
+    return result;
+}
+
+/*
+ *  Close the device and release everything held by the session
+ *
+ *  session   - session to close, may be partially prepared
+ */
+void dfu_session_close(struct dfu_session* session)
+{
+    dfu_session_close_interface(session);
+    
+    if (session->profiles != NULL && session->observed.idVendor != 0)
+    {
+        for (int request = 0; request < DFU_TIMEOUT_REQUESTS; request++)
+            session->observed.latency[request] = dfu_timeouts_latency(&session->dif.timeouts, request);
+        
+        session->observed.poll_timeout = session->dif.timeouts.poll_timeout;
+        
+        dfu_profile_store_merge(session->profiles, &session->observed);
+        
+        if (dfu_profile_store_save(session->profiles) != 0)
+            fprintf(stderr, "[!] Failed to save device profiles to %s.\n", session->profiles->path);
+        
+        memset(&session->observed, 0, sizeof(session->observed));
+    }
+    
+    if (session->device != NULL)
+    {
+        (*session->device)->USBDeviceClose(session->device);
+        (*session->device)->Release(session->device);
+        
+        session->device = NULL;
+    }
+}
+
+static unsigned int dfu_startup_ms(uint64_t from, uint64_t to)
+{
+    return from != 0 && to > from ? (unsigned int)((to - from) / 1000) : 0;
+}
+
+/*
+ *  Print where the time from launch to the first DFU_DNLOAD went
+ *
+ *  session   - session that started a download
+ *
+ *  returns milliseconds from launch to the first DFU_DNLOAD, 0 if unknown
+ */
+unsigned int dfu_session_print_startup(const struct dfu_session* session)
+{
+    const struct dfu_startup* startup = &session->startup;
+    
+    if (startup->first_block == 0)
+        return 0;
+    
+    unsigned int total = dfu_startup_ms(startup->launch, startup->first_block);
+    
+    printf("[i] Startup %u ms: open %u ms, configure %u ms, descriptor %u ms, dfu mode %u ms, ",
+           total,
+           dfu_startup_ms(startup->launch, startup->opened),
+           dfu_startup_ms(startup->opened, startup->configured),
+           dfu_startup_ms(startup->configured, startup->described),
+           dfu_startup_ms(startup->described, startup->ready));
+    
+    // The image may have been validated while the device was opened
+    if (startup->image > startup->ready)
+        printf("waiting for image %u ms, ", dfu_startup_ms(startup->ready, startup->image));
+    
+    printf("image ready at %u ms.\n", dfu_startup_ms(startup->launch, startup->image));
+    
+    return total;
+}
@@ -0,0 +1,115 @@
+/*
+ *  DFU session on one USB device
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef __dfu_util__dfu_session__
+#define __dfu_util__dfu_session__
+
+#include "dfu.h"
+#include "dfu_dfuse.h"
+#include "dfu_events.h"
+#include "dfu_file.h"
+#include "dfu_history.h"
+#include "dfu_profile.h"
+#include "dfu_record.h"
+#include "dfu_transfer.h"
+
+/* Startup milestones in dfu_time_us(), 0 when not reached */
+struct dfu_startup
+{
+    /* Set by the caller at launch, prepare starts the clock otherwise */
+    uint64_t launch;
+    uint64_t opened;
+    uint64_t configured;
+    /* DFU interface located and its descriptor parsed */
+    uint64_t described;
+    /* Device in dfuIDLE */
+    uint64_t ready;
+    /* Set by the caller once the image is validated */
+    uint64_t image;
+    uint64_t first_block;
+};
+
+/*
+ *  Everything needed to flash one device. Sessions share no state, any
+ *  number of them may run concurrently on different devices.
+ */
+struct dfu_session
+{
+    unsigned short idVendor;
+    unsigned short idProduct;
+    /* Bus location of the device, 0 takes the first one with the ids */
+    UInt32 locationID;
+    IOUSBDeviceInterface300** device;
+    IOUSBInterfaceInterface300** interface;
+    /* Copy of the DFU functional descriptor, valid until the device re-enumerates */
+    IOUSBDFUDescriptor descriptor;
+    bool described;
+    /* Skip device strings and redundant SetConfiguration */
+    bool fast;
+    struct dfu_startup startup;
+    struct dfu_if dif;
+    struct dfu_transfer transfer;
+    /* Applied to every download of the session */
+    struct dfu_retry_policy retry;
+    /* Expected SHA-256 of downloaded images, NULL to skip verification */
+    const uint8_t* sha256;
+    /* Device profiles seeding and learning from the session, may be NULL */
+    struct dfu_profile_store* profiles;
+    /* Stored profile if the device model was seen before */
+    bool profiled;
+    struct dfu_profile profile;
+    /* What this session measured, merged into the store on close */
+    struct dfu_profile observed;
+    /* Logs every request of the session for replay, may be NULL */
+    struct dfu_recorder* recorder;
+    /* Records the pages DfuSe downloads leave on the device, may be NULL */
+    struct dfu_history* history;
+    /* Only write the pages that differ from the history */
+    bool differential;
+    /* Supplies the blocks of downloads instead of the image, may be NULL */
+    const struct dfu_source* source;
+    /* Admits every block of downloads, may be NULL */
+    const struct dfu_gate* gate;
+    /* Receives device, state, block, progress, error and done events, may be NULL */
+    struct dfu_events* events;
+    struct dfu_event_meter meter;
+    /* Called before prepare changes the device state, returning false
+       leaves the device as it is, may be NULL */
+    bool (*proceed)(void* context);
+    void* proceed_context;
+    /* Called after every acknowledged block, may be NULL */
+    void (*progress)(const struct dfu_transfer* transfer, int block_size, void* context);
+    void* context;
+};
+
+void dfu_session_init(struct dfu_session* session, unsigned short idVendor, unsigned short idProduct);
+IOReturn dfu_session_prepare(struct dfu_session* session);
+IOReturn dfu_session_open_interface(struct dfu_session* session, unsigned char required);
+void dfu_session_close_interface(struct dfu_session* session);
+IOReturn dfu_session_download(struct dfu_session* session, const struct dfu_file* file);
+IOReturn dfu_session_download_dfuse(struct dfu_session* session, const struct dfu_image* image,
+                                    const char* layout, enum dfu_erase_mode mode);
+IOReturn dfu_session_upload(struct dfu_session* session, uint8_t* buffer, int length, int* received);
+IOReturn dfu_session_status(struct dfu_session* session, struct dfu_status* status);
+void dfu_session_close(struct dfu_session* session);
+unsigned int dfu_session_print_startup(const struct dfu_session* session);
+
+#endif /* defined(__dfu_util__dfu_session__) */
@@ -0,0 +1,217 @@
+/*
+ *  SHA-256 (FIPS 180-4)
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <string.h>
+
+#include "dfu_sha256.h"
+
+static const uint32_t round_constants[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n)      (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void transform(uint32_t *state, const uint8_t *block)
+{
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, h;
+    int i;
+    
+    for (i = 0; i < 16; i++)
+        w[i] = ((uint32_t)block[4 * i] << 24) | (block[4 * i + 1] << 16) | (block[4 * i + 2] << 8) | block[4 * i + 3];
+    
+    for (i = 16; i < 64; i++)
+    {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    
+    a = state[0]; b = state[1]; c = state[2]; d = state[3];
+    e = state[4]; f = state[5]; g = state[6]; h = state[7];
+    
+    for (i = 0; i < 64; i++)
+    {
+        uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + round_constants[i] + w[i];
+        uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+void dfu_sha256_init(struct dfu_sha256 *sha)
+{
+    static const uint32_t initial[8] =
+    {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    
+    memcpy(sha->state, initial, sizeof(initial));
+    sha->length = 0;
+    sha->used = 0;
+}
+
+void dfu_sha256_update(struct dfu_sha256 *sha, const void *data, size_t length)
+{
+    const uint8_t *bytes = data;
+    
+    sha->length += length;
+    
+    if (sha->used > 0)
+    {
+        size_t take = 64 - sha->used < length ? 64 - sha->used : length;
+        
+        memcpy(sha->block + sha->used, bytes, take);
+        sha->used += take;
+        bytes += take;
+        length -= take;
+        
+        if (sha->used < 64)
+            return;
+        
+        transform(sha->state, sha->block);
+        sha->used = 0;
+    }
+    
+    // Whole blocks straight from the input
+    for (; length >= 64; bytes += 64, length -= 64)
+        transform(sha->state, bytes);
+    
+    memcpy(sha->block, bytes, length);
+    sha->used = length;
+}
+
+void dfu_sha256_final(struct dfu_sha256 *sha, uint8_t *digest)
+{
+    uint64_t bits = sha->length * 8;
+    int i;
+    
+    sha->block[sha->used++] = 0x80;
+    
+    if (sha->used > 56)
+    {
+        memset(sha->block + sha->used, 0, 64 - sha->used);
+        transform(sha->state, sha->block);
+        sha->used = 0;
+    }
+    
+    memset(sha->block + sha->used, 0, 56 - sha->used);
+    
+    for (i = 0; i < 8; i++)
+        sha->block[56 + i] = bits >> (56 - 8 * i);
+    
+    transform(sha->state, sha->block);
+    
+    for (i = 0; i < 8; i++)
+    {
+        digest[4 * i] = sha->state[i] >> 24;
+        digest[4 * i + 1] = sha->state[i] >> 16;
+        digest[4 * i + 2] = sha->state[i] >> 8;
+        digest[4 * i + 3] = sha->state[i];
+    }
+}
+
+/*
+ *  Digest of a buffer in one call
+ *
+ *  data      - bytes to hash
+ *  length    - number of bytes
+ *  digest    - receives DFU_SHA256_LENGTH bytes
+ */
+void dfu_sha256(const void *data, size_t length, uint8_t *digest)
+{
+    struct dfu_sha256 sha;
+    
+    dfu_sha256_init(&sha);
+    dfu_sha256_update(&sha, data, length);
+    dfu_sha256_final(&sha, digest);
+}
+
+/*
+ *  Parse a digest written as 64 hex digits
+ *
+ *  hex       - digest text, either case
+ *  digest    - receives DFU_SHA256_LENGTH bytes
+ *
+ *  returns false if the text is not a SHA-256 digest
+ */
+bool dfu_sha256_parse(const char *hex, uint8_t *digest)
+{
+    int i;
+    
+    if (strlen(hex) != DFU_SHA256_HEX_LENGTH)
+        return false;
+    
+    for (i = 0; i < DFU_SHA256_HEX_LENGTH; i++)
+    {
+        char c = hex[i];
+        int value;
+        
+        if (c >= '0' && c <= '9')
+            value = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            value = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            value = c - 'A' + 10;
+        else
+            return false;
+        
+        if (i % 2 == 0)
+            digest[i / 2] = value << 4;
+        else
+            digest[i / 2] |= value;
+    }
+    
+    return true;
+}
+
+/*
+ *  Format a digest as 64 lower case hex digits
+ *
+ *  digest    - DFU_SHA256_LENGTH bytes
+ *  hex       - receives DFU_SHA256_HEX_LENGTH + 1 characters
+ */
+void dfu_sha256_format(const uint8_t *digest, char *hex)
+{
+    static const char digits[] = "0123456789abcdef";
+    int i;
+    
+    for (i = 0; i < DFU_SHA256_LENGTH; i++)
+    {
+        hex[2 * i] = digits[digest[i] >> 4];
+        hex[2 * i + 1] = digits[digest[i] & 0x0f];
+    }
+    
+    hex[DFU_SHA256_HEX_LENGTH] = '\0';
+}
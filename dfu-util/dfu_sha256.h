@@ -0,0 +1,47 @@
+/*
+ *  SHA-256 (FIPS 180-4)
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef __dfu_util__dfu_sha256__
+#define __dfu_util__dfu_sha256__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define DFU_SHA256_LENGTH       32
+#define DFU_SHA256_HEX_LENGTH   (2 * DFU_SHA256_LENGTH)
+
+struct dfu_sha256
+{
+    uint32_t state[8];
+    uint64_t length;
+    uint8_t block[64];
+    size_t used;
+};
+
+void dfu_sha256_init(struct dfu_sha256 *sha);
+void dfu_sha256_update(struct dfu_sha256 *sha, const void *data, size_t length);
+void dfu_sha256_final(struct dfu_sha256 *sha, uint8_t *digest);
+void dfu_sha256(const void *data, size_t length, uint8_t *digest);
+bool dfu_sha256_parse(const char *hex, uint8_t *digest);
+void dfu_sha256_format(const uint8_t *digest, char *hex);
+
+#endif /* defined(__dfu_util__dfu_sha256__) */
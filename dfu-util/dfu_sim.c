@@ -0,0 +1,244 @@
+/*
+ *  Simulated DFU device behind a struct dfu_if transport
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <string.h>
+
+#include "dfu_sim.h"
+
+/*
+ *  Initialize a simulated device
+ *
+ *  sim         - device to initialize
+ *  memory      - flash contents, written by DFU_DNLOAD
+ *  memory_size - size of the flash
+ *  state       - initial state, STATE_APP_IDLE or STATE_DFU_IDLE
+ */
+void dfu_sim_init(struct dfu_sim *sim, uint8_t *memory, int memory_size, unsigned char state)
+{
+    memset(sim, 0, sizeof(*sim));
+    
+    sim->state = state;
+    sim->status = DFU_STATUS_OK;
+    sim->attributes = USB_DFU_CAN_DOWNLOAD | USB_DFU_CAN_UPLOAD | USB_DFU_MANIFEST_TOL;
+    sim->detach_timeout = 1000;
+    sim->transfer_size = DFU_SIM_TRANSFER_SIZE;
+    sim->poll_timeout = DFU_SIM_POLL_TIMEOUT;
+    sim->memory = memory;
+    sim->memory_size = memory_size;
+}
+
+/*
+ *  Route all requests of a DFU interface to a simulated device
+ *
+ *  sim       - simulated device
+ *  dif       - DFU interface, no IOKit objects are needed
+ */
+void dfu_sim_attach(struct dfu_sim *sim, struct dfu_if *dif)
+{
+    memset(dif, 0, sizeof(*dif));
+    
+    dif->timeout = DFU_DEFAULT_TIMEOUT;
+    dif->transport.control = dfu_sim_control;
+    dif->transport.reset = dfu_sim_reset;
+    dif->transport.context = sim;
+}
+
+static IOReturn dfu_sim_stall(struct dfu_sim *sim)
+{
+    sim->state = STATE_DFU_ERROR;
+    sim->status = DFU_STATUS_ERROR_STALLEDPKT;
+    
+    return kIOUSBPipeStalled;
+}
+
+static IOReturn dfu_sim_download(struct dfu_sim *sim, IOUSBDevRequestTO *request)
+{
+    if (sim->state != STATE_DFU_IDLE && sim->state != STATE_DFU_DOWNLOAD_IDLE)
+        return dfu_sim_stall(sim);
+    
+    if (request->wLength == 0)
+    {
+        // Nothing downloaded yet, nothing to manifest
+        if (sim->state == STATE_DFU_IDLE)
+            return dfu_sim_stall(sim);
+        
+        sim->image_size = sim->written;
+        sim->state = STATE_DFU_MANIFEST_SYNC;
+        
+        return kIOReturnSuccess;
+    }
+    
+    if (request->wLength > sim->transfer_size || ++sim->downloads == sim->stall_download)
+        return dfu_sim_stall(sim);
+    
+    if (sim->state == STATE_DFU_IDLE)
+        sim->written = 0;
+    
+    if (sim->written + request->wLength > sim->memory_size)
+    {
+        sim->state = STATE_DFU_ERROR;
+        sim->status = DFU_STATUS_ERROR_ADDRESS;
+        
+        return kIOReturnSuccess;
+    }
+    
+    memcpy(sim->memory + sim->written, request->pData, request->wLength);
+    
+    sim->written += request->wLength;
+    sim->state = STATE_DFU_DOWNLOAD_SYNC;
+    request->wLenDone = request->wLength;
+    
+    return kIOReturnSuccess;
+}
+
+static IOReturn dfu_sim_upload(struct dfu_sim *sim, IOUSBDevRequestTO *request)
+{
+    if (!(sim->attributes & USB_DFU_CAN_UPLOAD) ||
+        (sim->state != STATE_DFU_IDLE && sim->state != STATE_DFU_UPLOAD_IDLE))
+        return dfu_sim_stall(sim);
+    
+    if (sim->state == STATE_DFU_IDLE)
+        sim->upload_offset = 0;
+    
+    int length = sim->image_size - sim->upload_offset;
+    
+    if (length > request->wLength)
+        length = request->wLength;
+    
+    memcpy(request->pData, sim->memory + sim->upload_offset, length);
+    
+    sim->upload_offset += length;
+    request->wLenDone = length;
+    
+    // Short frame ends the upload
+    sim->state = length < request->wLength ? STATE_DFU_IDLE : STATE_DFU_UPLOAD_IDLE;
+    
+    return kIOReturnSuccess;
+}
+
+static IOReturn dfu_sim_get_status(struct dfu_sim *sim, IOUSBDevRequestTO *request)
+{
+    uint8_t *buffer = request->pData;
+    
+    if (request->wLength < 6)
+        return dfu_sim_stall(sim);
+    
+    // Blocks are programmed synchronously, the state moves on right away
+    if (sim->state == STATE_DFU_DOWNLOAD_SYNC)
+    {
+        sim->state = STATE_DFU_DOWNLOAD_IDLE;
+        
+        if (++sim->statuses == sim->drop_status)
+            return kIOReturnTimeout;
+    }
+    else if (sim->state == STATE_DFU_MANIFEST_SYNC)
+        sim->state = (sim->attributes & USB_DFU_MANIFEST_TOL) ? STATE_DFU_IDLE : STATE_DFU_MANIFEST_WAIT_RESET;
+    
+    buffer[0] = sim->status;
+    buffer[1] = sim->poll_timeout & 0xff;
+    buffer[2] = (sim->poll_timeout >> 8) & 0xff;
+    buffer[3] = (sim->poll_timeout >> 16) & 0xff;
+    buffer[4] = sim->state;
+    buffer[5] = 0;
+    
+    request->wLenDone = 6;
+    
+    return kIOReturnSuccess;
+}
+
+/*
+ *  Transport entry point, serves one control request
+ *
+ *  context   - struct dfu_sim
+ *  request   - DFU class request
+ *
+ *  returns IOReturn value, kIOUSBPipeStalled for invalid requests
+ */
+IOReturn dfu_sim_control(void *context, IOUSBDevRequestTO *request)
+{
+    struct dfu_sim *sim = context;
+    
+    sim->requests++;
+    request->wLenDone = 0;
+    
+    switch (request->bRequest)
+    {
+        case DFU_DETACH:
+            if (sim->state != STATE_APP_IDLE)
+                return dfu_sim_stall(sim);
+        
+            sim->state = STATE_APP_DETACH;
+            return kIOReturnSuccess;
+        case DFU_DNLOAD:
+            return dfu_sim_download(sim, request);
+        case DFU_UPLOAD:
+            return dfu_sim_upload(sim, request);
+        case DFU_GETSTATUS:
+            return dfu_sim_get_status(sim, request);
+        case DFU_CLRSTATUS:
+            if (sim->state != STATE_DFU_ERROR)
+                return dfu_sim_stall(sim);
+        
+            sim->state = STATE_DFU_IDLE;
+            sim->status = DFU_STATUS_OK;
+            return kIOReturnSuccess;
+        case DFU_GETSTATE:
+            if (request->wLength < 1)
+                return dfu_sim_stall(sim);
+        
+            ((uint8_t *)request->pData)[0] = sim->state;
+            request->wLenDone = 1;
+            return kIOReturnSuccess;
+        case DFU_ABORT:
+            if (sim->state != STATE_DFU_IDLE &&
+                sim->state != STATE_DFU_DOWNLOAD_SYNC &&
+                sim->state != STATE_DFU_DOWNLOAD_IDLE &&
+                sim->state != STATE_DFU_MANIFEST_SYNC &&
+                sim->state != STATE_DFU_UPLOAD_IDLE)
+                return dfu_sim_stall(sim);
+        
+            sim->state = STATE_DFU_IDLE;
+            return kIOReturnSuccess;
+        default:
+            return dfu_sim_stall(sim);
+    }
+}
+
+/*
+ *  Transport reset, leaves or enters DFU mode like a USB reset does
+ *
+ *  context   - struct dfu_sim
+ *
+ *  returns IOReturn value
+ */
+IOReturn dfu_sim_reset(void *context)
+{
+    struct dfu_sim *sim = context;
+    
+    if (sim->state == STATE_APP_DETACH)
+        sim->state = STATE_DFU_IDLE;
+    else
+        sim->state = STATE_APP_IDLE;
+    
+    sim->status = DFU_STATUS_OK;
+    
+    return kIOReturnSuccess;
+}
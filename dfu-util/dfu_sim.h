@@ -0,0 +1,71 @@
+/*
+ *  Simulated DFU device behind a struct dfu_if transport
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef __dfu_util__dfu_sim__
+#define __dfu_util__dfu_sim__
+
+#include <stdint.h>
+
+#include "dfu.h"
+
+#define DFU_SIM_TRANSFER_SIZE   1024
+#define DFU_SIM_POLL_TIMEOUT    5
+
+/*
+ *  Follows the DFU 1.1 state diagram, requests that are not valid in the
+ *  current state stall and put the device into dfuERROR like real
+ *  hardware does.
+ */
+struct dfu_sim
+{
+    unsigned char state;
+    unsigned char status;
+    /* Functional descriptor */
+    unsigned char attributes;
+    unsigned short detach_timeout;
+    unsigned short transfer_size;
+    /* bwPollTimeout reported by DFU_GETSTATUS */
+    unsigned int poll_timeout;
+    /* Flash contents */
+    uint8_t *memory;
+    int memory_size;
+    /* Bytes downloaded since the last dfuIDLE */
+    int written;
+    /* Bytes of the image the device holds, read back by DFU_UPLOAD */
+    int image_size;
+    int upload_offset;
+    /* Requests served */
+    unsigned long requests;
+    /* Faults: the reply to this DFU_GETSTATUS of a download is lost after
+       the device acted on it, this DFU_DNLOAD stalls, counted from 1,
+       0 for none */
+    unsigned long drop_status;
+    unsigned long stall_download;
+    unsigned long downloads;
+    unsigned long statuses;
+};
+
+void dfu_sim_init(struct dfu_sim *sim, uint8_t *memory, int memory_size, unsigned char state);
+void dfu_sim_attach(struct dfu_sim *sim, struct dfu_if *dif);
+IOReturn dfu_sim_control(void *context, IOUSBDevRequestTO *request);
+IOReturn dfu_sim_reset(void *context);
+
+#endif /* defined(__dfu_util__dfu_sim__) */
@@ -0,0 +1,232 @@
+/*
+ *  DFU state transition table and recovery to dfuIDLE
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include "dfu_state.h"
+
+/*
+ *  Cheapest way back to dfuIDLE from every state (DFU Spec 1.1, Appendix A).
+ *
+ *  Deterministic transitions are trusted and cost no extra DFU_GETSTATUS,
+ *  STATE_DFU_QUERY marks the places where only the device knows the outcome.
+ *  dfuMANIFEST leads to dfuMANIFEST-WAIT-RESET instead of dfuMANIFEST-SYNC
+ *  when the device is not manifestation tolerant.
+ */
+static const struct dfu_transition dfu_transitions[] =
+{
+    /* state                          step                 next */
+    { STATE_APP_IDLE,                 DFU_STEP_DETACH,     STATE_APP_DETACH },
+    { STATE_APP_DETACH,               DFU_STEP_RESET,      STATE_DFU_QUERY },
+    { STATE_DFU_IDLE,                 DFU_STEP_NONE,       STATE_DFU_IDLE },
+    { STATE_DFU_DOWNLOAD_SYNC,        DFU_STEP_GETSTATUS,  STATE_DFU_QUERY },
+    { STATE_DFU_DOWNLOAD_BUSY,        DFU_STEP_POLL,       STATE_DFU_DOWNLOAD_SYNC },
+    { STATE_DFU_DOWNLOAD_IDLE,        DFU_STEP_ABORT,      STATE_DFU_IDLE },
+    { STATE_DFU_MANIFEST_SYNC,        DFU_STEP_GETSTATUS,  STATE_DFU_QUERY },
+    { STATE_DFU_MANIFEST,             DFU_STEP_POLL,       STATE_DFU_MANIFEST_SYNC },
+    { STATE_DFU_MANIFEST_WAIT_RESET,  DFU_STEP_RESET,      STATE_DFU_QUERY },
+    { STATE_DFU_UPLOAD_IDLE,          DFU_STEP_ABORT,      STATE_DFU_IDLE },
+    { STATE_DFU_ERROR,                DFU_STEP_CLRSTATUS,  STATE_DFU_IDLE },
+};
+
+/*
+ *  Look up the recovery transition for a state
+ *
+ *  state     - DFU state as reported by DFU_GETSTATUS
+ *
+ *  returns the table row or NULL for states not defined by the spec
+ */
+const struct dfu_transition* dfu_state_transition(int state)
+{
+    if (state < 0 || state >= (int)(sizeof(dfu_transitions) / sizeof(dfu_transitions[0])))
+        return NULL;
+
+    return &dfu_transitions[state];
+}
+
+static unsigned char dfu_state_next(const struct dfu_transition* transition, unsigned char attributes)
+{
+    if (transition->state == STATE_DFU_MANIFEST && !(attributes & USB_DFU_MANIFEST_TOL))
+        return STATE_DFU_MANIFEST_WAIT_RESET;
+
+    return transition->next;
+}
+
+/*
+ *  Compute the steps leading from a state to dfuIDLE without talking to the
+ *  device. The plan stops at the first step whose outcome only the device
+ *  can tell, the caller replans from the state it reports.
+ *
+ *  state      - current DFU state
+ *  attributes - DFU functional descriptor bmAttributes
+ *  steps      - output array
+ *  max        - size of the output array
+ *
+ *  returns number of steps or < 0 if dfuIDLE cannot be reached
+ */
+int dfu_state_plan(int state, unsigned char attributes, enum dfu_step* steps, int max)
+{
+    int count = 0;
+
+    while (count < max)
+    {
+        const struct dfu_transition* transition = dfu_state_transition(state);
+
+        if (transition == NULL || transition->step == DFU_STEP_FAIL)
+            return -1;
+
+        if (transition->step == DFU_STEP_NONE)
+            return count;
+
+        steps[count++] = transition->step;
+        state = dfu_state_next(transition, attributes);
+
+        if (state == STATE_DFU_QUERY)
+        {
+            if (transition->step != DFU_STEP_GETSTATUS && count < max)
+                steps[count++] = DFU_STEP_GETSTATUS;
+
+            return count;
+        }
+    }
+
+    return -1;
+}
+
+static IOReturn dfu_state_step(struct dfu_if* dif,
+                               unsigned char attributes,
+                               unsigned short detach_timeout,
+                               const struct dfu_transition* transition,
+                               struct dfu_status* status)
+{
+    switch (transition->step)
+    {
+        case DFU_STEP_DETACH:
+            return dfu_detach(dif, detach_timeout);
+        case DFU_STEP_RESET:
+            // Device resets itself after DFU_DETACH, but still waits for
+            // the host in dfuMANIFEST-WAIT-RESET
+            if (transition->state == STATE_APP_DETACH && (attributes & USB_DFU_WILL_DETACH))
+                return kIOReturnSuccess;
+
+            return dfu_reset(dif);
+        case DFU_STEP_GETSTATUS:
+            return dfu_get_status(dif, status);
+        case DFU_STEP_CLRSTATUS:
+            return dfu_clear_status(dif);
+        case DFU_STEP_ABORT:
+            return dfu_abort(dif);
+        case DFU_STEP_POLL:
+            dfu_wait(dif, status->bwPollTimeout);
+            return kIOReturnSuccess;
+        default:
+            return kIOReturnError;
+    }
+}
+
+/*
+ *  Bring a device into dfuIDLE using the fewest requests the table allows
+ *
+ *  dif            - DFU interface
+ *  attributes     - DFU functional descriptor bmAttributes
+ *  detach_timeout - wDetachTimeout passed with DFU_DETACH
+ *  status         - last status read from the device, updated on return
+ *
+ *  returns IOReturn value
+ */
+IOReturn dfu_state_recover(struct dfu_if* dif,
+                           unsigned char attributes,
+                           unsigned short detach_timeout,
+                           struct dfu_status* status)
+{
+    int steps;
+
+    for (steps = 0; steps < DFU_RECOVERY_MAX_STEPS; steps++)
+    {
+        const struct dfu_transition* transition = dfu_state_transition(status->bState);
+
+        if (transition == NULL || transition->step == DFU_STEP_FAIL)
+        {
+            fprintf(stderr, "[!] No recovery from state %s.\n", dfu_state_to_string(status->bState));
+            return kIOReturnError;
+        }
+
+        if (transition->step == DFU_STEP_NONE)
+            return kIOReturnSuccess;
+
+        printf("[i] Recovering from %s: %s.\n",
+               dfu_state_to_string(status->bState), dfu_step_to_string(transition->step));
+
+        IOReturn result = dfu_state_step(dif, attributes, detach_timeout, transition, status);
+
+        if (result != kIOReturnSuccess)
+            return result;
+
+        // Device reported its new state already
+        if (transition->step == DFU_STEP_GETSTATUS)
+            continue;
+
+        unsigned char next = dfu_state_next(transition, attributes);
+
+        if (next == STATE_DFU_QUERY)
+        {
+            result = dfu_get_status(dif, status);
+
+            if (result != kIOReturnSuccess)
+                return result;
+        }
+        else
+        {
+            status->bState = next;
+
+            if (next == STATE_DFU_IDLE)
+                status->bStatus = DFU_STATUS_OK;
+        }
+    }
+
+    fprintf(stderr, "[!] Device did not reach dfuIDLE after %d steps (state %s).\n",
+            steps, dfu_state_to_string(status->bState));
+
+    return kIOReturnError;
+}
+
+const char* dfu_step_to_string(enum dfu_step step)
+{
+    switch (step)
+    {
+        case DFU_STEP_NONE:
+            return "none";
+        case DFU_STEP_DETACH:
+            return "DFU_DETACH";
+        case DFU_STEP_RESET:
+            return "USB reset";
+        case DFU_STEP_GETSTATUS:
+            return "DFU_GETSTATUS";
+        case DFU_STEP_CLRSTATUS:
+            return "DFU_CLRSTATUS";
+        case DFU_STEP_ABORT:
+            return "DFU_ABORT";
+        case DFU_STEP_POLL:
+            return "wait bwPollTimeout";
+        case DFU_STEP_FAIL:
+            return "fail";
+        default:
+            return "Unknown";
+    }
+}
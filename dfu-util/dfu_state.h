@@ -0,0 +1,63 @@
+/*
+ *  DFU state transition table and recovery to dfuIDLE
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef __dfu_util__dfu_state__
+#define __dfu_util__dfu_state__
+
+#include "dfu.h"
+
+/* Next state is only known once the device reports it through DFU_GETSTATUS */
+#define STATE_DFU_QUERY                 0xff
+
+/* Longest recovery path, anything longer means the device is looping */
+#define DFU_RECOVERY_MAX_STEPS          8
+
+enum dfu_step
+{
+    DFU_STEP_NONE,          /* Already in dfuIDLE */
+    DFU_STEP_DETACH,        /* DFU_DETACH request */
+    DFU_STEP_RESET,         /* USB reset, skipped if the device detaches itself */
+    DFU_STEP_GETSTATUS,     /* DFU_GETSTATUS request */
+    DFU_STEP_CLRSTATUS,     /* DFU_CLRSTATUS request */
+    DFU_STEP_ABORT,         /* DFU_ABORT request */
+    DFU_STEP_POLL,          /* Wait bwPollTimeout, no request allowed */
+    DFU_STEP_FAIL           /* No way back to dfuIDLE */
+};
+
+/*
+ *  One row of the recovery table: the cheapest step leading from state
+ *  towards dfuIDLE, and the state the device is in after it.
+ */
+struct dfu_transition
+{
+    unsigned char state;
+    enum dfu_step step;
+    unsigned char next;
+};
+
+const struct dfu_transition* dfu_state_transition(int state);
+int dfu_state_plan(int state, unsigned char attributes, enum dfu_step* steps, int max);
+IOReturn dfu_state_recover(struct dfu_if* dif, unsigned char attributes, unsigned short detach_timeout,
+                           struct dfu_status* status);
+
+const char* dfu_step_to_string(enum dfu_step step);
+
+#endif /* defined(__dfu_util__dfu_state__) */
@@ -0,0 +1,180 @@
+/*
+ *  Adaptive control request timeouts from observed latency
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <string.h>
+
+#include "dfu.h"
+#include "dfu_timeout.h"
+
+/* Requests the device may hold until the bwPollTimeout it announced has passed */
+#define DFU_TIMEOUT_POLLED(request)     ((request) == DFU_DNLOAD || (request) == DFU_GETSTATUS)
+
+/*
+ *  Enable adaptive timeouts with the default floor and ceiling
+ *
+ *  timeouts  - per device timeouts to initialize
+ */
+void dfu_timeouts_init(struct dfu_timeouts *timeouts)
+{
+    memset(timeouts, 0, sizeof(*timeouts));
+    
+    timeouts->adaptive = true;
+    timeouts->floor = DFU_TIMEOUT_FLOOR;
+    timeouts->ceiling = DFU_TIMEOUT_CEILING;
+}
+
+/*
+ *  Timeout for the next request of a type
+ *
+ *  timeouts  - per device timeouts
+ *  request   - bRequest
+ *  fallback  - fixed timeout in ms, used until enough latency was observed
+ *
+ *  returns timeout in ms
+ */
+unsigned int dfu_timeouts_get(const struct dfu_timeouts *timeouts, unsigned char request, unsigned int fallback)
+{
+    if (!timeouts->adaptive || request >= DFU_TIMEOUT_REQUESTS)
+        return fallback;
+    
+    const struct dfu_latency *latency = &timeouts->requests[request];
+    
+    if (latency->timeout == 0)
+        return fallback;
+    
+    unsigned int timeout = latency->timeout;
+    
+    if (DFU_TIMEOUT_POLLED(request))
+        timeout += timeouts->poll_timeout;
+    
+    timeout <<= latency->penalty;
+    
+    if (timeout < timeouts->floor)
+        timeout = timeouts->floor;
+    
+    if (timeout > timeouts->ceiling)
+        timeout = timeouts->ceiling;
+    
+    return timeout;
+}
+
+/*
+ *  Percentile of the latency window, insertion sorted, the window is small
+ *
+ *  returns latency in microseconds
+ */
+static uint32_t latency_percentile(const struct dfu_latency *latency, int percentile)
+{
+    uint32_t sorted[DFU_TIMEOUT_SAMPLES];
+    int i, j;
+    
+    for (i = 0; i < latency->count; i++)
+    {
+        uint32_t sample = latency->samples[i];
+        
+        for (j = i; j > 0 && sorted[j - 1] > sample; j--)
+            sorted[j] = sorted[j - 1];
+        
+        sorted[j] = sample;
+    }
+    
+    return sorted[(latency->count - 1) * percentile / 100];
+}
+
+/*
+ *  Record the outcome of a request
+ *
+ *  timeouts   - per device timeouts
+ *  request    - bRequest
+ *  timed_out  - the request hit its timeout
+ *  elapsed_us - time from submission to completion
+ */
+void dfu_timeouts_record(struct dfu_timeouts *timeouts, unsigned char request, bool timed_out, uint64_t elapsed_us)
+{
+    if (!timeouts->adaptive || request >= DFU_TIMEOUT_REQUESTS)
+        return;
+    
+    struct dfu_latency *latency = &timeouts->requests[request];
+    
+    // A timeout says nothing about the latency, only that it was too short
+    if (timed_out)
+    {
+        if (latency->penalty < DFU_TIMEOUT_MAX_PENALTY)
+            latency->penalty++;
+        
+        return;
+    }
+    
+    latency->penalty = 0;
+    latency->samples[latency->next] = elapsed_us > UINT32_MAX ? UINT32_MAX : (uint32_t)elapsed_us;
+    latency->next = (latency->next + 1) % DFU_TIMEOUT_SAMPLES;
+    
+    if (latency->count < DFU_TIMEOUT_SAMPLES)
+        latency->count++;
+    
+    if (latency->count < DFU_TIMEOUT_MIN_SAMPLES)
+        return;
+    
+    uint64_t timeout = (uint64_t)latency_percentile(latency, DFU_TIMEOUT_PERCENTILE) * DFU_TIMEOUT_FACTOR / 1000;
+    
+    latency->timeout = timeout < timeouts->floor ? timeouts->floor : (unsigned int)timeout;
+}
+
+/*
+ *  Start a request type with a latency learned earlier, e.g. from a device
+ *  profile, instead of the fixed timeout. Samples replace it as they come.
+ *
+ *  timeouts   - per device timeouts
+ *  request    - bRequest
+ *  latency_us - expected percentile latency
+ */
+void dfu_timeouts_seed(struct dfu_timeouts *timeouts, unsigned char request, uint32_t latency_us)
+{
+    if (!timeouts->adaptive || request >= DFU_TIMEOUT_REQUESTS || latency_us == 0)
+        return;
+    
+    struct dfu_latency *latency = &timeouts->requests[request];
+    uint64_t timeout = (uint64_t)latency_us * DFU_TIMEOUT_FACTOR / 1000;
+    
+    if (latency->count < DFU_TIMEOUT_MIN_SAMPLES)
+        latency->timeout = timeout < timeouts->floor ? timeouts->floor : (unsigned int)timeout;
+}
+
+/*
+ *  Percentile latency observed for a request type
+ *
+ *  timeouts  - per device timeouts
+ *  request   - bRequest
+ *
+ *  returns latency in microseconds, 0 until enough samples were seen
+ */
+uint32_t dfu_timeouts_latency(const struct dfu_timeouts *timeouts, unsigned char request)
+{
+    if (request >= DFU_TIMEOUT_REQUESTS)
+        return 0;
+    
+    const struct dfu_latency *latency = &timeouts->requests[request];
+    
+    if (latency->count < DFU_TIMEOUT_MIN_SAMPLES)
+        return 0;
+    
+    return latency_percentile(latency, DFU_TIMEOUT_PERCENTILE);
+}
@@ -0,0 +1,70 @@
+/*
+ *  Adaptive control request timeouts from observed latency
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef __dfu_util__dfu_timeout__
+#define __dfu_util__dfu_timeout__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define DFU_TIMEOUT_REQUESTS    7     /* DFU_DETACH .. DFU_ABORT */
+#define DFU_TIMEOUT_SAMPLES     32    /* latencies kept per request type */
+#define DFU_TIMEOUT_MIN_SAMPLES 8     /* fixed timeout until this many were seen */
+#define DFU_TIMEOUT_PERCENTILE  95
+#define DFU_TIMEOUT_FACTOR      4     /* timeout is this multiple of the percentile */
+#define DFU_TIMEOUT_FLOOR       200   /* ms */
+#define DFU_TIMEOUT_CEILING     30000 /* ms */
+#define DFU_TIMEOUT_MAX_PENALTY 4     /* doublings after consecutive timeouts */
+
+/* Recent latencies of one request type */
+struct dfu_latency
+{
+    /* Ring of the last samples in microseconds */
+    uint32_t samples[DFU_TIMEOUT_SAMPLES];
+    int count;
+    int next;
+    /* Current timeout in ms, 0 until enough samples were seen */
+    unsigned int timeout;
+    /* Consecutive timeouts, each one doubles the timeout */
+    unsigned int penalty;
+};
+
+/*
+ *  Per device timeouts. A zeroed structure is disabled and every request
+ *  uses the fixed timeout of the interface.
+ */
+struct dfu_timeouts
+{
+    bool adaptive;
+    unsigned int floor;
+    unsigned int ceiling;
+    /* Last bwPollTimeout reported, the device may take that long to answer */
+    unsigned int poll_timeout;
+    struct dfu_latency requests[DFU_TIMEOUT_REQUESTS];
+};
+
+void dfu_timeouts_init(struct dfu_timeouts *timeouts);
+unsigned int dfu_timeouts_get(const struct dfu_timeouts *timeouts, unsigned char request, unsigned int fallback);
+void dfu_timeouts_record(struct dfu_timeouts *timeouts, unsigned char request, bool timed_out, uint64_t elapsed_us);
+void dfu_timeouts_seed(struct dfu_timeouts *timeouts, unsigned char request, uint32_t latency_us);
+uint32_t dfu_timeouts_latency(const struct dfu_timeouts *timeouts, unsigned char request);
+
+#endif /* defined(__dfu_util__dfu_timeout__) */
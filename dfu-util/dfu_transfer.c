@@ -0,0 +1,422 @@
+/*
+ *  DFU download engine
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <limits.h>
+#include <string.h>
+
+#include "dfu_transfer.h"
+#include "dfu_metrics.h"
+#include "dfu_state.h"
+
+/*
+ *  Prepare a download of an image
+ *
+ *  transfer      - transfer state to initialize
+ *  dif           - DFU interface, must be in dfuIDLE
+ *  data          - image without DFU suffix
+ *  size          - image size in bytes
+ *  transfer_size - wTransferSize of the device
+ */
+void dfu_transfer_init(struct dfu_transfer *transfer,
+                       struct dfu_if *dif,
+                       const uint8_t *data,
+                       int size,
+                       unsigned short transfer_size)
+{
+    memset(transfer, 0, sizeof(*transfer));
+    
+    transfer->dif = dif;
+    transfer->data = data;
+    transfer->size = size;
+    transfer->transfer_size = transfer_size;
+    transfer->transaction = 1;
+    
+    dfu_retry_policy_init(&transfer->retry);
+}
+
+/*
+ *  Default retry policy
+ *
+ *  retry     - policy to initialize
+ */
+void dfu_retry_policy_init(struct dfu_retry_policy *retry)
+{
+    retry->budget = DFU_RETRY_DEFAULT_BUDGET;
+    retry->attempts = DFU_RETRY_DEFAULT_ATTEMPTS;
+    retry->backoff = DFU_RETRY_DEFAULT_BACKOFF;
+    retry->max_backoff = DFU_RETRY_DEFAULT_MAX_BACKOFF;
+}
+
+/*
+ *  Classify a failed block
+ *
+ *  result    - IOReturn of the block, kIOReturnError for an error status
+ *  status    - status read after the block
+ *
+ *  returns true if resending the block may succeed
+ */
+bool dfu_transfer_is_transient(IOReturn result, const struct dfu_status *status)
+{
+    switch (result)
+    {
+        case kIOReturnTimeout:
+        case kIOUSBTransactionTimeout:
+        case kIOUSBPipeStalled:
+            return true;
+        case kIOReturnError:
+            return status->bStatus == DFU_STATUS_ERROR_NOTDONE ||
+                   status->bStatus == DFU_STATUS_ERROR_STALLEDPKT;
+        default:
+            return false;
+    }
+}
+
+/* Where a download continues after a failed block */
+enum dfu_recovery
+{
+    /* The device did not take the block, send it again */
+    DFU_RECOVERY_RESEND,
+    /* The block arrived, only its status was lost */
+    DFU_RECOVERY_ACKNOWLEDGED,
+    /* The device is back in dfuIDLE and starts a new download */
+    DFU_RECOVERY_RESTART
+};
+
+static IOReturn dfu_transfer_block(struct dfu_transfer *transfer, int size, bool *delivered)
+{
+    const uint8_t *block = transfer->data + transfer->sent;
+    
+    if (transfer->source != NULL)
+        block = transfer->source->read(transfer->source->context, transfer->sent, size);
+    
+    *delivered = false;
+    
+    if (block == NULL)
+        return kIOReturnNoMemory;
+    
+    IOReturn result = dfu_download(transfer->dif,
+                                   size,
+                                   transfer->transaction,
+                                   (unsigned char *)block);
+    
+    if (result != kIOReturnSuccess)
+        return result;
+    
+    *delivered = true;
+    
+    result = dfu_get_status(transfer->dif, &transfer->status);
+    
+    if (result != kIOReturnSuccess)
+        return result;
+    
+    return transfer->status.bStatus == DFU_STATUS_OK ? kIOReturnSuccess : kIOReturnError;
+}
+
+/*
+ *  Bring the device back to a state that accepts blocks again: let a
+ *  pending block finish, clear an error, abort anything else
+ *
+ *  transfer  - transfer with a failed block
+ *  delivered - the DFU_DNLOAD of the block completed
+ *  recovery  - receives how the download continues
+ *
+ *  returns IOReturn value
+ */
+static IOReturn dfu_transfer_recover(struct dfu_transfer *transfer, bool delivered, enum dfu_recovery *recovery)
+{
+    int step;
+    
+    for (step = 0; step < DFU_RECOVERY_MAX_STEPS; step++)
+    {
+        IOReturn result = dfu_get_status(transfer->dif, &transfer->status);
+        
+        if (result != kIOReturnSuccess)
+            return result;
+        
+        switch (transfer->status.bState)
+        {
+            // CLRSTATUS / ABORT end the download, streaming devices start
+            // writing from the beginning again on the next block
+            case STATE_DFU_IDLE:
+                *recovery = DFU_RECOVERY_RESTART;
+                return kIOReturnSuccess;
+            // Resending a block the device took would write it twice
+            case STATE_DFU_DOWNLOAD_IDLE:
+                *recovery = delivered && transfer->status.bStatus == DFU_STATUS_OK ?
+                            DFU_RECOVERY_ACKNOWLEDGED : DFU_RECOVERY_RESEND;
+                return kIOReturnSuccess;
+            case STATE_DFU_DOWNLOAD_SYNC:
+            case STATE_DFU_DOWNLOAD_BUSY:
+                dfu_wait(transfer->dif, transfer->status.bwPollTimeout);
+                break;
+            case STATE_DFU_ERROR:
+                result = dfu_clear_status(transfer->dif);
+                break;
+            default:
+                result = dfu_abort(transfer->dif);
+                break;
+        }
+        
+        if (result != kIOReturnSuccess)
+            return result;
+    }
+    
+    return kIOReturnTimeout;
+}
+
+/*
+ *  Send the image block by block, checking the status after each block.
+ *  Transient errors are retried within transfer->retry.
+ *
+ *  transfer  - initialized transfer
+ *
+ *  returns IOReturn value, kIOReturnError when the device reported an error
+ *  status (see transfer->status)
+ */
+IOReturn dfu_transfer_download(struct dfu_transfer *transfer)
+{
+    IOReturn result;
+    int attempts = 0;
+    unsigned int backoff = transfer->retry.backoff;
+    bool recover = false;
+    bool delivered = false;
+    enum dfu_recovery recovery = DFU_RECOVERY_RESEND;
+    
+    while (transfer->sent < transfer->size)
+    {
+        int remaining = transfer->size - transfer->sent;
+        int size = transfer->transfer_size < remaining ? transfer->transfer_size : remaining;
+        
+        // A failed recovery counts as another failed attempt of the block
+        result = recover ? dfu_transfer_recover(transfer, delivered, &recovery) : kIOReturnSuccess;
+        
+        if (result == kIOReturnSuccess && recover && recovery == DFU_RECOVERY_RESTART && transfer->sent > 0)
+        {
+            fprintf(stderr, "[!] Device left the download, sending the image again.\n");
+            
+            transfer->sent = 0;
+            transfer->transaction = 1;
+            recover = false;
+            continue;
+        }
+        
+        if (result == kIOReturnSuccess && recover && recovery == DFU_RECOVERY_ACKNOWLEDGED)
+            recover = false;
+        else if (result == kIOReturnSuccess && transfer->gate != NULL)
+        {
+            transfer->gate->enter(transfer->gate->context);
+            
+            uint64_t started = dfu_time_us();
+            
+            result = dfu_transfer_block(transfer, size, &delivered);
+            transfer->gate->leave(transfer->gate->context, result, dfu_time_us() - started);
+        }
+        else if (result == kIOReturnSuccess)
+            result = dfu_transfer_block(transfer, size, &delivered);
+        
+        if (result == kIOReturnSuccess)
+        {
+            // Wrap transaction around if required
+            transfer->transaction++;
+            transfer->transaction %= USHRT_MAX;
+            
+            transfer->sent += size;
+            attempts = 0;
+            backoff = transfer->retry.backoff;
+            recover = false;
+            
+            if (transfer->progress != NULL)
+                transfer->progress(transfer, size, transfer->context);
+            
+            continue;
+        }
+        
+        if (!dfu_transfer_is_transient(result, &transfer->status) ||
+            transfer->retries >= transfer->retry.budget ||
+            ++attempts >= transfer->retry.attempts)
+        {
+            if (result == kIOReturnError)
+                fprintf(stderr, "[!] Firmware download aborting (state %s, status %s).\n",
+                        dfu_state_to_string(transfer->status.bState),
+                        dfu_status_to_string(transfer->status.bStatus));
+            
+            return result;
+        }
+        
+        fprintf(stderr, "[!] Block %d failed (0x%08x, status %s), retrying in %u ms.\n",
+                transfer->transaction, result, dfu_status_to_string(transfer->status.bStatus), backoff);
+        
+        transfer->retries++;
+        dfu_metrics_retry();
+        
+        dfu_wait(transfer->dif, backoff);
+        
+        backoff = backoff * 2 < transfer->retry.max_backoff ? backoff * 2 : transfer->retry.max_backoff;
+        recover = true;
+    }
+    
+    return kIOReturnSuccess;
+}
+
+static void *dfu_verify_thread(void *context)
+{
+    struct dfu_verify *verify = context;
+    
+    dfu_sha256(verify->data, verify->size, verify->digest);
+    
+    return NULL;
+}
+
+/*
+ *  Start hashing an image on another core, the transfer does not wait
+ *
+ *  verify    - verification state, lives until dfu_verify_finish()
+ *  data      - image to hash
+ *  size      - image size in bytes
+ *  expected  - published digest, DFU_SHA256_LENGTH bytes
+ */
+void dfu_verify_start(struct dfu_verify *verify, const uint8_t *data, size_t size, const uint8_t *expected)
+{
+    verify->data = data;
+    verify->size = size;
+    memcpy(verify->expected, expected, DFU_SHA256_LENGTH);
+    
+    verify->running = pthread_create(&verify->thread, NULL, dfu_verify_thread, verify) == 0;
+    
+    // No thread to spare, hash right away
+    if (!verify->running)
+        dfu_verify_thread(verify);
+}
+
+/*
+ *  Wait for the digest and compare it, may be called more than once
+ *
+ *  verify    - started verification
+ *
+ *  returns true if the image matches the expected digest
+ */
+bool dfu_verify_finish(struct dfu_verify *verify)
+{
+    if (verify->running)
+    {
+        pthread_join(verify->thread, NULL);
+        verify->running = false;
+    }
+    
+    return memcmp(verify->digest, verify->expected, DFU_SHA256_LENGTH) == 0;
+}
+
+/*
+ *  Signal the end of the image with a zero length DFU_DNLOAD so the device
+ *  starts manifestation
+ *
+ *  transfer  - transfer whose blocks have all been sent
+ *
+ *  returns IOReturn value, kIOReturnError when the device reported an error
+ *  status (see transfer->status), kIOReturnNotPermitted when the image
+ *  does not match transfer->verify
+ */
+IOReturn dfu_transfer_manifest(struct dfu_transfer *transfer)
+{
+    IOReturn result;
+    
+    // A modified image must never reach manifestation
+    if (transfer->verify != NULL && !dfu_verify_finish(transfer->verify))
+    {
+        char expected[DFU_SHA256_HEX_LENGTH + 1], actual[DFU_SHA256_HEX_LENGTH + 1];
+        
+        dfu_sha256_format(transfer->verify->expected, expected);
+        dfu_sha256_format(transfer->verify->digest, actual);
+        fprintf(stderr, "[!] Image digest %s does not match %s, not manifesting.\n", actual, expected);
+        
+        dfu_abort(transfer->dif);
+        
+        return kIOReturnNotPermitted;
+    }
+    
+    dfu_get_status(transfer->dif, &transfer->status);
+    printf("[i] Device State %s, Status %s, String %d\n",
+           dfu_state_to_string(transfer->status.bState),
+           dfu_status_to_string(transfer->status.bStatus),
+           transfer->status.iString);
+    
+    dfu_wait(transfer->dif, transfer->status.bwPollTimeout);
+    
+    // Signal firmware upload finished
+    result = dfu_download(transfer->dif, 0, transfer->transaction, NULL);
+    
+    if (result != kIOReturnSuccess)
+        return result;
+    
+    result = dfu_get_status(transfer->dif, &transfer->status);
+    
+    if (result != kIOReturnSuccess)
+        return result;
+    
+    printf("[i] Device State %s, Status %s, String %d\n",
+           dfu_state_to_string(transfer->status.bState),
+           dfu_status_to_string(transfer->status.bStatus),
+           transfer->status.iString);
+    
+    return transfer->status.bStatus == DFU_STATUS_OK ? kIOReturnSuccess : kIOReturnError;
+}
+
+/*
+ *  Read the device memory back with DFU_UPLOAD until the device sends a
+ *  short block or transfer->size bytes have been received
+ *
+ *  transfer  - transfer initialized with a NULL image, size is the buffer size
+ *  buffer    - receives the data
+ *
+ *  returns IOReturn value, transfer->sent holds the number of bytes read
+ */
+IOReturn dfu_transfer_upload(struct dfu_transfer *transfer, uint8_t *buffer)
+{
+    IOReturn result;
+    
+    // Upload blocks are numbered from 0
+    transfer->transaction = 0;
+    
+    while (transfer->sent < transfer->size)
+    {
+        int remaining = transfer->size - transfer->sent;
+        int size = transfer->transfer_size < remaining ? transfer->transfer_size : remaining;
+        unsigned short received = 0;
+        
+        result = dfu_upload(transfer->dif, size, transfer->transaction, buffer + transfer->sent, &received);
+        
+        if (result != kIOReturnSuccess)
+            return result;
+        
+        transfer->transaction++;
+        transfer->sent += received;
+        
+        if (transfer->progress != NULL)
+            transfer->progress(transfer, received, transfer->context);
+        
+        // Short block ends the upload, device is back in dfuIDLE
+        if (received < size)
+            return kIOReturnSuccess;
+    }
+    
+    // Buffer full before the device ended the upload
+    return dfu_abort(transfer->dif);
+}
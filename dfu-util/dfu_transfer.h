@@ -0,0 +1,129 @@
+/*
+ *  DFU download engine
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef __dfu_util__dfu_transfer__
+#define __dfu_util__dfu_transfer__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dfu.h"
+#include "dfu_sha256.h"
+
+#define DFU_RETRY_DEFAULT_BUDGET        16    /* retries per image */
+#define DFU_RETRY_DEFAULT_ATTEMPTS      4     /* attempts per block */
+#define DFU_RETRY_DEFAULT_BACKOFF       10    /* ms before the first retry */
+#define DFU_RETRY_DEFAULT_MAX_BACKOFF   1000  /* ms */
+
+/*
+ *  Blocks failing with a transient error (timeout, stall, errNOTDONE or
+ *  errSTALLEDPKT) are recovered in place and resent with the same wValue,
+ *  anything else aborts the transfer.
+ */
+struct dfu_retry_policy
+{
+    /* Retries allowed over the whole transfer, 0 disables retrying */
+    int budget;
+    /* Attempts of a single block, including the first one */
+    int attempts;
+    /* Delay before the first retry of a block in ms, doubled on every retry */
+    unsigned int backoff;
+    unsigned int max_backoff;
+};
+
+/* SHA-256 of an image computed on its own thread while blocks are sent */
+struct dfu_verify
+{
+    const uint8_t *data;
+    size_t size;
+    uint8_t expected[DFU_SHA256_LENGTH];
+    uint8_t digest[DFU_SHA256_LENGTH];
+    pthread_t thread;
+    bool running;
+};
+
+/*
+ *  Admission of every block, lets a scheduler share a bus between the
+ *  transfers of several devices
+ */
+struct dfu_gate
+{
+    /* Blocks until the block may be sent */
+    void (*enter)(void *context);
+    /* Result and duration of the DFU_DNLOAD and its DFU_GETSTATUS */
+    void (*leave)(void *context, IOReturn result, uint64_t elapsed_us);
+    void *context;
+};
+
+/*
+ *  Supplies the blocks of a download in place of a contiguous image, e.g.
+ *  a patched view of a shared image
+ */
+struct dfu_source
+{
+    /* Returns size bytes at offset, valid until the next call, NULL on error */
+    const uint8_t *(*read)(void *context, int offset, int size);
+    void *context;
+};
+
+struct dfu_transfer
+{
+    struct dfu_if *dif;
+    /* Image to download without DFU suffix, or maximum upload size */
+    const uint8_t *data;
+    int size;
+    /* Bytes per DFU_DNLOAD, wTransferSize of the device */
+    unsigned short transfer_size;
+    /* wValue of the next DFU_DNLOAD */
+    unsigned short transaction;
+    /* Bytes acknowledged by or received from the device */
+    int sent;
+    /* Last status read from the device */
+    struct dfu_status status;
+    /* Digest that must match before manifestation, may be NULL */
+    struct dfu_verify *verify;
+    /* Retry policy and retries used so far */
+    struct dfu_retry_policy retry;
+    int retries;
+    /* Blocks come from here instead of data if not NULL */
+    const struct dfu_source *source;
+    /* Admits every block, may be NULL */
+    const struct dfu_gate *gate;
+    /* Called after every acknowledged block, may be NULL */
+    void (*progress)(const struct dfu_transfer *transfer, int block_size, void *context);
+    void *context;
+};
+
+void dfu_transfer_init(struct dfu_transfer *transfer,
+                       struct dfu_if *dif,
+                       const uint8_t *data,
+                       int size,
+                       unsigned short transfer_size);
+void dfu_retry_policy_init(struct dfu_retry_policy *retry);
+bool dfu_transfer_is_transient(IOReturn result, const struct dfu_status *status);
+void dfu_verify_start(struct dfu_verify *verify, const uint8_t *data, size_t size, const uint8_t *expected);
+bool dfu_verify_finish(struct dfu_verify *verify);
+IOReturn dfu_transfer_download(struct dfu_transfer *transfer);
+IOReturn dfu_transfer_manifest(struct dfu_transfer *transfer);
+IOReturn dfu_transfer_upload(struct dfu_transfer *transfer, uint8_t *buffer);
+
+#endif /* defined(__dfu_util__dfu_transfer__) */
@@ -0,0 +1,54 @@
+/*
+ *  libdfu - reentrant DFU protocol, file and device library
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef __dfu_util__libdfu__
+#define __dfu_util__libdfu__
+
+/*
+ *  The library holds no global state: a struct dfu_if per interface, a
+ *  struct dfu_file per image and a struct dfu_session per device. Errors
+ *  are returned as IOReturn or dfu_file_error values, never by exiting.
+ */
+
+#include "dfu.h"
+#include "dfu_archive.h"
+#include "dfu_buffer.h"
+#include "dfu_catalog.h"
+#include "dfu_dfuse.h"
+#include "dfu_events.h"
+#include "dfu_file.h"
+#include "dfu_hci.h"
+#include "dfu_history.h"
+#include "dfu_image.h"
+#include "dfu_overlay.h"
+#include "dfu_patchram.h"
+#include "dfu_predict.h"
+#include "dfu_profile.h"
+#include "dfu_record.h"
+#include "dfu_scheduler.h"
+#include "dfu_sha256.h"
+#include "dfu_state.h"
+#include "dfu_transfer.h"
+#include "dfu_session.h"
+#include "dfu_metrics.h"
+#include "usb_device.h"
+
+#endif /* defined(__dfu_util__libdfu__) */
@@ -20,267 +20,400 @@
 #include <IOKit/IOKitLib.h>
 #include <IOKit/usb/IOUSBLib.h>
 #include <CoreFoundation/CoreFoundation.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
-#include "usb_device.h"
-#include "dfu.h"
-#include "dfu_file.h"
+#include "libdfu.h"
+#include "daemon.h"
+#include "agent.h"
+#include "suffix.h"
+#include "predict.h"
+#include "replay.h"
+#include "analyze.h"
+#include "patchram.h"
+#include "catalog.h"
+#include "batch.h"
+#include "personalize.h"
+#include "backup.h"
 
-struct dfu_file firmware;
+static void printProgress(const struct dfu_transfer* transfer, int block_size, void* context)
+{
+    printf("[i] Downloaded firmware: Chunk %d (%d bytes) - %d / %d bytes.\n",
+           (unsigned short)(transfer->transaction - 1), block_size, transfer->sent, transfer->size);
+}
+
+/* Periodic summary in place of a line per block while events are streamed */
+static void printSummary(const struct dfu_transfer* transfer, int block_size, void* context)
+{
+    struct dfu_event report;
+    
+    if (!dfu_event_meter_due(context, transfer->sent, transfer->size, DFU_EVENTS_SUMMARY_MS, &report))
+        return;
+    
+    printf("[i] Downloaded firmware: %d / %d bytes (%d%%), %.1f KB/s, %.1f s left.\n",
+           report.sent, report.total, report.total > 0 ? (int)(100LL * report.sent / report.total) : 100,
+           report.bytes_per_second / 1024.0, report.eta_us / 1000000.0);
+}
+
+/* Image validated on its own thread while the device is opened */
+struct imageLoad
+{
+    struct dfu_file* file;
+    unsigned short idVendor;
+    unsigned short idProduct;
+    int result;
+    uint64_t finished;
+    /* DfuSe downloads keep the address ranges, raw files start at address */
+    struct dfu_image* image;
+    uint32_t address;
+    /* Loader thread, joined once */
+    pthread_t thread;
+    bool loading;
+};
 
-IOUSBDeviceInterface300** prepareDFU(unsigned short idVendor, unsigned short idProduct)
+static void* loadImage(void* context)
 {
-    IOUSBDeviceInterface300** device = getDevice(idVendor, idProduct);
+    struct imageLoad* load = context;
     
-    if (device == NULL)
+    if (load->image != NULL)
     {
-        fprintf(stderr, "[!] Failed to retrieve USB device [%04x:%04x].\n", idVendor, idProduct);
-        return NULL;
+        load->image->name = load->file->name;
+        load->result = dfu_image_load(load->image);
+        
+        if (load->result == DFU_FILE_ERROR_FORMAT && load->image->format == DFU_IMAGE_RAW)
+        {
+            load->result = dfu_load_any_file(load->file, load->idVendor, load->idProduct);
+            
+            if (load->result == DFU_FILE_OK)
+                load->result = dfu_image_from_file(load->image, load->file, load->address);
+        }
     }
+    else
+        load->result = dfu_load_any_file(load->file, load->idVendor, load->idProduct);
+    
+    load->finished = dfu_time_us();
+    
+    return NULL;
+}
+
+static void showImage(const struct imageLoad* load)
+{
+    if (load->image != NULL && load->image->format != DFU_IMAGE_RAW)
+        show_image_ranges(load->image);
+    else
+        show_suffix_and_prefix(load->file);
+}
+
+static void finishLoad(struct imageLoad* load)
+{
+    if (!load->loading)
+        return;
+    
+    pthread_join(load->thread, NULL);
+    load->loading = false;
     
-    printDeviceInfo(device);
+    if (load->result == DFU_FILE_OK)
+        showImage(load);
+}
+
+/* Session hook, a device is only detached for an image that loaded */
+static bool imageLoaded(void* context)
+{
+    struct imageLoad* load = context;
     
-    if ((*device)->USBDeviceOpen(device) != kIOReturnSuccess)
-        return NULL;
+    finishLoad(load);
     
-    setConfiguration(device);
+    return load->result == DFU_FILE_OK;
+}
+
+/*
+ *  Print the DfuSe erase plan of an image without a device
+ */
+static int printPlan(struct dfu_image* image, const char* layout, enum dfu_erase_mode eraseMode)
+{
+    struct dfu_layout parsed;
+    struct dfu_erase_timing timing;
+    struct dfu_dfuse_plan plan;
+    int status = -1;
     
-    IOUSBInterfaceInterface300** interface = getDFUInterface(device);
+    dfu_erase_timing_init(&timing);
     
-    if (interface != NULL)
+    if (layout == NULL)
+        fprintf(stderr, "[!] --plan needs the memory layout from --layout.\n");
+    else if (dfu_layout_parse(&parsed, layout))
     {
-        IOUSBDFUDescriptor* descriptor = getDFUDescriptor(interface);
-        
-        if (descriptor != NULL)
+        if (dfu_dfuse_plan_build(&plan, &parsed, image, &timing, eraseMode))
         {
-            if (descriptor->bmAttributes & USB_DFU_CAN_DOWNLOAD)
-            {
-                if ((*interface)->USBInterfaceOpen(interface) != kIOReturnSuccess)
-                    return NULL;
-                
-                unsigned char intfIndex;
-                if ((*interface)->GetInterfaceNumber(interface, &intfIndex) != kIOReturnSuccess)
-                    return NULL;
-                
-                struct dfu_status status;
-                
-                if (dfu_get_status(interface, intfIndex, &status) != kIOReturnSuccess)
-                    goto error;
-                
-                printf("[i] Device State %s, Status %s\n",
-                       dfu_state_to_string(status.bState), dfu_status_to_string(status.bStatus));
-                
-                // Is device stuck in error mode?
-                if (status.bState == STATE_DFU_ERROR)
-                {
-                    printf("[i] Device is in error mode\n.");
-                    
-                    if (dfu_clear_status(interface, intfIndex) != kIOReturnSuccess)
-                        goto error;
-                    
-                    if (dfu_abort(interface, intfIndex) != kIOReturnSuccess)
-                        goto error;
-                    
-                    if (dfu_get_status(interface, intfIndex, &status) != kIOReturnSuccess)
-                        goto error;
-                }
-                
-                // Is previous firmware transfer incomplete?
-                if (status.bState == STATE_DFU_DOWNLOAD_IDLE || status.bState == STATE_DFU_UPLOAD_IDLE)
-                {
-                    if (dfu_abort(interface, intfIndex) != kIOReturnSuccess)
-                        goto error;
-                   
-                    if (dfu_get_status(interface, intfIndex, &status) != kIOReturnSuccess)
-                        goto error;
-                }
-                
-                // Device is already in DFU mode
-                if (status.bState == STATE_DFU_IDLE)
-                {
-                    printf("[i] Device is already in DFU mode.\n");
-                    
-                    if ((*interface)->USBInterfaceClose(interface) != kIOReturnSuccess)
-                        return NULL;
-                    
-                    if ((*interface)->Release(interface) != kIOReturnSuccess)
-                        return NULL;
-                   
-                    return device;
-                }
-                
-                if (status.bState != STATE_APP_IDLE)
-                {
-                    fprintf(stderr, "[!] Device is not idle, unable to detach (state %s).\n", dfu_state_to_string(status.bState));
-                    goto error;
-                }
-                
-                printf("[i] Transitioning from STATE_APP_IDLE into STATE_DFU_IDLE.\n");
-                
-                if (dfu_detach(interface, intfIndex, descriptor->wDetachTimeout) != kIOReturnSuccess)
-                    goto error;
-                
-                if (!(descriptor->bmAttributes & USB_DFU_WILL_DETACH))
-                    if ((*device)->ResetDevice(device) != kIOReturnSuccess)
-                        return NULL;
-                
-                if (dfu_get_status(interface, intfIndex, &status) != kIOReturnSuccess)
-                    goto error;
-                
-                if (status.bState != STATE_DFU_IDLE)
-                {
-                    fprintf(stderr, "[!] Device is not in dfu mode (state %s).\n", dfu_state_to_string(status.bState));
-                    goto error;
-                }
-                
-                if ((*interface)->USBInterfaceClose(interface) != kIOReturnSuccess)
-                    return NULL;
-                
-                if ((*interface)->Release(interface) != kIOReturnSuccess)
-                    return NULL;
-                
-                if ((*device)->USBDeviceClose(device) != kIOReturnSuccess)
-                    return NULL;
-
-                
-                if ((*device)->USBDeviceOpen(device) != kIOReturnSuccess)
-                    return NULL;
-                
-                return device;
-            }
-            else
-                fprintf(stderr, "[!] Device is not able to receive firmware through DFU.\n");
+            printf("[i] Memory layout %s, %d sectors.\n", parsed.name, parsed.count);
+            dfu_dfuse_plan_print(&plan, true);
+            dfu_dfuse_plan_free(&plan);
+            status = 0;
         }
-        else
-            fprintf(stderr, "[!] Failed to locate DFU descriptor for interface.\n");
         
-    error:
-        (*interface)->USBInterfaceClose(interface);
-        (*interface)->Release(interface);
+        dfu_layout_free(&parsed);
     }
-    else
-        fprintf(stderr, "[!] Failed to locate DFU interface.\n");
-
-    (*device)->USBDeviceClose(device);
-    (*device)->Release(device);
     
-    return NULL;
+    dfu_image_free(image);
+    
+    return status;
 }
 
-bool uploadFirmware(IOUSBDeviceInterface300** device)
+static void printUsage(void)
 {
-    IOUSBInterfaceInterface300** interface = getDFUInterface(device);
+    printf("Usage: dfu-util [options] <vendorId hex> <productId hex> <firmware>\n");
+    printf("       dfu-util --catalog <index> [options] <vendorId hex> <productId hex>\n");
+    printf("       dfu-util daemon <socket> [workers [metrics.prom]]\n");
+    printf("       dfu-util submit <socket> flash <priority> <vendorId hex> <productId hex>[@location hex] <firmware> [sha256]\n");
+    printf("       dfu-util submit <socket> readback <priority> <vendorId hex> <productId hex>[@location hex] <output> <length>\n");
+    printf("       dfu-util submit <socket> status [<priority> <vendorId hex> <productId hex>[@location hex]]\n");
+    printf("       dfu-util submit <socket> metrics\n");
+    printf("       dfu-util agent [port] [--bind address] [--simulate [--faults]]\n");
+    printf("       dfu-util remote <host[:port]> <vendorId hex> <productId hex> <firmware>\n");
+    printf("       dfu-util batch [--jobs n] [--window n] [--patches file] [--list] <vendorId hex> <productId hex> <firmware>\n");
+    printf("       dfu-util patchram [--simulate] [--in-flight n] <vendorId hex> <productId hex> <firmware.hcd>\n");
+    printf("       dfu-util predict [predict options] <firmware>\n");
+    printf("       dfu-util replay [--paced] <log> <firmware>\n");
+    printf("       dfu-util analyze [--timeline] <capture>...\n");
+    printf("       dfu-util catalog <index> scan [--jobs n] <directory>...\n");
+    printf("       dfu-util catalog <index> list | find <vendorId hex> <productId hex> [bcdDevice hex]\n");
+    printf("       dfu-util backup <archive> store [--serial s] <vendorId hex> <productId hex> <length>\n");
+    printf("       dfu-util backup <archive> restore [--force] <manifest> <vendorId hex> <productId hex> | list\n");
+    printf("       dfu-util suffix add|remove|rewrite|check [suffix options] <file or directory>...\n");
+    printf("\nOptions:\n");
+    printf("  --retries <n>         transient errors retried per image (default %d, 0 disables)\n", DFU_RETRY_DEFAULT_BUDGET);
+    printf("  --retry-attempts <n>  attempts per block (default %d)\n", DFU_RETRY_DEFAULT_ATTEMPTS);
+    printf("  --retry-backoff <ms>  delay before the first retry, doubled per retry (default %d)\n", DFU_RETRY_DEFAULT_BACKOFF);
+    printf("  --sha256 <digest>     refuse to manifest an image with a different SHA-256\n");
+    printf("  --fast                skip device strings and redundant SetConfiguration, load the image\n");
+    printf("                        while the device opens and print a startup breakdown\n");
+    printf("  --startup-budget <ms> fail if the first DFU_DNLOAD is sent later than this after launch\n");
+    printf("  --dfuse               DfuSe download following an erase plan, starts the image afterwards\n");
+    printf("  --layout <string>     DfuSe memory layout instead of the interface string\n");
+    printf("  --erase <mode>        auto, mass or page erase (default auto, the faster one\n");
+    printf("                        that keeps sectors outside of the image)\n");
+    printf("  --address <hex>       DfuSe address of raw images (default first sector)\n");
+    printf("  --plan                print the DfuSe plan for --layout and exit\n");
+    printf("  --history <file>      DfuSe pages written per device serial, only changed pages are written\n");
+    printf("  --full                write every page and start a new history for the device\n");
+    printf("  --patches <file>      personalize the image with offset / bytes patches, sent in place\n");
+    printf("  --catalog <index>     take the image for the device's bcdDevice from a firmware catalog\n");
+    printf("  --profiles <file>     device profiles seeding timeouts and detach handling, updated after the run\n");
+    printf("  --record <file>       log every request and response of the run for dfu-util replay\n");
+    printf("  --events-fd <fd>      stream NDJSON events to a file descriptor, console shows a summary per second\n");
+    printf("  --timeout <ms>        fixed request timeout instead of adaptive timeouts (%d - %d ms)\n",
+           DFU_TIMEOUT_FLOOR, DFU_TIMEOUT_CEILING);
+}
+
+int main(int argc, const char * argv[])
+{
+    uint64_t launch = dfu_time_us();
+    
+    // Client output is meant for scripts, keep it free of the banner
+    if (argc >= 4 && strcmp(argv[1], "submit") == 0)
+        return submitJob(argv[2], argc - 3, argv + 3);
+    
+    // Release pipelines run this over whole trees, one line per file
+    if (argc >= 2 && strcmp(argv[1], "suffix") == 0)
+        return runSuffix(argc - 2, argv + 2);
     
-    if (interface != NULL)
+    if (argc >= 2 && strcmp(argv[1], "predict") == 0)
+        return runPredict(argc - 2, argv + 2);
+    
+    if (argc >= 2 && strcmp(argv[1], "replay") == 0)
+        return runReplay(argc - 2, argv + 2);
+    
+    if (argc >= 2 && strcmp(argv[1], "analyze") == 0)
+        return runAnalyze(argc - 2, argv + 2);
+    
+    if (argc >= 2 && strcmp(argv[1], "catalog") == 0)
+        return runCatalog(argc - 2, argv + 2);
+    
+    printf("dfu-util, utility to flash dfu firmware into USB devices on OS X.\n");
+    printf("Based on original dfu-tool & dfu-programmer for Linux.\n\n");
+    
+    if (argc >= 3 && argc <= 5 && strcmp(argv[1], "daemon") == 0)
+        return runDaemon(argv[2], argc >= 4 ? atoi(argv[3]) : DAEMON_DEFAULT_WORKERS, argc == 5 ? argv[4] : NULL);
+    
+    if (argc >= 2 && argc <= 7 && strcmp(argv[1], "agent") == 0)
+    {
+        const char* address = AGENT_DEFAULT_ADDRESS;
+        unsigned short port = AGENT_DEFAULT_PORT;
+        bool simulate = false;
+        bool faults = false;
+        
+        for (int i = 2; i < argc; i++)
+        {
+            if (strcmp(argv[i], "--simulate") == 0)
+                simulate = true;
+            else if (strcmp(argv[i], "--faults") == 0)
+                faults = true;
+            else if (strcmp(argv[i], "--bind") == 0 && i + 1 < argc)
+                address = argv[++i];
+            else
+                port = atoi(argv[i]);
+        }
+        
+        return runAgent(address, port, simulate, faults);
+    }
+    
+    if (argc >= 5 && strcmp(argv[1], "patchram") == 0)
+        return runPatchram(argc - 2, argv + 2);
+    
+    if (argc >= 4 && strcmp(argv[1], "batch") == 0)
+        return runBatch(argc - 2, argv + 2);
+    
+    if (argc >= 4 && strcmp(argv[1], "backup") == 0)
+        return runBackup(argc - 2, argv + 2);
+    
+    if (argc == 6 && strcmp(argv[1], "remote") == 0)
     {
-        IOUSBDFUDescriptor* descriptor = getDFUDescriptor(interface);
+        char host[256];
+        unsigned short port = AGENT_DEFAULT_PORT;
+        
+        strlcpy(host, argv[2], sizeof(host));
+        
+        char* separator = strrchr(host, ':');
         
-        if (descriptor != NULL)
+        if (separator != NULL)
         {
-            if (descriptor->bmAttributes & USB_DFU_CAN_DOWNLOAD)
+            *separator = 0;
+            port = atoi(separator + 1);
+        }
+        
+        struct dfu_file firmware = { 0 };
+        
+        firmware.name = argv[5];
+        
+        unsigned short idVendor = strtoul(argv[3], NULL, 16);
+        unsigned short idProduct = strtoul(argv[4], NULL, 16);
+        
+        if (dfu_load_any_file(&firmware, idVendor, idProduct) != DFU_FILE_OK)
+            return -1;
+        
+        show_suffix_and_prefix(&firmware);
+        
+        int result = flashRemote(host, port, idVendor, idProduct, &firmware);
+        
+        dfu_free_file(&firmware);
+        
+        return result;
+    }
+    
+    struct dfu_retry_policy retry;
+    unsigned int timeout = 0;
+    uint8_t sha256[DFU_SHA256_LENGTH];
+    bool verify = false;
+    const char* profilePath = NULL;
+    const char* recordPath = NULL;
+    const char* historyPath = NULL;
+    bool full = false;
+    const char* catalogPath = NULL;
+    char catalogImage[PATH_MAX];
+    const char* patchesPath = NULL;
+    int eventsFd = -1;
+    bool fast = false;
+    unsigned int startupBudget = 0;
+    bool dfuse = false;
+    bool planOnly = false;
+    const char* layout = NULL;
+    enum dfu_erase_mode eraseMode = DFU_ERASE_AUTO;
+    uint32_t address = 0;
+    
+    dfu_retry_policy_init(&retry);
+    
+    // Options of the flash command precede its arguments
+    while (argc > 2 && strncmp(argv[1], "--", 2) == 0)
+    {
+        if (strcmp(argv[1], "--fast") == 0 || strcmp(argv[1], "--dfuse") == 0 || strcmp(argv[1], "--plan") == 0 ||
+            strcmp(argv[1], "--full") == 0)
+        {
+            fast |= strcmp(argv[1], "--fast") == 0;
+            full |= strcmp(argv[1], "--full") == 0;
+            dfuse |= strcmp(argv[1], "--dfuse") == 0;
+            planOnly |= strcmp(argv[1], "--plan") == 0;
+            argc--;
+            argv++;
+            continue;
+        }
+        
+        if (strcmp(argv[1], "--retries") == 0)
+            retry.budget = atoi(argv[2]);
+        else if (strcmp(argv[1], "--retry-attempts") == 0)
+            retry.attempts = atoi(argv[2]);
+        else if (strcmp(argv[1], "--retry-backoff") == 0)
+            retry.backoff = atoi(argv[2]);
+        else if (strcmp(argv[1], "--timeout") == 0)
+            timeout = atoi(argv[2]);
+        else if (strcmp(argv[1], "--profiles") == 0)
+            profilePath = argv[2];
+        else if (strcmp(argv[1], "--record") == 0)
+            recordPath = argv[2];
+        else if (strcmp(argv[1], "--history") == 0)
+            historyPath = argv[2];
+        else if (strcmp(argv[1], "--catalog") == 0)
+            catalogPath = argv[2];
+        else if (strcmp(argv[1], "--patches") == 0)
+            patchesPath = argv[2];
+        else if (strcmp(argv[1], "--events-fd") == 0)
+            eventsFd = atoi(argv[2]);
+        else if (strcmp(argv[1], "--startup-budget") == 0)
+            startupBudget = atoi(argv[2]);
+        else if (strcmp(argv[1], "--layout") == 0)
+            layout = argv[2];
+        else if (strcmp(argv[1], "--address") == 0)
+            address = strtoul(argv[2], NULL, 16);
+        else if (strcmp(argv[1], "--erase") == 0)
+        {
+            if (strcmp(argv[2], "auto") == 0)
+                eraseMode = DFU_ERASE_AUTO;
+            else if (strcmp(argv[2], "mass") == 0)
+                eraseMode = DFU_ERASE_MASS;
+            else if (strcmp(argv[2], "page") == 0)
+                eraseMode = DFU_ERASE_PAGE;
+            else
             {
-                (*interface)->USBInterfaceOpen(interface);
-                
-                unsigned char intfIndex;
-                (*interface)->GetInterfaceNumber(interface, &intfIndex);
-                
-                struct dfu_status status;
-                int firmware_size = firmware.size.total - firmware.size.suffix;
-                int remaining = firmware_size;
-                unsigned short transaction = 1;
-                int sent = 0;
-
-                printf("[i] Initiating firmware upload (%d bytes, %d bytes transfer size).\n", remaining, descriptor->wTransferSize);
-                
-                while (remaining > 0)
-                {
-                    int size = descriptor->wTransferSize < remaining ? descriptor->wTransferSize : remaining;
-                    
-                    printf("[i] Downloading firmware: Chunk %d (%d bytes) - %d / %d bytes.\n", transaction, size, sent, firmware_size);
-                    
-                    if (dfu_download(interface,
-                                     intfIndex,
-                                     size,
-                                     transaction,
-                                     firmware.firmware + sent) != kIOReturnSuccess)
-                        break;
-                    
-                    sent += size;
-                    remaining -= size;
-                                    
-                    // Wrap transaction around if required
-                    transaction++;
-                    transaction %= USHRT_MAX;
-                    
-                    if (dfu_get_status(interface, intfIndex, &status) != kIOReturnSuccess)
-                        break;
-                    
-                    if (status.bStatus != DFU_STATUS_OK)
-                    {
-                        fprintf(stderr, "[!] Firmware download aborting (state %s, status %s).\n",
-                                dfu_state_to_string(status.bState),
-                                dfu_status_to_string(status.bStatus));
-                        
-                        break;
-                    }
-                }
-                
-                dfu_get_status(interface, intfIndex, &status);
-                printf("[i] Device State %s, Status %s, String %d\n", dfu_state_to_string(status.bState), dfu_status_to_string(status.bStatus), status.iString);
-                                
-                usleep(status.bwPollTimeout * 1000);
-                
-                // Signal firmware upload finished
-                dfu_download(interface, intfIndex, 0, transaction, NULL);
-                
-                dfu_get_status(interface, intfIndex, &status);
-                printf("[i] Device State %s, Status %s, String %d\n", dfu_state_to_string(status.bState), dfu_status_to_string(status.bStatus), status.iString);
-                
-                // Firmware upload done resetting device
-                if (remaining > 0)
-                    fprintf(stderr, "[!] Error while flashing: \"%s\", %d / %d bytes remaining.\n",
-                            dfu_status_to_string(status.bStatus), remaining, firmware_size);
-                else if (status.bStatus != DFU_STATUS_OK)
-                    fprintf(stderr, "[!] Error while flashing, %s.\n", dfu_status_to_string(status.bStatus));
-                else
-                {
-                    printf("[i] Firmware upload complete, resetting device.\n");
-                    
-                    (*device)->ResetDevice(device);
-                    (*interface)->USBInterfaceClose(interface);
-                    (*interface)->Release(interface);
-                    
-                    (*device)->USBDeviceClose(device);
-                    
-                    return true;
-                }
-
-                (*interface)->USBInterfaceClose(interface);
+                fprintf(stderr, "[!] Unknown erase mode %s.\n", argv[2]);
+                return -1;
+            }
+        }
+        else if (strcmp(argv[1], "--sha256") == 0)
+        {
+            verify = dfu_sha256_parse(argv[2], sha256);
+            
+            if (!verify)
+            {
+                fprintf(stderr, "[!] Invalid SHA-256 digest %s.\n", argv[2]);
+                return -1;
             }
-            else
-                fprintf(stderr, "[!] Device is not capable to download firmware.\n");
         }
         else
-            fprintf(stderr, "[!] Failed to locate DFU descriptor for interface.\n");
+            break;
         
-        (*interface)->Release(interface);
+        argc -= 2;
+        argv += 2;
     }
-    else
-        fprintf(stderr, "[!] Failed to locate DFU interface.\n");
     
-    (*device)->USBDeviceClose(device);
+    if (argc != (catalogPath != NULL ? 3 : 4))
+    {
+        printUsage();
+        return -1;
+    }
     
-    return false;
-}
-
-int main(int argc, const char * argv[])
-{
-    printf("dfu-util, utility to flash dfu firmware into USB devices on OS X.\n");
-    printf("Based on original dfu-tool & dfu-programmer for Linux.\n\n");
+    if (patchesPath != NULL && (dfuse || planOnly))
+    {
+        fprintf(stderr, "[!] Patches are only applied to plain DFU downloads.\n");
+        return -1;
+    }
     
-    if (argc != 4)
+    // The digest is checked on the plain image, neither DfuSe elements nor
+    // personalized blocks would be covered by it
+    if (verify && (dfuse || patchesPath != NULL))
     {
-        printf("Usage: dfu-util <vendorId hex> <productId hex> <firmware.dfu>\n");
+        fprintf(stderr, "[!] --sha256 cannot be combined with --dfuse or --patches.\n");
         return -1;
     }
     
@@ -290,19 +423,204 @@ int main(int argc, const char * argv[])
     
     printf("[i] Initiating DFU for USB device [%04x:%04x].\n", idVendor, idProduct);
     
+    struct dfu_file firmware = { 0 };
+    struct dfu_image image = { 0 };
+    struct imageLoad load = { .file = &firmware, .idVendor = idVendor, .idProduct = idProduct,
+                              .result = DFU_FILE_OK, .address = address };
+    struct dfu_layout parsedLayout;
+    
     firmware.name = argv[3];
-    dfu_load_file(&firmware, NEEDS_SUFFIX);
+    firmware.allocator = &dfu_wired_allocator;
     
-    show_suffix_and_prefix(&firmware);
-  
-    IOUSBDeviceInterface300** device = NULL;
+    // The catalog knows which image fits the attached device
+    if (catalogPath != NULL)
+    {
+        if (catalogSelect(catalogPath, idVendor, idProduct, catalogImage, sizeof(catalogImage)) != 0)
+            return -1;
+        
+        firmware.name = catalogImage;
+    }
     
-    if ((device = prepareDFU(idVendor, idProduct)) != NULL)
-        uploadFirmware(device);
-    else
-        fprintf(stderr, "[!] Failed to enter DFU mode.\n");
-
-    free(firmware.firmware);
+    if (dfuse || planOnly)
+        load.image = &image;
+    
+    // Raw images go to the first sector unless told otherwise
+    if (layout != NULL && address == 0 && dfu_layout_parse(&parsedLayout, layout))
+    {
+        load.address = parsedLayout.sectors[0].address;
+        dfu_layout_free(&parsedLayout);
+    }
+    
+    // Fast start validates the image while the device is opened
+    if (fast && !planOnly)
+        load.loading = pthread_create(&load.thread, NULL, loadImage, &load) == 0;
+    
+    if (!load.loading)
+    {
+        loadImage(&load);
+        
+        if (load.result != DFU_FILE_OK)
+            return -1;
+        
+        showImage(&load);
+    }
+    
+    if (planOnly)
+    {
+        int planned = printPlan(&image, layout, eraseMode);
+        
+        dfu_free_file(&firmware);
+        
+        return planned;
+    }
+    
+    struct dfu_profile_store profiles;
+    struct dfu_recorder recorder;
+    struct dfu_history history;
+    struct dfu_events events;
+    struct dfu_event_meter summary;
+    struct dfu_overlay overlay = { 0 };
+    struct dfu_session session;
+    int status = 0;
+    
+    dfu_session_init(&session, idVendor, idProduct);
+    session.progress = printProgress;
+    session.retry = retry;
+    session.sha256 = verify ? sha256 : NULL;
+    session.fast = fast;
+    session.startup.launch = launch;
+    
+    if (timeout > 0)
+    {
+        session.dif.timeout = timeout;
+        session.dif.timeouts.adaptive = false;
+    }
+    
+    if (profilePath != NULL)
+    {
+        if (dfu_profile_store_open(&profiles, profilePath) == 0)
+            session.profiles = &profiles;
+        else
+            fprintf(stderr, "[!] Failed to read device profiles from %s.\n", profilePath);
+    }
+    
+    if (historyPath != NULL && !dfuse)
+        printf("[i] Flash history is only kept for --dfuse downloads.\n");
+    else if (historyPath != NULL)
+    {
+        if (dfu_history_open(&history, historyPath) == 0)
+        {
+            session.history = &history;
+            session.differential = !full;
+        }
+        else
+        {
+            fprintf(stderr, "[!] Failed to read flash history from %s.\n", historyPath);
+            status = -1;
+        }
+    }
+    
+    if (recordPath != NULL)
+    {
+        if (dfu_recorder_open(&recorder, recordPath) == 0)
+            session.recorder = &recorder;
+        else
+            status = -1;
+    }
+    
+    if (eventsFd >= 0)
+    {
+        // A reader going away must not take the flash down with it
+        signal(SIGPIPE, SIG_IGN);
+        
+        if (dfu_events_open(&events, eventsFd) == 0)
+        {
+            session.events = &events;
+            session.progress = printSummary;
+            session.context = &summary;
+        }
+        else
+        {
+            fprintf(stderr, "[!] Failed to start the event stream.\n");
+            status = -1;
+        }
+    }
+    
+    // Opening and reading descriptors overlap the load, the detach waits for it
+    session.proceed = imageLoaded;
+    session.proceed_context = &load;
+    
+    IOReturn result = status == 0 ? dfu_session_prepare(&session) : kIOReturnError;
+    
+    finishLoad(&load);
+    
+    session.startup.image = load.finished;
+    
+    if (result != kIOReturnSuccess)
+    {
+        if (load.result == DFU_FILE_OK)
+            fprintf(stderr, "[!] Failed to enter DFU mode.\n");
+        
+        status = -1;
+    }
+    else if (load.result == DFU_FILE_OK && dfuse)
+    {
+        if (dfu_session_download_dfuse(&session, &image, layout, eraseMode) != kIOReturnSuccess)
+            status = -1;
+    }
+    else if (load.result == DFU_FILE_OK && patchesPath != NULL && loadPatches(&overlay, patchesPath, &firmware) != 0)
+        status = -1;
+    else if (load.result == DFU_FILE_OK)
+    {
+        if (patchesPath != NULL)
+            session.source = &overlay.source;
+        
+        dfu_event_meter_start(&summary);
+        
+        if (dfu_session_download(&session, &firmware) != kIOReturnSuccess)
+            status = -1;
+    }
+    
+    if (load.result != DFU_FILE_OK)
+        status = -1;
+    else if (fast || startupBudget > 0)
+    {
+        unsigned int startup = dfu_session_print_startup(&session);
+        
+        if (startupBudget > 0 && startup > startupBudget)
+        {
+            fprintf(stderr, "[!] Startup took %u ms, over the budget of %u ms.\n", startup, startupBudget);
+            status = -1;
+        }
+    }
+    
+    dfu_session_close(&session);
+    
+    if (session.profiles != NULL)
+        dfu_profile_store_close(&profiles);
+    
+    if (session.history != NULL)
+        dfu_history_close(&history);
+    
+    if (session.events != NULL)
+    {
+        if (dfu_events_close(&events) != 0)
+            fprintf(stderr, "[!] Event stream was closed by the reader.\n");
+        else if (events.dropped > 0)
+            printf("[i] %llu block events dropped, the reader fell behind.\n", (unsigned long long)events.dropped);
+    }
+    
+    if (session.recorder != NULL)
+    {
+        if (dfu_recorder_close(&recorder) == 0)
+            printf("[i] Recorded %lu requests to %s.\n", recorder.records, recordPath);
+        else
+            fprintf(stderr, "[!] Failed to write %s.\n", recordPath);
+    }
+    
+    dfu_overlay_free(&overlay);
+    dfu_image_free(&image);
+    dfu_free_file(&firmware);
     
-    return 0;
+    return status;
 }
@@ -0,0 +1,171 @@
+/*
+ *  Broadcom PatchRAM download
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "patchram.h"
+#include "libdfu.h"
+#include "dfu_hci_sim.h"
+
+static void printUsage(void)
+{
+    printf("Usage: dfu-util patchram [options] <vendorId hex> <productId hex> <firmware.hcd>\n");
+    printf("\nOptions:\n");
+    printf("  --simulate              load the patch into a simulated controller\n");
+    printf("  --in-flight <n>         Write_RAM commands kept in flight at most (default %d)\n", DFU_PATCHRAM_IN_FLIGHT);
+}
+
+static uint32_t patchCRC(const struct dfu_hcd* hcd)
+{
+    uint32_t crc = 0xffffffff;
+    
+    for (int i = 0; i < hcd->count; i++)
+        if (hcd->records[i].opcode == HCI_BRCM_WRITE_RAM)
+            crc = dfu_crc32(crc, hcd->records[i].parameters + 4, hcd->records[i].length - 4);
+    
+    return crc;
+}
+
+static IOReturn patchSimulated(const struct dfu_hcd* hcd, int inFlight)
+{
+    struct dfu_hci_sim sim;
+    struct dfu_hci hci;
+    
+    dfu_hci_sim_init(&sim, DFU_HCI_SIM_CAPACITY);
+    dfu_hci_sim_attach(&sim, &hci);
+    
+    IOReturn result = dfu_patchram_download(&hci, hcd, inFlight);
+    
+    if (result != kIOReturnSuccess)
+        return result;
+    
+    if (!sim.running || sim.overruns > 0 || sim.written != hcd->size || sim.crc != patchCRC(hcd))
+    {
+        fprintf(stderr, "[!] Simulated controller is not running the patch (%u of %u bytes, %lu commands lost).\n",
+                sim.written, hcd->size, sim.overruns);
+        return kIOReturnError;
+    }
+    
+    printf("[i] Simulated controller runs the patch, %lu commands, at most %d of %d buffered.\n",
+           sim.commands, sim.max_queued, sim.capacity);
+    
+    return kIOReturnSuccess;
+}
+
+static IOReturn patchDevice(unsigned short idVendor, unsigned short idProduct, const struct dfu_hcd* hcd, int inFlight)
+{
+    IOUSBDeviceInterface300** device = getDevice(idVendor, idProduct);
+    
+    if (device == NULL)
+    {
+        fprintf(stderr, "[!] Failed to retrieve USB device [%04x:%04x].\n", idVendor, idProduct);
+        return kIOReturnNoDevice;
+    }
+    
+    IOReturn result = claimDevice(device);
+    
+    if (result == kIOReturnSuccess)
+    {
+        struct dfu_hci hci;
+        
+        ensureConfiguration(device);
+        dfu_hci_init(&hci);
+        
+        result = dfu_hci_open_usb(&hci, device);
+        
+        if (result == kIOReturnSuccess)
+            result = dfu_patchram_download(&hci, hcd, inFlight);
+        
+        dfu_hci_close_usb(&hci);
+        (*device)->USBDeviceClose(device);
+    }
+    
+    (*device)->Release(device);
+    
+    return result;
+}
+
+int runPatchram(int argc, const char* argv[])
+{
+    bool simulate = false;
+    int inFlight = DFU_PATCHRAM_IN_FLIGHT;
+    
+    while (argc > 0 && strncmp(argv[0], "--", 2) == 0)
+    {
+        if (strcmp(argv[0], "--simulate") == 0)
+            simulate = true;
+        else if (strcmp(argv[0], "--in-flight") == 0 && argc > 1)
+        {
+            inFlight = atoi(argv[1]);
+            argc--;
+            argv++;
+        }
+        else
+        {
+            fprintf(stderr, "[!] Unknown option %s.\n", argv[0]);
+            return -1;
+        }
+        
+        argc--;
+        argv++;
+    }
+    
+    if (argc != 3)
+    {
+        printUsage();
+        return -1;
+    }
+    
+    unsigned short idVendor = strtoul(argv[0], NULL, 16);
+    unsigned short idProduct = strtoul(argv[1], NULL, 16);
+    struct dfu_file firmware = { 0 };
+    struct dfu_hcd hcd;
+    
+    firmware.name = argv[2];
+    
+    // Patches are plain HCI commands, a DFU suffix would be sent as one
+    if (dfu_load_file(&firmware, NO_SUFFIX) != DFU_FILE_OK)
+        return -1;
+    
+    if (dfu_hcd_parse(&hcd, firmware.firmware, firmware.size.total) != DFU_FILE_OK)
+    {
+        dfu_free_file(&firmware);
+        return -1;
+    }
+    
+    printf("[i] Loading PatchRAM %s into [%04x:%04x]: %d records, %u bytes.\n",
+           firmware.name, idVendor, idProduct, hcd.count, hcd.size);
+    
+    IOReturn result = simulate ? patchSimulated(&hcd, inFlight) : patchDevice(idVendor, idProduct, &hcd, inFlight);
+    
+    if (result == kIOReturnSuccess)
+        printf("[i] Patch launched, controller reset.\n");
+    else
+        fprintf(stderr, "[!] PatchRAM download failed.\n");
+    
+    dfu_hcd_free(&hcd);
+    dfu_free_file(&firmware);
+    
+    return result == kIOReturnSuccess ? 0 : -1;
+}
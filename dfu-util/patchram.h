@@ -0,0 +1,33 @@
+/*
+ *  Broadcom PatchRAM download
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef __dfu_util__patchram__
+#define __dfu_util__patchram__
+
+/*
+ *  patchram [--simulate] [--in-flight n] <vendorId hex> <productId hex> <firmware.hcd>
+ *
+ *    --simulate        load the patch into a simulated controller
+ *    --in-flight <n>   Write_RAM commands kept in flight at most
+ */
+int runPatchram(int argc, const char* argv[]);
+
+#endif /* defined(__dfu_util__patchram__) */
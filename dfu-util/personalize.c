@@ -0,0 +1,62 @@
+/*
+ *  Per-device patches of a shared firmware image
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "personalize.h"
+
+void patchPath(char* path, size_t size, const char* pattern, UInt32 locationID)
+{
+    const char* marker = strstr(pattern, "{location}");
+    
+    if (marker == NULL)
+    {
+        strlcpy(path, pattern, size);
+        return;
+    }
+    
+    snprintf(path, size, "%.*s%08x%s", (int)(marker - pattern), pattern, locationID, marker + strlen("{location}"));
+}
+
+int loadPatches(struct dfu_overlay* overlay, const char* path, const struct dfu_file* firmware)
+{
+    dfu_overlay_init(overlay, firmware->firmware, firmware->size.total - firmware->size.suffix);
+    
+    int result = dfu_overlay_load(overlay, path);
+    
+    if (result != DFU_FILE_OK)
+    {
+        fprintf(stderr, "[!] Failed to load patches from %s: %s.\n", path, dfu_file_error_to_string(result));
+        dfu_overlay_free(overlay);
+        return -1;
+    }
+    
+    printf("[i] %d patches (%u bytes) from %s", overlay->count, overlay->bytes_size, path);
+    
+    // The suffix CRC covers everything but itself
+    if (firmware->size.suffix > 0)
+        printf(", personalized CRC 0x%08X", dfu_overlay_crc(overlay, firmware->dwCRC, firmware->size.total - 4));
+    
+    printf(".\n");
+    
+    return 0;
+}
@@ -0,0 +1,41 @@
+/*
+ *  Per-device patches of a shared firmware image
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef __dfu_util__personalize__
+#define __dfu_util__personalize__
+
+#include <stddef.h>
+
+#include "libdfu.h"
+
+/*
+ *  Patch file of a device, {location} in the pattern is replaced by its
+ *  location id in hex
+ */
+void patchPath(char* path, size_t size, const char* pattern, UInt32 locationID);
+
+/*
+ *  Load a patch file over a loaded firmware image and print the
+ *  personalized suffix CRC, returns 0 on success
+ */
+int loadPatches(struct dfu_overlay* overlay, const char* path, const struct dfu_file* firmware);
+
+#endif /* defined(__dfu_util__personalize__) */
@@ -0,0 +1,237 @@
+/*
+ *  Flash time and station capacity prediction
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "predict.h"
+#include "libdfu.h"
+#include "dfu_sim.h"
+
+#define PREDICT_MAX_ROWS    16
+
+static double seconds(uint64_t us)
+{
+    return us / 1000000.0;
+}
+
+static double unitsPerHour(uint64_t unitUs, int fixtures)
+{
+    return unitUs > 0 ? fixtures * 3600000000.0 / unitUs : 0;
+}
+
+static void printUsage(void)
+{
+    printf("Usage: dfu-util predict [options] <firmware>\n");
+    printf("\nOptions:\n");
+    printf("  --transfer-size <n>     block size (default %d)\n", DFU_SIM_TRANSFER_SIZE);
+    printf("  --poll <ms>[-<ms>]      bwPollTimeout, or the range it is drawn from (default %d)\n", DFU_SIM_POLL_TIMEOUT);
+    printf("  --detach <ms>           re-enumeration time, 0 starts in DFU mode (default %d)\n", DFU_PREDICT_DETACH);
+    printf("  --manifest <ms>         manifestation time (default %d)\n", DFU_PREDICT_MANIFEST);
+    printf("  --request-us <us>       overhead of every control request (default %d)\n", DFU_PREDICT_REQUEST_US);
+    printf("  --profiles <file>       take the timing from the profile of\n");
+    printf("  --device <vid:pid:bcd>  this device model\n");
+    printf("  --fixtures <n>          units flashed in parallel (default 1)\n");
+    printf("  --hubs <n>              hubs the fixtures are spread over (default 1)\n");
+    printf("  --handling <ms>         operator time per unit (default 0)\n");
+}
+
+int runPredict(int argc, const char* argv[])
+{
+    struct dfu_timing timing;
+    struct dfu_profile profile = { 0 };
+    const char* profilePath = NULL;
+    bool device = false;
+    int fixtures = 1;
+    int hubs = 1;
+    unsigned int handling = 0;
+    int i;
+    
+    dfu_timing_init(&timing);
+    
+    // Hand given timing overrides the profile, it is applied afterwards
+    struct dfu_timing given = { 0 };
+    bool givenPoll = false, givenDetach = false;
+    
+    for (i = 0; i + 1 < argc && strncmp(argv[i], "--", 2) == 0; i += 2)
+    {
+        const char* value = argv[i + 1];
+        
+        if (strcmp(argv[i], "--transfer-size") == 0)
+            given.transfer_size = atoi(value);
+        else if (strcmp(argv[i], "--poll") == 0)
+        {
+            const char* range = strchr(value, '-');
+            
+            given.poll_min = atoi(value);
+            given.poll_max = range != NULL ? atoi(range + 1) : given.poll_min;
+            givenPoll = true;
+        }
+        else if (strcmp(argv[i], "--detach") == 0)
+        {
+            given.detach = atoi(value);
+            givenDetach = true;
+        }
+        else if (strcmp(argv[i], "--manifest") == 0)
+            given.manifest = atoi(value);
+        else if (strcmp(argv[i], "--request-us") == 0)
+            given.request_us = atoi(value);
+        else if (strcmp(argv[i], "--profiles") == 0)
+            profilePath = value;
+        else if (strcmp(argv[i], "--device") == 0)
+        {
+            unsigned int vid, pid, bcd;
+            
+            device = sscanf(value, "%x:%x:%x", &vid, &pid, &bcd) == 3;
+            profile.idVendor = vid;
+            profile.idProduct = pid;
+            profile.bcdDevice = bcd;
+        }
+        else if (strcmp(argv[i], "--fixtures") == 0)
+            fixtures = atoi(value);
+        else if (strcmp(argv[i], "--hubs") == 0)
+            hubs = atoi(value);
+        else if (strcmp(argv[i], "--handling") == 0)
+            handling = atoi(value);
+        else
+        {
+            fprintf(stderr, "[!] Unknown option %s.\n", argv[i]);
+            return -1;
+        }
+    }
+    
+    if (i + 1 != argc || fixtures < 1 || hubs < 1 || (profilePath != NULL && !device))
+    {
+        printUsage();
+        return -1;
+    }
+    
+    if (profilePath != NULL)
+    {
+        struct dfu_profile_store profiles;
+        
+        if (dfu_profile_store_open(&profiles, profilePath) != 0 || !dfu_profile_store_find(&profiles, &profile))
+        {
+            fprintf(stderr, "[!] No profile of %04x:%04x:%04x in %s.\n",
+                    profile.idVendor, profile.idProduct, profile.bcdDevice, profilePath);
+            return -1;
+        }
+        
+        dfu_timing_from_profile(&timing, &profile);
+        dfu_profile_store_close(&profiles);
+    }
+    
+    if (given.transfer_size > 0)
+        timing.transfer_size = given.transfer_size;
+    
+    if (givenPoll)
+    {
+        timing.poll_min = given.poll_min;
+        timing.poll_max = given.poll_max;
+    }
+    
+    if (givenDetach)
+        timing.detach = given.detach;
+    
+    if (given.manifest > 0)
+        timing.manifest = given.manifest;
+    
+    if (given.request_us > 0)
+        timing.request_us = given.request_us;
+    
+    struct dfu_file firmware = { 0 };
+    
+    firmware.name = argv[i];
+    
+    if (dfu_load_any_file(&firmware, device ? profile.idVendor : 0xffff, device ? profile.idProduct : 0xffff) != DFU_FILE_OK)
+        return -1;
+    
+    int size = firmware.size.total - firmware.size.suffix;
+    struct dfu_prediction prediction;
+    
+    dfu_predict_model(&timing, size, &prediction);
+    
+    printf("[i] Image %d bytes, %d blocks of %d bytes, bwPollTimeout %u-%u ms, detach %u ms, manifest %u ms.\n",
+           size, prediction.blocks, timing.transfer_size, timing.poll_min, timing.poll_max, timing.detach, timing.manifest);
+    
+    // Check the closed form against the transfer code before trusting it
+    printf("[i] Validating the model against a simulated device:\n");
+    
+    IOReturn result = dfu_predict_simulate(&timing, firmware.firmware, size, &prediction);
+    
+    dfu_free_file(&firmware);
+    
+    if (result != kIOReturnSuccess)
+    {
+        fprintf(stderr, "[!] Simulated flash failed (0x%08x).\n", result);
+        return -1;
+    }
+    
+    double deviation = prediction.model_us > 0 ?
+        100.0 * ((double)prediction.simulated_us - prediction.model_us) / prediction.model_us : 0;
+    
+    printf("[i] Simulated %.3f s (detach %.3f s, download %.3f s, manifest %.3f s), model %.3f s (%+.1f%%).\n",
+           seconds(prediction.simulated_us), seconds(prediction.detach_us), seconds(prediction.download_us),
+           seconds(prediction.manifest_us), seconds(prediction.model_us), deviation);
+    
+    printf("[i] Per block: %.2f ms on the bus, %.2f ms programming.\n",
+           prediction.block_bus_us / 1000.0, prediction.block_device_us / 1000.0);
+    
+    int sharing = (fixtures + hubs - 1) / hubs;
+    uint64_t unit = dfu_predict_shared(&prediction, sharing) + (uint64_t)handling * 1000;
+    
+    printf("[i] Station: %d fixtures on %d hubs, %.3f s per unit, %.0f units per hour.\n",
+           fixtures, hubs, seconds(unit), unitsPerHour(unit, fixtures));
+    
+    printf("\n  fixtures/hub  s/unit   units/hour (%d hubs)\n", hubs);
+    
+    for (int n = 1; n <= PREDICT_MAX_ROWS && n <= sharing * 2; n++)
+    {
+        uint64_t rowUnit = dfu_predict_shared(&prediction, n) + (uint64_t)handling * 1000;
+        
+        printf("  %12d  %6.3f  %10.0f\n", n, seconds(rowUnit), unitsPerHour(rowUnit, n * hubs));
+    }
+    
+    printf("\n  block size    s/unit   units/hour (%d per hub)\n", sharing);
+    
+    for (int blockSize = 64; ; blockSize *= 2)
+    {
+        struct dfu_timing row = timing;
+        struct dfu_prediction rowPrediction;
+        
+        if (blockSize > timing.transfer_size)
+            blockSize = timing.transfer_size;
+        
+        row.transfer_size = blockSize;
+        dfu_predict_model(&row, size, &rowPrediction);
+        
+        uint64_t rowUnit = dfu_predict_shared(&rowPrediction, sharing) + (uint64_t)handling * 1000;
+        
+        printf("  %10d  %8.3f  %10.0f\n", blockSize, seconds(rowUnit), unitsPerHour(rowUnit, fixtures));
+        
+        if (blockSize == timing.transfer_size)
+            break;
+    }
+    
+    return 0;
+}
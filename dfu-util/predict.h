@@ -0,0 +1,41 @@
+/*
+ *  Flash time and station capacity prediction
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef __dfu_util__predict__
+#define __dfu_util__predict__
+
+/*
+ *  predict [options] <firmware>
+ *
+ *    --transfer-size <n>     block size, default the simulated device's
+ *    --poll <ms>[-<ms>]      bwPollTimeout, or range it is drawn from
+ *    --detach <ms>           re-enumeration time, 0 starts in DFU mode
+ *    --manifest <ms>         manifestation time
+ *    --request-us <us>       overhead of every control request
+ *    --profiles <file>       take the timing from a device profile ...
+ *    --device <vid:pid:bcd>  ... of this device model
+ *    --fixtures <n>          units flashed in parallel
+ *    --hubs <n>              hubs the fixtures are spread over
+ *    --handling <ms>         operator time per unit
+ */
+int runPredict(int argc, const char* argv[]);
+
+#endif /* defined(__dfu_util__predict__) */
@@ -0,0 +1,155 @@
+/*
+ *  Offline replay of recorded sessions
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "replay.h"
+#include "libdfu.h"
+
+static void printUsage(void)
+{
+    printf("Usage: dfu-util replay [--paced] <log> <firmware>\n");
+    printf("\nOptions:\n");
+    printf("  --paced                 sleep to reproduce the recorded timing\n");
+}
+
+/*
+ *  The steps of dfu_session_prepare() and dfu_session_download() that
+ *  talk to the device, in the same order
+ */
+static IOReturn replaySession(struct dfu_replay* replay, struct dfu_if* dif, const struct dfu_file* firmware)
+{
+    struct dfu_status status;
+    IOReturn result = dfu_get_status(dif, &status);
+    
+    if (result != kIOReturnSuccess)
+        return result;
+    
+    unsigned char initialState = status.bState;
+    
+    dfu_replay_describe(replay);
+    
+    unsigned char attributes = replay->descriptor.bmAttributes;
+    
+    result = dfu_state_recover(dif, attributes, replay->descriptor.wDetachTimeout, &status);
+    
+    if (result != kIOReturnSuccess && status.bState == STATE_APP_DETACH && (attributes & USB_DFU_WILL_DETACH))
+        result = dfu_state_recover(dif, attributes & ~USB_DFU_WILL_DETACH, replay->descriptor.wDetachTimeout, &status);
+    
+    if (result != kIOReturnSuccess)
+        return result;
+    
+    // The recording ends here if the run only prepared the device
+    if (!dfu_replay_describe(replay))
+        return kIOReturnSuccess;
+    
+    if (initialState == STATE_APP_IDLE || initialState == STATE_APP_DETACH)
+        printf("[i] Device re-enumerated in DFU mode.\n");
+    
+    struct dfu_transfer transfer;
+    int firmware_size = firmware->size.total - firmware->size.suffix;
+    unsigned short transfer_size = replay->transfer_size > 0 ? replay->transfer_size : replay->descriptor.wTransferSize;
+    
+    dfu_transfer_init(&transfer, dif, firmware->firmware, firmware_size, transfer_size);
+    
+    printf("[i] Replaying firmware upload (%d bytes, %d bytes transfer size).\n", firmware_size, transfer_size);
+    
+    result = dfu_transfer_download(&transfer);
+    
+    if (result == kIOReturnSuccess)
+        result = dfu_transfer_manifest(&transfer);
+    
+    if (result == kIOReturnSuccess)
+        dfu_reset(dif);
+    
+    return result;
+}
+
+int runReplay(int argc, const char* argv[])
+{
+    bool paced = false;
+    
+    if (argc >= 1 && strcmp(argv[0], "--paced") == 0)
+    {
+        paced = true;
+        argc--;
+        argv++;
+    }
+    
+    if (argc != 2)
+    {
+        printUsage();
+        return -1;
+    }
+    
+    struct dfu_replay replay;
+    
+    if (dfu_replay_open(&replay, argv[0], paced) != 0)
+        return -1;
+    
+    if (replay.idVendor == 0 && replay.idProduct == 0)
+    {
+        fprintf(stderr, "[!] %s holds no device description.\n", argv[0]);
+        dfu_replay_close(&replay);
+        return -1;
+    }
+    
+    struct dfu_file firmware = { 0 };
+    
+    firmware.name = argv[1];
+    
+    if (dfu_load_any_file(&firmware, replay.idVendor, replay.idProduct) != DFU_FILE_OK)
+    {
+        dfu_replay_close(&replay);
+        return -1;
+    }
+    
+    printf("[i] Replaying %s for USB device [%04x:%04x]%s.\n",
+           argv[0], replay.idVendor, replay.idProduct, paced ? " at recorded pace" : "");
+    
+    struct dfu_if dif;
+    
+    dfu_replay_attach(&replay, &dif);
+    
+    uint64_t start = dfu_time_us();
+    IOReturn result = replaySession(&replay, &dif, &firmware);
+    uint64_t elapsed = dfu_time_us() - start;
+    
+    // Requests the session did not make are a divergence as well
+    if (replay.divergences == 0 && !dfu_replay_finished(&replay))
+    {
+        fprintf(stderr, "[!] Replay ended after request %lu, the log holds more.\n", replay.requests);
+        replay.divergences++;
+    }
+    
+    printf("[i] %lu requests, %.3f s replayed, %.3f s recorded, %lu divergences.\n",
+           replay.requests, elapsed / 1000000.0, replay.recorded_us / 1000000.0, replay.divergences);
+    
+    if (result != kIOReturnSuccess && replay.divergences == 0)
+        printf("[i] Recorded session failed with 0x%08x, replayed the same way.\n", result);
+    
+    dfu_free_file(&firmware);
+    dfu_replay_close(&replay);
+    
+    return replay.divergences == 0 ? 0 : -1;
+}
@@ -0,0 +1,36 @@
+/*
+ *  Offline replay of recorded sessions
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef __dfu_util__replay__
+#define __dfu_util__replay__
+
+/*
+ *  replay [--paced] <log> <firmware>
+ *
+ *    --paced                 reproduce the recorded timing
+ *
+ *  Runs the protocol logic of a flash against a log written with
+ *  --record, returns non-zero if any request diverged from it. No device
+ *  is needed, but libdfu and with it replay only build on macOS.
+ */
+int runReplay(int argc, const char* argv[]);
+
+#endif /* defined(__dfu_util__replay__) */
@@ -0,0 +1,496 @@
+/*
+ *  Add, strip, rewrite and verify DFU suffixes in place
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fts.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "suffix.h"
+#include "libdfu.h"
+
+#define SUFFIX_CRC_OFFSET       12    /* the CRC covers everything before it */
+
+enum suffixCommand
+{
+    SUFFIX_ADD,
+    SUFFIX_REMOVE,
+    SUFFIX_REWRITE,
+    SUFFIX_CHECK
+};
+
+/* Fields in suffix order, -1 when not given */
+struct suffixFields
+{
+    int bcdDevice;
+    int idProduct;
+    int idVendor;
+    int bcdDFU;
+};
+
+struct suffixBatch
+{
+    enum suffixCommand command;
+    struct suffixFields fields;
+    char** paths;
+    int count;
+    /* Next path to process, taken by the workers */
+    int next;
+    int failed;
+};
+
+/* Trailing bytes of a file mapped for editing */
+struct fileTail
+{
+    void* mapping;
+    size_t length;
+    uint8_t* bytes;
+};
+
+/*
+ *  Map the last bytes of a file, the mapping starts at the page they fall
+ *  into so nothing before it is read or written
+ */
+static bool mapTail(struct fileTail* tail, int fd, off_t size, off_t length, bool writable)
+{
+    off_t offset = (size - length) & ~((off_t)getpagesize() - 1);
+    
+    tail->length = size - offset;
+    tail->mapping = mmap(NULL, tail->length, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, offset);
+    
+    if (tail->mapping == MAP_FAILED)
+        return false;
+    
+    tail->bytes = (uint8_t*)tail->mapping + (size - length - offset);
+    
+    return true;
+}
+
+static void unmapTail(struct fileTail* tail)
+{
+    munmap(tail->mapping, tail->length);
+}
+
+static bool hasSignature(const uint8_t* suffix)
+{
+    return suffix[8] == 'U' && suffix[9] == 'F' && suffix[10] == 'D' && suffix[11] >= DFU_SUFFIX_LENGTH;
+}
+
+static uint32_t storedCRC(const uint8_t* suffix)
+{
+    return suffix[12] | (suffix[13] << 8) | (suffix[14] << 16) | ((uint32_t)suffix[15] << 24);
+}
+
+/*
+ *  CRC of the first bytes of a file, the only part of a suffix edit that
+ *  has to read the whole image
+ */
+static bool fileCRC(int fd, off_t length, uint32_t* crc)
+{
+    *crc = 0xffffffff;
+    
+    if (length == 0)
+        return true;
+    
+    void* mapping = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    
+    if (mapping == MAP_FAILED)
+        return false;
+    
+    madvise(mapping, length, MADV_SEQUENTIAL);
+    
+    *crc = dfu_crc32(*crc, mapping, length);
+    
+    munmap(mapping, length);
+    
+    return true;
+}
+
+static void applyFields(uint8_t* suffix, const struct suffixFields* fields)
+{
+    const int values[4] = { fields->bcdDevice, fields->idProduct, fields->idVendor, fields->bcdDFU };
+    
+    for (int i = 0; i < 4; i++)
+    {
+        if (values[i] < 0)
+            continue;
+        
+        suffix[i * 2] = values[i] & 0xff;
+        suffix[i * 2 + 1] = values[i] >> 8;
+    }
+}
+
+static const char* addSuffix(int fd, off_t size, const struct suffixFields* fields)
+{
+    struct fileTail tail;
+    uint32_t crc;
+    
+    // Stamping twice would hide the first suffix inside the image
+    if (size >= DFU_SUFFIX_LENGTH)
+    {
+        if (!mapTail(&tail, fd, size, DFU_SUFFIX_LENGTH, false))
+            return strerror(errno);
+        
+        bool stamped = hasSignature(tail.bytes) &&
+                       fileCRC(fd, size - 4, &crc) && crc == storedCRC(tail.bytes);
+        
+        unmapTail(&tail);
+        
+        if (stamped)
+            return "already has a suffix";
+    }
+    
+    if (!fileCRC(fd, size, &crc))
+        return strerror(errno);
+    
+    uint8_t suffix[DFU_SUFFIX_LENGTH];
+    
+    dfu_suffix_build(suffix, crc,
+                     fields->idVendor < 0 ? 0xffff : fields->idVendor,
+                     fields->idProduct < 0 ? 0xffff : fields->idProduct,
+                     fields->bcdDevice < 0 ? 0xffff : fields->bcdDevice,
+                     fields->bcdDFU < 0 ? DFU_SUFFIX_BCD_DFU : fields->bcdDFU);
+    
+    if (ftruncate(fd, size + DFU_SUFFIX_LENGTH) != 0)
+        return strerror(errno);
+    
+    if (!mapTail(&tail, fd, size + DFU_SUFFIX_LENGTH, DFU_SUFFIX_LENGTH, true))
+    {
+        const char* error = strerror(errno);
+        
+        ftruncate(fd, size);
+        return error;
+    }
+    
+    memcpy(tail.bytes, suffix, DFU_SUFFIX_LENGTH);
+    unmapTail(&tail);
+    
+    return NULL;
+}
+
+static const char* removeSuffix(int fd, off_t size)
+{
+    struct fileTail tail;
+    
+    if (size < DFU_SUFFIX_LENGTH)
+        return "no suffix";
+    
+    if (!mapTail(&tail, fd, size, DFU_SUFFIX_LENGTH, false))
+        return strerror(errno);
+    
+    int length = hasSignature(tail.bytes) ? tail.bytes[11] : 0;
+    
+    unmapTail(&tail);
+    
+    if (length == 0)
+        return "no suffix";
+    
+    if (length > size)
+        return "invalid suffix length";
+    
+    if (ftruncate(fd, size - length) != 0)
+        return strerror(errno);
+    
+    return NULL;
+}
+
+static const char* rewriteSuffix(int fd, off_t size, const struct suffixFields* fields)
+{
+    struct fileTail tail;
+    
+    if (size < DFU_SUFFIX_LENGTH)
+        return "no suffix";
+    
+    if (!mapTail(&tail, fd, size, DFU_SUFFIX_LENGTH, true))
+        return strerror(errno);
+    
+    if (!hasSignature(tail.bytes))
+    {
+        unmapTail(&tail);
+        return "no suffix";
+    }
+    
+    // Take the old fields out of the stored CRC and put the new ones in, the
+    // image itself is never read. A CRC that was wrong stays wrong.
+    uint32_t crc = dfu_crc32_unwind(storedCRC(tail.bytes), tail.bytes, SUFFIX_CRC_OFFSET);
+    
+    applyFields(tail.bytes, fields);
+    
+    crc = dfu_crc32(crc, tail.bytes, SUFFIX_CRC_OFFSET);
+    
+    tail.bytes[12] = crc & 0xff;
+    tail.bytes[13] = (crc >> 8) & 0xff;
+    tail.bytes[14] = (crc >> 16) & 0xff;
+    tail.bytes[15] = crc >> 24;
+    
+    unmapTail(&tail);
+    
+    return NULL;
+}
+
+static const char* checkSuffix(int fd, off_t size, const char* path)
+{
+    struct fileTail tail;
+    uint32_t crc;
+    
+    if (size < DFU_SUFFIX_LENGTH)
+        return "no suffix";
+    
+    if (!mapTail(&tail, fd, size, DFU_SUFFIX_LENGTH, false))
+        return strerror(errno);
+    
+    const char* error = NULL;
+    
+    if (!hasSignature(tail.bytes))
+        error = "no suffix";
+    else if (tail.bytes[11] > size)
+        error = "invalid suffix length";
+    else if (!fileCRC(fd, size - 4, &crc))
+        error = strerror(errno);
+    else if (crc != storedCRC(tail.bytes))
+        error = "CRC mismatch";
+    else
+        printf("[i] %s: %04x:%04x, bcdDevice %04x, bcdDFU %04x.\n", path,
+               tail.bytes[4] | (tail.bytes[5] << 8), tail.bytes[2] | (tail.bytes[3] << 8),
+               tail.bytes[0] | (tail.bytes[1] << 8), tail.bytes[6] | (tail.bytes[7] << 8));
+    
+    unmapTail(&tail);
+    
+    return error;
+}
+
+static bool processFile(const struct suffixBatch* batch, const char* path)
+{
+    const char* error = NULL;
+    int fd = open(path, batch->command == SUFFIX_CHECK ? O_RDONLY : O_RDWR);
+    struct stat st;
+    
+    if (fd < 0 || fstat(fd, &st) != 0)
+        error = strerror(errno);
+    else if (batch->command == SUFFIX_ADD)
+        error = addSuffix(fd, st.st_size, &batch->fields);
+    else if (batch->command == SUFFIX_REMOVE)
+        error = removeSuffix(fd, st.st_size);
+    else if (batch->command == SUFFIX_REWRITE)
+        error = rewriteSuffix(fd, st.st_size, &batch->fields);
+    else
+        error = checkSuffix(fd, st.st_size, path);
+    
+    if (fd >= 0)
+        close(fd);
+    
+    if (error != NULL)
+        fprintf(stderr, "[!] %s: %s.\n", path, error);
+    
+    return error == NULL;
+}
+
+static void* suffixWorker(void* argument)
+{
+    struct suffixBatch* batch = argument;
+    
+    for (;;)
+    {
+        int index = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED);
+        
+        if (index >= batch->count)
+            break;
+        
+        if (!processFile(batch, batch->paths[index]))
+            __atomic_fetch_add(&batch->failed, 1, __ATOMIC_RELAXED);
+    }
+    
+    return NULL;
+}
+
+/*
+ *  Expand the command line into regular files, walking directories
+ *
+ *  returns number of entries that could not be read, -1 if the walk failed
+ */
+static int collectFiles(struct suffixBatch* batch, char* const* roots)
+{
+    FTS* fts = fts_open(roots, FTS_PHYSICAL | FTS_NOCHDIR, NULL);
+    FTSENT* entry;
+    int capacity = 0;
+    int failed = 0;
+    
+    if (fts == NULL)
+    {
+        fprintf(stderr, "[!] Failed to walk files: %s.\n", strerror(errno));
+        return 1;
+    }
+    
+    while ((entry = fts_read(fts)) != NULL)
+    {
+        if (entry->fts_info == FTS_DNR || entry->fts_info == FTS_ERR || entry->fts_info == FTS_NS)
+        {
+            fprintf(stderr, "[!] %s: %s.\n", entry->fts_path, strerror(entry->fts_errno));
+            failed++;
+            continue;
+        }
+        
+        if (entry->fts_info != FTS_F)
+            continue;
+        
+        if (batch->count == capacity)
+        {
+            int grown = capacity ? capacity * 2 : 256;
+            char** paths = realloc(batch->paths, grown * sizeof(char*));
+            
+            if (paths == NULL)
+                break;
+            
+            batch->paths = paths;
+            capacity = grown;
+        }
+        
+        if ((batch->paths[batch->count] = strdup(entry->fts_path)) == NULL)
+            break;
+        
+        batch->count++;
+    }
+    
+    // Stopped early, the walk is not complete
+    if (entry != NULL)
+    {
+        fprintf(stderr, "[!] Failed to walk files: %s.\n", strerror(ENOMEM));
+        failed = -1;
+    }
+    
+    fts_close(fts);
+    
+    return failed;
+}
+
+static void printSuffixUsage(void)
+{
+    printf("Usage: dfu-util suffix add|remove|rewrite|check [options] <file or directory>...\n");
+    printf("\nOptions:\n");
+    printf("  --vid <hex>     idVendor (add default ffff)\n");
+    printf("  --pid <hex>     idProduct (add default ffff)\n");
+    printf("  --device <hex>  bcdDevice (add default ffff)\n");
+    printf("  --dfu <hex>     bcdDFU (add default %04x)\n", DFU_SUFFIX_BCD_DFU);
+    printf("  --jobs <n>      files processed in parallel (default one per core)\n");
+}
+
+int runSuffix(int argc, const char* argv[])
+{
+    struct suffixBatch batch = { 0 };
+    int jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+    
+    batch.fields = (struct suffixFields){ -1, -1, -1, -1 };
+    
+    if (argc < 2)
+    {
+        printSuffixUsage();
+        return -1;
+    }
+    
+    if (strcmp(argv[0], "add") == 0)
+        batch.command = SUFFIX_ADD;
+    else if (strcmp(argv[0], "remove") == 0)
+        batch.command = SUFFIX_REMOVE;
+    else if (strcmp(argv[0], "rewrite") == 0)
+        batch.command = SUFFIX_REWRITE;
+    else if (strcmp(argv[0], "check") == 0)
+        batch.command = SUFFIX_CHECK;
+    else
+    {
+        printSuffixUsage();
+        return -1;
+    }
+    
+    for (i = 1; i + 1 < argc && strncmp(argv[i], "--", 2) == 0; i += 2)
+    {
+        int value = (int)strtoul(argv[i + 1], NULL, 16);
+        
+        if (strcmp(argv[i], "--vid") == 0)
+            batch.fields.idVendor = value & 0xffff;
+        else if (strcmp(argv[i], "--pid") == 0)
+            batch.fields.idProduct = value & 0xffff;
+        else if (strcmp(argv[i], "--device") == 0)
+            batch.fields.bcdDevice = value & 0xffff;
+        else if (strcmp(argv[i], "--dfu") == 0)
+            batch.fields.bcdDFU = value & 0xffff;
+        else if (strcmp(argv[i], "--jobs") == 0)
+            jobs = atoi(argv[i + 1]);
+        else
+        {
+            fprintf(stderr, "[!] Unknown option %s.\n", argv[i]);
+            return -1;
+        }
+    }
+    
+    if (i == argc)
+    {
+        printSuffixUsage();
+        return -1;
+    }
+    
+    int unreadable = collectFiles(&batch, (char* const*)(argv + i));
+    
+    if (unreadable < 0)
+    {
+        for (int f = 0; f < batch.count; f++)
+            free(batch.paths[f]);
+        
+        free(batch.paths);
+        
+        return -1;
+    }
+    
+    if (jobs > batch.count)
+        jobs = batch.count;
+    
+    if (jobs < 1)
+        jobs = 1;
+    
+    pthread_t threads[jobs];
+    int started = 0;
+    
+    for (started = 0; started < jobs - 1; started++)
+        if (pthread_create(&threads[started], NULL, suffixWorker, &batch) != 0)
+            break;
+    
+    // The calling thread works too, and alone if no thread could be created
+    suffixWorker(&batch);
+    
+    for (int t = 0; t < started; t++)
+        pthread_join(threads[t], NULL);
+    
+    printf("[i] %d files, %d failed.\n", batch.count, batch.failed + unreadable);
+    
+    for (int f = 0; f < batch.count; f++)
+        free(batch.paths[f]);
+    
+    free(batch.paths);
+    
+    return batch.failed + unreadable > 0 ? -1 : 0;
+}
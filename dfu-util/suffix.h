@@ -0,0 +1,40 @@
+/*
+ *  Add, strip, rewrite and verify DFU suffixes in place
+ *
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef __dfu_util__suffix__
+#define __dfu_util__suffix__
+
+/*
+ *  suffix add|remove|rewrite|check [options] <file or directory>...
+ *
+ *    --vid <hex>       idVendor
+ *    --pid <hex>       idProduct
+ *    --device <hex>    bcdDevice
+ *    --dfu <hex>       bcdDFU
+ *    --jobs <n>        files processed in parallel, default one per core
+ *
+ *  add stamps files without a suffix, fields not given are 0xffff (bcdDFU
+ *  0x0100). rewrite only changes the fields given. Directories are walked
+ *  and every regular file in them is processed.
+ */
+int runSuffix(int argc, const char* argv[]);
+
+#endif /* defined(__dfu_util__suffix__) */
@@ -154,6 +154,145 @@ IOUSBDeviceInterface300** getDevice(const unsigned short idVendor, const unsigne
     return device;
 }
 
+/*
+ *  Obtain an USB device pointer for a USB device at a bus location
+ *
+ *  idVendor    - USB device vendor
+ *  idProduct   - USB device product
+ *  locationID  - IOKit location of the device, 0 for the first match
+ *
+ *  returns IOUSBDeviceInterface300** NULL or on error
+ */
+IOUSBDeviceInterface300** getDeviceAt(const unsigned short idVendor, const unsigned short idProduct, const UInt32 locationID)
+{
+    if (locationID == 0)
+        return getDevice(idVendor, idProduct);
+    
+    struct usbLocation locations[USB_MAX_DEVICES];
+    IOUSBDeviceInterface300** device = NULL;
+    int count = getDevices(idVendor, idProduct, locations, USB_MAX_DEVICES, true);
+    
+    for (int i = 0; i < count; i++)
+    {
+        if (device == NULL && locations[i].locationID == locationID)
+            device = locations[i].device;
+        else
+            (*locations[i].device)->Release(locations[i].device);
+    }
+    
+    if (device == NULL)
+        fprintf(stderr, "[!] No device [%04x:%04x] at location 0x%08x.\n", idVendor, idProduct, locationID);
+    
+    return device;
+}
+
+/*
+ *  List every attached USB device with a vendor and product id
+ *
+ *  idVendor    - USB device vendor
+ *  idProduct   - USB device product
+ *  locations   - receives bus location and speed of each device
+ *  max         - size of locations
+ *  keep        - return the device pointers, released by the caller
+ *
+ *  returns number of devices found
+ */
+int getDevices(const unsigned short idVendor, const unsigned short idProduct, struct usbLocation* locations, const int max, const bool keep)
+{
+    CFDictionaryRef matchingDictionary = getMatchingDictionary(idVendor, idProduct);
+    io_iterator_t iterator;
+    io_service_t service;
+    int count = 0;
+    
+    if (matchingDictionary == NULL)
+    {
+        fprintf(stderr, "[!] Failed to initialize device matching dictionary.\n");
+        return 0;
+    }
+    
+    // Consumes the dictionary
+    if (IOServiceGetMatchingServices(kIOMasterPortDefault, matchingDictionary, &iterator) != kIOReturnSuccess)
+        return 0;
+    
+    while ((service = IOIteratorNext(iterator)) != 0)
+    {
+        IOCFPlugInInterface** plugin;
+        IOUSBDeviceInterface300** device = NULL;
+        SInt32 score;
+        
+        if (IOCreatePlugInInterfaceForService(service, kIOUSBDeviceUserClientTypeID, kIOCFPlugInInterfaceID, &plugin, &score) == kIOReturnSuccess)
+        {
+            (*plugin)->QueryInterface(plugin, CFUUIDGetUUIDBytes(kIOUSBDeviceInterfaceID300), (LPVOID)&device);
+            (*plugin)->Release(plugin);
+        }
+        
+        IOObjectRelease(service);
+        
+        if (device == NULL)
+            continue;
+        
+        if (count < max)
+        {
+            locations[count].locationID = 0;
+            locations[count].speed = kUSBDeviceSpeedFull;
+            (*device)->GetLocationID(device, &locations[count].locationID);
+            (*device)->GetDeviceSpeed(device, &locations[count].speed);
+            locations[count++].device = keep ? device : NULL;
+            
+            // Handed to the caller
+            if (keep)
+                continue;
+        }
+        
+        (*device)->Release(device);
+    }
+    
+    IOObjectRelease(iterator);
+    
+    return count;
+}
+
+/*
+ *  Open a USB device, taking it over if another client holds it open
+ *
+ *  device      - USB device pointer
+ *
+ *  returns IOReturn value
+ */
+IOReturn claimDevice(IOUSBDeviceInterface300** device)
+{
+    IOReturn result = (*device)->USBDeviceOpen(device);
+    
+    // The owner is asked to close, a retry would only race its rematch
+    if (result == kIOReturnExclusiveAccess)
+    {
+        printf("[i] USB device is held by another client, seizing it.\n");
+        result = (*device)->USBDeviceOpenSeize(device);
+    }
+    
+    return result;
+}
+
+/*
+ *  Open a USB interface, taking it over from the driver that claimed it
+ *
+ *  interface   - USB interface pointer
+ *
+ *  returns IOReturn value
+ */
+IOReturn claimInterface(IOUSBInterfaceInterface300** interface)
+{
+    IOReturn result = (*interface)->USBInterfaceOpen(interface);
+    
+    if (result == kIOReturnExclusiveAccess)
+    {
+        printf("[i] USB interface is held by its driver, seizing it.\n");
+        result = (*interface)->USBInterfaceOpenSeize(interface);
+    }
+    
+    return result;
+}
+
 /*
  *  Set the USB device configuration to the first available configuration
  *
@@ -184,13 +323,42 @@ bool setConfiguration(IOUSBDeviceInterface300** device)
 }
 
 /*
- *  Get the USB device DFU interface
+ *  Select the first available configuration unless it is already active,
+ *  a redundant SetConfiguration resets every interface of a composite
+ *  device
  *
  *  device      - USB device pointer
  *
+ *  returns true or false on error
+ */
+bool ensureConfiguration(IOUSBDeviceInterface300** device)
+{
+    IOUSBConfigurationDescriptorPtr config;
+    unsigned char current = 0;
+    
+    if ((*device)->GetConfigurationDescriptorPtr(device, 0, &config) != kIOReturnSuccess)
+    {
+        fprintf(stderr, "[!] Failed to retrieve configuration descriptor at index 0.\n");
+        return false;
+    }
+    
+    if ((*device)->GetConfiguration(device, &current) == kIOReturnSuccess && current == config->bConfigurationValue)
+        return true;
+    
+    return ((*device)->SetConfiguration(device, config->bConfigurationValue) == kIOReturnSuccess);
+}
+
+/*
+ *  Get the first USB device interface of a class
+ *
+ *  device      - USB device pointer
+ *  class       - bInterfaceClass
+ *  subClass    - bInterfaceSubClass
+ *  protocol    - bInterfaceProtocol or kIOUSBFindInterfaceDontCare
+ *
  *  returns IOUSBInterfaceInterface300** or NULL on error
  */
-IOUSBInterfaceInterface300** getDFUInterface(IOUSBDeviceInterface300** device)
+static IOUSBInterfaceInterface300** getInterface(IOUSBDeviceInterface300** device, UInt16 class, UInt16 subClass, UInt16 protocol)
 {
     SInt32 score = 0;
     IOUSBFindInterfaceRequest request;
@@ -199,9 +367,9 @@ IOUSBInterfaceInterface300** getDFUInterface(IOUSBDeviceInterface300** device)
     io_iterator_t iterator;
     io_service_t service;
     
-    request.bInterfaceClass = kUSBApplicationSpecificInterfaceClass;
-    request.bInterfaceSubClass = kUSBDFUSubClass;
-    request.bInterfaceProtocol = kIOUSBFindInterfaceDontCare;
+    request.bInterfaceClass = class;
+    request.bInterfaceSubClass = subClass;
+    request.bInterfaceProtocol = protocol;
     request.bAlternateSetting = kIOUSBFindInterfaceDontCare;
     
     if ((*device)->CreateInterfaceIterator(device, &request, &iterator) != kIOReturnSuccess)
@@ -209,14 +377,14 @@ IOUSBInterfaceInterface300** getDFUInterface(IOUSBDeviceInterface300** device)
         fprintf(stderr, "[!] Failed to create interface iterator\n");
         return NULL;
     }
-   
+    
     while ((service = IOIteratorNext(iterator)) != 0)
     {
         if (IOCreatePlugInInterfaceForService(service, kIOUSBInterfaceUserClientTypeID, kIOCFPlugInInterfaceID, &plugin, &score) == kIOReturnSuccess)
         {
             if ((*plugin)->QueryInterface(plugin, CFUUIDGetUUIDBytes(kIOUSBInterfaceInterfaceID300), (LPVOID)&interface) == kIOReturnSuccess)
             {
-                // Located DFU interface
+                // Located interface
                 (*plugin)->Release(plugin);
                 break;
             }
@@ -236,6 +404,32 @@ IOUSBInterfaceInterface300** getDFUInterface(IOUSBDeviceInterface300** device)
     return interface;
 }
 
+/*
+ *  Get the USB device DFU interface
+ *
+ *  device      - USB device pointer
+ *
+ *  returns IOUSBInterfaceInterface300** or NULL on error
+ */
+IOUSBInterfaceInterface300** getDFUInterface(IOUSBDeviceInterface300** device)
+{
+    return getInterface(device, kUSBApplicationSpecificInterfaceClass, kUSBDFUSubClass, kIOUSBFindInterfaceDontCare);
+}
+
+/*
+ *  Get the USB device Bluetooth HCI interface, its interrupt endpoint
+ *  carries the HCI events
+ *
+ *  device      - USB device pointer
+ *
+ *  returns IOUSBInterfaceInterface300** or NULL on error
+ */
+IOUSBInterfaceInterface300** getHCIInterface(IOUSBDeviceInterface300** device)
+{
+    // Wireless controller, RF controller subclass, Bluetooth programming interface
+    return getInterface(device, kUSBWirelessControllerInterfaceClass, 1, 1);
+}
+
 /*
  *  Get the USB device DFU interface descriptor
  *
@@ -270,6 +464,31 @@ IOUSBDFUDescriptor* getDFUDescriptor(IOUSBInterfaceInterface300** interface)
     return NULL;
 }
 
+/*
+ *  Retrieve the string of an interface, DfuSe devices describe their
+ *  memory layout in it
+ *
+ *  device      - USB device pointer
+ *  interface   - USB interface pointer
+ *  output      - Output buffer
+ *  len         - Output buffer len
+ *
+ *  returns true or false if the interface has no string
+ */
+bool getInterfaceString(IOUSBDeviceInterface300** device, IOUSBInterfaceInterface300** interface, char* output, const int len)
+{
+    unsigned char stringIndex = 0;
+    
+    output[0] = 0;
+    
+    if ((*interface)->USBGetInterfaceStringIndex(interface, &stringIndex) != kIOReturnSuccess || stringIndex == 0)
+        return false;
+    
+    retrieveString(device, stringIndex, output, len);
+    
+    return output[0] != 0;
+}
+
 /*
  *  Prints the USB device information
  *
@@ -23,13 +23,33 @@
 #include <IOKit/IOKitLib.h>
 #include <IOKit/usb/IOUSBLib.h>
 #include <CoreFoundation/CoreFoundation.h>
+#include <stdbool.h>
 #include <stdio.h>
 
+#define USB_MAX_DEVICES     128
+
+/* Where a device is attached, see getDevices() */
+struct usbLocation
+{
+    /* Bus number in the top byte, then one nibble per port from the root hub down */
+    UInt32 locationID;
+    /* kUSBDeviceSpeedLow .. kUSBDeviceSpeedSuper */
+    UInt8 speed;
+    IOUSBDeviceInterface300** device;
+};
 
 IOUSBDeviceInterface300** getDevice(unsigned short idVendor, unsigned short idProduct);
+IOUSBDeviceInterface300** getDeviceAt(unsigned short idVendor, unsigned short idProduct, UInt32 locationID);
+int getDevices(unsigned short idVendor, unsigned short idProduct, struct usbLocation* locations, int max, bool keep);
+IOReturn claimDevice(IOUSBDeviceInterface300** device);
+IOReturn claimInterface(IOUSBInterfaceInterface300** interface);
 bool setConfiguration(IOUSBDeviceInterface300** device);
+bool ensureConfiguration(IOUSBDeviceInterface300** device);
 IOUSBInterfaceInterface300** getDFUInterface(IOUSBDeviceInterface300** device);
+IOUSBInterfaceInterface300** getHCIInterface(IOUSBDeviceInterface300** device);
 IOUSBDFUDescriptor* getDFUDescriptor(IOUSBInterfaceInterface300** interface);
+bool getInterfaceString(IOUSBDeviceInterface300** device, IOUSBInterfaceInterface300** interface, char* output, const int len);
+bool retrieveString(IOUSBDeviceInterface300** device, const unsigned char stringIndex, char* output, const int len);
 
 void printDeviceInfo(IOUSBDeviceInterface300** device);
 